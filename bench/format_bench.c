@@ -0,0 +1,153 @@
+/* format_bench.c -- paul_format.h against equivalent snprintf calls
+
+   Build from the repository root and run:
+
+       cc -O2 -I. bench/format_bench.c -o format_bench -lm
+       ./format_bench
+
+   Each template runs through format_impl, format_alloc, format_fprint (to
+   the null device) and format_exec on a precompiled program, next to an
+   snprintf producing comparable output. Results are ns/op, plus MB/s of
+   output for format_impl. The whole table is printed twice, the second
+   time with format_cache_enable turned on. */
+
+#define PAUL_FORMAT_IMPLEMENTATION
+#include "paul_format.h"
+#include <time.h>
+
+#ifdef _WIN32
+#define BENCH_NULL_DEVICE "NUL"
+#else
+#define BENCH_NULL_DEVICE "/dev/null"
+#endif
+
+#ifndef BENCH_ITERS
+#define BENCH_ITERS 200000
+#endif
+
+typedef void (*BenchBaseline)(int i);
+
+enum { BENCH_IMPL, BENCH_ALLOC, BENCH_FPRINT, BENCH_EXEC, BENCH_MODES };
+
+static FILE *bench_null;
+static char bench_out[65536];
+static char bench_ref[65536];
+static volatile size_t bench_sink;
+static int bench_ints[1000];
+
+static double bench_now(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static void bench_run(const char *name, const char *fmt, FormatArg *args, size_t n, int iters, BenchBaseline baseline) {
+    FormatProgram *prog = format_compile(fmt);
+    double ns[BENCH_MODES];
+    size_t bytes = 0;
+    for (int m = 0; m < BENCH_MODES; m++) {
+        double t0 = bench_now();
+        for (int i = 0; i < iters; i++) {
+            switch (m) {
+                case BENCH_IMPL:
+                    bytes = format_impl(bench_out, sizeof(bench_out), fmt, args, n);
+                    break;
+                case BENCH_ALLOC: {
+                    char *s = format_alloc(fmt, args, n);
+                    bench_sink += s[0];
+                    free(s);
+                    break;
+                }
+                case BENCH_FPRINT:
+                    format_fprint(bench_null, fmt, args, n);
+                    break;
+                default:
+                    format_exec(prog, bench_out, sizeof(bench_out), args, n);
+                    break;
+            }
+        }
+        ns[m] = (bench_now() - t0) * 1e9 / iters;
+    }
+
+    char ref[16] = "n/a";
+    if (baseline) {
+        double t0 = bench_now();
+        for (int i = 0; i < iters; i++)
+            baseline(i);
+        snprintf(ref, sizeof(ref), "%.0f", (bench_now() - t0) * 1e9 / iters);
+    }
+    printf("  %-20s %6zu  %8.0f %8.0f %8.0f %8.0f %9s  %8.0f\n", name, bytes, ns[BENCH_IMPL], ns[BENCH_ALLOC],
+           ns[BENCH_FPRINT], ns[BENCH_EXEC], ref, bytes / ns[BENCH_IMPL] * 1e3);
+    format_program_free(prog);
+}
+
+/* snprintf equivalents of the templates below */
+static void baseline_literal(int i) {
+    (void)i;
+    bench_sink += snprintf(bench_ref, sizeof(bench_ref),
+                           "HTTP/1.1 200 OK\r\nServer: paul\r\nContent-Type: text/html; charset=utf-8\r\n"
+                           "Cache-Control: no-cache, no-store, must-revalidate\r\nConnection: keep-alive\r\n"
+                           "X-Request-Id: %s\r\nContent-Length: %s\r\n\r\n",
+                           "req-12345", "1024");
+}
+
+static void baseline_numbers(int i) {
+    bench_sink += snprintf(bench_ref, sizeof(bench_ref), "%d %u %lld %.3f %e %x %.2f\n", i, 4000000000u,
+                           -1234567890123ll, 3.14159 * i, 6.02e23, 0xdeadbeef, 99.5);
+}
+
+static void baseline_iteration(int i) {
+    (void)i;
+    size_t pos = 0;
+    for (int k = 0; k < 1000; k++)
+        pos += snprintf(bench_ref + pos, sizeof(bench_ref) - pos, k < 999 ? "%d, " : "%d", bench_ints[k]);
+    bench_sink += pos;
+}
+
+static void baseline_conditional(int i) {
+    static const char *names[] = {"zero", "one", "two"};
+    bench_sink += snprintf(bench_ref, sizeof(bench_ref), "%s %s %s\n", i & 1 ? "yes" : "no", names[i % 3],
+                           i & 2 ? "set" : "");
+}
+
+static void baseline_justify(int i) {
+    (void)i;
+    bench_sink += snprintf(bench_ref, sizeof(bench_ref), "%-20s%20s|%30s\n", "left", "right", "centered");
+}
+
+int main(void) {
+    bench_null = fopen(BENCH_NULL_DEVICE, "w");
+    if (!bench_null)
+        return 1;
+    for (int i = 0; i < 1000; i++)
+        bench_ints[i] = i * 37;
+
+    FormatArg literal[] = {FORMAT_ARG("req-12345"), FORMAT_ARG("1024")};
+    FormatArg numbers[] = {FORMAT_ARG(12345), FORMAT_ARG(4000000000u), FORMAT_ARG(-1234567890123ll),
+                           FORMAT_ARG(3.14159 * 12345), FORMAT_ARG(6.02e23), FORMAT_ARG(0xdeadbeef), FORMAT_ARG(99.5)};
+    FormatArg iteration[] = {FORMAT_ARRAY_INT(bench_ints, 1000)};
+    FormatArg conditional[] = {FORMAT_ARG(true), FORMAT_ARG(1), FORMAT_ARG(true)};
+    FormatArg justify[] = {FORMAT_ARG("left"), FORMAT_ARG("right"), FORMAT_ARG("centered")};
+    FormatArg radix[] = {FORMAT_ARG(1987654), FORMAT_ARG(3888)};
+
+    for (int cached = 0; cached < 2; cached++) {
+        if (cached)
+            format_cache_enable(0);
+        printf("%s\n  %-20s %6s  %8s %8s %8s %8s %9s  %8s\n", cached ? "template cache on (ns/op)" : "uncached (ns/op)",
+               "template", "bytes", "impl", "alloc", "fprint", "exec", "snprintf", "MB/s");
+        bench_run("literal-heavy",
+                  "HTTP/1.1 200 OK\r\nServer: paul\r\nContent-Type: text/html; charset=utf-8\r\n"
+                  "Cache-Control: no-cache, no-store, must-revalidate\r\nConnection: keep-alive\r\n"
+                  "X-Request-Id: ~A\r\nContent-Length: ~A\r\n\r\n",
+                  literal, 2, BENCH_ITERS, baseline_literal);
+        bench_run("int/float-heavy", "~D ~D ~D ~,3F ~E ~X ~,2F~%", numbers, 7, BENCH_ITERS, baseline_numbers);
+        bench_run("~{ over 1000 ints", "~{~D~^, ~}", iteration, 1, BENCH_ITERS / 100, baseline_iteration);
+        bench_run("conditionals", "~:[no~;yes~] ~[zero~;one~;two~] ~@[set~]~%", conditional, 3, BENCH_ITERS,
+                  baseline_conditional);
+        bench_run("~< justification", "~40<~A~;~A~>|~30@<~A~>~%", justify, 3, BENCH_ITERS, baseline_justify);
+        bench_run("~R english / ~@R", "~R ~@R~%", radix, 2, BENCH_ITERS, NULL);
+    }
+    format_cache_disable();
+    fclose(bench_null);
+    return 0;
+}
@@ -0,0 +1,165 @@
+/* string_bench.c -- throughput of common paul_string.h operations
+
+   Build from the repository root and run:
+
+       cc -O2 -march=native -I. bench/string_bench.c -o string_bench
+       ./string_bench [max_bytes]
+
+   Every operation runs on inputs from 16 bytes up to max_bytes (100 MB by
+   default) and reports GB/s of input processed. libc memmem and strstr run
+   on the same data as a baseline for str_find. Inputs are lowercase text
+   from a fixed seed, so runs are comparable between builds. */
+
+#define _GNU_SOURCE
+#define PAUL_STRING_IMPLEMENTATION
+#include "paul_string.h"
+#include <stdio.h>
+#include <time.h>
+
+#define BENCH_BUDGET ((size_t)1 << 28) /* bytes processed per measurement */
+
+static volatile size_t bench_sink;
+
+static double bench_now(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+/* Repeat the statement until about BENCH_BUDGET bytes have gone through */
+#define BENCH(label, bytes, ...)                                                           \
+    do {                                                                                   \
+        size_t reps_ = BENCH_BUDGET / (bytes) ? BENCH_BUDGET / (bytes) : 1;                \
+        if (reps_ > 1000000)                                                               \
+            reps_ = 1000000;                                                               \
+        double t0_ = bench_now();                                                          \
+        for (size_t r_ = 0; r_ < reps_; r_++) {                                            \
+            __VA_ARGS__;                                                                   \
+        }                                                                                  \
+        double dt_ = bench_now() - t0_;                                                    \
+        printf("  %-36s %8.2f GB/s\n", label, (double)(bytes) * (double)reps_ / dt_ / 1e9); \
+    } while (0)
+
+static char *bench_text(size_t n) {
+    char *buf = malloc(n + 1);
+    if (!buf)
+        return NULL;
+    uint64_t x = 0x9E3779B97F4A7C15u;
+    for (size_t i = 0; i < n; i++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        buf[i] = (char)('a' + x % 26);
+    }
+    buf[n] = '\0';
+    return buf;
+}
+
+static void bench_find(str_t s, const char *text, size_t n, size_t m) {
+    char label[64];
+    // Misses use a byte that never appears in the text
+    char *miss = bench_text(m);
+    miss[m - 1] = 'Z';
+    str_t needle = str_from_cstr(miss);
+    snprintf(label, sizeof(label), "str_find miss, %zuB needle", m);
+    BENCH(label, n, bench_sink += str_find(s, needle));
+    snprintf(label, sizeof(label), "memmem miss, %zuB needle", m);
+    BENCH(label, n, bench_sink += (size_t)memmem(text, n, miss, m));
+    snprintf(label, sizeof(label), "strstr miss, %zuB needle", m);
+    BENCH(label, n, bench_sink += (size_t)strstr(text, miss));
+    str_free(needle);
+    free(miss);
+
+    // Hits take the needle from the last quarter, so 3/4 of the input is scanned
+    size_t at = n - n / 4 - (n / 4 < m ? m - n / 4 : 0);
+    str_view_t v = {text + at, m};
+    needle = str_from_view(v);
+    snprintf(label, sizeof(label), "str_find hit at 3/4, %zuB needle", m);
+    BENCH(label, n, bench_sink += str_find(s, needle));
+    snprintf(label, sizeof(label), "memmem hit at 3/4, %zuB needle", m);
+    BENCH(label, n, bench_sink += (size_t)memmem(text, n, needle, m));
+    str_free(needle);
+}
+
+static void bench_size(size_t n) {
+    char *text = bench_text(n);
+    if (!text) {
+        printf("%zu bytes: out of memory\n", n);
+        return;
+    }
+    str_t s = str_from_cstr(text);
+    printf("%zu bytes\n", n);
+
+    // Growth, 16 bytes at a time
+    str_t piece = str_from_cstr("0123456789abcdef");
+    BENCH("str_concat 16B pieces", n, {
+        str_t c = str_from_cstr("");
+        for (size_t i = 0; i < n; i += 16)
+            str_concat(&c, piece);
+        str_free(c);
+    });
+    BENCH("str_builder_append_view 16B pieces", n, {
+        str_builder_t b;
+        str_builder_init(&b);
+        for (size_t i = 0; i < n; i += 16) {
+            str_view_t v = {text, n < 16 ? n : 16};
+            str_builder_append_view(&b, v);
+        }
+        str_free(str_builder_finish(&b));
+    });
+
+    size_t needles[] = {4, 32, 256};
+    for (size_t i = 0; i < sizeof(needles) / sizeof(needles[0]); i++)
+        if (needles[i] <= n)
+            bench_find(s, text, n, needles[i]);
+
+    // Replace a marker in the middle and back again, two searches per rep
+    str_t work = str_dup(s);
+    memcpy((char *)work + n / 2, "MARK", n >= 4 ? 4 : 0);
+    str_t mark = str_from_cstr("MARK"), other = str_from_cstr("KRAM");
+    if (n >= 4)
+        BENCH("str_replace (middle, 2 per rep)", n, {
+            str_replace(&work, mark, other);
+            str_replace(&work, other, mark);
+        });
+    str_free(mark);
+    str_free(other);
+    str_free(work);
+
+    // Half the input is leading whitespace, so trim moves the other half
+    str_t padded = str_dup(s);
+    memset(padded, ' ', n / 2);
+    work = str_dup(padded);
+    BENCH("str_trim (incl. restoring copy)", n, {
+        str_copy(work, padded);
+        str_trim(&work);
+    });
+    str_free(work);
+    str_free(padded);
+
+    BENCH("str_to_upper", n, str_to_upper(&s));
+    BENCH("str_to_lower", n, str_to_lower(&s));
+
+    BENCH("str_wildcard_ascii miss", n, bench_sink += str_wildcard_ascii(s, "*a[bc]?zz*Q*"));
+    str_glob_t *g = str_glob_compile("*a[bc]?zz*Q*");
+    BENCH("str_glob_match miss", n, bench_sink += str_glob_match(g, s));
+    str_glob_free(g);
+
+    BENCH("ascii -> wide (str_make_utf16)", n, str_free(str_make_utf16(s)));
+    str_t w = str_make_utf16(s);
+    BENCH("wide -> ascii (str_make_ascii)", n, str_free(str_make_ascii(w)));
+    str_free(w);
+
+    str_free(piece);
+    str_free(s);
+    free(text);
+}
+
+int main(int argc, char **argv) {
+    size_t max = argc > 1 ? (size_t)strtoull(argv[1], NULL, 10) : (size_t)100 * 1000 * 1000;
+    size_t sizes[] = {16, 1024, 64 * 1024, 1024 * 1024, 16 * 1024 * 1024, (size_t)100 * 1000 * 1000};
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+        if (sizes[i] <= max)
+            bench_size(sizes[i]);
+    return 0;
+}
@@ -104,6 +104,7 @@ extern "C" {
  * @constant FORMAT_ERR_MISSING_ARG A directive required an argument but none were available.
  * @constant FORMAT_ERR_UNCLOSED_BRACKET A bracketing directive (e.g., ~{, ~[) was not closed.
  * @constant FORMAT_ERR_INVALID_RADIX An invalid radix was specified for the ~R directive.
+ * @constant FORMAT_ERR_SINK_FAILED A sink could not grow its buffer or its write function failed.
  */
 typedef enum {
     FORMAT_OK = 0,
@@ -115,6 +116,7 @@ typedef enum {
     FORMAT_ERR_MISSING_ARG,
     FORMAT_ERR_UNCLOSED_BRACKET,
     FORMAT_ERR_INVALID_RADIX,
+    FORMAT_ERR_SINK_FAILED,
 } FormatError;
 
 /*!
@@ -134,6 +136,12 @@ typedef enum {
  * @constant FORMAT_TYPE_BOOL Boolean value.
  * @constant FORMAT_TYPE_ARRAY Array argument for iteration support (~{).
  * @constant FORMAT_TYPE_CUSTOM User-defined custom type.
+ * @constant FORMAT_TYPE_TYPED_ARRAY Array of plain C values read in place by ~{ (see FORMAT_ARRAY_OF).
+ * @constant FORMAT_TYPE_FLOAT Single precision float; only valid as a typed array element.
+ * @constant FORMAT_TYPE_SHORT short, read as an int; only valid as a typed array element.
+ * @constant FORMAT_TYPE_USHORT unsigned short, read as an unsigned int; typed array elements only.
+ * @constant FORMAT_TYPE_SCHAR signed char, read as an int; typed array elements only.
+ * @constant FORMAT_TYPE_UCHAR unsigned char, read as an unsigned int; typed array elements only.
  */
 typedef enum {
     FORMAT_TYPE_NIL,
@@ -150,6 +158,12 @@ typedef enum {
     FORMAT_TYPE_BOOL,
     FORMAT_TYPE_ARRAY,       /* For iteration support */
     FORMAT_TYPE_CUSTOM,      /* User-defined types */
+    FORMAT_TYPE_TYPED_ARRAY, /* Iteration over C arrays without FormatArg copies */
+    FORMAT_TYPE_FLOAT,       /* Typed array elements only */
+    FORMAT_TYPE_SHORT,
+    FORMAT_TYPE_USHORT,
+    FORMAT_TYPE_SCHAR,
+    FORMAT_TYPE_UCHAR,
 } FormatArgType;
 
 /* Forward declaration for custom formatter */
@@ -192,9 +206,99 @@ typedef struct FormatArg {
             FormatCustomFunc func;
             void *data;
         } as_custom;
+        struct {
+            const void *data;
+            uint64_t count : 40; /* Packed so FormatArg stays three words */
+            uint64_t stride : 16;
+            uint64_t type : 8;
+        } as_typed_array;
     } value;
 } FormatArg;
 
+/*!
+ * @typedef FormatSinkWrite
+ * @brief Function pointer type that receives the output of a sink.
+ * @param user The user pointer given to format_sink_init.
+ * @param data Bytes to write (not null-terminated).
+ * @param len Number of bytes.
+ * @return Number of bytes written; anything less than len marks the sink as failed.
+ */
+typedef size_t (*FormatSinkWrite)(void *user, const char *data, size_t len);
+
+/*!
+ * @struct FormatSegment
+ * @brief One piece of output queued by a writev sink.
+ * @field data Literal text referenced in place, or NULL for the next len bytes of the sink's buffer.
+ * @field len Number of bytes.
+ */
+typedef struct {
+    const char *data;
+    size_t len;
+} FormatSegment;
+
+/* Pieces a writev sink queues before it must write them out (at most IOV_MAX) */
+#ifndef FORMAT_SINK_SEGMENTS
+#define FORMAT_SINK_SEGMENTS 16
+#endif
+
+/* Shortest literal run a writev sink references instead of copying */
+#ifndef FORMAT_GATHER_MIN
+#define FORMAT_GATHER_MIN 64
+#endif
+
+/*!
+ * @struct FormatSink
+ * @brief Destination for formatted output that is not limited to a fixed buffer.
+ * @discussion Output is staged in buf. A sink without a write function keeps
+ *     everything, growing buf on the heap as needed; take the result with
+ *     format_sink_detach. A sink with a write function passes buf on whenever
+ *     it fills up and on format_sink_flush. A sink may be reused across calls,
+ *     and output from each call is appended to the previous one.
+ *     A writev sink (format_sink_init_writev) does not copy long literal
+ *     runs into buf; it queues them as segments pointing into the format
+ *     string or program and writes everything with one writev per call.
+ * @field write Receives staged output, or NULL to accumulate on the heap.
+ * @field user User pointer passed to write.
+ * @field buf Staging buffer (may start as a caller-provided buffer).
+ * @field capacity Size of buf.
+ * @field len Bytes currently staged in buf.
+ * @field flushed Total bytes already passed to write.
+ * @field last Last byte passed to write, so ~& knows whether a line is open.
+ * @field owned True once buf has been allocated by the sink.
+ * @field failed Set when buf could not grow or write came up short.
+ * @field gather True for a writev sink.
+ * @field mark Bytes of buf already covered by queued segments.
+ * @field gathered Bytes queued as literal segments.
+ * @field nsegs Number of queued segments.
+ * @field segs Queued segments.
+ */
+typedef struct FormatSink {
+    FormatSinkWrite write;
+    void *user;
+    char *buf;
+    size_t capacity;
+    size_t len;
+    size_t flushed;
+    char last;
+    bool owned;
+    bool failed;
+    bool gather;
+    size_t mark;
+    size_t gathered;
+    size_t nsegs;
+    FormatSegment segs[FORMAT_SINK_SEGMENTS];
+} FormatSink;
+
+/*!
+ * @typedef FormatContext
+ * @brief Scope for registered ~/name/ directives.
+ * @discussion Each context owns a hash table of directive functions. Lookups
+ *     never take a lock, so any number of threads may format with a context
+ *     while others register functions in it. A NULL context everywhere means
+ *     the global context used by format_register_func.
+ */
+typedef struct FormatContext FormatContext;
+
 /*!
  * @struct FormatState
  * @brief Maintains the state of the formatting process.
@@ -206,6 +310,11 @@ typedef struct FormatArg {
  * @field arg_index Current argument index being processed.
  * @field error Current error state.
  * @field error_pos Pointer to the position in the format string where the error occurred.
+ * @field iter_last True while ~{ formats its last element, so ~^ terminates the body.
+ * @field escaped Set by ~^ to stop formatting until the enclosing ~{ regains control.
+ * @field sink Sink that owns output, or NULL when output is a fixed buffer.
+ * @field hold Nonzero while output must stay in the buffer (~( rewrites it in place).
+ * @field ctx Context that ~/name/ directives are looked up in (NULL for the global one).
  */
 typedef struct FormatState {
     char *output;
@@ -216,6 +325,11 @@ typedef struct FormatState {
     size_t arg_index;
     FormatError error;
     const char *error_pos;  /* Position in format string where error occurred */
+    bool iter_last;
+    bool escaped;
+    FormatSink *sink;
+    unsigned hold;
+    FormatContext *ctx;
 } FormatState;
 
 /*!
@@ -229,7 +343,13 @@ typedef void (*FormatFunc)(FormatState *state, FormatArg *arg);
 /*!
  * @function format_register_func
  * @brief Registers a named function for use with the ~/func/ directive.
- * @param name The name of the function to register (max 32 functions total).
+ * @discussion Registers into the global context; same as format_context_register(NULL, ...).
+ *     The global context is never freed. Registering a name again swaps the
+ *     function in place and allocates nothing; each new name keeps a copy of
+ *     itself, and the table only reallocates when it doubles, so memory stays
+ *     linear in the number of distinct names. format_clear_funcs retires the
+ *     current table rather than freeing it.
+ * @param name The name of the function to register.
  * @param func The function pointer to register.
  */
 void format_register_func(const char *name, FormatFunc func);
@@ -240,6 +360,64 @@ void format_register_func(const char *name, FormatFunc func);
  */
 void format_clear_funcs(void);
 
+/*!
+ * @function format_context_new
+ * @brief Creates an empty directive context.
+ * @return The context, or NULL if out of memory; release it with format_context_free.
+ */
+FormatContext *format_context_new(void);
+
+/*!
+ * @function format_context_free
+ * @brief Releases a context and everything registered in it.
+ * @discussion No thread may be formatting with the context, and no program
+ *     compiled with it may be executed afterwards.
+ * @param ctx The context (may be NULL).
+ */
+void format_context_free(FormatContext *ctx);
+
+/*!
+ * @function format_context_register
+ * @brief Registers (or replaces) a named function for ~/name/ in a context.
+ * @discussion The name is copied. Safe to call while other threads format
+ *     with the same context. Replacing an existing name updates it in place;
+ *     see format_register_func for how memory grows.
+ * @param ctx The context, or NULL for the global context.
+ * @param name The directive name.
+ * @param func The function pointer to register.
+ * @return False if out of memory or an argument is NULL.
+ */
+bool format_context_register(FormatContext *ctx, const char *name, FormatFunc func);
+
+/*!
+ * @function format_context_clear
+ * @brief Removes every function registered in a context.
+ * @discussion Threads may still be looking names up in the old table, so its
+ *     memory is only released by format_context_free.
+ * @param ctx The context, or NULL for the global context.
+ */
+void format_context_clear(FormatContext *ctx);
+
+/*!
+ * @function format_context_lookup
+ * @brief Finds the function registered under a name.
+ * @param ctx The context, or NULL for the global context.
+ * @param name The directive name.
+ * @return The function, or NULL if none is registered.
+ */
+FormatFunc format_context_lookup(FormatContext *ctx, const char *name);
+
+/*!
+ * @function format_write
+ * @brief Appends bytes to the output of a format in progress.
+ * @discussion Use this from custom and registered directives instead of writing
+ *     to state->output directly, so output can grow or drain into a sink.
+ * @param state The current format state.
+ * @param data Bytes to append.
+ * @param len Number of bytes.
+ */
+void format_write(FormatState *state, const char *data, size_t len);
+
 static inline FormatArg format_arg_bool(bool x) {
     return (FormatArg){.type = FORMAT_TYPE_BOOL, .value.as_bool = x};
 }
@@ -292,6 +470,10 @@ static inline FormatArg format_arg_cptr(const void *x) {
     return (FormatArg){.type = FORMAT_TYPE_POINTER, .value.as_pointer = (void*)x};
 }
 
+static inline FormatArg format_arg_self(FormatArg x) {
+    return x;
+}
+
 /*!
  * @defined FORMAT_ARG
  * @brief Macro to wrap a value into a FormatArg structure using _Generic.
@@ -316,6 +498,7 @@ char*: format_arg_string, \
 const char*: format_arg_string, \
 void*: format_arg_ptr, \
 const void*: format_arg_cptr, \
+FormatArg: format_arg_self, \
 default: format_arg_ptr)(x)
 
 /*!
@@ -333,6 +516,102 @@ default: format_arg_ptr)(x)
 #define FORMAT_ARRAY(arr, cnt) \
 ((FormatArg){.type = FORMAT_TYPE_ARRAY, .value.as_array = {(arr), (cnt)}})
 
+/* Evaluates to 0, or fails to compile unless cond is a true constant expression */
+#define FORMAT_STATIC_CHECK(cond) (0 * sizeof(struct { int format_static_check : (cond) ? 1 : -1; }))
+
+/*!
+ * @defined FORMAT_ARRAY_OF
+ * @brief Creates a FormatArg that lets ~{ iterate over a C array in place.
+ * @discussion Each element is read from memory as ~{ reaches it, so no
+ *     FormatArg copy of the array is ever built. The array must stay valid
+ *     until formatting returns.
+ * @param elem_type FormatArgType of each element (a scalar type, one of the element-only types or FORMAT_TYPE_STRING).
+ * @param ptr Pointer to the first element.
+ * @param cnt Number of elements (below 2^40).
+ * @param stride_bytes Distance between elements in bytes; a constant
+ *     expression of at most UINT16_MAX, checked at compile time.
+ */
+#define FORMAT_ARRAY_OF(elem_type, ptr, cnt, stride_bytes) \
+((FormatArg){.type = FORMAT_TYPE_TYPED_ARRAY, .value.as_typed_array = \
+{(const void*)(ptr), (uint64_t)(cnt), \
+(uint64_t)(stride_bytes) + FORMAT_STATIC_CHECK((stride_bytes) <= UINT16_MAX), (uint64_t)(elem_type)}})
+
+/*!
+ * @defined FORMAT_ARRAY_INT
+ * @brief Creates a FormatArg for iterating over an int array.
+ * @param ptr Pointer to the ints.
+ * @param cnt Number of elements.
+ */
+#define FORMAT_ARRAY_INT(ptr, cnt) \
+FORMAT_ARRAY_OF(FORMAT_TYPE_INT, ptr, cnt, sizeof(int))
+
+/*!
+ * @defined FORMAT_ARRAY_DOUBLE
+ * @brief Creates a FormatArg for iterating over a double array.
+ * @param ptr Pointer to the doubles.
+ * @param cnt Number of elements.
+ */
+#define FORMAT_ARRAY_DOUBLE(ptr, cnt) \
+FORMAT_ARRAY_OF(FORMAT_TYPE_DOUBLE, ptr, cnt, sizeof(double))
+
+/*!
+ * @defined FORMAT_ARRAY_STR
+ * @brief Creates a FormatArg for iterating over an array of C strings.
+ * @param ptr Pointer to the string pointers.
+ * @param cnt Number of elements.
+ */
+#define FORMAT_ARRAY_STR(ptr, cnt) \
+FORMAT_ARRAY_OF(FORMAT_TYPE_STRING, ptr, cnt, sizeof(const char*))
+
+/* FormatArgType stored for a struct field of this C type */
+#define FORMAT_FIELD_TYPE(x) _Generic((x), \
+_Bool: FORMAT_TYPE_BOOL, \
+char: FORMAT_TYPE_CHAR, \
+signed char: FORMAT_TYPE_SCHAR, \
+unsigned char: FORMAT_TYPE_UCHAR, \
+short: FORMAT_TYPE_SHORT, \
+unsigned short: FORMAT_TYPE_USHORT, \
+int: FORMAT_TYPE_INT, \
+unsigned int: FORMAT_TYPE_UINT, \
+long: FORMAT_TYPE_LONG, \
+unsigned long: FORMAT_TYPE_ULONG, \
+long long: FORMAT_TYPE_LLONG, \
+unsigned long long: FORMAT_TYPE_ULLONG, \
+float: FORMAT_TYPE_FLOAT, \
+double: FORMAT_TYPE_DOUBLE, \
+char*: FORMAT_TYPE_STRING, \
+const char*: FORMAT_TYPE_STRING, \
+void*: FORMAT_TYPE_POINTER, \
+const void*: FORMAT_TYPE_POINTER)
+
+/* Size of the element FORMAT_FIELD_TYPE reads for x, or 0 when x is an
+   array. Arrays decay to pointers in _Generic, so only &x tells a char
+   array field from a char pointer field. */
+#define FORMAT_FIELD_SIZE(x) _Generic(&(x), \
+char**: sizeof(char*), \
+const char**: sizeof(char*), \
+char*const*: sizeof(char*), \
+const char*const*: sizeof(char*), \
+void**: sizeof(void*), \
+const void**: sizeof(void*), \
+void*const*: sizeof(void*), \
+const void*const*: sizeof(void*), \
+default: _Generic((x), char*: 0, const char*: 0, void*: 0, const void*: 0, default: sizeof(x)))
+
+/*!
+ * @defined FORMAT_ARRAY_FIELD
+ * @brief Creates a FormatArg for iterating over one field of an array of structs.
+ * @discussion The element type follows the field's C type. Inline char
+ *     arrays are rejected at compile time; use a char pointer field instead.
+ * @param ptr Pointer to the first struct.
+ * @param cnt Number of structs.
+ * @param field Name of the field to iterate over.
+ */
+#define FORMAT_ARRAY_FIELD(ptr, cnt, field) \
+FORMAT_ARRAY_OF(FORMAT_FIELD_TYPE((ptr)->field) + \
+FORMAT_STATIC_CHECK(sizeof((ptr)->field) == FORMAT_FIELD_SIZE((ptr)->field)), \
+&(ptr)->field, cnt, sizeof(*(ptr)))
+
 /*!
  * @defined FORMAT_CUSTOM
  * @brief Creates a FormatArg with a custom formatting function.
@@ -416,6 +695,20 @@ int format_impl(char *buf, size_t bufsize, const char *fmt_string,
 int format_impl_ex(char *buf, size_t bufsize, const char *fmt_string,
                    FormatArg *args, size_t arg_count, FormatError *err_out);
 
+/*!
+ * @function format_impl_ctx
+ * @brief Formats into a buffer, resolving ~/name/ directives in the given context.
+ * @param ctx Directive context (NULL for the global context).
+ * @param buf Output buffer.
+ * @param bufsize Size of the output buffer.
+ * @param fmt_string Format string.
+ * @param args Array of format arguments.
+ * @param arg_count Number of arguments.
+ * @return Number of characters written (excluding null terminator), or -1 on error.
+ */
+int format_impl_ctx(FormatContext *ctx, char *buf, size_t bufsize, const char *fmt_string,
+                    FormatArg *args, size_t arg_count);
+
 /*!
  * @function format_alloc
  * @brief Formats a string and allocates memory for the result.
@@ -448,6 +741,109 @@ int format_print(const char *fmt_string, FormatArg *args, size_t arg_count);
  */
 int format_fprint(FILE *fp, const char *fmt_string, FormatArg *args, size_t arg_count);
 
+/*!
+ * @function format_dprint
+ * @brief Formats a string and writes it to a file descriptor with a single writev.
+ * @discussion Literal text is passed to the kernel straight from fmt_string;
+ *     only directive output is copied, into a stack buffer.
+ * @param fd File descriptor to write to.
+ * @param fmt_string Format string.
+ * @param args Array of format arguments.
+ * @param arg_count Number of arguments.
+ * @return Number of characters written, or -1 on error.
+ */
+int format_dprint(int fd, const char *fmt_string, FormatArg *args, size_t arg_count);
+
+/*!
+ * @function format_sink_init
+ * @brief Initializes a sink that passes its output to a callback.
+ * @param sink The sink to initialize.
+ * @param write Output callback, or NULL to keep all output on the heap.
+ * @param user User pointer passed to write.
+ * @param buf Initial staging buffer (may be NULL; replaced by a heap buffer if it must grow).
+ * @param bufsize Size of buf.
+ */
+void format_sink_init(FormatSink *sink, FormatSinkWrite write, void *user, char *buf, size_t bufsize);
+
+/*!
+ * @function format_sink_init_heap
+ * @brief Initializes a sink that accumulates all output in a growable heap buffer.
+ * @param sink The sink to initialize.
+ */
+void format_sink_init_heap(FormatSink *sink);
+
+/*!
+ * @function format_sink_init_file
+ * @brief Initializes a sink that writes to a file stream.
+ * @param sink The sink to initialize.
+ * @param fp File stream to write to.
+ * @param buf Staging buffer (may be NULL).
+ * @param bufsize Size of buf.
+ */
+void format_sink_init_file(FormatSink *sink, FILE *fp, char *buf, size_t bufsize);
+
+/*!
+ * @function format_sink_init_fd
+ * @brief Initializes a sink that writes to a file descriptor.
+ * @discussion Output is buffered in the sink and written when the buffer
+ *     fills up or on format_sink_flush, so many small messages cost one write.
+ * @param sink The sink to initialize.
+ * @param fd File descriptor to write to.
+ * @param buf Staging buffer (may be NULL).
+ * @param bufsize Size of buf.
+ */
+void format_sink_init_fd(FormatSink *sink, int fd, char *buf, size_t bufsize);
+
+/*!
+ * @function format_sink_init_writev
+ * @brief Initializes a sink that writes to a file descriptor with scatter/gather I/O.
+ * @discussion Literal runs of at least FORMAT_GATHER_MIN bytes are referenced
+ *     in place instead of being copied into buf, and buf only holds directive
+ *     output. Queued output is written with writev when the call that
+ *     produced it returns, since the literals it points to may not outlive it.
+ * @param sink The sink to initialize.
+ * @param fd File descriptor to write to.
+ * @param buf Staging buffer for directive output (may be NULL).
+ * @param bufsize Size of buf.
+ */
+void format_sink_init_writev(FormatSink *sink, int fd, char *buf, size_t bufsize);
+
+/*!
+ * @function format_sink_flush
+ * @brief Passes staged output to the sink's write function.
+ * @param sink The sink (a no-op for heap sinks).
+ * @return False if the sink has failed.
+ */
+bool format_sink_flush(FormatSink *sink);
+
+/*!
+ * @function format_sink_detach
+ * @brief Takes the staged output of a sink as a heap string and empties the sink.
+ * @param sink The sink.
+ * @param len Set to the length of the string (optional).
+ * @return Null-terminated string that the caller must free, or NULL if the sink failed.
+ */
+char *format_sink_detach(FormatSink *sink, size_t *len);
+
+/*!
+ * @function format_sink_free
+ * @brief Flushes a sink and releases the buffer it allocated.
+ * @param sink The sink.
+ */
+void format_sink_free(FormatSink *sink);
+
+/*!
+ * @function format_impl_sink
+ * @brief Formats into a sink in a single pass.
+ * @param sink Destination sink.
+ * @param fmt_string Format string.
+ * @param args Array of format arguments.
+ * @param arg_count Number of arguments.
+ * @return Number of characters produced by this call (never truncated), or -1 on error.
+ */
+int format_impl_sink(FormatSink *sink, const char *fmt_string,
+                     FormatArg *args, size_t arg_count);
+
 /*!
  * @defined format
  * @brief Formats a string into a buffer using CL-style directives.
@@ -511,6 +907,18 @@ FORMAT_NARGS(__VA_ARGS__))
 #define formatf0(fmt_str) \
 format_print(fmt_str, NULL, 0)
 
+/*!
+ * @defined format_to
+ * @brief Formats a string into a sink.
+ * @param sink The FormatSink pointer.
+ * @param fmt_str The format string.
+ * @param ... Variadic arguments to be formatted.
+ */
+#define format_to(sink, fmt_str, ...) \
+format_impl_sink(sink, fmt_str, \
+(FormatArg[]){FORMAT_WRAP(__VA_ARGS__)}, \
+FORMAT_NARGS(__VA_ARGS__))
+
 /*!
  * @defined formatfp
  * @brief Formats a string and prints it to a file stream.
@@ -523,6 +931,302 @@ format_fprint(fp, fmt_str, \
 (FormatArg[]){FORMAT_WRAP(__VA_ARGS__)}, \
 FORMAT_NARGS(__VA_ARGS__))
 
+/*!
+ * @defined formatfd
+ * @brief Formats a string and writes it to a file descriptor.
+ * @param fd The file descriptor.
+ * @param fmt_str The format string.
+ * @param ... Variadic arguments to be formatted.
+ */
+#define formatfd(fd, fmt_str, ...) \
+format_dprint(fd, fmt_str, \
+(FormatArg[]){FORMAT_WRAP(__VA_ARGS__)}, \
+FORMAT_NARGS(__VA_ARGS__))
+
+/*!
+ * @typedef FormatProgram
+ * @brief A format string compiled by format_compile.
+ * @discussion Literal text is merged into runs, directive parameters are
+ *     parsed up front (except v and #, which read the arguments) and every
+ *     bracket records where its body and clauses end, so executing a
+ *     program never rescans the format string. A program is immutable
+ *     once compiled and may be executed from several threads at once.
+ */
+typedef struct FormatProgram FormatProgram;
+
+/*!
+ * @function format_compile
+ * @brief Compiles a format string for repeated use with format_exec.
+ * @param fmt_string Format string (not referenced after the call returns).
+ * @return The compiled program, or NULL on error (see format_get_error); release it with format_program_free.
+ */
+FormatProgram *format_compile(const char *fmt_string);
+
+/*!
+ * @function format_compile_ctx
+ * @brief Compiles a format string, resolving ~/name/ directives in a context.
+ * @discussion Names registered at compile time are bound to their function
+ *     in the program; names that are not yet registered are looked up in ctx
+ *     each time the program runs.
+ * @param ctx Directive context (NULL for the global context); must outlive the program.
+ * @param fmt_string Format string.
+ * @return The compiled program, or NULL on error.
+ */
+FormatProgram *format_compile_ctx(FormatContext *ctx, const char *fmt_string);
+
+/*!
+ * @function format_program_free
+ * @brief Releases a program returned by format_compile.
+ * @param prog The program (may be NULL).
+ */
+void format_program_free(FormatProgram *prog);
+
+/*!
+ * @function format_exec
+ * @brief Executes a compiled format program into a buffer.
+ * @discussion Produces the same output as format_impl with the original format string.
+ * @param prog Compiled program.
+ * @param buf Output buffer.
+ * @param bufsize Size of the output buffer.
+ * @param args Array of format arguments.
+ * @param arg_count Number of arguments.
+ * @return Number of characters written (excluding null terminator), or -1 on error.
+ */
+int format_exec(const FormatProgram *prog, char *buf, size_t bufsize,
+                FormatArg *args, size_t arg_count);
+
+/*!
+ * @function format_exec_sink
+ * @brief Executes a compiled format program into a sink in a single pass.
+ * @param prog Compiled program.
+ * @param sink Destination sink.
+ * @param args Array of format arguments.
+ * @param arg_count Number of arguments.
+ * @return Number of characters produced by this call (never truncated), or -1 on error.
+ */
+int format_exec_sink(const FormatProgram *prog, FormatSink *sink,
+                     FormatArg *args, size_t arg_count);
+
+/*!
+ * @defined format_compiled
+ * @brief Formats into a buffer using a compiled program.
+ * @param buf The output buffer.
+ * @param bufsize The size of the output buffer.
+ * @param prog The program from format_compile.
+ * @param ... Variadic arguments to be formatted.
+ */
+#define format_compiled(buf, bufsize, prog, ...) \
+format_exec(prog, buf, bufsize, \
+(FormatArg[]){FORMAT_WRAP(__VA_ARGS__)}, \
+FORMAT_NARGS(__VA_ARGS__))
+
+/*!
+ * @function format_cache_enable
+ * @brief Turns on the compiled-template cache.
+ * @discussion While the cache is on, format_impl, format_alloc, format_print
+ *     and the other functions that take a format string compile each template
+ *     the first time it is seen and run the compiled program from then on.
+ *     Templates are keyed by address, so string literals are found without
+ *     hashing their text; a stored copy of the text guards against the same
+ *     address being reused for a different string. Lookups take no lock.
+ *     The cache never evicts. A template whose FORMAT_CACHE_PROBES slots
+ *     are all held by others is interpreted without being compiled; it pays
+ *     only for those probes on every call.
+ * @param slots Number of templates the cache can hold, rounded up to a power
+ *     of two (0 for FORMAT_CACHE_SLOTS).
+ * @return False if the cache could not be allocated.
+ */
+bool format_cache_enable(size_t slots);
+
+/*!
+ * @function format_cache_disable
+ * @brief Turns off the compiled-template cache and releases the cached programs.
+ * @discussion Must not be called while other threads are formatting.
+ */
+void format_cache_disable(void);
+
+/* Parallel batch formatting (requires paul_threads.h to be included first) */
+#ifdef PAUL_THREADS_HEADER
+/* Most arguments a FormatBatchArgs function may produce for one record */
+#ifndef FORMAT_BATCH_MAX_ARGS
+#define FORMAT_BATCH_MAX_ARGS 32
+#endif
+
+/*!
+ * @typedef FormatBatchArgs
+ * @brief Function pointer type that turns one record into format arguments.
+ * @discussion Called concurrently from pool threads; pointers stored in args
+ *     (strings, arrays) must stay valid until format_batch returns.
+ * @param record The record to format.
+ * @param args Array of FORMAT_BATCH_MAX_ARGS arguments to fill in.
+ * @param max_args Size of args.
+ * @return Number of arguments filled in.
+ */
+typedef size_t (*FormatBatchArgs)(const void *record, FormatArg *args, size_t max_args);
+
+/*!
+ * @function format_batch
+ * @brief Formats every record of an array with one program, in parallel, in order.
+ * @discussion Records are handed out in blocks of FORMAT_BATCH_ROWS to the
+ *     pool's workers and the calling thread. Each block is formatted into a
+ *     buffer of its own, and finished blocks are appended to sink in record
+ *     order, so the output is the same for any number of threads. Every record
+ *     is formatted as if it started a fresh output: ~& and ~T do not see the
+ *     records before it. Completion is tracked per call, so the pool may be
+ *     shared with unrelated jobs, and format_batch may itself run as a job
+ *     of the same pool: the calling thread keeps taking blocks until none
+ *     are left and only waits for blocks a worker has started. A NULL pool
+ *     formats everything on the calling thread.
+ * @param pool Thread pool from paul_threads.h, or NULL.
+ * @param prog Compiled program applied to each record.
+ * @param records Pointer to the first record.
+ * @param record_size Distance between records in bytes.
+ * @param n Number of records.
+ * @param build Fills in the arguments for one record.
+ * @param sink Destination sink.
+ * @return Number of characters produced, or (size_t)-1 if the sink failed.
+ */
+size_t format_batch(thrd_pool_t *pool, const FormatProgram *prog, const void *records, size_t record_size,
+                    size_t n, FormatBatchArgs build, FormatSink *sink);
+#endif
+
+/*!
+ * @typedef FormatStream
+ * @brief Resumable execution of a compiled program.
+ * @discussion format_stream_read produces output a chunk at a time and
+ *     continues exactly where the previous call stopped, including in the
+ *     middle of ~{ loops and ~[ clauses, so large output can be sent as it
+ *     is produced instead of being built in full first. Output is produced
+ *     one op at a time; anything an op produces beyond the chunk is kept for
+ *     the next call, so only ~( and ~< blocks (which need their whole text
+ *     before it can be converted or padded) and single directives are ever
+ *     held in memory at once.
+ */
+typedef struct FormatStream FormatStream;
+
+/*!
+ * @function format_stream_new
+ * @brief Starts a resumable run of a compiled program.
+ * @param prog Compiled program; must outlive the stream.
+ * @param args Array of format arguments; must stay valid and unchanged until the stream is freed.
+ * @param arg_count Number of arguments.
+ * @return The stream, or NULL if it could not be allocated.
+ */
+FormatStream *format_stream_new(const FormatProgram *prog, FormatArg *args, size_t arg_count);
+
+/*!
+ * @function format_stream_read
+ * @brief Produces the next chunk of output.
+ * @param stream The stream.
+ * @param chunk Buffer to fill (not null-terminated).
+ * @param size Size of chunk.
+ * @return Number of bytes written, less than size only once the output is complete; 0 when there is nothing left.
+ */
+size_t format_stream_read(FormatStream *stream, char *chunk, size_t size);
+
+/*!
+ * @function format_stream_done
+ * @brief Checks whether a stream has produced all of its output.
+ * @param stream The stream.
+ * @return True once every byte has been returned by format_stream_read.
+ */
+bool format_stream_done(const FormatStream *stream);
+
+/*!
+ * @function format_stream_free
+ * @brief Releases a stream, finished or not.
+ * @param stream The stream (may be NULL).
+ */
+void format_stream_free(FormatStream *stream);
+
+/*!
+ * @typedef FormatLog
+ * @brief Deferred-formatting logger.
+ * @discussion Logging a message copies only the template id and the raw
+ *     arguments (strings and ~{ arrays are deep-copied) into a ring buffer
+ *     owned by the calling thread, without locks or formatting. Another
+ *     thread later calls format_log_drain, which runs the compiled templates
+ *     over the recorded arguments. Messages that do not fit in the ring are
+ *     dropped and counted rather than blocking the caller.
+ */
+typedef struct FormatLog FormatLog;
+
+/*!
+ * @defined FORMAT_LOG_INVALID
+ * @brief Template id returned by format_log_template on failure.
+ */
+#define FORMAT_LOG_INVALID UINT32_MAX
+
+/*!
+ * @function format_log_new
+ * @brief Creates a deferred logger.
+ * @param ctx Context for ~/name/ directives in templates (NULL for the global context).
+ * @param ring_size Bytes of ring buffer per logging thread (0 for the default of 64KB).
+ * @return The logger, or NULL if out of memory.
+ */
+FormatLog *format_log_new(FormatContext *ctx, size_t ring_size);
+
+/*!
+ * @function format_log_free
+ * @brief Releases a logger, its templates and every thread's ring.
+ * @discussion Pending messages are discarded; drain first to keep them.
+ *     No thread may be logging to it.
+ * @param log The logger (may be NULL).
+ */
+void format_log_free(FormatLog *log);
+
+/*!
+ * @function format_log_template
+ * @brief Compiles a format string and registers it with a logger.
+ * @param log The logger.
+ * @param fmt_string Format string.
+ * @return The template id, or FORMAT_LOG_INVALID on error.
+ */
+uint32_t format_log_template(FormatLog *log, const char *fmt_string);
+
+/*!
+ * @function format_log_write
+ * @brief Records a message for later formatting.
+ * @discussion Custom and pointer arguments are copied by value; whatever
+ *     they point to must still be valid when the log is drained.
+ * @param log The logger.
+ * @param id Template id from format_log_template.
+ * @param args Array of format arguments.
+ * @param arg_count Number of arguments.
+ * @return False if the message was dropped because the ring is full.
+ */
+bool format_log_write(FormatLog *log, uint32_t id, FormatArg *args, size_t arg_count);
+
+/*!
+ * @function format_log_drain
+ * @brief Formats every pending message into a sink, oldest first per thread.
+ * @discussion Only one thread may drain a logger at a time.
+ * @param log The logger.
+ * @param sink Destination for the formatted messages.
+ * @return Number of messages formatted.
+ */
+size_t format_log_drain(FormatLog *log, FormatSink *sink);
+
+/*!
+ * @function format_log_dropped
+ * @brief Counts messages dropped because a ring was full.
+ * @param log The logger.
+ * @return Total dropped messages across all threads.
+ */
+uint64_t format_log_dropped(FormatLog *log);
+
+/*!
+ * @defined format_log
+ * @brief Records a message for deferred formatting.
+ * @param log The FormatLog pointer.
+ * @param id Template id from format_log_template.
+ * @param ... Variadic arguments to be formatted.
+ */
+#define format_log(log, id, ...) \
+format_log_write(log, id, \
+(FormatArg[]){FORMAT_WRAP(__VA_ARGS__)}, \
+FORMAT_NARGS(__VA_ARGS__))
+
 #ifdef __cplusplus
 }
 #endif
@@ -534,6 +1238,14 @@ FORMAT_NARGS(__VA_ARGS__))
 #pragma GCC diagnostic ignored "-Wunused-function"
 #endif
 
+#if defined(_WIN32)
+#include <io.h>
+#else
+#include <unistd.h>
+#include <sys/uio.h>
+#endif
+#include <errno.h>
+
 /* Thread-local error storage */
 #if defined(_MSC_VER)
 #define FORMAT_THREAD_LOCAL __declspec(thread)
@@ -557,6 +1269,7 @@ const char *format_error_string(FormatError err) {
         case FORMAT_ERR_MISSING_ARG: return "Missing argument";
         case FORMAT_ERR_UNCLOSED_BRACKET: return "Unclosed bracket";
         case FORMAT_ERR_INVALID_RADIX: return "Invalid radix";
+        case FORMAT_ERR_SINK_FAILED: return "Sink failed";
         default: return "Unknown error";
     }
 }
@@ -573,78 +1286,556 @@ static void format_set_error(FormatState *state, FormatError err, const char *po
     format_last_error = err;
 }
 
-/* Function registry for ~/func/ directive */
-#define FORMAT_MAX_FUNCS 32
+/* Atomics for the directive registry and the deferred logger */
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define FORMAT_LOAD_PTR(p) _InterlockedCompareExchangePointer((void *volatile *)(p), NULL, NULL)
+#define FORMAT_STORE_PTR(p, v) _InterlockedExchangePointer((void *volatile *)(p), (v))
+#define FORMAT_LOCK(l) while (_InterlockedExchange((volatile long *)(l), 1))
+#define FORMAT_UNLOCK(l) _InterlockedExchange((volatile long *)(l), 0)
+#define FORMAT_LOAD_U64(p) (uint64_t)_InterlockedCompareExchange64((volatile __int64 *)(p), 0, 0)
+#define FORMAT_STORE_U64(p, v) _InterlockedExchange64((volatile __int64 *)(p), (__int64)(v))
+#define FORMAT_FETCH_ADD_U64(p, v) _InterlockedExchangeAdd64((volatile __int64 *)(p), (__int64)(v))
+#else
+#define FORMAT_LOAD_PTR(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define FORMAT_STORE_PTR(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define FORMAT_LOCK(l) while (__atomic_exchange_n((l), 1, __ATOMIC_ACQUIRE))
+#define FORMAT_UNLOCK(l) __atomic_store_n((l), 0, __ATOMIC_RELEASE)
+#define FORMAT_LOAD_U64(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define FORMAT_STORE_U64(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define FORMAT_FETCH_ADD_U64(p, v) __atomic_fetch_add((p), (v), __ATOMIC_RELAXED)
+#endif
 
+/* Function registry for ~/func/ directive */
 typedef struct {
     const char *name;
+    size_t len;
+    uint64_t hash;
     FormatFunc func;
 } FormatFuncEntry;
 
-static FormatFuncEntry format_func_registry[FORMAT_MAX_FUNCS];
-static size_t format_func_count = 0;
+/* Open-addressed table. Once published, entries are only filled in (name
+   stored last) or have their func swapped, both atomically. */
+typedef struct {
+    size_t mask;
+    size_t count;
+    FormatFuncEntry entries[];
+} FormatFuncTable;
+
+/* Writers fill in free slots of the live table and only copy it when it
+   has to grow. Outgrown tables and copied names are kept until the context
+   is freed, so a lookup that loaded an old table never touches freed
+   memory; since capacity doubles, they add up to less than the live one. */
+struct FormatContext {
+    FormatFuncTable *table;
+    long lock;
+    void **allocs;
+    size_t alloc_count;
+    size_t alloc_cap;
+};
+
+static FormatContext format_global_context;
+
+static uint64_t format_name_hash(const char *name, size_t len) {
+    uint64_t h = 14695981039346656037ULL; /* FNV-1a */
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)name[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/* Remember an allocation to release with the context (lock held) */
+static bool format_context_own(FormatContext *ctx, void *ptr) {
+    if (ctx->alloc_count == ctx->alloc_cap) {
+        size_t cap = ctx->alloc_cap ? ctx->alloc_cap * 2 : 16;
+        void **allocs = realloc(ctx->allocs, cap * sizeof(void *));
+        if (!allocs)
+            return false;
+        ctx->allocs = allocs;
+        ctx->alloc_cap = cap;
+    }
+    ctx->allocs[ctx->alloc_count++] = ptr;
+    return true;
+}
 
-void format_register_func(const char *name, FormatFunc func) {
-    if (format_func_count < FORMAT_MAX_FUNCS && name && func) {
-        format_func_registry[format_func_count].name = name;
-        format_func_registry[format_func_count].func = func;
-        format_func_count++;
+/* Slot for name in table: its entry, or the empty slot where it belongs */
+static FormatFuncEntry *format_table_slot(FormatFuncTable *table, const char *name, size_t len, uint64_t hash) {
+    for (size_t i = hash & table->mask;; i = (i + 1) & table->mask) {
+        FormatFuncEntry *entry = &table->entries[i];
+        const char *entry_name = FORMAT_LOAD_PTR(&entry->name);
+        if (!entry_name || (entry->hash == hash && entry->len == len && !memcmp(entry_name, name, len)))
+            return entry;
     }
 }
 
-void format_clear_funcs(void) {
-    format_func_count = 0;
+FormatContext *format_context_new(void) {
+    return calloc(1, sizeof(FormatContext));
 }
 
-static FormatFunc format_lookup_func(const char *name, size_t len) {
-    for (size_t i = 0; i < format_func_count; i++) {
-        if (strlen(format_func_registry[i].name) == len &&
-            strncmp(format_func_registry[i].name, name, len) == 0)
-            return format_func_registry[i].func;
+void format_context_free(FormatContext *ctx) {
+    if (!ctx)
+        return;
+    for (size_t i = 0; i < ctx->alloc_count; i++)
+        free(ctx->allocs[i]);
+    free(ctx->allocs);
+    free(ctx);
+}
 
+/* Copy table into one twice the size (lock held); it is not published yet */
+static FormatFuncTable *format_table_grow(FormatContext *ctx, FormatFuncTable *old) {
+    size_t capacity = old ? (old->mask + 1) * 2 : 8;
+    FormatFuncTable *table = calloc(1, sizeof(FormatFuncTable) + capacity * sizeof(FormatFuncEntry));
+    if (!table || !format_context_own(ctx, table)) {
+        free(table);
+        return NULL;
     }
-    return NULL;
+    table->mask = capacity - 1;
+    table->count = old ? old->count : 0;
+    for (size_t i = 0; old && i <= old->mask; i++) {
+        if (old->entries[i].name)
+            *format_table_slot(table, old->entries[i].name, old->entries[i].len, old->entries[i].hash) = old->entries[i];
+    }
+    return table;
 }
 
-/* Append string to output buffer */
-static void format_append_str(FormatState *state, const char *str) {
-    if (!str) return;
-    size_t len = strlen(str);
-    if (state->pos + len >= state->capacity)
-        len = state->capacity - state->pos - 1;
+bool format_context_register(FormatContext *ctx, const char *name, FormatFunc func) {
+    if (!name || !func)
+        return false;
+    if (!ctx)
+        ctx = &format_global_context;
+
+    size_t len = strlen(name);
+    uint64_t hash = format_name_hash(name, len);
+    bool ok = false;
+
+    FORMAT_LOCK(&ctx->lock);
+    FormatFuncTable *table = ctx->table;
+    FormatFuncEntry *entry = table ? format_table_slot(table, name, len, hash) : NULL;
+    if (entry && entry->name) {
+        /* Replacing a function needs no new table */
+        FORMAT_STORE_PTR(&entry->func, func);
+        ok = true;
+    } else {
+        if (!table || (table->count + 1) * 2 > table->mask + 1) {
+            table = format_table_grow(ctx, table);
+            entry = table ? format_table_slot(table, name, len, hash) : NULL;
+        }
+        char *copy = entry ? malloc(len + 1) : NULL;
+        if (copy && format_context_own(ctx, copy)) {
+            memcpy(copy, name, len + 1);
+            entry->len = len;
+            entry->hash = hash;
+            entry->func = func;
+            FORMAT_STORE_PTR(&entry->name, (const char *)copy); /* Lookups see the whole entry */
+            table->count++;
+            if (table != ctx->table)
+                FORMAT_STORE_PTR(&ctx->table, table);
+            ok = true;
+        } else
+            free(copy);
+    }
+    FORMAT_UNLOCK(&ctx->lock);
+    return ok;
+}
 
-    memcpy(state->output + state->pos, str, len);
-    state->pos += len;
-    state->output[state->pos] = '\0';
+void format_context_clear(FormatContext *ctx) {
+    if (!ctx)
+        ctx = &format_global_context;
+    FORMAT_LOCK(&ctx->lock);
+    FORMAT_STORE_PTR(&ctx->table, (FormatFuncTable *)NULL);
+    FORMAT_UNLOCK(&ctx->lock);
 }
 
-/* Append single character */
-static void format_append_char(FormatState *state, char c) {
-    if (state->pos + 1 < state->capacity) {
-        state->output[state->pos++] = c;
-        state->output[state->pos] = '\0';
-    }
+static FormatFunc format_lookup_func(FormatContext *ctx, const char *name, size_t len) {
+    FormatFuncTable *table = FORMAT_LOAD_PTR(&(ctx ? ctx : &format_global_context)->table);
+    if (!table)
+        return NULL;
+    return (FormatFunc)FORMAT_LOAD_PTR(&format_table_slot(table, name, len, format_name_hash(name, len))->func);
 }
 
-/* Append formatted string */
-static void format_append_fmt(FormatState *state, const char *fmt, ...) {
-    va_list args;
-    va_start(args, fmt);
-    int written = vsnprintf(state->output + state->pos,
-                            state->capacity - state->pos, fmt, args);
-    va_end(args);
-    if (written > 0) {
-        if ((size_t)written >= state->capacity - state->pos)
-            state->pos = state->capacity - 1;
-        else
-            state->pos += written;
+FormatFunc format_context_lookup(FormatContext *ctx, const char *name) {
+    return name ? format_lookup_func(ctx, name, strlen(name)) : NULL;
+}
 
-    }
+void format_register_func(const char *name, FormatFunc func) {
+    format_context_register(NULL, name, func);
 }
 
-/* Get integer value from argument (any integer type) */
-static long long format_arg_to_int(FormatArg *arg) {
-    switch (arg->type) {
+void format_clear_funcs(void) {
+    format_context_clear(NULL);
+}
+
+/* Smallest heap buffer a sink allocates */
+#ifndef FORMAT_SINK_MIN
+#define FORMAT_SINK_MIN 256
+#endif
+
+void format_sink_init(FormatSink *sink, FormatSinkWrite write, void *user, char *buf, size_t bufsize) {
+    sink->write = write;
+    sink->user = user;
+    sink->buf = buf;
+    sink->capacity = buf ? bufsize : 0;
+    sink->len = 0;
+    sink->flushed = 0;
+    sink->last = '\0';
+    sink->owned = false;
+    sink->failed = false;
+    sink->gather = false;
+    sink->mark = 0;
+    sink->gathered = 0;
+    sink->nsegs = 0;
+}
+
+void format_sink_init_heap(FormatSink *sink) {
+    format_sink_init(sink, NULL, NULL, NULL, 0);
+}
+
+static size_t format_sink_file_write(void *user, const char *data, size_t len) {
+    return fwrite(data, 1, len, (FILE*)user);
+}
+
+void format_sink_init_file(FormatSink *sink, FILE *fp, char *buf, size_t bufsize) {
+    format_sink_init(sink, format_sink_file_write, fp, buf, bufsize);
+}
+
+static size_t format_sink_fd_write(void *user, const char *data, size_t len) {
+    int fd = (int)(intptr_t)user;
+    size_t done = 0;
+    while (done < len) {
+#if defined(_WIN32)
+        int n = _write(fd, data + done, (unsigned)(len - done > 0x40000000 ? 0x40000000 : len - done));
+#else
+        ssize_t n = write(fd, data + done, len - done);
+#endif
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        done += (size_t)n;
+    }
+    return done;
+}
+
+void format_sink_init_fd(FormatSink *sink, int fd, char *buf, size_t bufsize) {
+    format_sink_init(sink, format_sink_fd_write, (void*)(intptr_t)fd, buf, bufsize);
+}
+
+void format_sink_init_writev(FormatSink *sink, int fd, char *buf, size_t bufsize) {
+    format_sink_init_fd(sink, fd, buf, bufsize);
+    sink->gather = true;
+}
+
+/* Write every queued segment, taking staged pieces from buf in order */
+static bool format_sink_writev(FormatSink *sink) {
+    const char *staged = sink->buf;
+#if defined(_WIN32)
+    for (size_t i = 0; i < sink->nsegs; i++) {
+        const char *data = sink->segs[i].data;
+        size_t len = sink->segs[i].len;
+        if (!data) {
+            data = staged;
+            staged += len;
+        }
+        if (format_sink_fd_write(sink->user, data, len) < len)
+            return false;
+    }
+    return true;
+#else
+    struct iovec iov[FORMAT_SINK_SEGMENTS];
+    for (size_t i = 0; i < sink->nsegs; i++) {
+        const char *data = sink->segs[i].data;
+        if (!data) {
+            data = staged;
+            staged += sink->segs[i].len;
+        }
+        iov[i].iov_base = (void*)data;
+        iov[i].iov_len = sink->segs[i].len;
+    }
+
+    int fd = (int)(intptr_t)sink->user;
+    struct iovec *v = iov;
+    int count = (int)sink->nsegs;
+    while (count > 0) {
+        ssize_t n = writev(fd, v, count);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        /* Skip what was written, resuming partway into a segment if needed */
+        for (; count > 0 && (size_t)n >= v->iov_len; v++, count--)
+            n -= (ssize_t)v->iov_len;
+        if (count > 0) {
+            v->iov_base = (char*)v->iov_base + n;
+            v->iov_len -= (size_t)n;
+        }
+    }
+    return true;
+#endif
+}
+
+/* Pass staged bytes to the write function */
+static void format_sink_drain(FormatSink *sink) {
+    if (sink->nsegs) {
+        /* Staged bytes after the last queued literal go out in the same writev */
+        if (sink->len > sink->mark)
+            sink->segs[sink->nsegs++] = (FormatSegment){NULL, sink->len - sink->mark};
+        const FormatSegment *tail = &sink->segs[sink->nsegs - 1];
+        sink->last = tail->data ? tail->data[tail->len - 1] : sink->buf[sink->len - 1];
+        if (!sink->failed && !format_sink_writev(sink))
+            sink->failed = true;
+        sink->flushed += sink->len + sink->gathered;
+        sink->len = 0;
+        sink->mark = 0;
+        sink->gathered = 0;
+        sink->nsegs = 0;
+        return;
+    }
+    if (!sink->write || !sink->len)
+        return;
+    if (!sink->failed && sink->write(sink->user, sink->buf, sink->len) < sink->len)
+        sink->failed = true;
+    sink->last = sink->buf[sink->len - 1];
+    sink->flushed += sink->len;
+    sink->len = 0;
+}
+
+/* Grow the staging buffer to at least size bytes */
+static bool format_sink_grow(FormatSink *sink, size_t size) {
+    size_t capacity = sink->capacity * 2;
+    if (capacity < size)
+        capacity = size;
+    if (capacity < FORMAT_SINK_MIN)
+        capacity = FORMAT_SINK_MIN;
+
+    char *buf;
+    if (sink->owned)
+        buf = realloc(sink->buf, capacity);
+    else if ((buf = malloc(capacity)) && sink->len)
+        memcpy(buf, sink->buf, sink->len);
+    if (!buf) {
+        sink->failed = true;
+        return false;
+    }
+    sink->buf = buf;
+    sink->capacity = capacity;
+    sink->owned = true;
+    return true;
+}
+
+bool format_sink_flush(FormatSink *sink) {
+    format_sink_drain(sink);
+    return !sink->failed;
+}
+
+char *format_sink_detach(FormatSink *sink, size_t *len) {
+    char *result = NULL;
+    if (!sink->failed) {
+        if (sink->owned && sink->len < sink->capacity)
+            result = sink->buf;
+        else if ((result = malloc(sink->len + 1)) && sink->len)
+            memcpy(result, sink->buf, sink->len);
+        if (result) {
+            result[sink->len] = '\0';
+            if (len) *len = sink->len;
+        }
+    }
+    if (sink->owned && result != sink->buf)
+        free(sink->buf);
+    if (sink->owned) {
+        sink->buf = NULL;
+        sink->capacity = 0;
+        sink->owned = false;
+    }
+    sink->len = 0;
+    sink->failed = false;
+    return result;
+}
+
+void format_sink_free(FormatSink *sink) {
+    format_sink_drain(sink);
+    if (sink->owned)
+        free(sink->buf);
+    sink->buf = NULL;
+    sink->capacity = 0;
+    sink->len = 0;
+    sink->owned = false;
+}
+
+/* Make room for len more bytes plus the terminator written when formatting
+   finishes, draining or growing the sink if there is one; returns how many
+   of the len bytes fit */
+static size_t format_reserve(FormatState *state, size_t len) {
+    if (state->pos + len < state->capacity)
+        return len;
+
+    FormatSink *sink = state->sink;
+    if (sink && !sink->failed) {
+        sink->len = state->pos;
+        if (sink->write && !state->hold) {
+            format_sink_drain(sink);
+            state->pos = 0;
+            if (len < state->capacity)
+                return len;
+        }
+        if (format_sink_grow(sink, state->pos + len + 1)) {
+            state->output = sink->buf;
+            state->capacity = sink->capacity;
+            return len;
+        }
+        format_set_error(state, FORMAT_ERR_SINK_FAILED, NULL);
+    }
+    return state->capacity > state->pos ? state->capacity - state->pos - 1 : 0;
+}
+
+/* Output position, counting bytes already drained from a sink or queued by reference */
+static size_t format_position(FormatState *state) {
+    return state->pos + (state->sink ? state->sink->flushed + state->sink->gathered : 0);
+}
+
+/* Last byte of output so far, including bytes already drained from a sink */
+static char format_last_char(FormatState *state) {
+    FormatSink *sink = state->sink;
+    if (state->pos > (sink ? sink->mark : 0))
+        return state->output[state->pos - 1];
+    return sink && (sink->flushed || sink->nsegs) ? sink->last : '\0';
+}
+
+/* Append len bytes to output buffer (left unterminated until formatting ends) */
+static void format_append_mem(FormatState *state, const char *str, size_t len) {
+    len = format_reserve(state, len);
+    memcpy(state->output + state->pos, str, len);
+    state->pos += len;
+}
+
+/* Append literal text that stays valid until formatting ends; a writev sink
+   queues long runs by reference instead of copying them */
+static void format_append_literal(FormatState *state, const char *str, size_t len) {
+    FormatSink *sink = state->sink;
+    if (len < FORMAT_GATHER_MIN || !sink || !sink->gather || state->hold || sink->failed) {
+        format_append_mem(state, str, len);
+        return;
+    }
+
+    /* Keep room for this run, the staged bytes before it and those after it */
+    sink->len = state->pos;
+    if (sink->nsegs + 3 > FORMAT_SINK_SEGMENTS) {
+        format_sink_drain(sink);
+        state->pos = 0;
+    }
+    if (state->pos > sink->mark)
+        sink->segs[sink->nsegs++] = (FormatSegment){NULL, state->pos - sink->mark};
+    sink->segs[sink->nsegs++] = (FormatSegment){str, len};
+    sink->mark = state->pos;
+    sink->gathered += len;
+    sink->last = str[len - 1];
+}
+
+void format_write(FormatState *state, const char *data, size_t len) {
+    if (data)
+        format_append_mem(state, data, len);
+}
+
+/* Append string to output buffer */
+static void format_append_str(FormatState *state, const char *str) {
+    if (!str) return;
+    format_append_mem(state, str, strlen(str));
+}
+
+/* Append single character */
+static void format_append_char(FormatState *state, char c) {
+    if (format_reserve(state, 1))
+        state->output[state->pos++] = c;
+}
+
+/* Size in memory of one typed array element, or 0 for unsupported types */
+static size_t format_typed_size(FormatArgType type) {
+    switch (type) {
+        case FORMAT_TYPE_INT: return sizeof(int);
+        case FORMAT_TYPE_UINT: return sizeof(unsigned int);
+        case FORMAT_TYPE_LONG: return sizeof(long);
+        case FORMAT_TYPE_ULONG: return sizeof(unsigned long);
+        case FORMAT_TYPE_LLONG: return sizeof(long long);
+        case FORMAT_TYPE_ULLONG: return sizeof(unsigned long long);
+        case FORMAT_TYPE_FLOAT: return sizeof(float);
+        case FORMAT_TYPE_SHORT: return sizeof(short);
+        case FORMAT_TYPE_USHORT: return sizeof(unsigned short);
+        case FORMAT_TYPE_SCHAR: return sizeof(signed char);
+        case FORMAT_TYPE_UCHAR: return sizeof(unsigned char);
+        case FORMAT_TYPE_DOUBLE: return sizeof(double);
+        case FORMAT_TYPE_CHAR: return sizeof(char);
+        case FORMAT_TYPE_STRING: return sizeof(const char*);
+        case FORMAT_TYPE_POINTER: return sizeof(void*);
+        case FORMAT_TYPE_BOOL: return sizeof(bool);
+        default: return 0;
+    }
+}
+
+/* Read element k of a typed array in place (floats widen to double, and
+   narrow integers to int or unsigned int as FORMAT_ARG does) */
+static FormatArg format_typed_item(const FormatArg *arr, size_t k) {
+    const char *p = (const char*)arr->value.as_typed_array.data + k * arr->value.as_typed_array.stride;
+    FormatArg item = {.type = (FormatArgType)arr->value.as_typed_array.type};
+    switch (item.type) {
+        case FORMAT_TYPE_INT: item.value.as_int = *(const int*)p; break;
+        case FORMAT_TYPE_UINT: item.value.as_uint = *(const unsigned int*)p; break;
+        case FORMAT_TYPE_LONG: item.value.as_long = *(const long*)p; break;
+        case FORMAT_TYPE_ULONG: item.value.as_ulong = *(const unsigned long*)p; break;
+        case FORMAT_TYPE_LLONG: item.value.as_llong = *(const long long*)p; break;
+        case FORMAT_TYPE_ULLONG: item.value.as_ullong = *(const unsigned long long*)p; break;
+        case FORMAT_TYPE_FLOAT:
+            item.type = FORMAT_TYPE_DOUBLE;
+            item.value.as_double = *(const float*)p;
+            break;
+        case FORMAT_TYPE_SHORT:
+            item.type = FORMAT_TYPE_INT;
+            item.value.as_int = *(const short*)p;
+            break;
+        case FORMAT_TYPE_USHORT:
+            item.type = FORMAT_TYPE_UINT;
+            item.value.as_uint = *(const unsigned short*)p;
+            break;
+        case FORMAT_TYPE_SCHAR:
+            item.type = FORMAT_TYPE_INT;
+            item.value.as_int = *(const signed char*)p;
+            break;
+        case FORMAT_TYPE_UCHAR:
+            item.type = FORMAT_TYPE_UINT;
+            item.value.as_uint = *(const unsigned char*)p;
+            break;
+        case FORMAT_TYPE_DOUBLE: item.value.as_double = *(const double*)p; break;
+        case FORMAT_TYPE_CHAR: item.value.as_char = *p; break;
+        case FORMAT_TYPE_STRING: item.value.as_string = *(const char* const*)p; break;
+        case FORMAT_TYPE_POINTER: item.value.as_pointer = *(void* const*)p; break;
+        case FORMAT_TYPE_BOOL: item.value.as_bool = *(const bool*)p; break;
+        default: item.type = FORMAT_TYPE_NIL; break;
+    }
+    return item;
+}
+
+/* Number of elements ~{ iterates over, or 0 if arg is not an array */
+static size_t format_array_count(const FormatArg *arg) {
+    if (arg->type == FORMAT_TYPE_ARRAY)
+        return arg->value.as_array.count;
+    if (arg->type == FORMAT_TYPE_TYPED_ARRAY)
+        return arg->value.as_typed_array.count;
+    return 0;
+}
+
+/* Point state->args at element k of an array; typed elements are read into item */
+static void format_array_select(FormatState *state, const FormatArg *arr, size_t k, FormatArg *item) {
+    if (arr->type == FORMAT_TYPE_ARRAY)
+        state->args = &arr->value.as_array.items[k];
+    else {
+        *item = format_typed_item(arr, k);
+        state->args = item;
+    }
+}
+
+/* Get integer value from argument (any integer type) */
+static long long format_arg_to_int(FormatArg *arg) {
+    switch (arg->type) {
         case FORMAT_TYPE_INT: return arg->value.as_int;
         case FORMAT_TYPE_UINT: return arg->value.as_uint;
         case FORMAT_TYPE_LONG: return arg->value.as_long;
@@ -689,31 +1880,314 @@ static bool format_arg_is_true(FormatArg *arg) {
         case FORMAT_TYPE_POINTER: return arg->value.as_pointer != NULL;
         case FORMAT_TYPE_ARRAY: return arg->value.as_array.count > 0;
         case FORMAT_TYPE_CUSTOM: return arg->value.as_custom.func != NULL;
+        case FORMAT_TYPE_TYPED_ARRAY: return arg->value.as_typed_array.count > 0;
+        case FORMAT_TYPE_FLOAT:
+        case FORMAT_TYPE_SHORT:
+        case FORMAT_TYPE_USHORT:
+        case FORMAT_TYPE_SCHAR:
+        case FORMAT_TYPE_UCHAR: return false;
     }
     return false;
 }
 
+/* "00".."99", for printing two decimal digits at a time */
+static const char format_digit_pairs[201] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+static const unsigned long long format_pow10[20] = {
+    1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL, 10000000ULL,
+    100000000ULL, 1000000000ULL, 10000000000ULL, 100000000000ULL, 1000000000000ULL,
+    10000000000000ULL, 100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+    100000000000000000ULL, 1000000000000000000ULL, 10000000000000000000ULL
+};
+
+/* Write the decimal digits of v so they end just before end; returns the first digit */
+static char *format_u64_dec(char *end, unsigned long long v) {
+    while (v >= 100) {
+        unsigned r = (unsigned)(v % 100);
+        v /= 100;
+        end -= 2;
+        memcpy(end, format_digit_pairs + r * 2, 2);
+    }
+    if (v >= 10) {
+        end -= 2;
+        memcpy(end, format_digit_pairs + v * 2, 2);
+    } else
+        *--end = (char)('0' + v);
+    return end;
+}
+
+/* Same as format_u64_dec with sep between groups of three digits */
+static char *format_u64_grouped(char *end, unsigned long long v, char sep) {
+    while (v >= 1000) {
+        unsigned r = (unsigned)(v % 1000);
+        v /= 1000;
+        end -= 2;
+        memcpy(end, format_digit_pairs + (r % 100) * 2, 2);
+        *--end = (char)('0' + r / 100);
+        *--end = sep;
+    }
+    return format_u64_dec(end, v);
+}
+
+/* Digits of v in a power-of-two radix 2^shift, ending just before end */
+static char *format_u64_pow2(char *end, unsigned long long v, int shift, const char *digits) {
+    unsigned mask = (1u << shift) - 1;
+    do {
+        *--end = digits[v & mask];
+        v >>= shift;
+    } while (v);
+    return end;
+}
+
+/* Magnitude of a signed value without overflowing on LLONG_MIN */
+static unsigned long long format_magnitude(long long value) {
+    return value < 0 ? 0ULL - (unsigned long long)value : (unsigned long long)value;
+}
+
+/* Append a signed decimal integer */
+static void format_append_int(FormatState *state, long long value) {
+    char buf[24];
+    char *end = buf + sizeof(buf);
+    char *p = format_u64_dec(end, format_magnitude(value));
+    if (value < 0)
+        *--p = '-';
+    format_append_mem(state, p, end - p);
+}
+
 /* Format integer with custom separator */
 static void format_int_with_separator(FormatState *state, long long value, char sep) {
-    char buf[64];
-    char result[128];
-    int neg = value < 0;
-    if (neg) value = -value;
+    char buf[32];
+    char *end = buf + sizeof(buf);
+    char *p = format_u64_grouped(end, format_magnitude(value), sep);
+    if (value < 0)
+        *--p = '-';
+    format_append_mem(state, p, end - p);
+}
 
-    snprintf(buf, sizeof(buf), "%lld", value);
-    size_t len = strlen(buf);
+/*
+ * Floating point kernels. A double is m * 2^e exactly, so the digits printf
+ * would produce for a given precision are round(m * 2^e * 10^k) for the
+ * right k, computed here exactly in 128-bit integers with ties to even.
+ * Values whose digits do not fit in 64 bits fall back to snprintf.
+ */
+#if defined(__SIZEOF_INT128__)
+#define FORMAT_HAS_INT128
+__extension__ typedef unsigned __int128 format_u128;
 
-    int j = 0;
-    if (neg) result[j++] = '-';
+static format_u128 format_pow10_wide(int k) {
+    return k < 20 ? format_pow10[k] : (format_u128)format_pow10[k - 19] * format_pow10[19];
+}
 
-    for (size_t i = 0; i < len; i++) {
-        if (i > 0 && (len - i) % 3 == 0)
-            result[j++] = sep;
+/* round(m * 2^e * 10^k), ties to even; false when out of range */
+static bool format_scale_round(unsigned long long m, int e, int k, unsigned long long *out) {
+    if (k > 22 || k < -38)
+        return false;
+    format_u128 num = m, den = 1;
+    if (k >= 0)
+        num *= format_pow10_wide(k);
+    else
+        den = format_pow10_wide(-k);
+    if (e >= 0) {
+        if (e > 127 || (num >> (127 - e)))
+            return false;
+        num <<= e;
+    } else {
+        if (-e > 127 || (den >> (127 + e)))
+            return false;
+        den <<= -e;
+    }
+
+    format_u128 q = num / den, r = num % den;
+    if (r > den - r || (r == den - r && (q & 1)))
+        q++;
+    if (q >> 64)
+        return false;
+    *out = (unsigned long long)q;
+    return true;
+}
+
+/* Split a finite double into m * 2^e; returns the sign */
+static bool format_decompose(double x, unsigned long long *m, int *e) {
+    uint64_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    int biased = (int)((bits >> 52) & 0x7FF);
+    *m = bits & ((1ULL << 52) - 1);
+    if (biased) {
+        *m |= 1ULL << 52;
+        *e = biased - 1075;
+    } else
+        *e = -1074;
+    return bits >> 63;
+}
+
+/* The first n (1..19) significant digits of m * 2^e, rounded as %e does, and the decimal exponent */
+static bool format_float_digits(unsigned long long m, int e, int n, unsigned long long *digits, int *exp10) {
+    int bits = 0;
+    for (unsigned long long t = m; t; t >>= 1)
+        bits++;
+    /* floor(log10(2^(bits + e - 1))), exact or one too small */
+    int t = (bits + e - 1) * 78913;
+    int x = t >= 0 ? t >> 18 : -((-t + (1 << 18) - 1) >> 18);
+
+    for (int tries = 0; tries < 3; tries++) {
+        unsigned long long q;
+        if (!format_scale_round(m, e, n - 1 - x, &q))
+            return false;
+        if (q >= format_pow10[n])
+            x++;
+        else if (q < format_pow10[n - 1])
+            x--;
+        else {
+            *digits = q;
+            *exp10 = x;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Write exactly n digits of v (zero padded) ending just before end */
+static char *format_u64_digits(char *end, unsigned long long v, int n) {
+    char *p = format_u64_dec(end, v);
+    while (end - p < n)
+        *--p = '0';
+    return p;
+}
+
+/* %.*f; returns the length, or 0 if the kernel cannot produce it */
+static size_t format_float_fixed(char *buf, double val, int prec) {
+    if (prec < 0 || prec > 19)
+        return 0;
+    unsigned long long m, q = 0;
+    int e;
+    bool neg = format_decompose(val, &m, &e);
+    double mag = neg ? -val : val;
+    if (!(mag * (double)format_pow10[prec] < 0.25) && !format_scale_round(m, e, prec, &q))
+        return 0;
+
+    char tmp[48];
+    char *end = tmp + sizeof(tmp), *p;
+    if (prec) {
+        p = format_u64_digits(end, q % format_pow10[prec], prec);
+        *--p = '.';
+        p = format_u64_dec(p, q / format_pow10[prec]);
+    } else
+        p = format_u64_dec(end, q);
+    if (neg)
+        *--p = '-';
+    memcpy(buf, p, end - p);
+    return end - p;
+}
+
+/* Append e+XX / e-XX (at least two exponent digits) */
+static size_t format_float_exponent(char *buf, int exp10) {
+    char tmp[8];
+    char *end = tmp + sizeof(tmp);
+    char *p = format_u64_digits(end, exp10 < 0 ? -exp10 : exp10, 2);
+    *--p = exp10 < 0 ? '-' : '+';
+    *--p = 'e';
+    memcpy(buf, p, end - p);
+    return end - p;
+}
+
+/* %.*e; returns the length, or 0 if the kernel cannot produce it */
+static size_t format_float_exp(char *buf, double val, int prec) {
+    if (prec < 0 || prec > 18)
+        return 0;
+    unsigned long long m, q = 0;
+    int e, exp10 = 0;
+    bool neg = format_decompose(val, &m, &e);
+    if (m && !format_float_digits(m, e, prec + 1, &q, &exp10))
+        return 0;
+
+    char tmp[24];
+    char *digits = format_u64_digits(tmp + sizeof(tmp), q, prec + 1);
+    size_t len = 0;
+    if (neg)
+        buf[len++] = '-';
+    buf[len++] = digits[0];
+    if (prec) {
+        buf[len++] = '.';
+        memcpy(buf + len, digits + 1, prec);
+        len += prec;
+    }
+    return len + format_float_exponent(buf + len, exp10);
+}
+
+/* %.*g; returns the length, or 0 if the kernel cannot produce it */
+static size_t format_float_general(char *buf, double val, int prec) {
+    if (prec == 0)
+        prec = 1;
+    if (prec < 0 || prec > 19)
+        return 0;
+    unsigned long long m, q;
+    int e, exp10;
+    size_t len = 0;
+    bool neg = format_decompose(val, &m, &e);
+    if (neg)
+        buf[len++] = '-';
+    if (!m) {
+        buf[len++] = '0';
+        return len;
+    }
+    if (!format_float_digits(m, e, prec, &q, &exp10))
+        return 0;
+
+    char tmp[24];
+    char *digits = format_u64_digits(tmp + sizeof(tmp), q, prec);
+    int n = prec;
+    while (n > 1 && digits[n - 1] == '0')
+        n--; /* %g drops trailing zeros */
+
+    if (exp10 < -4 || exp10 >= prec) {
+        buf[len++] = digits[0];
+        if (n > 1) {
+            buf[len++] = '.';
+            memcpy(buf + len, digits + 1, n - 1);
+            len += n - 1;
+        }
+        len += format_float_exponent(buf + len, exp10);
+    } else if (exp10 >= 0) {
+        int whole = exp10 + 1;
+        for (int i = 0; i < whole; i++)
+            buf[len++] = i < n ? digits[i] : '0';
+        if (n > whole) {
+            buf[len++] = '.';
+            memcpy(buf + len, digits + whole, n - whole);
+            len += n - whole;
+        }
+    } else {
+        buf[len++] = '0';
+        buf[len++] = '.';
+        for (int i = -1; i > exp10; i--)
+            buf[len++] = '0';
+        memcpy(buf + len, digits, n);
+        len += n;
+    }
+    return len;
+}
+#endif
 
-        result[j++] = buf[i];
+/* printf-compatible %.*f (conv 'f'), %.*e ('e') or %.*g ('g') into buf */
+static void format_double(char *buf, size_t size, double val, char conv, int prec) {
+#ifdef FORMAT_HAS_INT128
+    size_t len = conv == 'f' ? format_float_fixed(buf, val, prec)
+               : conv == 'e' ? format_float_exp(buf, val, prec)
+               : format_float_general(buf, val, prec);
+    if (len) {
+        buf[len] = '\0';
+        return;
     }
-    result[j] = '\0';
-    format_append_str(state, result);
+#endif
+    if (conv == 'f')
+        snprintf(buf, size, "%.*f", prec, val);
+    else if (conv == 'e')
+        snprintf(buf, size, "%.*e", prec, val);
+    else
+        snprintf(buf, size, "%.*g", prec, val);
 }
 
 /* English number words (for ~R) */
@@ -839,7 +2313,7 @@ static void format_number_ordinal(FormatState *state, long long n) {
 /* Roman numerals */
 static void format_number_roman(FormatState *state, long long n) {
     if (n <= 0 || n > 3999) {
-        format_append_fmt(state, "%lld", n);
+        format_append_int(state, n);
         return;
     }
 
@@ -859,28 +2333,31 @@ static void format_number_roman(FormatState *state, long long n) {
 
 /* Format integer in given base */
 static void format_int_base(FormatState *state, long long value, int base, bool uppercase) {
-    char buf[65];
-    int idx = 64;
-    buf[idx] = '\0';
-
-    bool neg = value < 0;
-    unsigned long long uval = neg ? -value : value;
+    char buf[66];
+    char *end = buf + sizeof(buf), *p;
+    unsigned long long uval = format_magnitude(value);
 
     const char *digits = uppercase ? "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ" : "0123456789abcdefghijklmnopqrstuvwxyz";
 
-    if (uval == 0)
-        buf[--idx] = '0';
-    else {
-        while (uval > 0) {
-            buf[--idx] = digits[uval % base];
+    if (base == 10)
+        p = format_u64_dec(end, uval);
+    else if ((base & (base - 1)) == 0) {
+        int shift = 0;
+        while ((1 << shift) < base)
+            shift++;
+        p = format_u64_pow2(end, uval, shift, digits);
+    } else {
+        p = end;
+        do {
+            *--p = digits[uval % base];
             uval /= base;
-        }
+        } while (uval);
     }
 
-    if (neg)
-        buf[--idx] = '-';
+    if (value < 0)
+        *--p = '-';
 
-    format_append_str(state, buf + idx);
+    format_append_mem(state, p, end - p);
 }
 
 /* Parse directive parameters */
@@ -899,6 +2376,8 @@ typedef struct {
     bool has_radix;
     bool mincol_from_arg;     /* 'v' - get mincol from next arg */
     bool precision_from_arg;  /* 'v' - get precision from next arg */
+    bool mincol_from_count;       /* '#' - mincol is the remaining arg count */
+    bool precision_from_count;    /* '#' - precision is the remaining arg count */
 } DirectiveParams;
 
 static const char *parse_directive_params(const char *p, DirectiveParams *params, FormatState *state) {
@@ -961,6 +2440,10 @@ static const char *parse_directive_params(const char *p, DirectiveParams *params
         } else if (*p == '#') {
             /* # means number of remaining args */
             p++;
+            if (param_index == 0)
+                params->mincol_from_count = true;
+            else
+                params->precision_from_count = true;
             if (state) {
                 int remaining = (int)(state->arg_count - state->arg_index);
                 if (param_index == 0) {
@@ -985,6 +2468,30 @@ static const char *parse_directive_params(const char *p, DirectiveParams *params
     return p;
 }
 
+/* Resolve v and # parameters of a directive parsed without a state */
+static void resolve_directive_params(FormatState *state, DirectiveParams *params) {
+    if (params->mincol_from_arg) {
+        if (state->arg_index < state->arg_count) {
+            params->mincol = (int)format_arg_to_int(&state->args[state->arg_index++]);
+            params->has_mincol = true;
+        }
+    } else if (params->mincol_from_count) {
+        params->mincol = (int)(state->arg_count - state->arg_index);
+        params->has_mincol = true;
+    }
+    if (params->precision_from_arg) {
+        if (state->arg_index < state->arg_count) {
+            params->precision = (int)format_arg_to_int(&state->args[state->arg_index++]);
+            params->has_precision = true;
+        }
+    } else if (params->precision_from_count) {
+        params->precision = (int)(state->arg_count - state->arg_index);
+        params->has_precision = true;
+    }
+    params->has_radix = params->has_mincol && params->mincol >= 2 && params->mincol <= 36;
+    params->radix = params->has_radix ? params->mincol : 0;
+}
+
 /* Count UTF-8 codepoints (display width approximation) */
 static size_t utf8_strlen(const char *str) {
     size_t count = 0;
@@ -1030,32 +2537,40 @@ static void format_aesthetic(FormatState *state, FormatArg *arg, DirectiveParams
 
     switch (arg->type) {
         case FORMAT_TYPE_NIL:
+        case FORMAT_TYPE_FLOAT: /* Never standalone arguments */
+        case FORMAT_TYPE_SHORT:
+        case FORMAT_TYPE_USHORT:
+        case FORMAT_TYPE_SCHAR:
+        case FORMAT_TYPE_UCHAR:
             snprintf(buf, sizeof(buf), "nil");
             break;
         case FORMAT_TYPE_INT:
-            snprintf(buf, sizeof(buf), "%d", arg->value.as_int);
-            break;
-        case FORMAT_TYPE_UINT:
-            snprintf(buf, sizeof(buf), "%u", arg->value.as_uint);
-            break;
         case FORMAT_TYPE_LONG:
-            snprintf(buf, sizeof(buf), "%ld", arg->value.as_long);
+        case FORMAT_TYPE_LLONG: {
+            long long v = format_arg_to_int(arg);
+            char *end = buf + 24;
+            char *p = format_u64_dec(end, format_magnitude(v));
+            if (v < 0)
+                *--p = '-';
+            memmove(buf, p, end - p);
+            buf[end - p] = '\0';
             break;
+        }
+        case FORMAT_TYPE_UINT:
         case FORMAT_TYPE_ULONG:
-            snprintf(buf, sizeof(buf), "%lu", arg->value.as_ulong);
-            break;
-        case FORMAT_TYPE_LLONG:
-            snprintf(buf, sizeof(buf), "%lld", arg->value.as_llong);
-            break;
-        case FORMAT_TYPE_ULLONG:
-            snprintf(buf, sizeof(buf), "%llu", arg->value.as_ullong);
+        case FORMAT_TYPE_ULLONG: {
+            unsigned long long v = arg->type == FORMAT_TYPE_UINT ? arg->value.as_uint
+                                 : arg->type == FORMAT_TYPE_ULONG ? arg->value.as_ulong
+                                 : arg->value.as_ullong;
+            char *end = buf + 24;
+            char *p = format_u64_dec(end, v);
+            memmove(buf, p, end - p);
+            buf[end - p] = '\0';
             break;
+        }
         case FORMAT_TYPE_DOUBLE:
-            if (params->has_precision)
-                snprintf(buf, sizeof(buf), "%.*g", params->precision, arg->value.as_double);
-            else
-                snprintf(buf, sizeof(buf), "%g", arg->value.as_double);
-
+            format_double(buf, sizeof(buf), arg->value.as_double, 'g',
+                          params->has_precision ? params->precision : 6);
             break;
         case FORMAT_TYPE_CHAR:
             buf[0] = arg->value.as_char;
@@ -1075,7 +2590,8 @@ static void format_aesthetic(FormatState *state, FormatArg *arg, DirectiveParams
             snprintf(buf, sizeof(buf), "%s", arg->value.as_bool ? "true" : "false");
             break;
         case FORMAT_TYPE_ARRAY:
-            snprintf(buf, sizeof(buf), "[array:%zu]", arg->value.as_array.count);
+        case FORMAT_TYPE_TYPED_ARRAY:
+            snprintf(buf, sizeof(buf), "[array:%zu]", format_array_count(arg));
             break;
         case FORMAT_TYPE_CUSTOM:
             if (arg->value.as_custom.func) {
@@ -1115,44 +2631,77 @@ static void format_standard(FormatState *state, FormatArg *arg, DirectiveParams
     }
 }
 
+/* Skip the parameters and modifiers of a directive, p points just past the ~ */
+static const char *skip_directive_params(const char *p) {
+    while (*p) {
+        if (*p == '\'' && p[1])
+            p += 2;
+        else if ((*p >= '0' && *p <= '9') || *p == ',' || *p == ':' || *p == '@' ||
+                 *p == 'v' || *p == 'V' || *p == '#')
+            p++;
+        else
+            break;
+    }
+    return p;
+}
+
+/* Position just past the directive whose ~ is at p */
+static const char *directive_after(const char *p) {
+    p = skip_directive_params(p + 1);
+    return *p ? p + 1 : p;
+}
+
+/* Whether the separator at sep is ~:; (starts the default clause of ~[) */
+static bool separator_is_default(const char *sep) {
+    const char *cmd = skip_directive_params(sep + 1);
+    return memchr(sep + 1, ':', cmd - sep - 1) != NULL;
+}
+
 /* Find matching closing bracket */
 static const char *find_closing(const char *p, char open, char close) {
     int depth = 1;
-    while (*p && depth > 0) {
-        if (*p == '~' && *(p+1) == open) {
-            depth++;
-            p += 2;
-        } else if (*p == '~' && *(p+1) == close) {
-            depth--;
-            if (depth == 0) return p;
-            p += 2;
-        } else
+    while (*p) {
+        if (*p != '~') {
             p++;
-
+            continue;
+        }
+        const char *cmd = skip_directive_params(p + 1);
+        if (*cmd == open)
+            depth++;
+        else if (*cmd == close && --depth == 0)
+            return p;
+        p = *cmd ? cmd + 1 : cmd;
     }
     return p;
 }
 
+/* Find the closing bracket, flagging an error when the string ends first */
+static const char *format_closing(FormatState *state, const char *p, char open, char close) {
+    const char *end = find_closing(p, open, close);
+    if (!*end)
+        format_set_error(state, FORMAT_ERR_UNCLOSED_BRACKET, p);
+    return end;
+}
+
 /* Find next separator at current depth */
 static const char *find_separator(const char *start, const char *end) {
     int depth = 0;
     const char *p = start;
     while (p < end) {
-        if (*p == '~') {
-            if (*(p+1) == '[' || *(p+1) == '{' || *(p+1) == '(') {
-                depth++;
-                p += 2;
-            } else if (*(p+1) == ']' || *(p+1) == '}' || *(p+1) == ')') {
-                depth--;
-                p += 2;
-            } else if (*(p+1) == ';' && depth == 0)
-                return p;
-            else
-                p++;
-
-        } else
+        if (*p != '~') {
             p++;
-
+            continue;
+        }
+        const char *cmd = skip_directive_params(p + 1);
+        if (cmd >= end)
+            break;
+        if (*cmd == '[' || *cmd == '{' || *cmd == '(' || *cmd == '<')
+            depth++;
+        else if (*cmd == ']' || *cmd == '}' || *cmd == ')' || *cmd == '>')
+            depth--;
+        else if (*cmd == ';' && depth == 0)
+            return p;
+        p = cmd + 1;
     }
     return NULL;
 }
@@ -1160,96 +2709,101 @@ static const char *find_separator(const char *start, const char *end) {
 /* Forward declaration for recursive formatting */
 static void format_process(FormatState *state, const char *fmt, const char *end);
 
-/* Format justification ~<...~> */
-/* ~mincol< content ~> with ~:< right, ~@< center, ~:@< left justify */
-static const char *format_justification(FormatState *state, const char *p, DirectiveParams *params) {
-    const char *end = find_closing(p, '<', '>');
-    if (!end) return p;
-
+/* Write justified content, padded to the directive's mincol */
+static void format_justify_emit(FormatState *state, const char *temp, size_t total_len, DirectiveParams *params) {
     int mincol = params->has_mincol ? params->mincol : 0;
     char padchar = params->padchar;
 
-    /* First, format the content to a temp buffer to get its length */
-    char temp[1024];
-    FormatState temp_state = {
-        .output = temp,
-        .capacity = sizeof(temp),
-        .pos = 0,
-        .args = state->args,
-        .arg_count = state->arg_count,
-        .arg_index = state->arg_index,
-        .error = FORMAT_OK,
-        .error_pos = NULL
-    };
-
-    /* Process segments separated by ~; */
-    const char *seg_start = p;
-    size_t seg_count = 0;
-    size_t seg_lens[16];
-    const char *seg_starts[16];
-
-    while (seg_start < end && seg_count < 16) {
-        const char *sep = find_separator(seg_start, end);
-        const char *seg_end = sep ? sep : end;
-
-        seg_starts[seg_count] = seg_start;
-
-        /* Format this segment */
-        size_t start_pos = temp_state.pos;
-        format_process(&temp_state, seg_start, seg_end);
-        seg_lens[seg_count] = temp_state.pos - start_pos;
-
-        seg_count++;
-
-        if (!sep) break;
-        seg_start = sep + 2; /* Skip ~; */
-    }
-
-    state->arg_index = temp_state.arg_index; /* Update consumed args */
-
-    size_t total_len = temp_state.pos;
-
     if ((int)total_len >= mincol) {
         /* Just output as-is */
-        temp[temp_state.pos] = '\0';
-        format_append_str(state, temp);
+        format_append_mem(state, temp, total_len);
     } else {
         int padding = mincol - (int)total_len;
 
         if (params->colon && params->at) {
             /* ~:@< left justify (padding on right) */
-            format_append_str(state, temp);
+            format_append_mem(state, temp, total_len);
             for (int i = 0; i < padding; i++)
                 format_append_char(state, padchar);
         } else if (params->colon) {
             /* ~:< right justify (padding on left) */
             for (int i = 0; i < padding; i++)
                 format_append_char(state, padchar);
-            format_append_str(state, temp);
+            format_append_mem(state, temp, total_len);
         } else if (params->at) {
             /* ~@< center */
             int left_pad = padding / 2;
             int right_pad = padding - left_pad;
             for (int i = 0; i < left_pad; i++)
                 format_append_char(state, padchar);
-            format_append_str(state, temp);
+            format_append_mem(state, temp, total_len);
             for (int i = 0; i < right_pad; i++)
                 format_append_char(state, padchar);
         } else {
             /* ~< left justify (default) */
-            format_append_str(state, temp);
+            format_append_mem(state, temp, total_len);
             for (int i = 0; i < padding; i++)
                 format_append_char(state, padchar);
         }
     }
+}
+
+/* Format justification ~<...~> */
+/* ~mincol< content ~> with ~:< right, ~@< center, ~:@< left justify */
+static const char *format_justification(FormatState *state, const char *p, DirectiveParams *params) {
+    const char *end = format_closing(state, p, '<', '>');
+    if (!*end)
+        return end;
+
+    /* First, format the content to a temp buffer to get its length */
+    char temp[1024];
+    FormatSink temp_sink;
+    format_sink_init(&temp_sink, NULL, NULL, temp, sizeof(temp));
+    FormatState temp_state = {
+        .output = temp,
+        .capacity = sizeof(temp),
+        .pos = 0,
+        .args = state->args,
+        .arg_count = state->arg_count,
+        .arg_index = state->arg_index,
+        .error = FORMAT_OK,
+        .error_pos = NULL,
+        .iter_last = state->iter_last,
+        .sink = &temp_sink,
+        .ctx = state->ctx
+    };
+
+    /* Process segments separated by ~; */
+    const char *seg_start = p;
+    size_t seg_count = 0;
+
+    while (seg_start < end && seg_count < 16) {
+        const char *sep = find_separator(seg_start, end);
+        const char *seg_end = sep ? sep : end;
+
+        /* Format this segment */
+        format_process(&temp_state, seg_start, seg_end);
+        seg_count++;
+
+        if (!sep || temp_state.escaped) break;
+        seg_start = directive_after(sep); /* Skip ~; */
+    }
+
+    state->arg_index = temp_state.arg_index; /* Update consumed args */
+    state->escaped = temp_state.escaped;
+
+    format_justify_emit(state, temp_state.output, temp_state.pos, params);
+    format_sink_free(&temp_sink);
 
-    return end + 2; /* Skip ~> */
+    return directive_after(end); /* Skip ~> */
 }
 
 /* Format conditional ~[...~;...~] */
 static const char *format_conditional(FormatState *state, const char *p, DirectiveParams *params) {
     /* Find the end of the conditional */
-    const char *end = find_closing(p, '[', ']');
+    const char *end = format_closing(state, p, '[', ']');
+    if (!*end)
+        return end;
 
     if (params->colon && params->at) {
         /* ~:@[...~] - Include if non-nil, keep arg available for inner directives */
@@ -1270,7 +2824,7 @@ static const char *format_conditional(FormatState *state, const char *p, Directi
             const char *sep = find_separator(p, end);
             if (sep) {
                 if (truthy)
-                    format_process(state, sep + 2, end);
+                    format_process(state, directive_after(sep), end);
                 else
                     format_process(state, p, sep);
             }
@@ -1285,113 +2839,82 @@ static const char *format_conditional(FormatState *state, const char *p, Directi
                 state->arg_index++; /* Consume the nil argument */
         }
     } else {
-        /* ~[case0~;case1~;...~] - Numeric selector */
-        FormatArg *arg = &state->args[state->arg_index++];
-        int selector = (int)format_arg_to_int(arg);
-
-        /* Find the right branch */
-        int branch = 0;
-        const char *branch_start = p;
-        const char *branch_end = NULL;
-        const char *default_start = NULL;
-
-        while (branch_start < end) {
-            const char *sep = find_separator(branch_start, end);
-            branch_end = sep ? sep : end;
-
-            /* Check for default case ~:; */
-            if (sep && *(sep+1) == ':' && *(sep+2) == ';') {
-                default_start = sep + 3;
-                break;
-            }
-
-            if (branch == selector) {
-                format_process(state, branch_start, branch_end);
-                goto done;
+        /* ~[case0~;case1~;...~:;default~] - Numeric selector */
+        if (state->arg_index < state->arg_count) {
+            FormatArg *arg = &state->args[state->arg_index++];
+            int selector = (int)format_arg_to_int(arg);
+
+            /* Find the right branch */
+            int branch = 0;
+            const char *branch_start = p;
+            while (branch_start < end) {
+                const char *sep = find_separator(branch_start, end);
+                if (branch == selector) {
+                    format_process(state, branch_start, sep ? sep : end);
+                    break;
+                }
+                if (!sep)
+                    break;
+                branch_start = directive_after(sep);
+                /* Everything after ~:; is the default */
+                if (separator_is_default(sep)) {
+                    format_process(state, branch_start, end);
+                    break;
+                }
+                branch++;
             }
-
-            branch++;
-            if (sep)
-                branch_start = sep + 2;
-            else
-                break;
-
         }
-
-        /* Use default if available */
-        if (default_start)
-            format_process(state, default_start, end);
-
     }
 
-done:
-    return end + 2; /* Skip ~] */
+    return directive_after(end); /* Skip ~] */
 }
 
 /* Format iteration ~{...~} */
 static const char *format_iteration(FormatState *state, const char *p, DirectiveParams *params) {
     (void)params;
-    const char *end = find_closing(p, '{', '}');
+    const char *end = format_closing(state, p, '{', '}');
+    if (!*end)
+        return end;
 
+    if (state->arg_index >= state->arg_count)
+        return directive_after(end);
     FormatArg *arr_arg = &state->args[state->arg_index++];
 
-    if (arr_arg->type != FORMAT_TYPE_ARRAY) {
+    if (arr_arg->type != FORMAT_TYPE_ARRAY && arr_arg->type != FORMAT_TYPE_TYPED_ARRAY) {
         /* Not an array - skip */
-        return end + 2;
+        return directive_after(end);
     }
 
-    FormatArg *items = arr_arg->value.as_array.items;
-    size_t count = arr_arg->value.as_array.count;
-
-    /* Check for escape ~^ */
-    const char *escape_pos = NULL;
-    for (const char *scan = p; scan < end - 1; scan++) {
-        if (*scan == '~' && *(scan+1) == '^') {
-            escape_pos = scan;
-            break;
-        }
-    }
+    size_t count = format_array_count(arr_arg);
+    FormatArg item;
 
     /* Save state and iterate */
     FormatArg *saved_args = state->args;
     size_t saved_count = state->arg_count;
+    size_t saved_index = state->arg_index;
+    bool saved_last = state->iter_last;
 
     for (size_t i = 0; i < count; i++) {
-        /* Set up args for this iteration */
-        state->args = &items[i];
+        /* Set up args for this iteration; ~^ ends the body of the last one */
+        format_array_select(state, arr_arg, i, &item);
         state->arg_count = 1;
         state->arg_index = 0;
-
-        if (escape_pos) {
-            /* Format up to escape */
-            format_process(state, p, escape_pos);
-            /* Check if we should escape (not last element) */
-            if (i < count - 1)
-                format_process(state, escape_pos + 2, end);
-
-        } else
-            format_process(state, p, end);
+        state->iter_last = i == count - 1;
+        format_process(state, p, end);
+        state->escaped = false;
     }
 
     /* Restore state */
     state->args = saved_args;
     state->arg_count = saved_count;
+    state->arg_index = saved_index;
+    state->iter_last = saved_last;
 
-    return end + 2;
+    return directive_after(end);
 }
 
-/* Format case conversion ~(...~) */
-static const char *format_case(FormatState *state, const char *p, DirectiveParams *params) {
-    const char *end = find_closing(p, '(', ')');
-
-    /* Capture output */
-    size_t start_pos = state->pos;
-    format_process(state, p, end);
-
-    /* Apply case conversion */
-    char *str = state->output + start_pos;
-    size_t len = state->pos - start_pos;
-
+/* Apply the case conversion selected by the ~( modifiers in place */
+static void format_apply_case(char *str, size_t len, DirectiveParams *params) {
     if (params->at && params->colon) {
         /* ~:@() - Capitalize all words */
         bool new_word = true;
@@ -1424,27 +2947,84 @@ static const char *format_case(FormatState *state, const char *p, DirectiveParam
         for (size_t i = 0; i < len; i++)
             str[i] = tolower((unsigned char)str[i]);
     }
+}
+
+/* Format case conversion ~(...~) */
+static const char *format_case(FormatState *state, const char *p, DirectiveParams *params) {
+    const char *end = format_closing(state, p, '(', ')');
+    if (!*end)
+        return end;
+
+    /* Capture output, keeping it in the buffer until it is converted */
+    size_t start_pos = state->pos;
+    state->hold++;
+    format_process(state, p, end);
+    state->hold--;
+
+    /* Apply case conversion */
+    format_apply_case(state->output + start_pos, state->pos - start_pos, params);
 
-    return end + 2;
+    return directive_after(end);
 }
 
-/* Process a single directive */
-static const char *format_directive(FormatState *state, const char *p) {
-    DirectiveParams params;
-    p = parse_directive_params(p, &params, state);
+/* Format a nested format string into the same output */
+static void format_indirect_run(FormatState *state, const char *fmt, FormatArg *args, size_t count) {
+    FormatState sub_state = {
+        .output = state->output,
+        .capacity = state->capacity,
+        .pos = state->pos,
+        .args = args,
+        .arg_count = count,
+        .arg_index = 0,
+        .error = FORMAT_OK,
+        .error_pos = NULL,
+        .sink = state->sink,
+        .hold = state->hold,
+        .ctx = state->ctx
+    };
+    format_process(&sub_state, fmt, NULL);
+    state->output = sub_state.output;
+    state->capacity = sub_state.capacity;
+    state->pos = sub_state.pos;
+}
 
-    char cmd = *p++;
+/* Indirect formatting ~? and ~@? */
+static void format_indirect(FormatState *state, DirectiveParams *params) {
+    if (state->arg_index < state->arg_count) {
+        FormatArg *fmt_arg = &state->args[state->arg_index++];
+        if (fmt_arg->type == FORMAT_TYPE_STRING && fmt_arg->value.as_string) {
+            const char *sub_fmt = fmt_arg->value.as_string;
+            if (params->at) {
+                /* ~@? - Use remaining arguments */
+                FormatArg *remaining_args = &state->args[state->arg_index];
+                size_t remaining_count = state->arg_count - state->arg_index;
+                state->arg_index = state->arg_count; /* Consume all remaining */
+                format_indirect_run(state, sub_fmt, remaining_args, remaining_count);
+            } else {
+                /* ~? - Next arg should be array of args */
+                if (state->arg_index < state->arg_count) {
+                    FormatArg *args_arg = &state->args[state->arg_index++];
+                    if (args_arg->type == FORMAT_TYPE_ARRAY)
+                        format_indirect_run(state, sub_fmt, args_arg->value.as_array.items,
+                                            args_arg->value.as_array.count);
+                }
+            }
+        }
+    }
+}
 
+/* Execute a directive that does not open a bracket */
+static void format_simple_directive(FormatState *state, char cmd, DirectiveParams *params) {
     switch (toupper((unsigned char)cmd)) {
         case 'A': { /* Aesthetic */
             if (state->arg_index < state->arg_count)
-                format_aesthetic(state, &state->args[state->arg_index++], &params);
+                format_aesthetic(state, &state->args[state->arg_index++], params);
             break;
         }
 
         case 'S': { /* Standard */
             if (state->arg_index < state->arg_count)
-                format_standard(state, &state->args[state->arg_index++], &params);
+                format_standard(state, &state->args[state->arg_index++], params);
 
             break;
         }
@@ -1458,7 +3038,7 @@ static const char *format_directive(FormatState *state, const char *p) {
                 } else {
                     /* Fall back to aesthetic for non-custom types */
                     state->arg_index--; /* Unconsume */
-                    format_aesthetic(state, &state->args[state->arg_index++], &params);
+                    format_aesthetic(state, &state->args[state->arg_index++], params);
                 }
             }
             break;
@@ -1468,12 +3048,17 @@ static const char *format_directive(FormatState *state, const char *p) {
             if (state->arg_index < state->arg_count) {
                 FormatArg *arg = &state->args[state->arg_index++];
                 long long val = format_arg_to_int(arg);
-                if (params.colon)
-                    format_int_with_separator(state, val, params.separator);
+                if (params->colon)
+                    format_int_with_separator(state, val, params->separator);
+                else if (params->mincol <= 0)
+                    format_append_int(state, val);
                 else {
-                    char buf[64];
-                    snprintf(buf, sizeof(buf), "%lld", val);
-                    format_with_padding(state, buf, &params);
+                    char buf[24];
+                    char *p = format_u64_dec(buf + sizeof(buf) - 1, format_magnitude(val));
+                    if (val < 0)
+                        *--p = '-';
+                    buf[sizeof(buf) - 1] = '\0';
+                    format_with_padding(state, p, params);
                 }
             }
             break;
@@ -1507,12 +3092,12 @@ static const char *format_directive(FormatState *state, const char *p) {
             if (state->arg_index < state->arg_count) {
                 FormatArg *arg = &state->args[state->arg_index++];
                 long long val = format_arg_to_int(arg);
-                if (params.has_radix) {
+                if (params->has_radix) {
                     /* ~nR - Print in base n */
-                    format_int_base(state, val, params.radix, false);
-                } else if (params.at)
+                    format_int_base(state, val, params->radix, false);
+                } else if (params->at)
                     format_number_roman(state, val);
-                else if (params.colon)
+                else if (params->colon)
                     format_number_ordinal(state, val);
                 else
                     format_number_english(state, val);
@@ -1524,10 +3109,10 @@ static const char *format_directive(FormatState *state, const char *p) {
             if (state->arg_index < state->arg_count) {
                 FormatArg *arg = &state->args[state->arg_index++];
                 double val = format_arg_to_double(arg);
-                char buf[64];
-                int prec = params.has_precision ? params.precision : 6;
-                snprintf(buf, sizeof(buf), "%.*f", prec, val);
-                format_with_padding(state, buf, &params);
+                char buf[512];
+                int prec = params->has_precision ? params->precision : 6;
+                format_double(buf, sizeof(buf), val, 'f', prec);
+                format_with_padding(state, buf, params);
             }
             break;
         }
@@ -1537,9 +3122,9 @@ static const char *format_directive(FormatState *state, const char *p) {
                 FormatArg *arg = &state->args[state->arg_index++];
                 double val = format_arg_to_double(arg);
                 char buf[64];
-                int prec = params.has_precision ? params.precision : 6;
-                snprintf(buf, sizeof(buf), "%.*e", prec, val);
-                format_with_padding(state, buf, &params);
+                int prec = params->has_precision ? params->precision : 6;
+                format_double(buf, sizeof(buf), val, 'e', prec);
+                format_with_padding(state, buf, params);
             }
             break;
         }
@@ -1549,9 +3134,9 @@ static const char *format_directive(FormatState *state, const char *p) {
                 FormatArg *arg = &state->args[state->arg_index++];
                 double val = format_arg_to_double(arg);
                 char buf[64];
-                int prec = params.has_precision ? params.precision : 6;
-                snprintf(buf, sizeof(buf), "%.*g", prec, val);
-                format_with_padding(state, buf, &params);
+                int prec = params->has_precision ? params->precision : 6;
+                format_double(buf, sizeof(buf), val, 'g', prec);
+                format_with_padding(state, buf, params);
             }
             break;
         }
@@ -1560,9 +3145,9 @@ static const char *format_directive(FormatState *state, const char *p) {
             if (state->arg_index < state->arg_count) {
                 FormatArg *arg = &state->args[state->arg_index++];
                 double val = format_arg_to_double(arg);
-                char buf[64];
-                snprintf(buf, sizeof(buf), "%.2f", val);
-                format_with_padding(state, buf, &params);
+                char buf[512];
+                format_double(buf, sizeof(buf), val, 'f', 2);
+                format_with_padding(state, buf, params);
             }
             break;
         }
@@ -1571,7 +3156,7 @@ static const char *format_directive(FormatState *state, const char *p) {
             if (state->arg_index < state->arg_count) {
                 FormatArg *arg = &state->args[state->arg_index++];
                 if (arg->type == FORMAT_TYPE_CHAR) {
-                    if (params.at) {
+                    if (params->at) {
                         /* Print character name */
                         char c = arg->value.as_char;
                         if (c == ' ') format_append_str(state, "Space");
@@ -1583,21 +3168,21 @@ static const char *format_directive(FormatState *state, const char *p) {
                         format_append_char(state, arg->value.as_char);
 
                 } else
-                    format_aesthetic(state, arg, &params);
+                    format_aesthetic(state, arg, params);
             }
             break;
         }
 
         case 'P': { /* Plural */
             long long val;
-            if (params.colon && state->arg_index > 0) /* ~:P - use previous arg */
+            if (params->colon && state->arg_index > 0) /* ~:P - use previous arg */
                 val = format_arg_to_int(&state->args[state->arg_index - 1]);
             else if (state->arg_index < state->arg_count)
                 val = format_arg_to_int(&state->args[state->arg_index++]);
             else
                 val = 0;
 
-            if (params.at) {
+            if (params->at) {
                 /* ~@P or ~:@P - y/ies */
                 format_append_str(state, val == 1 ? "y" : "ies");
             } else
@@ -1607,7 +3192,7 @@ static const char *format_directive(FormatState *state, const char *p) {
         }
 
         case '%': { /* Newline */
-            int count = params.has_mincol ? params.mincol : 1;
+            int count = params->has_mincol ? params->mincol : 1;
             for (int i = 0; i < count; i++)
                 format_append_char(state, '\n');
 
@@ -1615,22 +3200,23 @@ static const char *format_directive(FormatState *state, const char *p) {
         }
 
         case '&': { /* Fresh line */
-            if (state->pos > 0 && state->output[state->pos - 1] != '\n')
+            char last = format_last_char(state);
+            if (last && last != '\n')
                 format_append_char(state, '\n');
 
             break;
         }
 
         case 'T': { /* Tab */
-            int col = params.has_mincol ? params.mincol : 1;
-            if (params.at) {
+            int col = params->has_mincol ? params->mincol : 1;
+            if (params->at) {
                 /* Relative tab */
                 for (int i = 0; i < col; i++)
                     format_append_char(state, ' ');
 
             } else {
                 /* Absolute tab */
-                while ((int)state->pos < col)
+                for (long long i = (long long)format_position(state); i < col; i++)
                     format_append_char(state, ' ');
 
             }
@@ -1638,7 +3224,7 @@ static const char *format_directive(FormatState *state, const char *p) {
         }
 
         case '|': { /* Page separator - ~n| outputs n page breaks */
-            int count = params.has_mincol ? params.mincol : 1;
+            int count = params->has_mincol ? params->mincol : 1;
             for (int i = 0; i < count; i++)
                 format_append_char(state, '\f');
 
@@ -1651,18 +3237,18 @@ static const char *format_directive(FormatState *state, const char *p) {
         }
 
         case '*': { /* Argument navigation */
-            if (params.colon) {
+            if (params->colon) {
                 /* ~:* - Go back */
                 if (state->arg_index > 0) state->arg_index--;
-            } else if (params.at) {
+            } else if (params->at) {
                 /* ~@* - Go to absolute position */
-                int pos = params.has_mincol ? params.mincol : 0;
+                int pos = params->has_mincol ? params->mincol : 0;
                 if (pos >= 0 && (size_t)pos < state->arg_count)
                     state->arg_index = pos;
 
             } else {
                 /* ~* - Skip forward */
-                int skip = params.has_mincol ? params.mincol : 1;
+                int skip = params->has_mincol ? params->mincol : 1;
                 state->arg_index += skip;
                 if (state->arg_index > state->arg_count)
                     state->arg_index = state->arg_count;
@@ -1670,6 +3256,36 @@ static const char *format_directive(FormatState *state, const char *p) {
             break;
         }
 
+        case '?': { /* Indirect formatting */
+            format_indirect(state, params);
+            break;
+        }
+
+        case '^': { /* Escape - ends the body of the last ~{ element */
+            if (state->iter_last)
+                state->escaped = true;
+            break;
+        }
+
+        default:
+            /* Unknown directive - output as-is */
+            format_append_char(state, '~');
+            format_append_char(state, cmd);
+            break;
+    }
+}
+
+/* Process a single directive */
+static const char *format_directive(FormatState *state, const char *p) {
+    DirectiveParams params;
+    p = parse_directive_params(p, &params, state);
+
+    char cmd = *p++;
+
+    switch (cmd) {
+        case '\0': /* Unterminated directive */
+            return p - 1;
+
         case '[': { /* Conditional */
             return format_conditional(state, p, &params);
         }
@@ -1686,60 +3302,12 @@ static const char *format_directive(FormatState *state, const char *p) {
             return format_justification(state, p, &params);
         }
 
-        case '?': { /* Indirect formatting */
-            if (state->arg_index < state->arg_count) {
-                FormatArg *fmt_arg = &state->args[state->arg_index++];
-                if (fmt_arg->type == FORMAT_TYPE_STRING && fmt_arg->value.as_string) {
-                    const char *sub_fmt = fmt_arg->value.as_string;
-                    if (params.at) {
-                        /* ~@? - Use remaining arguments */
-                        FormatArg *remaining_args = &state->args[state->arg_index];
-                        size_t remaining_count = state->arg_count - state->arg_index;
-                        state->arg_index = state->arg_count; /* Consume all remaining */
-
-                        FormatState sub_state = {
-                            .output = state->output,
-                            .capacity = state->capacity,
-                            .pos = state->pos,
-                            .args = remaining_args,
-                            .arg_count = remaining_count,
-                            .arg_index = 0,
-                            .error = FORMAT_OK,
-                            .error_pos = NULL
-                        };
-                        format_process(&sub_state, sub_fmt, NULL);
-                        state->pos = sub_state.pos;
-                    } else {
-                        /* ~? - Next arg should be array of args */
-                        if (state->arg_index < state->arg_count) {
-                            FormatArg *args_arg = &state->args[state->arg_index++];
-                            if (args_arg->type == FORMAT_TYPE_ARRAY) {
-                                FormatState sub_state = {
-                                    .output = state->output,
-                                    .capacity = state->capacity,
-                                    .pos = state->pos,
-                                    .args = args_arg->value.as_array.items,
-                                    .arg_count = args_arg->value.as_array.count,
-                                    .arg_index = 0,
-                                    .error = FORMAT_OK,
-                                    .error_pos = NULL
-                                };
-                                format_process(&sub_state, sub_fmt, NULL);
-                                state->pos = sub_state.pos;
-                            }
-                        }
-                    }
-                }
-            }
-            break;
-        }
-
         case '/': { /* Call registered function ~/func/ */
             const char *name_start = p;
             while (*p && *p != '/') p++;
             if (*p == '/') {
                 size_t name_len = p - name_start;
-                FormatFunc func = format_lookup_func(name_start, name_len);
+                FormatFunc func = format_lookup_func(state->ctx, name_start, name_len);
                 if (func && state->arg_index < state->arg_count)
                     func(state, &state->args[state->arg_index++]);
 
@@ -1748,20 +3316,14 @@ static const char *format_directive(FormatState *state, const char *p) {
             return p;
         }
 
-        case '^': { /* Escape - handled by iteration */
-            break;
-        }
-
         case '\n': { /* Newline in format string */
             /* Skip whitespace after newline */
             while (*p && (*p == ' ' || *p == '\t')) p++;
             break;
         }
 
-default:
-            /* Unknown directive - output as-is */
-            format_append_char(state, '~');
-            format_append_char(state, cmd);
+        default:
+            format_simple_directive(state, cmd, &params);
             break;
     }
 
@@ -1772,125 +3334,1531 @@ default:
 static void format_process(FormatState *state, const char *fmt, const char *end) {
     const char *p = fmt;
 
-    while (*p && (!end || p < end)) {
+    while (*p && (!end || p < end) && !state->escaped) {
         if (*p == '~') {
             p++;
             if (!*p || (end && p >= end)) break;
             p = format_directive(state, p);
-        } else
-            format_append_char(state, *p++);
+        } else {
+            /* Copy the whole literal run up to the next directive at once */
+            const char *run = end ? memchr(p, '~', end - p) : strchr(p, '~');
+            if (!run)
+                run = end ? end : p + strlen(p);
+            format_append_literal(state, p, run - p);
+            p = run;
+        }
+    }
+}
+
+/* Compiled templates: a flat op list where brackets record where their body ends */
+typedef enum {
+    FORMAT_OP_LITERAL,     /* a, b: run in the literal pool */
+    FORMAT_OP_DIRECTIVE,   /* cmd with pre-parsed params */
+    FORMAT_OP_CONDITIONAL, /* ~[, b: first ~; (or end) */
+    FORMAT_OP_SEPARATOR,   /* ~;, a: 1 for ~:;, b: next ~; (or end) */
+    FORMAT_OP_ITERATION,   /* ~{ */
+    FORMAT_OP_CASE,        /* ~( */
+    FORMAT_OP_JUSTIFY,     /* ~<, b: first ~; (or end) */
+    FORMAT_OP_CALL,        /* ~/name/, a, b: name in the literal pool */
+} FormatOpCode;
+
+#define FORMAT_OP_NONE UINT32_MAX
+
+typedef struct {
+    uint8_t code;
+    char cmd;
+    bool dynamic;          /* params use v or # and are resolved per call */
+    uint32_t a;
+    uint32_t b;
+    uint32_t end;          /* brackets: first op after the body */
+    FormatFunc func;       /* ~/name/ resolved at compile time */
+    DirectiveParams params;
+} FormatOp;
+
+struct FormatProgram {
+    FormatContext *ctx;
+    FormatOp *ops;
+    uint32_t count;
+    uint32_t capacity;
+    char *literals;
+    size_t literals_len;
+    size_t literals_cap;
+};
 
+typedef struct {
+    FormatProgram *prog;
+    uint32_t mergeable;    /* literal op that the next run may extend */
+} FormatCompiler;
+
+static FormatOp *compile_emit(FormatCompiler *c, FormatOpCode code) {
+    FormatProgram *prog = c->prog;
+    if (prog->count == prog->capacity) {
+        uint32_t capacity = prog->capacity ? prog->capacity * 2 : 16;
+        FormatOp *ops = realloc(prog->ops, capacity * sizeof(FormatOp));
+        if (!ops)
+            return NULL;
+        prog->ops = ops;
+        prog->capacity = capacity;
     }
+    FormatOp *op = &prog->ops[prog->count++];
+    memset(op, 0, sizeof(*op));
+    op->code = (uint8_t)code;
+    c->mergeable = FORMAT_OP_NONE;
+    return op;
 }
 
-/* Main implementation function */
-int format_impl(char *buf, size_t bufsize, const char *fmt_string,
-                FormatArg *args, size_t arg_count) {
-    return format_impl_ex(buf, bufsize, fmt_string, args, arg_count, NULL);
+/* Copy bytes into the literal pool, returns their offset or SIZE_MAX */
+static size_t compile_pool(FormatCompiler *c, const char *str, size_t len) {
+    FormatProgram *prog = c->prog;
+    if (prog->literals_len + len > prog->literals_cap) {
+        size_t cap = prog->literals_cap ? prog->literals_cap : 64;
+        while (cap < prog->literals_len + len)
+            cap *= 2;
+        char *literals = realloc(prog->literals, cap);
+        if (!literals)
+            return SIZE_MAX;
+        prog->literals = literals;
+        prog->literals_cap = cap;
+    }
+    memcpy(prog->literals + prog->literals_len, str, len);
+    prog->literals_len += len;
+    return prog->literals_len - len;
 }
 
-/* Extended implementation with error output */
-int format_impl_ex(char *buf, size_t bufsize, const char *fmt_string,
-                   FormatArg *args, size_t arg_count, FormatError *err_out) {
-    format_last_error = FORMAT_OK;
+/* Append literal text, extending the previous literal op when possible */
+static bool compile_literal(FormatCompiler *c, const char *str, size_t len) {
+    if (!len)
+        return true;
+    uint32_t merge = c->mergeable;
+    size_t offset = compile_pool(c, str, len);
+    if (offset == SIZE_MAX)
+        return false;
+    if (merge != FORMAT_OP_NONE) {
+        c->prog->ops[merge].b += (uint32_t)len;
+        return true;
+    }
+    FormatOp *op = compile_emit(c, FORMAT_OP_LITERAL);
+    if (!op)
+        return false;
+    op->a = (uint32_t)offset;
+    op->b = (uint32_t)len;
+    c->mergeable = c->prog->count - 1;
+    return true;
+}
 
-    if (!buf) {
-        format_last_error = FORMAT_ERR_NULL_BUFFER;
-        if (err_out) *err_out = FORMAT_ERR_NULL_BUFFER;
-        return -1;
+/* Compile up to the directive closing the current bracket (0 at top level).
+   clauses is the op whose ~; chain is being built, or FORMAT_OP_NONE. */
+static bool compile_body(FormatCompiler *c, const char **pp, char close, uint32_t clauses) {
+    const char *p = *pp;
+    uint32_t chain = clauses;
+
+    for (;;) {
+        const char *tilde = strchr(p, '~');
+        size_t len = tilde ? (size_t)(tilde - p) : strlen(p);
+        if (!compile_literal(c, p, len))
+            return false;
+        p += len;
+        if (!tilde || !tilde[1])
+            break;
+
+        DirectiveParams params;
+        p = parse_directive_params(tilde + 1, &params, NULL);
+        char cmd = *p;
+        if (!cmd)
+            break;
+        p++;
+        bool dynamic = params.mincol_from_arg || params.precision_from_arg ||
+                       params.mincol_from_count || params.precision_from_count;
+
+        if (cmd == close) {
+            if (chain != FORMAT_OP_NONE)
+                c->prog->ops[chain].b = c->prog->count;
+            c->mergeable = FORMAT_OP_NONE;
+            *pp = p;
+            return true;
+        }
+
+        switch (cmd) {
+            case '[':
+            case '{':
+            case '(':
+            case '<': {
+                static const char closers[] = "]})>";
+                static const FormatOpCode codes[] = {
+                    FORMAT_OP_CONDITIONAL, FORMAT_OP_ITERATION, FORMAT_OP_CASE, FORMAT_OP_JUSTIFY
+                };
+                int kind = (int)(strchr("[{(<", cmd) - "[{(<");
+                FormatOp *op = compile_emit(c, codes[kind]);
+                if (!op)
+                    return false;
+                uint32_t at = c->prog->count - 1;
+                op->cmd = cmd;
+                op->params = params;
+                op->dynamic = dynamic;
+                bool clauses_allowed = cmd == '[' || cmd == '<';
+                if (!compile_body(c, &p, closers[kind], clauses_allowed ? at : FORMAT_OP_NONE))
+                    return false;
+                c->prog->ops[at].end = c->prog->count;
+                break;
+            }
+
+            case ';': {
+                if (chain == FORMAT_OP_NONE) {
+                    if (!compile_literal(c, "~;", 2))
+                        return false;
+                    break;
+                }
+                FormatOp *op = compile_emit(c, FORMAT_OP_SEPARATOR);
+                if (!op)
+                    return false;
+                op->a = params.colon;
+                c->prog->ops[chain].b = c->prog->count - 1;
+                chain = c->prog->count - 1;
+                break;
+            }
+
+            case '/': {
+                const char *name_end = strchr(p, '/');
+                if (!name_end) {
+                    p += strlen(p);
+                    break;
+                }
+                size_t offset = compile_pool(c, p, (size_t)(name_end - p));
+                FormatOp *op = offset == SIZE_MAX ? NULL : compile_emit(c, FORMAT_OP_CALL);
+                if (!op)
+                    return false;
+                op->a = (uint32_t)offset;
+                op->b = (uint32_t)(name_end - p);
+                op->func = format_lookup_func(c->prog->ctx, p, op->b);
+                p = name_end + 1;
+                break;
+            }
+
+            case '\n':
+                while (*p == ' ' || *p == '\t')
+                    p++;
+                break;
+
+            case '~':
+                if (!compile_literal(c, "~", 1))
+                    return false;
+                break;
+
+            case '%':
+            case '|': {
+                /* Fixed repeat counts fold into the surrounding literal text */
+                int count = params.has_mincol ? params.mincol : 1;
+                if (!dynamic && count <= 16) {
+                    char fill[16];
+                    memset(fill, cmd == '%' ? '\n' : '\f', sizeof(fill));
+                    if (!compile_literal(c, fill, (size_t)(count > 0 ? count : 0)))
+                        return false;
+                    break;
+                }
+            }
+            /* fallthrough */
+            default: {
+                if (!strchr("ASWDBOXRFEG$CP%&T|*?^", toupper((unsigned char)cmd))) {
+                    /* Unknown directive - output as-is */
+                    char text[2] = {'~', cmd};
+                    if (!compile_literal(c, text, 2))
+                        return false;
+                    break;
+                }
+                FormatOp *op = compile_emit(c, FORMAT_OP_DIRECTIVE);
+                if (!op)
+                    return false;
+                op->cmd = cmd;
+                op->params = params;
+                op->dynamic = dynamic;
+                break;
+            }
+        }
     }
-    if (bufsize == 0) {
-        format_last_error = FORMAT_ERR_ZERO_SIZE;
-        if (err_out) *err_out = FORMAT_ERR_ZERO_SIZE;
-        return -1;
+
+    *pp = p;
+    if (close) {
+        format_last_error = FORMAT_ERR_UNCLOSED_BRACKET;
+        return false;
     }
+    return true;
+}
+
+FormatProgram *format_compile(const char *fmt_string) {
+    return format_compile_ctx(NULL, fmt_string);
+}
+
+FormatProgram *format_compile_ctx(FormatContext *ctx, const char *fmt_string) {
+    format_last_error = FORMAT_OK;
     if (!fmt_string) {
         format_last_error = FORMAT_ERR_NULL_FORMAT;
-        if (err_out) *err_out = FORMAT_ERR_NULL_FORMAT;
-        buf[0] = '\0';
-        return -1;
+        return NULL;
+    }
+    FormatProgram *prog = calloc(1, sizeof(FormatProgram));
+    if (!prog)
+        return NULL;
+    prog->ctx = ctx;
+    FormatCompiler c = {.prog = prog, .mergeable = FORMAT_OP_NONE};
+    if (!compile_body(&c, &fmt_string, 0, FORMAT_OP_NONE)) {
+        format_program_free(prog);
+        return NULL;
     }
+    return prog;
+}
 
-    FormatState state = {
-        .output = buf,
-        .capacity = bufsize,
-        .pos = 0,
-        .args = args,
-        .arg_count = arg_count,
-        .arg_index = 0,
-        .error = FORMAT_OK,
-        .error_pos = NULL
-    };
+void format_program_free(FormatProgram *prog) {
+    if (!prog)
+        return;
+    free(prog->ops);
+    free(prog->literals);
+    free(prog);
+}
 
-    buf[0] = '\0';
-    format_process(&state, fmt_string, NULL);
+static void format_run(FormatState *state, const FormatProgram *prog, uint32_t i, uint32_t end);
 
-    if (err_out) *err_out = state.error;
-    if (state.error != FORMAT_OK)
-        format_last_error = state.error;
+/* Compiled-template cache */
+#ifndef FORMAT_CACHE_SLOTS
+#define FORMAT_CACHE_SLOTS 1024
+#endif
 
-    return (int)state.pos;
-}
+/* Slots tried for a template before it is left uncached */
+#define FORMAT_CACHE_PROBES 4
 
-/* Allocate and return formatted string */
-char *format_alloc(const char *fmt_string, FormatArg *args, size_t arg_count) {
-    /* First pass: calculate size */
-    char small_buf[1024];
-    int len = format_impl(small_buf, sizeof(small_buf), fmt_string, args, arg_count);
+/* Never modified once published */
+typedef struct {
+    const char *key;     /* Address the template was passed at */
+    char *text;          /* Copy of the template at the time it was compiled */
+    FormatProgram *prog; /* NULL if the template does not compile */
+} FormatCacheEntry;
 
-    if (len < (int)sizeof(small_buf) - 1) {
-        /* Fits in small buffer */
-        char *result = malloc(len + 1);
-        if (result)
-            memcpy(result, small_buf, len + 1);
+typedef struct {
+    size_t mask;
+    long lock;
+    FormatCacheEntry *slots[];
+} FormatCache;
+
+static FormatCache *format_cache;
+
+bool format_cache_enable(size_t slots) {
+    if (FORMAT_LOAD_PTR(&format_cache))
+        return true;
+    size_t capacity = FORMAT_CACHE_PROBES;
+    while (capacity < (slots ? slots : FORMAT_CACHE_SLOTS))
+        capacity *= 2;
+    FormatCache *cache = calloc(1, sizeof(FormatCache) + capacity * sizeof(FormatCacheEntry *));
+    if (!cache)
+        return false;
+    cache->mask = capacity - 1;
+#if defined(_MSC_VER) && !defined(__clang__)
+    if (_InterlockedCompareExchangePointer((void *volatile *)&format_cache, cache, NULL))
+        free(cache);
+#else
+    FormatCache *expected = NULL;
+    if (!__atomic_compare_exchange_n(&format_cache, &expected, cache, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        free(cache);
+#endif
+    return true;
+}
 
-        return result;
+void format_cache_disable(void) {
+    FormatCache *cache = FORMAT_LOAD_PTR(&format_cache);
+    if (!cache)
+        return;
+    FORMAT_STORE_PTR(&format_cache, (FormatCache *)NULL);
+    for (size_t i = 0; i <= cache->mask; i++) {
+        if (cache->slots[i]) {
+            format_program_free(cache->slots[i]->prog);
+            free(cache->slots[i]->text);
+            free(cache->slots[i]);
+        }
     }
+    free(cache);
+}
 
-    /* Need larger buffer */
-    size_t size = len + 256;
-    char *result = malloc(size);
-    if (result)
-        format_impl(result, size, fmt_string, args, arg_count);
-
-    return result;
+/* Compile a template for the cache; ~/name/ is looked up in the caller's context on every run */
+static FormatCacheEntry *format_cache_compile(const char *fmt) {
+    FormatCacheEntry *entry = malloc(sizeof(FormatCacheEntry));
+    size_t len = strlen(fmt);
+    char *text = malloc(len + 1);
+    if (!entry || !text) {
+        free(entry);
+        free(text);
+        return NULL;
+    }
+    memcpy(text, fmt, len + 1);
+    entry->key = fmt;
+    entry->text = text;
+    entry->prog = format_compile(fmt);
+    format_last_error = FORMAT_OK;
+    for (uint32_t i = 0; entry->prog && i < entry->prog->count; i++)
+        entry->prog->ops[i].func = NULL;
+    return entry;
 }
 
-/* Print to stdout */
-int format_print(const char *fmt_string, FormatArg *args, size_t arg_count) {
-    char buf[4096];
-    int len = format_impl(buf, sizeof(buf), fmt_string, args, arg_count);
-    if (len >= (int)sizeof(buf) - 1) {
-        /* Need larger buffer */
-        char *large = format_alloc(fmt_string, args, arg_count);
-        if (large) {
-            len = (int)strlen(large);
-            fputs(large, stdout);
-            free(large);
+/* Program for fmt if the cache is on and fmt compiles, compiling it on first use */
+static const FormatProgram *format_cache_lookup(const char *fmt) {
+    FormatCache *cache = FORMAT_LOAD_PTR(&format_cache);
+    if (!cache)
+        return NULL;
+
+    uint64_t h = (uint64_t)(uintptr_t)fmt * 0x9E3779B97F4A7C15ULL;
+    size_t start = (size_t)(h >> 32);
+    bool vacant = false;
+    for (size_t k = 0; k < FORMAT_CACHE_PROBES; k++) {
+        FormatCacheEntry *entry = FORMAT_LOAD_PTR(&cache->slots[(start + k) & cache->mask]);
+        if (!entry) {
+            vacant = true;
+            break;
         }
-    } else
-        fputs(buf, stdout);
-
-    return len;
+        if (entry->key == fmt)
+            return strcmp(entry->text, fmt) ? NULL : entry->prog;
+    }
+    /* Nowhere to keep a program, so don't build one */
+    if (!vacant)
+        return NULL;
+
+    /* Not cached yet; compile outside the lock, then claim a slot */
+    FormatCacheEntry *entry = format_cache_compile(fmt);
+    if (!entry)
+        return NULL;
+    const FormatProgram *prog = NULL;
+    bool stored = false;
+    FORMAT_LOCK(&cache->lock);
+    for (size_t k = 0; k < FORMAT_CACHE_PROBES; k++) {
+        FormatCacheEntry **slot = &cache->slots[(start + k) & cache->mask];
+        if (!*slot) {
+            FORMAT_STORE_PTR(slot, entry);
+            prog = entry->prog;
+            stored = true;
+            break;
+        }
+        if ((*slot)->key == fmt) {
+            /* Another thread got here first */
+            if (!strcmp((*slot)->text, fmt))
+                prog = (*slot)->prog;
+            break;
+        }
+    }
+    FORMAT_UNLOCK(&cache->lock);
+    if (!stored) {
+        format_program_free(entry->prog);
+        free(entry->text);
+        free(entry);
+    }
+    return prog;
 }
 
-/* Print to file */
-int format_fprint(FILE *fp, const char *fmt_string, FormatArg *args, size_t arg_count) {
-    char buf[4096];
-    int len = format_impl(buf, sizeof(buf), fmt_string, args, arg_count);
-    if (len >= (int)sizeof(buf) - 1) {
-        char *large = format_alloc(fmt_string, args, arg_count);
-        if (large) {
-            len = (int)strlen(large);
-            fputs(large, fp);
-            free(large);
+/* Pick the ~[ clause to run, with the same selection rules as format_conditional;
+   returns false when no clause applies */
+static bool format_select_clause(FormatState *state, const FormatProgram *prog, uint32_t i,
+                                 DirectiveParams *params, uint32_t *start, uint32_t *stop) {
+    const FormatOp *op = &prog->ops[i];
+    uint32_t body = i + 1, sep = op->b;
+    *start = body;
+    *stop = op->end;
+
+    if (params->colon && params->at)
+        return state->arg_index < state->arg_count && format_arg_is_true(&state->args[state->arg_index]);
+    if (params->colon) {
+        if (state->arg_index >= state->arg_count)
+            return false;
+        bool truthy = format_arg_is_true(&state->args[state->arg_index++]);
+        if (sep >= op->end)
+            return false;
+        if (truthy)
+            *start = sep + 1;
+        else
+            *stop = sep;
+        return true;
+    }
+    if (params->at) {
+        if (state->arg_index >= state->arg_count)
+            return false;
+        if (format_arg_is_true(&state->args[state->arg_index]))
+            return true;
+        state->arg_index++; /* Consume the nil argument */
+        return false;
+    }
+    if (state->arg_index >= state->arg_count)
+        return false;
+    int selector = (int)format_arg_to_int(&state->args[state->arg_index++]);
+    for (int branch = 0;; branch++) {
+        if (branch == selector) {
+            *start = body;
+            *stop = sep;
+            return true;
         }
-    } else
-        fputs(buf, fp);
+        if (sep >= op->end)
+            return false;
+        body = sep + 1;
+        if (prog->ops[sep].a) { /* Everything after ~:; is the default */
+            *start = body;
+            return true;
+        }
+        sep = prog->ops[sep].b;
+    }
+}
 
-    return len;
+static void format_run_conditional(FormatState *state, const FormatProgram *prog, uint32_t i,
+                                   DirectiveParams *params) {
+    uint32_t start, stop;
+    if (format_select_clause(state, prog, i, params, &start, &stop))
+        format_run(state, prog, start, stop);
 }
 
+/* ~{ over an array argument; ~^ stops the body of the last element */
+static void format_run_iteration(FormatState *state, const FormatProgram *prog, uint32_t i) {
+    if (state->arg_index >= state->arg_count)
+        return;
+    FormatArg *arr_arg = &state->args[state->arg_index++];
+    if (arr_arg->type != FORMAT_TYPE_ARRAY && arr_arg->type != FORMAT_TYPE_TYPED_ARRAY)
+        return;
+
+    size_t count = format_array_count(arr_arg);
+    FormatArg item;
+    FormatArg *saved_args = state->args;
+    size_t saved_count = state->arg_count;
+    size_t saved_index = state->arg_index;
+    bool saved_last = state->iter_last;
+
+    for (size_t k = 0; k < count; k++) {
+        format_array_select(state, arr_arg, k, &item);
+        state->arg_count = 1;
+        state->arg_index = 0;
+        state->iter_last = k == count - 1;
+        format_run(state, prog, i + 1, prog->ops[i].end);
+        state->escaped = false;
+    }
+
+    state->args = saved_args;
+    state->arg_count = saved_count;
+    state->arg_index = saved_index;
+    state->iter_last = saved_last;
+}
+
+/* ~< formats its clauses into a temporary buffer, then pads the result */
+static void format_run_justify(FormatState *state, const FormatProgram *prog, uint32_t i,
+                               DirectiveParams *params) {
+    const FormatOp *op = &prog->ops[i];
+    char temp[1024];
+    FormatSink temp_sink;
+    format_sink_init(&temp_sink, NULL, NULL, temp, sizeof(temp));
+    FormatState temp_state = {
+        .output = temp,
+        .capacity = sizeof(temp),
+        .pos = 0,
+        .args = state->args,
+        .arg_count = state->arg_count,
+        .arg_index = state->arg_index,
+        .error = FORMAT_OK,
+        .error_pos = NULL,
+        .iter_last = state->iter_last,
+        .sink = &temp_sink,
+        .ctx = state->ctx
+    };
+
+    for (uint32_t start = i + 1, sep = op->b;; start = sep + 1, sep = prog->ops[sep].b) {
+        format_run(&temp_state, prog, start, sep);
+        if (sep >= op->end || temp_state.escaped)
+            break;
+    }
+
+    state->arg_index = temp_state.arg_index;
+    state->escaped = temp_state.escaped;
+    format_justify_emit(state, temp_state.output, temp_state.pos, params);
+    format_sink_free(&temp_sink);
+}
+
+/* ~( keeps its output in the buffer and converts it in place */
+static void format_run_case(FormatState *state, const FormatProgram *prog, uint32_t i,
+                            DirectiveParams *params) {
+    size_t start_pos = state->pos;
+    state->hold++;
+    format_run(state, prog, i + 1, prog->ops[i].end);
+    state->hold--;
+    format_apply_case(state->output + start_pos, state->pos - start_pos, params);
+}
+
+/* Execute ops [i, end) until done or ~^ ends the enclosing iteration body */
+static void format_run(FormatState *state, const FormatProgram *prog, uint32_t i, uint32_t end) {
+    while (i < end && !state->escaped) {
+        const FormatOp *op = &prog->ops[i];
+        DirectiveParams params;
+        if (op->code != FORMAT_OP_LITERAL) {
+            params = op->params;
+            if (op->dynamic)
+                resolve_directive_params(state, &params);
+        }
+
+        switch ((FormatOpCode)op->code) {
+            case FORMAT_OP_LITERAL:
+                format_append_literal(state, prog->literals + op->a, op->b);
+                break;
+
+            case FORMAT_OP_DIRECTIVE:
+                format_simple_directive(state, op->cmd, &params);
+                break;
+
+            case FORMAT_OP_SEPARATOR:
+                /* Outside clause selection ~; prints itself, as in format_process */
+                format_append_mem(state, "~;", 2);
+                break;
+
+            case FORMAT_OP_CONDITIONAL:
+                format_run_conditional(state, prog, i, &params);
+                i = op->end;
+                continue;
+
+            case FORMAT_OP_ITERATION:
+                format_run_iteration(state, prog, i);
+                i = op->end;
+                continue;
+
+            case FORMAT_OP_CASE:
+                format_run_case(state, prog, i, &params);
+                i = op->end;
+                continue;
+
+            case FORMAT_OP_JUSTIFY:
+                format_run_justify(state, prog, i, &params);
+                i = op->end;
+                continue;
+
+            case FORMAT_OP_CALL: {
+                FormatFunc func = op->func ? op->func : format_lookup_func(state->ctx, prog->literals + op->a, op->b);
+                if (func && state->arg_index < state->arg_count)
+                    func(state, &state->args[state->arg_index++]);
+                break;
+            }
+        }
+        i++;
+    }
+}
+
+int format_exec(const FormatProgram *prog, char *buf, size_t bufsize,
+                FormatArg *args, size_t arg_count) {
+    format_last_error = FORMAT_OK;
+
+    if (!buf) {
+        format_last_error = FORMAT_ERR_NULL_BUFFER;
+        return -1;
+    }
+    if (bufsize == 0) {
+        format_last_error = FORMAT_ERR_ZERO_SIZE;
+        return -1;
+    }
+    buf[0] = '\0';
+    if (!prog) {
+        format_last_error = FORMAT_ERR_NULL_FORMAT;
+        return -1;
+    }
+
+    FormatState state = {
+        .output = buf,
+        .capacity = bufsize,
+        .pos = 0,
+        .args = args,
+        .arg_count = arg_count,
+        .arg_index = 0,
+        .error = FORMAT_OK,
+        .error_pos = NULL,
+        .ctx = prog->ctx
+    };
+
+    format_run(&state, prog, 0, prog->count);
+    buf[state.pos] = '\0';
+
+    if (state.error != FORMAT_OK)
+        format_last_error = state.error;
+
+    return (int)state.pos;
+}
+
+/* Format into a fixed buffer */
+static int format_buffer_impl(FormatContext *ctx, char *buf, size_t bufsize, const char *fmt_string,
+                              FormatArg *args, size_t arg_count, FormatError *err_out) {
+    format_last_error = FORMAT_OK;
+
+    if (!buf) {
+        format_last_error = FORMAT_ERR_NULL_BUFFER;
+        if (err_out) *err_out = FORMAT_ERR_NULL_BUFFER;
+        return -1;
+    }
+    if (bufsize == 0) {
+        format_last_error = FORMAT_ERR_ZERO_SIZE;
+        if (err_out) *err_out = FORMAT_ERR_ZERO_SIZE;
+        return -1;
+    }
+    if (!fmt_string) {
+        format_last_error = FORMAT_ERR_NULL_FORMAT;
+        if (err_out) *err_out = FORMAT_ERR_NULL_FORMAT;
+        buf[0] = '\0';
+        return -1;
+    }
+
+    FormatState state = {
+        .output = buf,
+        .capacity = bufsize,
+        .pos = 0,
+        .args = args,
+        .arg_count = arg_count,
+        .arg_index = 0,
+        .error = FORMAT_OK,
+        .error_pos = NULL,
+        .ctx = ctx
+    };
+
+    const FormatProgram *prog = format_cache_lookup(fmt_string);
+    if (prog)
+        format_run(&state, prog, 0, prog->count);
+    else
+        format_process(&state, fmt_string, NULL);
+    buf[state.pos] = '\0';
+
+    if (err_out) *err_out = state.error;
+    if (state.error != FORMAT_OK)
+        format_last_error = state.error;
+
+    return (int)state.pos;
+}
+
+/* Main implementation function */
+int format_impl(char *buf, size_t bufsize, const char *fmt_string,
+                FormatArg *args, size_t arg_count) {
+    return format_impl_ex(buf, bufsize, fmt_string, args, arg_count, NULL);
+}
+
+/* Extended implementation with error output */
+int format_impl_ex(char *buf, size_t bufsize, const char *fmt_string,
+                   FormatArg *args, size_t arg_count, FormatError *err_out) {
+    return format_buffer_impl(NULL, buf, bufsize, fmt_string, args, arg_count, err_out);
+}
+
+/* Implementation with a directive context */
+int format_impl_ctx(FormatContext *ctx, char *buf, size_t bufsize, const char *fmt_string,
+                    FormatArg *args, size_t arg_count) {
+    return format_buffer_impl(ctx, buf, bufsize, fmt_string, args, arg_count, NULL);
+}
+
+/* Format a string or run a program into a sink, returning the true length */
+static int format_sink_run(FormatSink *sink, const char *fmt_string, const FormatProgram *prog,
+                           FormatArg *args, size_t arg_count) {
+    format_last_error = FORMAT_OK;
+
+    if (!sink) {
+        format_last_error = FORMAT_ERR_NULL_BUFFER;
+        return -1;
+    }
+    if (!fmt_string && !prog) {
+        format_last_error = FORMAT_ERR_NULL_FORMAT;
+        return -1;
+    }
+    if (!prog)
+        prog = format_cache_lookup(fmt_string);
+
+    FormatState state = {
+        .output = sink->buf,
+        .capacity = sink->capacity,
+        .pos = sink->len,
+        .args = args,
+        .arg_count = arg_count,
+        .arg_index = 0,
+        .error = FORMAT_OK,
+        .error_pos = NULL,
+        .sink = sink,
+        .ctx = prog ? prog->ctx : NULL
+    };
+    size_t start = sink->flushed + sink->gathered + sink->len;
+
+    /* Make sure there is a buffer to write into */
+    format_reserve(&state, 1);
+    if (!sink->failed) {
+        if (prog)
+            format_run(&state, prog, 0, prog->count);
+        else
+            format_process(&state, fmt_string, NULL);
+        state.output[state.pos] = '\0';
+    }
+    sink->len = state.pos;
+    /* Literals queued by a writev sink are only valid during this call */
+    if (sink->gather)
+        format_sink_drain(sink);
+
+    if (sink->failed) {
+        format_last_error = FORMAT_ERR_SINK_FAILED;
+        return -1;
+    }
+    if (state.error != FORMAT_OK)
+        format_last_error = state.error;
+
+    return (int)(sink->flushed + sink->gathered + sink->len - start);
+}
+
+int format_impl_sink(FormatSink *sink, const char *fmt_string,
+                     FormatArg *args, size_t arg_count) {
+    if (!fmt_string) {
+        format_last_error = FORMAT_ERR_NULL_FORMAT;
+        return -1;
+    }
+    return format_sink_run(sink, fmt_string, NULL, args, arg_count);
+}
+
+int format_exec_sink(const FormatProgram *prog, FormatSink *sink,
+                     FormatArg *args, size_t arg_count) {
+    if (!prog) {
+        format_last_error = FORMAT_ERR_NULL_FORMAT;
+        return -1;
+    }
+    return format_sink_run(sink, NULL, prog, args, arg_count);
+}
+
+/* Allocate and return formatted string */
+char *format_alloc(const char *fmt_string, FormatArg *args, size_t arg_count) {
+    /* Short results are copied out of the stack buffer in one allocation */
+    char small_buf[1024];
+    FormatSink sink;
+    format_sink_init(&sink, NULL, NULL, small_buf, sizeof(small_buf));
+
+    if (format_impl_sink(&sink, fmt_string, args, arg_count) < 0) {
+        format_sink_free(&sink);
+        return NULL;
+    }
+    return format_sink_detach(&sink, NULL);
+}
+
+/* Print to stdout */
+int format_print(const char *fmt_string, FormatArg *args, size_t arg_count) {
+    return format_fprint(stdout, fmt_string, args, arg_count);
+}
+
+/* Print to file */
+int format_fprint(FILE *fp, const char *fmt_string, FormatArg *args, size_t arg_count) {
+    char buf[4096];
+    FormatSink sink;
+    format_sink_init_file(&sink, fp, buf, sizeof(buf));
+
+    int len = format_impl_sink(&sink, fmt_string, args, arg_count);
+    if (!format_sink_flush(&sink))
+        len = -1;
+    format_sink_free(&sink);
+
+    return len;
+}
+
+/* Print to file descriptor */
+int format_dprint(int fd, const char *fmt_string, FormatArg *args, size_t arg_count) {
+    char buf[4096];
+    FormatSink sink;
+    format_sink_init_writev(&sink, fd, buf, sizeof(buf));
+
+    int len = format_impl_sink(&sink, fmt_string, args, arg_count);
+    format_sink_free(&sink);
+
+    return len;
+}
+
+/* Deferred logger */
+#ifndef FORMAT_LOG_RING_SIZE
+#define FORMAT_LOG_RING_SIZE (64 * 1024)
+#endif
+
+#define FORMAT_LOG_ALIGN 8
+#define FORMAT_LOG_WRAP UINT32_MAX
+
+/* A message in a ring: header, FormatArg[argc], then copied arrays and strings.
+   Pointers inside the copy are stored as offsets from the header. */
+typedef struct {
+    uint32_t size;         /* bytes to the next record, or to the ring end for a wrap */
+    uint32_t id;
+    uint32_t argc;
+    uint32_t reserved;
+} FormatLogRecord;
+
+/* Single-producer (the owning thread), single-consumer (the drainer) ring */
+typedef struct FormatLogRing {
+    struct FormatLogRing *next;
+    const void *owner;
+    char *data;
+    uint64_t mask;
+    uint64_t head;         /* written by the owner */
+    uint64_t tail;         /* written by the drainer */
+    uint64_t dropped;
+} FormatLogRing;
+
+struct FormatLog {
+    FormatContext *ctx;
+    FormatLogRing *rings;
+    FormatProgram **templates;
+    uint32_t template_count;
+    uint32_t template_cap;
+    size_t ring_size;
+    uint64_t serial;
+    long lock;
+};
+
+static uint64_t format_log_serial;
+static FORMAT_THREAD_LOCAL uint64_t format_log_tls_serial;
+static FORMAT_THREAD_LOCAL FormatLogRing *format_log_tls_ring;
+static FORMAT_THREAD_LOCAL char format_log_tls_owner;
+
+FormatLog *format_log_new(FormatContext *ctx, size_t ring_size) {
+    FormatLog *log = calloc(1, sizeof(FormatLog));
+    if (!log)
+        return NULL;
+    size_t size = 1024;
+    while (size < (ring_size ? ring_size : FORMAT_LOG_RING_SIZE))
+        size *= 2;
+    log->ctx = ctx;
+    log->ring_size = size;
+    log->serial = FORMAT_FETCH_ADD_U64(&format_log_serial, 1) + 1;
+    return log;
+}
+
+void format_log_free(FormatLog *log) {
+    if (!log)
+        return;
+    for (FormatLogRing *ring = log->rings, *next; ring; ring = next) {
+        next = ring->next;
+        free(ring->data);
+        free(ring);
+    }
+    for (uint32_t i = 0; i < log->template_count; i++)
+        format_program_free(log->templates[i]);
+    free(log->templates);
+    free(log);
+}
+
+uint32_t format_log_template(FormatLog *log, const char *fmt_string) {
+    FormatProgram *prog = format_compile_ctx(log->ctx, fmt_string);
+    if (!prog)
+        return FORMAT_LOG_INVALID;
+
+    uint32_t id = FORMAT_LOG_INVALID;
+    FORMAT_LOCK(&log->lock);
+    if (log->template_count == log->template_cap) {
+        uint32_t cap = log->template_cap ? log->template_cap * 2 : 16;
+        FormatProgram **templates = realloc(log->templates, cap * sizeof(FormatProgram *));
+        if (templates) {
+            log->templates = templates;
+            log->template_cap = cap;
+        }
+    }
+    if (log->template_count < log->template_cap) {
+        id = log->template_count++;
+        log->templates[id] = prog;
+    }
+    FORMAT_UNLOCK(&log->lock);
+
+    if (id == FORMAT_LOG_INVALID)
+        format_program_free(prog);
+    return id;
+}
+
+/* The calling thread's ring, created on first use */
+static FormatLogRing *format_log_ring(FormatLog *log) {
+    if (format_log_tls_serial == log->serial)
+        return format_log_tls_ring;
+
+    FORMAT_LOCK(&log->lock);
+    FormatLogRing *ring = log->rings;
+    while (ring && ring->owner != &format_log_tls_owner)
+        ring = ring->next;
+    if (!ring && (ring = calloc(1, sizeof(FormatLogRing)))) {
+        if ((ring->data = malloc(log->ring_size))) {
+            ring->owner = &format_log_tls_owner;
+            ring->mask = log->ring_size - 1;
+            ring->next = log->rings;
+            FORMAT_STORE_PTR(&log->rings, ring);
+        } else {
+            free(ring);
+            ring = NULL;
+        }
+    }
+    FORMAT_UNLOCK(&log->lock);
+
+    if (ring) {
+        format_log_tls_serial = log->serial;
+        format_log_tls_ring = ring;
+    }
+    return ring;
+}
+
+static size_t format_log_align(size_t n) {
+    return (n + FORMAT_LOG_ALIGN - 1) & ~(size_t)(FORMAT_LOG_ALIGN - 1);
+}
+
+/* Bytes needed to copy args, including strings and nested arrays */
+static size_t format_log_measure(const FormatArg *args, size_t n) {
+    size_t size = n * sizeof(FormatArg);
+    for (size_t i = 0; i < n; i++) {
+        if (args[i].type == FORMAT_TYPE_STRING && args[i].value.as_string)
+            size += strlen(args[i].value.as_string) + 1;
+        else if (args[i].type == FORMAT_TYPE_ARRAY && args[i].value.as_array.items)
+            size += FORMAT_LOG_ALIGN + format_log_measure(args[i].value.as_array.items, args[i].value.as_array.count);
+        else if (args[i].type == FORMAT_TYPE_TYPED_ARRAY && args[i].value.as_typed_array.data) {
+            size_t count = args[i].value.as_typed_array.count;
+            size += FORMAT_LOG_ALIGN + count * format_typed_size((FormatArgType)args[i].value.as_typed_array.type);
+            for (size_t k = 0; k < count && args[i].value.as_typed_array.type == FORMAT_TYPE_STRING; k++) {
+                const char *str = format_typed_item(&args[i], k).value.as_string;
+                if (str)
+                    size += strlen(str) + 1;
+            }
+        }
+    }
+    return size;
+}
+
+/* Copy args into dst; strings and arrays go to base + *heap */
+static void format_log_pack(char *base, FormatArg *dst, const FormatArg *args, size_t n, size_t *heap) {
+    memcpy(dst, args, n * sizeof(FormatArg));
+    for (size_t i = 0; i < n; i++) {
+        if (args[i].type == FORMAT_TYPE_ARRAY && args[i].value.as_array.items) {
+            size_t offset = format_log_align(*heap);
+            *heap = offset + args[i].value.as_array.count * sizeof(FormatArg);
+            format_log_pack(base, (FormatArg *)(base + offset), args[i].value.as_array.items,
+                            args[i].value.as_array.count, heap);
+            dst[i].value.as_array.items = (FormatArg *)(uintptr_t)offset;
+        } else if (args[i].type == FORMAT_TYPE_TYPED_ARRAY && args[i].value.as_typed_array.data) {
+            /* Elements are packed without gaps; strings are copied after them */
+            FormatArgType type = (FormatArgType)args[i].value.as_typed_array.type;
+            size_t count = args[i].value.as_typed_array.count;
+            size_t elem = format_typed_size(type);
+            size_t offset = format_log_align(*heap);
+            *heap = offset + count * elem;
+            for (size_t k = 0; k < count; k++) {
+                const char *src = (const char *)args[i].value.as_typed_array.data + k * args[i].value.as_typed_array.stride;
+                const char *str;
+                if (type == FORMAT_TYPE_STRING && (str = *(const char * const *)src)) {
+                    size_t len = strlen(str) + 1;
+                    uintptr_t at = *heap;
+                    memcpy(base + *heap, str, len);
+                    memcpy(base + offset + k * elem, &at, sizeof(at));
+                    *heap += len;
+                } else
+                    memcpy(base + offset + k * elem, src, elem);
+            }
+            dst[i].value.as_typed_array.data = (const void *)(uintptr_t)offset;
+            dst[i].value.as_typed_array.stride = elem;
+        } else if (args[i].type == FORMAT_TYPE_STRING && args[i].value.as_string) {
+            size_t len = strlen(args[i].value.as_string) + 1;
+            memcpy(base + *heap, args[i].value.as_string, len);
+            dst[i].value.as_string = (const char *)(uintptr_t)*heap;
+            *heap += len;
+        }
+    }
+}
+
+/* Turn the offsets written by format_log_pack back into pointers */
+static void format_log_unpack(char *base, FormatArg *args, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        if (args[i].type == FORMAT_TYPE_ARRAY && args[i].value.as_array.items) {
+            args[i].value.as_array.items = (FormatArg *)(base + (uintptr_t)args[i].value.as_array.items);
+            format_log_unpack(base, args[i].value.as_array.items, args[i].value.as_array.count);
+        } else if (args[i].type == FORMAT_TYPE_TYPED_ARRAY && args[i].value.as_typed_array.data) {
+            char *data = base + (uintptr_t)args[i].value.as_typed_array.data;
+            args[i].value.as_typed_array.data = data;
+            for (size_t k = 0; k < args[i].value.as_typed_array.count &&
+                               args[i].value.as_typed_array.type == FORMAT_TYPE_STRING; k++) {
+                uintptr_t at;
+                memcpy(&at, data + k * sizeof(at), sizeof(at));
+                if (at) {
+                    const char *str = base + at;
+                    memcpy(data + k * sizeof(at), &str, sizeof(str));
+                }
+            }
+        } else if (args[i].type == FORMAT_TYPE_STRING && args[i].value.as_string)
+            args[i].value.as_string = base + (uintptr_t)args[i].value.as_string;
+    }
+}
+
+bool format_log_write(FormatLog *log, uint32_t id, FormatArg *args, size_t arg_count) {
+    FormatLogRing *ring = format_log_ring(log);
+    if (!ring)
+        return false;
+
+    size_t size = format_log_align(sizeof(FormatLogRecord) + format_log_measure(args, arg_count));
+    uint64_t capacity = ring->mask + 1;
+    uint64_t head = ring->head;
+    uint64_t offset = head & ring->mask;
+    uint64_t gap = offset + size > capacity ? capacity - offset : 0; /* records never wrap */
+
+    if (size > capacity / 2 || arg_count > UINT32_MAX ||
+        head + gap + size - FORMAT_LOAD_U64(&ring->tail) > capacity) {
+        FORMAT_STORE_U64(&ring->dropped, ring->dropped + 1);
+        return false;
+    }
+
+    if (gap) {
+        FormatLogRecord *wrap = (FormatLogRecord *)(ring->data + offset);
+        wrap->size = (uint32_t)gap;
+        wrap->id = FORMAT_LOG_WRAP;
+        offset = 0;
+    }
+    char *base = ring->data + offset;
+    FormatLogRecord *record = (FormatLogRecord *)base;
+    record->size = (uint32_t)size;
+    record->id = id;
+    record->argc = (uint32_t)arg_count;
+    size_t heap = sizeof(FormatLogRecord) + arg_count * sizeof(FormatArg);
+    format_log_pack(base, (FormatArg *)(record + 1), args, arg_count, &heap);
+
+    FORMAT_STORE_U64(&ring->head, head + gap + size);
+    return true;
+}
+
+size_t format_log_drain(FormatLog *log, FormatSink *sink) {
+    size_t count = 0;
+    for (FormatLogRing *ring = FORMAT_LOAD_PTR(&log->rings); ring; ring = ring->next) {
+        uint64_t tail = ring->tail;
+        uint64_t head = FORMAT_LOAD_U64(&ring->head);
+        while (tail < head) {
+            char *base = ring->data + (tail & ring->mask);
+            FormatLogRecord *record = (FormatLogRecord *)base;
+            if (record->id != FORMAT_LOG_WRAP) {
+                FormatArg *args = (FormatArg *)(record + 1);
+                format_log_unpack(base, args, record->argc);
+
+                FORMAT_LOCK(&log->lock);
+                FormatProgram *prog = record->id < log->template_count ? log->templates[record->id] : NULL;
+                FORMAT_UNLOCK(&log->lock);
+                if (prog)
+                    format_exec_sink(prog, sink, args, record->argc);
+                count++;
+            }
+            tail += record->size;
+            FORMAT_STORE_U64(&ring->tail, tail);
+        }
+    }
+    return count;
+}
+
+uint64_t format_log_dropped(FormatLog *log) {
+    uint64_t dropped = 0;
+    for (FormatLogRing *ring = FORMAT_LOAD_PTR(&log->rings); ring; ring = ring->next)
+        dropped += FORMAT_LOAD_U64(&ring->dropped);
+    return dropped;
+}
+
+/* Resumable formatting */
+#ifndef FORMAT_STREAM_DEPTH
+#define FORMAT_STREAM_DEPTH 16
+#endif
+
+/* A range of ops being executed; for ~{ the range is the body and the
+   frame also holds the loop state */
+typedef struct {
+    uint32_t i;
+    uint32_t end;
+    bool iteration;
+    uint32_t body;
+    size_t k;
+    size_t count;
+    FormatArg array;
+    FormatArg item;
+    FormatArg *saved_args;
+    size_t saved_count;
+    size_t saved_index;
+    bool saved_last;
+} FormatStreamFrame;
+
+struct FormatStream {
+    const FormatProgram *prog;
+    FormatState state;
+    FormatSink pending;  /* Output produced but not yet returned */
+    size_t taken;        /* Bytes of pending already returned */
+    size_t depth;
+    FormatStreamFrame frames[FORMAT_STREAM_DEPTH];
+};
+
+FormatStream *format_stream_new(const FormatProgram *prog, FormatArg *args, size_t arg_count) {
+    if (!prog) {
+        format_last_error = FORMAT_ERR_NULL_FORMAT;
+        return NULL;
+    }
+    FormatStream *stream = calloc(1, sizeof(FormatStream));
+    if (!stream)
+        return NULL;
+    stream->prog = prog;
+    format_sink_init_heap(&stream->pending);
+    stream->state = (FormatState){
+        .args = args,
+        .arg_count = arg_count,
+        .sink = &stream->pending,
+        .ctx = prog->ctx
+    };
+    stream->frames[0] = (FormatStreamFrame){.i = 0, .end = prog->count};
+    stream->depth = 1;
+
+    /* Make sure there is a buffer to write into */
+    format_reserve(&stream->state, 1);
+    if (stream->pending.failed) {
+        format_stream_free(stream);
+        return NULL;
+    }
+    return stream;
+}
+
+void format_stream_free(FormatStream *stream) {
+    if (!stream)
+        return;
+    format_sink_free(&stream->pending);
+    free(stream);
+}
+
+bool format_stream_done(const FormatStream *stream) {
+    return !stream->depth && stream->taken == stream->state.pos;
+}
+
+/* Copy pending output into chunk; returns the number of bytes copied */
+static size_t format_stream_take(FormatStream *stream, char *chunk, size_t size) {
+    FormatState *state = &stream->state;
+    size_t len = state->pos - stream->taken;
+    if (len > size)
+        len = size;
+    if (len) {
+        memcpy(chunk, state->output + stream->taken, len);
+        stream->taken += len;
+    }
+    if (stream->taken == state->pos && state->pos) {
+        /* Everything was returned; reuse the buffer, keeping ~& and ~T right */
+        stream->pending.last = state->output[state->pos - 1];
+        stream->pending.flushed += state->pos;
+        state->pos = 0;
+        stream->taken = 0;
+    }
+    return len;
+}
+
+/* Execute one op of the innermost frame, or finish that frame */
+static void format_stream_step(FormatStream *stream) {
+    FormatState *state = &stream->state;
+    const FormatProgram *prog = stream->prog;
+    FormatStreamFrame *frame = &stream->frames[stream->depth - 1];
+
+    if (frame->i >= frame->end || state->escaped) {
+        if (frame->iteration) {
+            /* Next element, as in format_run_iteration */
+            state->escaped = false;
+            if (++frame->k < frame->count) {
+                format_array_select(state, &frame->array, frame->k, &frame->item);
+                state->arg_count = 1;
+                state->arg_index = 0;
+                state->iter_last = frame->k == frame->count - 1;
+                frame->i = frame->body;
+                return;
+            }
+            state->args = frame->saved_args;
+            state->arg_count = frame->saved_count;
+            state->arg_index = frame->saved_index;
+            state->iter_last = frame->saved_last;
+        }
+        stream->depth--;
+        return;
+    }
+
+    uint32_t i = frame->i;
+    const FormatOp *op = &prog->ops[i];
+    frame->i = op->code == FORMAT_OP_LITERAL || op->code == FORMAT_OP_DIRECTIVE ||
+               op->code == FORMAT_OP_SEPARATOR || op->code == FORMAT_OP_CALL ? i + 1 : op->end;
+    if (op->code != FORMAT_OP_CONDITIONAL && op->code != FORMAT_OP_ITERATION) {
+        /* Everything else completes within one op */
+        format_run(state, prog, i, frame->i);
+        return;
+    }
+
+    DirectiveParams params = op->params;
+    if (op->dynamic)
+        resolve_directive_params(state, &params);
+    switch ((FormatOpCode)op->code) {
+        case FORMAT_OP_CONDITIONAL: {
+            uint32_t start, stop;
+            if (!format_select_clause(state, prog, i, &params, &start, &stop))
+                break;
+            if (stream->depth == FORMAT_STREAM_DEPTH) {
+                format_run(state, prog, start, stop);
+                break;
+            }
+            stream->frames[stream->depth++] = (FormatStreamFrame){.i = start, .end = stop};
+            break;
+        }
+
+        case FORMAT_OP_ITERATION: {
+            if (stream->depth == FORMAT_STREAM_DEPTH) {
+                /* Too deep to track; finish this loop in one go */
+                format_run_iteration(state, prog, i);
+                break;
+            }
+            if (state->arg_index >= state->arg_count)
+                break;
+            FormatArg *arr_arg = &state->args[state->arg_index++];
+            size_t count = format_array_count(arr_arg);
+            if (!count)
+                break;
+
+            FormatStreamFrame *loop = &stream->frames[stream->depth++];
+            *loop = (FormatStreamFrame){
+                .i = i + 1,
+                .end = op->end,
+                .iteration = true,
+                .body = i + 1,
+                .k = 0,
+                .count = count,
+                .array = *arr_arg,
+                .saved_args = state->args,
+                .saved_count = state->arg_count,
+                .saved_index = state->arg_index,
+                .saved_last = state->iter_last
+            };
+            format_array_select(state, &loop->array, 0, &loop->item);
+            state->arg_count = 1;
+            state->arg_index = 0;
+            state->iter_last = count == 1;
+            break;
+        }
+
+        default:
+            break;
+    }
+}
+
+size_t format_stream_read(FormatStream *stream, char *chunk, size_t size) {
+    format_last_error = FORMAT_OK;
+    if (!stream || !chunk)
+        return 0;
+
+    size_t n = format_stream_take(stream, chunk, size);
+    while (n < size && stream->depth && !stream->pending.failed) {
+        format_stream_step(stream);
+        n += format_stream_take(stream, chunk + n, size - n);
+    }
+
+    if (stream->pending.failed)
+        format_last_error = FORMAT_ERR_SINK_FAILED;
+    else if (stream->state.error != FORMAT_OK)
+        format_last_error = stream->state.error;
+    return n;
+}
+
+/* Parallel batch formatting */
+#ifdef PAUL_THREADS_HEADER
+#ifndef FORMAT_BATCH_ROWS
+#define FORMAT_BATCH_ROWS 1024
+#endif
+
+/* One block of records and the output it produced */
+typedef struct {
+    const FormatProgram *prog;
+    const char *records;
+    size_t record_size;
+    FormatBatchArgs build;
+    size_t start;
+    size_t end;
+    FormatSink out;
+    FormatError error;
+} FormatBatchTask;
+
+/* One round of blocks, shared by the caller and the helper jobs it queued.
+   A helper may only start after the round is over, so the state lives on
+   the heap until the last reference to it is dropped. */
+typedef struct {
+    mtx_t lock;
+    cnd_t done;
+    uint64_t next;  /* next block to claim, updated atomically */
+    size_t running; /* helpers inside their claim loop, under lock */
+    size_t refs;    /* caller plus queued helpers, under lock */
+    size_t count;
+    FormatBatchTask *tasks;
+} FormatBatchRun;
+
+/* Append bytes to a sink outside of a formatting call */
+static bool format_sink_put(FormatSink *sink, const char *data, size_t len) {
+    if (!len)
+        return !sink->failed;
+    FormatState state = {
+        .output = sink->buf,
+        .capacity = sink->capacity,
+        .pos = sink->len,
+        .sink = sink
+    };
+    format_append_mem(&state, data, len);
+    if (!sink->failed)
+        state.output[state.pos] = '\0';
+    sink->len = state.pos;
+    return !sink->failed;
+}
+
+static size_t format_batch_collect(void *user, const char *data, size_t len) {
+    return format_sink_put((FormatSink *)user, data, len) ? len : 0;
+}
+
+/* Format the task's records into its buffer, each through a fresh staging sink */
+static void format_batch_rows(FormatBatchTask *task) {
+    char stage_buf[1024];
+    FormatArg args[FORMAT_BATCH_MAX_ARGS];
+    for (size_t i = task->start; i < task->end && !task->out.failed; i++) {
+        size_t count = task->build(task->records + i * task->record_size, args, FORMAT_BATCH_MAX_ARGS);
+        if (count > FORMAT_BATCH_MAX_ARGS)
+            count = FORMAT_BATCH_MAX_ARGS;
+
+        FormatSink stage;
+        format_sink_init(&stage, format_batch_collect, &task->out, stage_buf, sizeof(stage_buf));
+        format_exec_sink(task->prog, &stage, args, count);
+        if (task->error == FORMAT_OK)
+            task->error = format_last_error;
+        format_sink_free(&stage);
+    }
+}
+
+/* Format blocks until none are left unclaimed */
+static void format_batch_drain(FormatBatchRun *run) {
+    for (uint64_t i; (i = FORMAT_FETCH_ADD_U64(&run->next, 1)) < run->count;)
+        format_batch_rows(&run->tasks[i]);
+}
+
+/* Drop a reference with run->lock held */
+static void format_batch_release(FormatBatchRun *run) {
+    bool last = --run->refs == 0;
+    mtx_unlock(&run->lock);
+    if (last) {
+        cnd_destroy(&run->done);
+        mtx_destroy(&run->lock);
+        free(run);
+    }
+}
+
+static void format_batch_job(void *arg) {
+    FormatBatchRun *run = (FormatBatchRun *)arg;
+    mtx_lock(&run->lock);
+    run->running++;
+    mtx_unlock(&run->lock);
+    format_batch_drain(run);
+    mtx_lock(&run->lock);
+    if (--run->running == 0)
+        cnd_signal(&run->done);
+    format_batch_release(run);
+}
+
+/* Cleanup for a helper the pool discards without running it */
+static void format_batch_discard(void *arg) {
+    FormatBatchRun *run = (FormatBatchRun *)arg;
+    mtx_lock(&run->lock);
+    format_batch_release(run);
+}
+
+/* Format count blocks with help from the pool. The caller claims blocks
+   too and then waits only for helpers that have started, so it cannot
+   deadlock when it runs as a job of the same pool. */
+static void format_batch_round(thrd_pool_t *pool, FormatBatchTask *tasks, size_t count) {
+    FormatBatchRun *run = count > 1 ? malloc(sizeof(FormatBatchRun)) : NULL;
+    if (run && mtx_init(&run->lock, 0) != thrd_success) {
+        free(run);
+        run = NULL;
+    } else if (run && cnd_init(&run->done) != thrd_success) {
+        mtx_destroy(&run->lock);
+        free(run);
+        run = NULL;
+    }
+    if (!run) {
+        for (size_t i = 0; i < count; i++)
+            format_batch_rows(&tasks[i]);
+        return;
+    }
+    run->next = 0;
+    run->running = 0;
+    run->refs = 1;
+    run->count = count;
+    run->tasks = tasks;
+    for (size_t i = 1; i < count; i++) {
+        mtx_lock(&run->lock);
+        run->refs++;
+        mtx_unlock(&run->lock);
+        if (thrd_pool_submit(pool, format_batch_job, run, format_batch_discard) != thrd_success) {
+            mtx_lock(&run->lock);
+            run->refs--;
+            mtx_unlock(&run->lock);
+            break;
+        }
+    }
+    format_batch_drain(run);
+    mtx_lock(&run->lock);
+    while (run->running)
+        cnd_wait(&run->done, &run->lock);
+    format_batch_release(run);
+}
+
+size_t format_batch(thrd_pool_t *pool, const FormatProgram *prog, const void *records, size_t record_size,
+                    size_t n, FormatBatchArgs build, FormatSink *sink) {
+    format_last_error = FORMAT_OK;
+    if (!sink) {
+        format_last_error = FORMAT_ERR_NULL_BUFFER;
+        return (size_t)-1;
+    }
+    if (!prog || !build) {
+        format_last_error = FORMAT_ERR_NULL_FORMAT;
+        return (size_t)-1;
+    }
+
+    /* One task per worker plus one for the calling thread */
+    size_t k = (pool ? thrd_pool_get_thread_count(pool) : 0) + 1;
+    FormatBatchTask single;
+    FormatBatchTask *tasks = k > 1 ? calloc(k, sizeof(FormatBatchTask)) : NULL;
+    if (!tasks) {
+        tasks = &single;
+        k = 1;
+    }
+    for (size_t i = 0; i < k; i++) {
+        tasks[i] = (FormatBatchTask){
+            .prog = prog,
+            .records = (const char *)records,
+            .record_size = record_size,
+            .build = build
+        };
+        format_sink_init_heap(&tasks[i].out);
+    }
+
+    size_t total = 0;
+    FormatError error = FORMAT_OK;
+    bool failed = false;
+    for (size_t row = 0; row < n && !failed;) {
+        /* Deal out the next round of blocks */
+        size_t used = 0;
+        for (; used < k && row < n; used++) {
+            size_t rows = n - row < FORMAT_BATCH_ROWS ? n - row : FORMAT_BATCH_ROWS;
+            tasks[used].start = row;
+            tasks[used].end = row += rows;
+        }
+
+        format_batch_round(pool, tasks, used);
+
+        /* Hand the blocks to the sink in record order */
+        for (size_t i = 0; i < used && !failed; i++) {
+            FormatSink *out = &tasks[i].out;
+            if (out->failed || !format_sink_put(sink, out->buf, out->len))
+                failed = true;
+            total += out->len;
+            out->len = 0;
+            if (error == FORMAT_OK)
+                error = tasks[i].error;
+            tasks[i].error = FORMAT_OK;
+        }
+    }
+
+    for (size_t i = 0; i < k; i++)
+        format_sink_free(&tasks[i].out);
+    if (tasks != &single)
+        free(tasks);
+    if (sink->gather)
+        format_sink_drain(sink);
+
+    if (failed || sink->failed) {
+        format_last_error = FORMAT_ERR_SINK_FAILED;
+        return (size_t)-1;
+    }
+    format_last_error = error;
+    return total;
+}
+#endif
+
 #ifdef __GNUC__
 #pragma GCC diagnostic pop
 #endif
@@ -19,7 +19,7 @@
  @header paul_string.h
  @copyright George Watson GPLv3
  @updated 2025-07-19
- @brief Unified ascii+wide string type for C/C++.
+ @brief Unified ascii+utf8+wide string type for C/C++.
  @discussion
     Implementation is included when PAUL_STRING_IMPLEMENTATION or PAUL_IMPLEMENTATION is defined.
 */
@@ -30,13 +30,29 @@
 extern "C" {
 #endif
 #include <stdint.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <wchar.h>
+#include <wctype.h>
 #include <stdbool.h>
 
-#if defined(__cpluscplus) || __STDC_VERSION__ < 201112L || !__has_extension(c_generic_selections)
+#ifndef STR_MALLOC
+#define STR_MALLOC malloc
+#endif
+#ifndef STR_REALLOC
+#define STR_REALLOC realloc
+#endif
+#ifndef STR_FREE
+#define STR_FREE free
+#endif
+
+#if defined(__cplusplus) || !defined(__STDC_VERSION__) || __STDC_VERSION__ < 201112L
 #define PAUL_NO_GENERICS
+#elif defined(__has_extension)
+#if !__has_extension(c_generic_selections)
+#define PAUL_NO_GENERICS
+#endif
 #endif
 
 #ifndef PAUL_NO_GENERICS
@@ -96,7 +112,7 @@ _Generic((S),                           \
  @brief Opaque string handle used by the paul string API.
  @discussion
     A `str_t` points to an internal buffer allocated by the paul library
-    that stores either an ASCII (char) or wide (wchar_t) string. The
+    that stores an ASCII (char), UTF-8 (char) or wide (wchar_t) string. The
     implementation stores a small header placed immediately before the
     returned data pointer to track the stored type and the character length.
     Callers must treat `str_t` as an opaque handle and use the provided
@@ -112,6 +128,18 @@ typedef void* str_t;
 */
 str_t str_dup(const str_t s);
 
+/*!
+ @function str_free
+ @brief Release a string handle.
+ @discussion Heap strings are returned to `STR_FREE`. Strings living in a
+     `str_arena_t` are reclaimed by `str_arena_reset`/`str_arena_destroy`
+     instead (the most recent arena allocation is rolled back immediately),
+     and interned strings are owned by their pool, so both are otherwise
+     left untouched. Passing NULL is a no-op.
+ @param s The `str_t` to release; it must not be used afterwards.
+*/
+void str_free(str_t s);
+
 /*!
  @function str_from_cstr
  @brief Create a `str_t` from a NUL-terminated C string (ASCII).
@@ -147,7 +175,8 @@ str_t str_make_ascii(str_t s);
 /*!
  @function str_make_utf16
  @brief Convert a `str_t` to a wide (wchar_t) representation.
- @discussion If the string is already wide this returns a duplicate.
+ @discussion If the string is already wide this returns a duplicate. ASCII
+    strings are widened byte for byte and UTF-8 strings are decoded.
  @param s The source `str_t`.
  @return A new wide `str_t` or NULL on failure.
 */
@@ -157,7 +186,7 @@ str_t str_make_utf16(str_t s);
  @function str_raw_cstr
  @brief Return a raw NUL-terminated C string pointer for ASCII `str_t`.
  @param s The `str_t` handle.
- @return Pointer to NUL-terminated char data when ASCII, otherwise NULL.
+ @return Pointer to NUL-terminated char data when ASCII or UTF-8, otherwise NULL.
 */
 const char* str_raw_cstr(const str_t s);
 
@@ -185,18 +214,131 @@ bool str_is_ascii(const str_t s);
 */
 bool str_is_utf16(const str_t s);
 
+/* UTF-8 */
+/*!
+ @function str_from_utf8
+ @brief Create a UTF-8 `str_t` from a NUL-terminated C string.
+ @discussion The input is validated first; overlong encodings, surrogates
+     and code points above U+10FFFF are rejected.
+ @param cstr NUL-terminated UTF-8 string.
+ @return A new UTF-8 `str_t`, or NULL if the input is not valid UTF-8.
+*/
+str_t str_from_utf8(const char *cstr);
+
+/*!
+ @function str_from_utf8_n
+ @brief Create a UTF-8 `str_t` from a byte buffer of known length.
+ @param data UTF-8 bytes (need not be NUL-terminated).
+ @param len Number of bytes.
+ @return A new UTF-8 `str_t`, or NULL if the input is not valid UTF-8.
+*/
+str_t str_from_utf8_n(const char *data, size_t len);
+
+/*!
+ @function str_make_utf8
+ @brief Convert a `str_t` to a UTF-8 representation.
+ @discussion ASCII strings are copied as-is, wide strings are encoded from
+     UTF-16 or UTF-32 depending on the size of `wchar_t`.
+ @param s The source `str_t`.
+ @return A new UTF-8 `str_t`, or NULL if a wide string holds invalid code points.
+*/
+str_t str_make_utf8(str_t s);
+
+/*!
+ @function str_is_utf8
+ @brief Query whether the `str_t` stores UTF-8 encoded characters.
+ @param s The `str_t` handle.
+ @return true when UTF-8, false otherwise.
+*/
+bool str_is_utf8(const str_t s);
+
+/*!
+ @function str_utf8_length
+ @brief Count the code points in a `str_t`.
+ @discussion For UTF-8 strings this counts code points, for other types it
+     is the same as `str_length`.
+ @param s The `str_t` handle.
+ @return Number of code points.
+*/
+size_t str_utf8_length(const str_t s);
+
+/*!
+ @function str_utf8_valid
+ @brief Validate a buffer as UTF-8.
+ @discussion Runs of ASCII are skipped 32 bytes at a time with SSE2 when
+     available; only multi-byte sequences are decoded individually.
+ @param data Bytes to validate.
+ @param len Number of bytes.
+ @return true when the buffer is well-formed UTF-8.
+*/
+bool str_utf8_valid(const char *data, size_t len);
+
+/*!
+ @function str_utf8_count
+ @brief Count code points in a UTF-8 buffer (assumed valid).
+ @param data UTF-8 bytes.
+ @param len Number of bytes.
+ @return Number of code points.
+*/
+size_t str_utf8_count(const char *data, size_t len);
+
+/*!
+ @function str_utf8_to_utf16
+ @brief Transcode UTF-8 to UTF-16.
+ @param src UTF-8 bytes.
+ @param len Number of bytes.
+ @param dst Output buffer, or NULL to only compute the required size.
+ @return Number of UTF-16 units written, or (size_t)-1 on malformed input.
+*/
+size_t str_utf8_to_utf16(const char *src, size_t len, uint16_t *dst);
+
+/*!
+ @function str_utf8_to_utf32
+ @brief Transcode UTF-8 to UTF-32.
+ @param src UTF-8 bytes.
+ @param len Number of bytes.
+ @param dst Output buffer, or NULL to only compute the required size.
+ @return Number of code points written, or (size_t)-1 on malformed input.
+*/
+size_t str_utf8_to_utf32(const char *src, size_t len, uint32_t *dst);
+
+/*!
+ @function str_utf16_to_utf8
+ @brief Transcode UTF-16 to UTF-8.
+ @param src UTF-16 units.
+ @param len Number of units.
+ @param dst Output buffer, or NULL to only compute the required size.
+ @return Number of bytes written, or (size_t)-1 on unpaired surrogates.
+*/
+size_t str_utf16_to_utf8(const uint16_t *src, size_t len, char *dst);
+
+/*!
+ @function str_utf32_to_utf8
+ @brief Transcode UTF-32 to UTF-8.
+ @param src Code points.
+ @param len Number of code points.
+ @param dst Output buffer, or NULL to only compute the required size.
+ @return Number of bytes written, or (size_t)-1 on invalid code points.
+*/
+size_t str_utf32_to_utf8(const uint32_t *src, size_t len, char *dst);
+
 /* Mutating operations */
 /*!
  @function str_resize
  @brief Resize a `str_t` in-place to new length (truncates or extends with NUL).
  @param s Pointer to the `str_t` handle to resize.
+ @discussion Shrinking always succeeds. When growing fails the string is
+     left as it was.
  @param new_len New length in characters (not including NUL).
+ @return false if the string is read-only or memory could not be allocated.
 */
-void str_resize(str_t* s, size_t new_len);
+bool str_resize(str_t* s, size_t new_len);
 
 /*!
  @function str_copy
- @brief Copy the contents of src into dest. Both must be the same underlying type.
+ @brief Copy the contents of src into dest.
+ @discussion Both must be narrow (ASCII or UTF-8) or both wide. Copying a
+     UTF-8 string makes dest UTF-8.
  @param dest Destination `str_t` data pointer.
  @param src Source `str_t`.
 */
@@ -205,6 +347,8 @@ void str_copy(str_t dest, const str_t src);
 /*!
  @function str_concat
  @brief Concatenate src to the end of *dest (dest is resized as needed).
+ @discussion ASCII and UTF-8 strings can be mixed freely; the result is
+     UTF-8 when either side is. Wide and narrow strings are not converted.
  @param dest Pointer to destination `str_t` handle.
  @param src Source `str_t` to append.
 */
@@ -213,7 +357,10 @@ void str_concat(str_t* dest, const str_t src);
 /*!
  @function str_append_char
  @brief Append a single ASCII character to an ASCII `str_t`.
- @param s Pointer to an ASCII `str_t`.
+ @discussion On a UTF-8 string bytes of 0x80 and above are rejected, since a
+     lone byte is not a valid character. Append encoded characters with
+     `str_concat` instead.
+ @param s Pointer to an ASCII or UTF-8 `str_t`.
  @param c Character to append.
 */
 void str_append_char(str_t* s, char c);
@@ -221,6 +368,7 @@ void str_append_char(str_t* s, char c);
 /*!
  @function str_insert
  @brief Insert substr into *s at position pos.
+ @discussion Type rules follow `str_concat`.
  @param s Pointer to destination `str_t` handle.
  @param pos Insertion index (must be <= length).
  @param substr Substring to insert.
@@ -247,15 +395,20 @@ void str_replace(str_t* s, const str_t old_sub, const str_t new_sub);
 
 /*!
  @function str_trim
- @brief Trim leading and trailing whitespace (ASCII only) from *s.
- @param s Pointer to ASCII `str_t`.
+ @brief Trim leading and trailing ASCII whitespace from *s.
+ @discussion Space, tab, newline, vertical tab, form feed and carriage
+     return are removed. The string is shortened in place; heap strings keep
+     their allocation.
+ @param s Pointer to `str_t`.
 */
 void str_trim(str_t* s);
 
 /*!
  @function str_to_upper
  @brief Convert the string in-place to upper-case.
- @discussion Works for ASCII and wide strings.
+ @discussion ASCII and UTF-8 strings have their ASCII letters converted 16
+     or 32 bytes at a time, independent of the current locale. Wide strings
+     use `towupper` outside the ASCII range.
  @param s Pointer to `str_t`.
 */
 void str_to_upper(str_t* s);
@@ -263,7 +416,7 @@ void str_to_upper(str_t* s);
 /*!
  @function str_to_lower
  @brief Convert the string in-place to lower-case.
- @discussion Works for ASCII and wide strings.
+ @discussion See `str_to_upper`; the same rules apply.
  @param s Pointer to `str_t`.
 */
 void str_to_lower(str_t* s);
@@ -272,6 +425,8 @@ void str_to_lower(str_t* s);
 /*!
  @function str_cmp
  @brief Compare two `str_t` values. Returns <0, 0, >0 similar to strcmp/wcscmp.
+ @discussion ASCII and UTF-8 strings compare by their bytes. A narrow string
+     orders before a wide one.
  @param a First string.
  @param b Second string.
 */
@@ -280,12 +435,43 @@ int str_cmp(const str_t a, const str_t b);
 /*!
  @function str_equal
  @brief Equality test between two `str_t` values.
+ @discussion Identical handles (such as strings interned in the same pool)
+     compare equal without touching their contents, and strings whose
+     cached hashes (see `str_hash`) differ are rejected without a memcmp.
  @param a First string.
  @param b Second string.
  @return true when equal, false otherwise.
 */
 bool str_equal(const str_t a, const str_t b);
 
+/*!
+ @function str_hash
+ @brief Hash the contents of a string, caching the result in its header.
+ @discussion The hash is computed on first use and stored next to the
+     length, so later calls and `str_equal` get it for free. Every mutating
+     function drops the cached value. Code that writes through the raw
+     data pointer of a hashed string must call a mutator (or `str_dup` the
+     string) before relying on the hash again. The value equals
+     `str_hash_bytes(s, size_in_bytes, 0)`. Several threads may hash and
+     compare the same string at once; the cache is filled with atomic
+     stores. Mutating a string while others read it is still a race.
+ @param s The string to hash.
+ @return A 64-bit hash.
+*/
+uint64_t str_hash(const str_t s);
+
+/*!
+ @function str_hash_bytes
+ @brief Hash an arbitrary byte range with the string library's hash.
+ @discussion The signature matches `table_hash_fn` from paul_table.h, so it
+     can be passed directly as a table's hash function.
+ @param data Bytes to hash.
+ @param len Number of bytes.
+ @param seed Seed value.
+ @return A 64-bit hash.
+*/
+uint64_t str_hash_bytes(const void *data, size_t len, uint32_t seed);
+
 /*!
  @function str_find
  @brief Find the first occurrence of substr in s.
@@ -295,6 +481,37 @@ bool str_equal(const str_t a, const str_t b);
 */
 size_t str_find(const str_t s, const str_t substr);
 
+/*!
+ @function str_casecmp
+ @brief Compare two `str_t` values ignoring ASCII case.
+ @discussion Only the letters A-Z/a-z are folded, so the result does not
+     depend on the locale. Narrow and wide strings order as in `str_cmp`.
+ @param a First string.
+ @param b Second string.
+ @return <0, 0 or >0 like `str_cmp`.
+*/
+int str_casecmp(const str_t a, const str_t b);
+
+/*!
+ @function str_casefind
+ @brief Find the first occurrence of substr in s ignoring ASCII case.
+ @param s The string to search.
+ @param substr The substring to find.
+ @return Index of first match or (size_t)-1 if not found.
+*/
+size_t str_casefind(const str_t s, const str_t substr);
+
+/*!
+ @function str_casehash
+ @brief Hash a string with ASCII case folded.
+ @discussion Strings that compare equal under `str_casecmp` hash to the
+     same value, which makes this suitable for case-insensitive lookup keys
+     such as header names.
+ @param s The string to hash.
+ @return A 64-bit hash.
+*/
+uint64_t str_casehash(const str_t s);
+
 /*!
  @function str_find_char
  @brief Find the first occurrence of ASCII character c in s (ASCII only).
@@ -326,6 +543,9 @@ bool str_ends_with(const str_t s, const str_t suffix);
      character classes like [a-z] or [^aeiou].
  @discussion This is the ASCII helper invoked by the `str_wildcard` macro
      when `_Generic` is available and the argument is an ASCII `const char *`.
+     The pattern is re-parsed on every call; compile it once with
+     `str_glob_compile` when it is matched repeatedly. A '[' with no
+     closing ']' matches a literal '['.
  @param s The ASCII `str_t` to test.
  @param pattern NUL-terminated pattern using ASCII characters.
  @return true on match, false otherwise.
@@ -369,462 +589,5156 @@ char str_char_at(const str_t s, size_t index);
 */
 wchar_t str_wchar_at(const str_t s, size_t index);
 
-#ifdef __cplusplus
-}
-#endif
-#endif // PAUL_STRING_H
+/* Views and tokenizing */
+/*!
+ @typedef str_view_t
+ @brief Non-owning view over a run of narrow characters.
+ @discussion
+    A view is a pointer and a length; it does not own its data and is not
+    NUL-terminated. Views returned by the split iterators point into the
+    string they were created from and stay valid for as long as it does.
+ @field data Pointer to the first character.
+ @field length Number of characters in the view.
+*/
+typedef struct str_view {
+    const char *data;
+    size_t length;
+} str_view_t;
 
-#if defined(PAUL_STRING_IMPLEMENTATION) || defined(PAUL_IMPLEMENTATION)
-typedef struct str_header {
-    uint32_t type;
-    uint32_t length;
-    char data[];
-} str_header_t;
+/*!
+ @typedef str_split_t
+ @brief Iterator state for `str_split_*` tokenizers.
+ @discussion
+    Created by one of the `str_split_*` constructors and advanced with
+    `str_split_next`. The iterator never allocates; every token is a view
+    into the source. Fields are internal and should not be modified.
+*/
+typedef struct str_split {
+    const char *cursor;
+    const char *end;
+    const char *delim;
+    size_t delim_len;
+    int mode;
+    bool done;
+    uint8_t set[32];
+} str_split_t;
 
-typedef struct wstr_header {
-    uint32_t type;
-    uint32_t length;
-    wchar_t data[];
-} wstr_header_t;
+/*!
+ @function str_view
+ @brief Create a view over an ASCII `str_t`.
+ @param s The `str_t` handle.
+ @return A view of the whole string, or an empty view if `s` is wide.
+*/
+str_view_t str_view(const str_t s);
 
-/* Helper macros to access string header fields */
-#define STR_TYPE(s) (*(uint32_t *)((char *)(s) - 8))
-#define STR_LENGTH(s) (*(uint32_t *)((char *)(s) - 4))
-#define STR_HEADER_SIZE(type) ((type) == 0 ? sizeof(str_header_t) : sizeof(wstr_header_t))
-#define STR_ELEM_SIZE(type) ((type) == 0 ? sizeof(char) : sizeof(wchar_t))
+/*!
+ @function str_view_cstr
+ @brief Create a view over a NUL-terminated C string.
+ @param cstr NUL-terminated string.
+ @return A view of `cstr` (not including the NUL).
+*/
+str_view_t str_view_cstr(const char *cstr);
 
-static str_t _make_ascii(const char *s, size_t len) {
-    struct str_header *h = (struct str_header *)malloc(sizeof(struct str_header) + (len + 1) * sizeof(char));
-    h->type = 0;
-    h->length = (uint32_t)len;
-    memcpy(h->data, s, len);
-    h->data[len] = '\0';
-    return (str_t)h->data;
-}
+/*!
+ @function str_view_equal
+ @brief Compare two views byte for byte.
+ @param a First view.
+ @param b Second view.
+ @return true when both views have the same length and contents.
+*/
+bool str_view_equal(str_view_t a, str_view_t b);
 
-static str_t _make_utf16(const wchar_t *s, size_t len) {
-    struct wstr_header *h = (struct wstr_header *)malloc(sizeof(struct wstr_header) + (len + 1) * sizeof(wchar_t));
-    h->type = 1;
-    h->length = (uint32_t)len;
-    memcpy(h->data, s, len * sizeof(wchar_t));
-    h->data[len] = L'\0';
-    return (str_t)h->data;
-}
+/*!
+ @function str_from_view
+ @brief Copy a view into a new ASCII `str_t`.
+ @param v The view to copy.
+ @return A new `str_t` owning a copy of the view.
+*/
+str_t str_from_view(str_view_t v);
 
-static str_t _str_dup(const str_t *s, size_t header_size, size_t elem_size) {
-    void *p = *s;
-    void *header_start = (char *)p - header_size;
-    uint32_t len = STR_LENGTH(p);
-    size_t alloc_sz = header_size + (len + 1) * elem_size;
-    void *new_p = malloc(alloc_sz);
-    memcpy(new_p, header_start, alloc_sz);
-    return (str_t)((char *)new_p + header_size);
-}
+/*!
+ @function str_split_char
+ @brief Split a view on a single delimiter character.
+ @discussion Consecutive delimiters produce empty tokens, so a source with
+     n delimiters always yields n+1 tokens (an empty source yields one
+     empty token).
+ @param v The view to split.
+ @param delim The delimiter character.
+ @return A new iterator, advance it with `str_split_next`.
+*/
+str_split_t str_split_char(str_view_t v, char delim);
 
-str_t str_dup(const str_t s) {
-    uint32_t type = STR_TYPE(s);
-    return type == 0 ? _str_dup(&s, sizeof(str_header_t), sizeof(char)) : _str_dup(&s, sizeof(wstr_header_t), sizeof(wchar_t));
-}
+/*!
+ @function str_split_str
+ @brief Split a view on a multi-character delimiter.
+ @discussion Token semantics match `str_split_char`. An empty delimiter
+     yields the whole source as a single token.
+ @param v The view to split.
+ @param delim NUL-terminated delimiter; must outlive the iterator.
+ @return A new iterator, advance it with `str_split_next`.
+*/
+str_split_t str_split_str(str_view_t v, const char *delim);
 
-str_t str_from_cstr(const char *cstr) {
-    return _make_ascii(cstr, strlen(cstr));
-}
+/*!
+ @function str_split_any
+ @brief Split a view on any character from a set.
+ @discussion Token semantics match `str_split_char`, with every character
+     in `set` acting as a delimiter.
+ @param v The view to split.
+ @param set NUL-terminated set of delimiter characters; must outlive the iterator.
+ @return A new iterator, advance it with `str_split_next`.
+*/
+str_split_t str_split_any(str_view_t v, const char *set);
 
-str_t str_from_wcstr(const wchar_t *cstr) {
-    return _make_utf16(cstr, wcslen(cstr));
-}
+/*!
+ @function str_split_lines
+ @brief Iterate over the lines of a view.
+ @discussion Lines are terminated by "\n" or "\r\n"; the terminator is not
+     part of the token. A trailing terminator does not produce an extra
+     empty line, and an empty source yields no lines.
+ @param v The view to split.
+ @return A new iterator, advance it with `str_split_next`.
+*/
+str_split_t str_split_lines(str_view_t v);
 
-str_t str_make_ascii(str_t s) {
-    uint32_t type = STR_TYPE(s);
-    uint32_t len = STR_LENGTH(s);
-    if (type == 0)
-        return str_dup(s);
-    else
-    {
-        // Convert wide to narrow, assume ASCII
-        const wchar_t *ws = (const wchar_t *)s;
-        char *narrow = (char *)malloc(len + 1);
-        for (size_t i = 0; i < len; i++) {
-            if (ws[i] > 127) {
-                free(narrow);
-                return NULL; // Cannot convert
-            }
-            narrow[i] = (char)ws[i];
-        }
-        narrow[len] = '\0';
-        str_t result = _make_ascii(narrow, len);
-        free(narrow);
-        return result;
-    }
-}
+/*!
+ @function str_split_next
+ @brief Advance a split iterator.
+ @param it Iterator created by one of the `str_split_*` functions.
+ @param out Receives the next token.
+ @return true when a token was produced, false once the source is exhausted.
+*/
+bool str_split_next(str_split_t *it, str_view_t *out);
 
-str_t str_make_utf16(str_t s) {
-    uint32_t type = STR_TYPE(s);
-    uint32_t len = STR_LENGTH(s);
-    if (type == 1)
-        return str_dup(s);
-    else
-    {
-        // Convert narrow to wide
-        const char *ns = (const char *)s;
-        wchar_t *wide = (wchar_t *)malloc((len + 1) * sizeof(wchar_t));
-        for (size_t i = 0; i < len; i++)
-            wide[i] = (wchar_t)ns[i];
-        wide[len] = L'\0';
-        str_t result = _make_utf16(wide, len);
-        free(wide);
-        return result;
-    }
-}
+/* Compiled globs */
+/*!
+ @typedef str_glob_t
+ @brief Opaque compiled glob pattern.
+ @discussion
+    Created by `str_glob_compile` from the same syntax as
+    `str_wildcard_ascii`. The pattern is split at every `*` into segments,
+    and each segment is compiled into per-byte bitmasks so that literals,
+    `?` and `[...]` classes are all tested with a single table lookup. The
+    first and last segments are checked in place at the ends of the
+    subject. Middle segments are located leftmost-first with a bit-parallel
+    (Shift-And) scan that skips ahead with `memchr` while no partial match
+    is live. Because every segment is searched only once, matching is
+    linear in the length of the subject, with no backtracking. A compiled
+    glob is immutable, so it can be shared between threads.
+*/
+typedef struct str_glob str_glob_t;
 
-const char *str_raw_cstr(const str_t s) {
-    uint32_t type = STR_TYPE(s);
-    return type == 0 ? (const char *)s : NULL;
-}
+/*!
+ @function str_glob_compile
+ @brief Compile a glob pattern for repeated matching.
+ @discussion Matching is byte-wise, so `?` matches a single byte of a
+     UTF-8 string.
+ @param pattern NUL-terminated pattern using '*', '?' and [...] classes.
+ @return A compiled pattern, or NULL on allocation failure.
+*/
+str_glob_t *str_glob_compile(const char *pattern);
 
-const wchar_t *str_raw_wcstr(const str_t s) {
-    uint32_t type = STR_TYPE(s);
-    return type == 1 ? (const wchar_t *)s : NULL;
-}
+/*!
+ @function str_glob_free
+ @brief Release a compiled pattern.
+ @param glob The pattern returned by `str_glob_compile`.
+*/
+void str_glob_free(str_glob_t *glob);
 
-bool str_is_ascii(const str_t s) {
-    uint32_t type = STR_TYPE(s);
-    return type == 0;
-}
+/*!
+ @function str_glob_match
+ @brief Match an ASCII or UTF-8 `str_t` against a compiled pattern.
+ @param glob The compiled pattern.
+ @param s The string to test.
+ @return true on match, false otherwise (always false for wide strings).
+*/
+bool str_glob_match(const str_glob_t *glob, const str_t s);
 
-bool str_is_utf16(const str_t s) {
-    uint32_t type = STR_TYPE(s);
-    return type == 1;
-}
+/*!
+ @function str_glob_match_view
+ @brief Match a view against a compiled pattern.
+ @param glob The compiled pattern.
+ @param v The bytes to test.
+ @return true on match, false otherwise.
+*/
+bool str_glob_match_view(const str_glob_t *glob, str_view_t v);
 
-void str_resize(str_t *s, size_t new_len) {
-    uint32_t type = STR_TYPE(*s);
-    uint32_t old_len = STR_LENGTH(*s);
-    size_t header_size = STR_HEADER_SIZE(type);
-    size_t elem_size = STR_ELEM_SIZE(type);
-    size_t new_alloc_sz = header_size + (new_len + 1) * elem_size;
-    void *new_p = realloc((char *)*s - header_size, new_alloc_sz);
-    void *new_data = (char *)new_p + header_size;
-    STR_LENGTH(new_data) = (uint32_t)new_len;
-    if (type == 0)
-        ((char *)new_data)[new_len] = '\0';
-    else
-        ((wchar_t *)new_data)[new_len] = L'\0';
-    *s = (str_t)new_data;
-}
+/*!
+ @function str_glob_match_batch
+ @brief Match one compiled pattern against many strings.
+ @discussion Strings shorter than the pattern's minimum length are
+     rejected from their header alone, without touching the contents.
+ @param glob The compiled pattern.
+ @param strs Array of strings to test.
+ @param count Number of entries in `strs`.
+ @param results Optional array of `count` entries that receives each result.
+ @return The number of strings that matched.
+*/
+size_t str_glob_match_batch(const str_glob_t *glob, const str_t *strs, size_t count, bool *results);
 
-void str_copy(str_t dest, const str_t src) {
-    uint32_t type_dest = STR_TYPE(dest);
-    uint32_t type_src = STR_TYPE(src);
-    if (type_dest != type_src)
-        return; // or handle conversion
-    uint32_t len_src = STR_LENGTH(src);
-    size_t elem_size = STR_ELEM_SIZE(type_dest);
-    memcpy((void *)dest, (void *)src, len_src * elem_size);
-    if (type_dest == 0)
-        ((char *)dest)[len_src] = '\0';
-    else
-        ((wchar_t *)dest)[len_src] = L'\0';
-    STR_LENGTH(dest) = len_src;
-}
+/* Arenas */
+/*!
+ @typedef str_arena_t
+ @brief Opaque bump allocator for request-scoped strings.
+ @discussion
+    Strings created in an arena are carved out of large chunks and are
+    released together by a single `str_arena_reset`, so per-request string
+    churn never reaches the general purpose allocator. Arena strings are
+    ordinary `str_t` handles: every API function accepts them and mutators
+    that change the length reallocate inside the same arena (growing in
+    place when the string is the most recent allocation). `str_dup` of an
+    arena string returns a heap string. An arena is not thread-safe.
+*/
+typedef struct str_arena str_arena_t;
 
-void str_concat(str_t *dest, const str_t src) {
-    uint32_t type_dest = STR_TYPE(*dest);
-    uint32_t type_src = STR_TYPE(src);
-    if (type_dest != type_src)
-        return;
-    uint32_t len_dest = STR_LENGTH(*dest);
-    uint32_t len_src = STR_LENGTH(src);
-    size_t new_len = len_dest + len_src;
-    str_resize(dest, new_len);
-    size_t elem_size = STR_ELEM_SIZE(type_dest);
-    memcpy((char *)*dest + len_dest * elem_size, (void *)src, len_src * elem_size);
-}
+/*!
+ @function str_arena_create
+ @brief Create an empty arena.
+ @param chunk_size Size in bytes of each chunk, or 0 for `STR_ARENA_CHUNK_SIZE`.
+ @return A new arena, or NULL on allocation failure.
+*/
+str_arena_t *str_arena_create(size_t chunk_size);
 
-void str_append_char(str_t *s, char c) {
-    uint32_t type = STR_TYPE(*s);
-    if (type != 0)
-        return; // only for ASCII
-    uint32_t len = STR_LENGTH(*s);
-    str_resize(s, len + 1);
-    ((char *)*s)[len] = c;
-}
+/*!
+ @function str_arena_reset
+ @brief Release every string allocated from an arena.
+ @discussion One chunk is kept for reuse so a steady request loop does not
+     allocate at all once warmed up. All strings created from the arena
+     become invalid.
+ @param arena The arena to reset.
+*/
+void str_arena_reset(str_arena_t *arena);
 
-void str_insert(str_t *s, size_t pos, const str_t substr) {
-    uint32_t type_s = STR_TYPE(*s);
-    uint32_t type_sub = STR_TYPE(substr);
-    if (type_s != type_sub)
-        return;
-    uint32_t len_s = STR_LENGTH(*s);
-    uint32_t len_sub = STR_LENGTH(substr);
-    if (pos > len_s)
-        return;
-    size_t new_len = len_s + len_sub;
-    str_resize(s, new_len);
-    size_t elem_size = STR_ELEM_SIZE(type_s);
-    memmove((char *)*s + (pos + len_sub) * elem_size, (char *)*s + pos * elem_size, (len_s - pos) * elem_size);
-    memcpy((char *)*s + pos * elem_size, (void *)substr, len_sub * elem_size);
-}
+/*!
+ @function str_arena_destroy
+ @brief Destroy an arena and every string allocated from it.
+ @param arena The arena to destroy.
+*/
+void str_arena_destroy(str_arena_t *arena);
 
-void str_erase(str_t *s, size_t pos, size_t len) {
-    uint32_t type = STR_TYPE(*s);
-    uint32_t len_s = STR_LENGTH(*s);
-    if (pos >= len_s || len == 0)
-        return;
-    if (pos + len > len_s)
-        len = len_s - pos;
-    size_t elem_size = STR_ELEM_SIZE(type);
-    memmove((char *)*s + pos * elem_size, (char *)*s + (pos + len) * elem_size, (len_s - pos - len) * elem_size);
-    str_resize(s, len_s - len);
-}
+/*!
+ @function str_arena_from_cstr
+ @brief Create an ASCII `str_t` inside an arena.
+ @param arena The arena that owns the string.
+ @param cstr NUL-terminated string.
+ @return The new `str_t`, or NULL on allocation failure.
+*/
+str_t str_arena_from_cstr(str_arena_t *arena, const char *cstr);
 
-void str_replace(str_t *s, const str_t old_sub, const str_t new_sub) {
-    // Simplified: find and replace first occurrence
-    size_t pos = str_find(*s, old_sub);
-    if (pos != (size_t)-1) {
-        uint32_t len_old = STR_LENGTH(old_sub);
-        str_erase(s, pos, len_old);
-        str_insert(s, pos, new_sub);
+/*!
+ @function str_arena_from_wcstr
+ @brief Create a wide `str_t` inside an arena.
+ @param arena The arena that owns the string.
+ @param wcstr NUL-terminated wide string.
+ @return The new `str_t`, or NULL on allocation failure.
+*/
+str_t str_arena_from_wcstr(str_arena_t *arena, const wchar_t *wcstr);
+
+/*!
+ @function str_arena_from_view
+ @brief Create an ASCII `str_t` inside an arena from a view.
+ @param arena The arena that owns the string.
+ @param v The bytes to copy.
+ @return The new `str_t`, or NULL on allocation failure.
+*/
+str_t str_arena_from_view(str_arena_t *arena, str_view_t v);
+
+/*!
+ @function str_arena_dup
+ @brief Copy any `str_t` into an arena, preserving its type.
+ @param arena The arena that owns the copy.
+ @param s The string to copy.
+ @return The new `str_t`, or NULL on allocation failure.
+*/
+str_t str_arena_dup(str_arena_t *arena, const str_t s);
+
+/* Interning */
+/*!
+ @typedef str_pool_t
+ @brief Opaque intern table that owns canonical copies of strings.
+ @discussion
+    Interned strings live in large contiguous chunks owned by the pool and
+    carry a precomputed hash in their header. Within one pool equal
+    contents always map to the same `str_t`, so equality is a pointer
+    comparison. Interned strings are immutable: mutating functions ignore
+    them, and they are released all at once by `str_pool_destroy`. A pool
+    is not thread-safe.
+*/
+typedef struct str_pool str_pool_t;
+
+/*!
+ @function str_pool_create
+ @brief Create an empty intern pool.
+ @return A new pool, or NULL on allocation failure.
+*/
+str_pool_t *str_pool_create(void);
+
+/*!
+ @function str_pool_destroy
+ @brief Destroy a pool and every string interned in it.
+ @param pool The pool to destroy.
+*/
+void str_pool_destroy(str_pool_t *pool);
+
+/*!
+ @function str_pool_count
+ @brief Number of distinct strings held by a pool.
+ @param pool The pool.
+ @return The number of interned strings.
+*/
+size_t str_pool_count(const str_pool_t *pool);
+
+/*!
+ @function str_intern
+ @brief Return the canonical copy of a `str_t` in a pool.
+ @discussion The type (ASCII, UTF-8 or wide) is part of the identity.
+ @param pool The pool.
+ @param s The string to intern; it is not consumed.
+ @return The pool-owned `str_t`, or NULL on allocation failure.
+*/
+str_t str_intern(str_pool_t *pool, const str_t s);
+
+/*!
+ @function str_intern_cstr
+ @brief Return the canonical ASCII `str_t` for a C string.
+ @param pool The pool.
+ @param cstr NUL-terminated string.
+ @return The pool-owned `str_t`, or NULL on allocation failure.
+*/
+str_t str_intern_cstr(str_pool_t *pool, const char *cstr);
+
+/*!
+ @function str_intern_view
+ @brief Return the canonical ASCII `str_t` for a view.
+ @discussion Useful together with the split iterators, since no temporary
+     `str_t` has to be created for tokens that are already interned.
+ @param pool The pool.
+ @param v The view to intern.
+ @return The pool-owned `str_t`, or NULL on allocation failure.
+*/
+str_t str_intern_view(str_pool_t *pool, str_view_t v);
+
+/*!
+ @function str_is_interned
+ @brief Query whether a `str_t` is owned by an intern pool.
+ @param s The `str_t` handle.
+ @return true when interned, false otherwise.
+*/
+bool str_is_interned(const str_t s);
+
+/* Small strings */
+#ifndef STR_SSO_CAPACITY
+#define STR_SSO_CAPACITY 23
+#endif
+
+/*!
+ @typedef sstr_t
+ @brief Fixed-size string value with inline storage for short strings.
+ @discussion
+    An `sstr_t` is a `STR_SSO_CAPACITY + 1` byte value (24 bytes by
+    default) that stores strings of up to `STR_SSO_CAPACITY` bytes inline,
+    without touching the heap. Longer strings are kept in an ordinary heap
+    `str_t` referenced from the handle. The last byte doubles as the inline
+    length tag and, for full-length strings, as the NUL terminator. Unused
+    inline bytes are always zero, so two inline strings compare equal
+    exactly when their handles are byte-identical. An `sstr_t` is a plain
+    value: it can be stored directly in arrays and structs. It must be
+    released with `sstr_free` once it may have spilled to the heap.
+    Contents are narrow bytes (ASCII or UTF-8).
+*/
+typedef struct sstr {
+    char buf[STR_SSO_CAPACITY + 1];
+} sstr_t;
+
+/*!
+ @function sstr_from_cstr
+ @brief Create a small string from a NUL-terminated C string.
+ @param cstr NUL-terminated string.
+ @return The new value, or an empty value if a long string could not be allocated.
+*/
+sstr_t sstr_from_cstr(const char *cstr);
+
+/*!
+ @function sstr_from_view
+ @brief Create a small string from a view.
+ @param v The bytes to copy.
+ @return The new value.
+*/
+sstr_t sstr_from_view(str_view_t v);
+
+/*!
+ @function sstr_from_str
+ @brief Create a small string from an ASCII or UTF-8 `str_t`.
+ @discussion Wide strings produce an empty value.
+ @param s The string to copy.
+ @return The new value.
+*/
+sstr_t sstr_from_str(const str_t s);
+
+/*!
+ @function sstr_to_str
+ @brief Copy a small string into a new heap `str_t`.
+ @discussion A spilled string keeps the type of its heap copy. Inline
+     contents are UTF-8 when any byte is >= 0x80 and ASCII otherwise.
+ @param s The small string.
+ @return A new `str_t`, or NULL on allocation failure.
+*/
+str_t sstr_to_str(const sstr_t *s);
+
+/*!
+ @function sstr_dup
+ @brief Duplicate a small string.
+ @param s The small string.
+ @return An independent copy.
+*/
+sstr_t sstr_dup(const sstr_t *s);
+
+/*!
+ @function sstr_free
+ @brief Release any heap storage held by a small string and reset it to empty.
+ @param s The small string.
+*/
+void sstr_free(sstr_t *s);
+
+/*!
+ @function sstr_is_inline
+ @brief Query whether a small string is stored inline.
+ @param s The small string.
+ @return true when no heap storage is used.
+*/
+bool sstr_is_inline(const sstr_t *s);
+
+/*!
+ @function sstr_length
+ @brief Get the length of a small string in bytes.
+ @param s The small string.
+ @return The number of bytes (not including NUL).
+*/
+size_t sstr_length(const sstr_t *s);
+
+/*!
+ @function sstr_cstr
+ @brief Get a NUL-terminated pointer to the contents.
+ @discussion The pointer is invalidated by any function that modifies `s`
+     and, for inline strings, by moving the `sstr_t` value itself.
+ @param s The small string.
+ @return Pointer to the contents.
+*/
+const char *sstr_cstr(const sstr_t *s);
+
+/*!
+ @function sstr_view
+ @brief Create a view over a small string.
+ @param s The small string.
+ @return A view of the contents, with the same lifetime rules as `sstr_cstr`.
+*/
+str_view_t sstr_view(const sstr_t *s);
+
+/*!
+ @function sstr_char_at
+ @brief Get the byte at the specified index.
+ @param s The small string.
+ @param index The index (0-based).
+ @return The byte, or 0 if out of bounds.
+*/
+char sstr_char_at(const sstr_t *s, size_t index);
+
+/*!
+ @function sstr_append
+ @brief Append bytes to a small string, spilling to the heap when it outgrows the inline buffer.
+ @param s The small string.
+ @param v The bytes to append.
+*/
+void sstr_append(sstr_t *s, str_view_t v);
+
+/*!
+ @function sstr_append_char
+ @brief Append one byte to a small string.
+ @param s The small string.
+ @param c The byte to append.
+*/
+void sstr_append_char(sstr_t *s, char c);
+
+/*!
+ @function sstr_cmp
+ @brief Compare two small strings bytewise.
+ @param a First string.
+ @param b Second string.
+ @return <0, 0 or >0 like `str_cmp`.
+*/
+int sstr_cmp(const sstr_t *a, const sstr_t *b);
+
+/*!
+ @function sstr_equal
+ @brief Equality test between two small strings.
+ @discussion Inline strings are compared as whole handles, without a
+     length or byte loop.
+ @param a First string.
+ @param b Second string.
+ @return true when equal, false otherwise.
+*/
+bool sstr_equal(const sstr_t *a, const sstr_t *b);
+
+/*!
+ @function sstr_hash
+ @brief Hash the contents of a small string.
+ @param s The small string.
+ @return A 64-bit hash.
+*/
+uint64_t sstr_hash(const sstr_t *s);
+
+/* Ropes */
+#ifndef STR_ROPE_CHUNK_SIZE
+#define STR_ROPE_CHUNK_SIZE 1024
+#endif
+#ifndef STR_ROPE_MERGE_SIZE
+#define STR_ROPE_MERGE_SIZE (STR_ROPE_CHUNK_SIZE / 2)
+#endif
+#ifndef STR_ROPE_ITER_DEPTH
+#define STR_ROPE_ITER_DEPTH 64
+#endif
+
+/*!
+ @typedef str_rope_t
+ @brief Opaque rope for large, frequently edited narrow text.
+ @discussion
+    A rope stores its text in chunks of at most `STR_ROPE_CHUNK_SIZE`
+    bytes, kept in order by a randomized balanced tree (an implicit treap
+    keyed by position). Insertion, erasure, indexing and concatenation of
+    two ropes are O(log n) in the number of chunks, plus a memmove within
+    a single chunk. An insert that fits in the chunk at the insertion
+    point is done in place. Chunks are allocated to fit their contents and
+    grow by doubling. Where an edit joins two chunks and one of them is
+    shorter than `STR_ROPE_MERGE_SIZE`, they are folded into one if the
+    result fits. Use `str_rope_flatten` to get back an ordinary `str_t`.
+    A rope is not thread-safe.
+*/
+typedef struct str_rope str_rope_t;
+
+/*!
+ @typedef str_rope_iter_t
+ @brief Iterator over the chunks of a rope.
+ @discussion Created by `str_rope_iter` and advanced with
+     `str_rope_iter_next`. The iterator walks the tree with a stack of the
+     chunks still to visit, so each step is O(1) amortized. Any
+     modification of the rope invalidates the views already produced, but
+     the iterator itself keeps working from its current byte offset.
+ @field rope The rope being iterated.
+ @field pos Byte offset of the next chunk.
+ @field version Modification count of the rope when the stack was built.
+ @field depth Number of entries on the stack.
+ @field stack Chunks still to visit, the next one on top.
+*/
+typedef struct str_rope_iter {
+    const str_rope_t *rope;
+    size_t pos;
+    uint64_t version;
+    size_t depth;
+    const struct str_rope_node *stack[STR_ROPE_ITER_DEPTH];
+} str_rope_iter_t;
+
+/*!
+ @function str_rope_create
+ @brief Create an empty rope.
+ @return A new rope, or NULL on allocation failure.
+*/
+str_rope_t *str_rope_create(void);
+
+/*!
+ @function str_rope_from_view
+ @brief Create a rope holding a copy of a view.
+ @param v The initial contents.
+ @return A new rope, or NULL on allocation failure.
+*/
+str_rope_t *str_rope_from_view(str_view_t v);
+
+/*!
+ @function str_rope_destroy
+ @brief Destroy a rope and all of its chunks.
+ @param rope The rope to destroy.
+*/
+void str_rope_destroy(str_rope_t *rope);
+
+/*!
+ @function str_rope_length
+ @brief Get the length of a rope in bytes.
+ @param rope The rope.
+ @return The number of bytes.
+*/
+size_t str_rope_length(const str_rope_t *rope);
+
+/*!
+ @function str_rope_insert
+ @brief Insert bytes at a position.
+ @param rope The rope.
+ @param pos Insertion offset (must be <= length).
+ @param v The bytes to insert.
+ @return true on success, false when pos is out of range or allocation failed (the rope is unchanged).
+*/
+bool str_rope_insert(str_rope_t *rope, size_t pos, str_view_t v);
+
+/*!
+ @function str_rope_append
+ @brief Append bytes to the end of a rope.
+ @param rope The rope.
+ @param v The bytes to append.
+ @return true on success, false on allocation failure.
+*/
+bool str_rope_append(str_rope_t *rope, str_view_t v);
+
+/*!
+ @function str_rope_erase
+ @brief Erase len bytes starting at pos.
+ @discussion The range is clamped to the end of the rope.
+ @param rope The rope.
+ @param pos Start offset.
+ @param len Number of bytes to remove.
+ @return true on success, false on allocation failure (the rope is unchanged).
+*/
+bool str_rope_erase(str_rope_t *rope, size_t pos, size_t len);
+
+/*!
+ @function str_rope_concat
+ @brief Move the contents of src to the end of dest.
+ @discussion No text is copied; the two trees are joined in O(log n).
+     `src` is left empty but must still be destroyed.
+ @param dest The rope to extend.
+ @param src The rope whose contents are moved.
+*/
+void str_rope_concat(str_rope_t *dest, str_rope_t *src);
+
+/*!
+ @function str_rope_char_at
+ @brief Get the byte at a position.
+ @param rope The rope.
+ @param index The index (0-based).
+ @return The byte, or 0 if out of bounds.
+*/
+char str_rope_char_at(const str_rope_t *rope, size_t index);
+
+/*!
+ @function str_rope_iter
+ @brief Start iterating over the chunks of a rope.
+ @param rope The rope.
+ @return An iterator positioned at the first byte.
+*/
+str_rope_iter_t str_rope_iter(const str_rope_t *rope);
+
+/*!
+ @function str_rope_iter_next
+ @brief Produce the next run of contiguous bytes.
+ @param it The iterator.
+ @param out Receives a view into the rope.
+ @return true when a run was produced, false at the end of the rope.
+*/
+bool str_rope_iter_next(str_rope_iter_t *it, str_view_t *out);
+
+/*!
+ @function str_rope_flatten
+ @brief Copy the contents of a rope into a new ASCII `str_t`.
+ @param rope The rope.
+ @return A `str_t` allocated at exactly the rope's length, or NULL on allocation failure.
+*/
+str_t str_rope_flatten(const str_rope_t *rope);
+
+/* Builders */
+/*!
+ @typedef str_builder_t
+ @brief Accumulates output in linked chunks and produces one `str_t` at the end.
+ @discussion
+    Appending never moves text that was already written: when the current
+    chunk is full a new, larger one is linked after it. `str_builder_finish`
+    then copies every chunk once into a `str_t` allocated at exactly the
+    final length. Integers are printed with a two-digits-at-a-time table and
+    doubles with the Ryu shortest round-trip algorithm, without `snprintf`.
+    A builder is a plain value; initialise it with `str_builder_init`.
+ @field head First chunk.
+ @field tail Chunk currently being filled.
+ @field length Total number of bytes appended.
+ @field utf8 Set once non-ASCII text (a UTF-8 or wide string) was appended.
+*/
+typedef struct str_builder_chunk str_builder_chunk_t;
+typedef struct str_builder {
+    str_builder_chunk_t *head;
+    str_builder_chunk_t *tail;
+    size_t length;
+    bool utf8;
+} str_builder_t;
+
+/*!
+ @function str_builder_init
+ @brief Initialise an empty builder.
+ @param b The builder.
+*/
+void str_builder_init(str_builder_t *b);
+
+/*!
+ @function str_builder_free
+ @brief Release a builder's chunks without producing a string.
+ @param b The builder; it is left empty and can be reused.
+*/
+void str_builder_free(str_builder_t *b);
+
+/*!
+ @function str_builder_length
+ @brief Number of bytes appended so far.
+ @param b The builder.
+ @return The current length.
+*/
+size_t str_builder_length(const str_builder_t *b);
+
+/*!
+ @function str_builder_append
+ @brief Append a `str_t`.
+ @discussion Wide strings are encoded as UTF-8.
+ @param b The builder.
+ @param s The string to append.
+ @return true on success, false on allocation failure or malformed wide input.
+*/
+bool str_builder_append(str_builder_t *b, const str_t s);
+
+/*!
+ @function str_builder_append_cstr
+ @brief Append a NUL-terminated C string.
+ @param b The builder.
+ @param cstr The string to append.
+ @return true on success, false on allocation failure.
+*/
+bool str_builder_append_cstr(str_builder_t *b, const char *cstr);
+
+/*!
+ @function str_builder_append_view
+ @brief Append the bytes of a view.
+ @param b The builder.
+ @param v The bytes to append.
+ @return true on success, false on allocation failure.
+*/
+bool str_builder_append_view(str_builder_t *b, str_view_t v);
+
+/*!
+ @function str_builder_append_char
+ @brief Append a single byte.
+ @param b The builder.
+ @param c The byte to append.
+ @return true on success, false on allocation failure.
+*/
+bool str_builder_append_char(str_builder_t *b, char c);
+
+/*!
+ @function str_builder_append_i64
+ @brief Append a signed integer in decimal.
+ @param b The builder.
+ @param v The value.
+ @return true on success, false on allocation failure.
+*/
+bool str_builder_append_i64(str_builder_t *b, int64_t v);
+
+/*!
+ @function str_builder_append_u64
+ @brief Append an unsigned integer in decimal.
+ @param b The builder.
+ @param v The value.
+ @return true on success, false on allocation failure.
+*/
+bool str_builder_append_u64(str_builder_t *b, uint64_t v);
+
+/*!
+ @function str_builder_append_f64
+ @brief Append a double using the shortest digits that round-trip.
+ @discussion The layout follows JavaScript's Number to string rules:
+     plain notation for magnitudes in [1e-6, 1e21), otherwise exponent
+     notation such as `1.5e+21`. Non-finite values print as `NaN`,
+     `Infinity` and `-Infinity`; negative zero prints as `-0`.
+ @param b The builder.
+ @param v The value.
+ @return true on success, false on allocation failure.
+*/
+bool str_builder_append_f64(str_builder_t *b, double v);
+
+/*!
+ @function str_builder_finish
+ @brief Produce the accumulated text as a single `str_t`.
+ @discussion The result is allocated once at exactly the final length and
+     is typed UTF-8 when any appended byte is 0x80 or above, ASCII
+     otherwise. The bytes themselves are not validated. The builder is
+     emptied and can be reused.
+ @param b The builder.
+ @return The new `str_t`, or NULL on allocation failure (the builder is left intact).
+*/
+str_t str_builder_finish(str_builder_t *b);
+
+/* Numbers */
+/*!
+ @function str_to_i64
+ @brief Parse a signed decimal integer from the start of a view.
+ @discussion Accepts an optional `+` or `-` followed by decimal digits.
+     Leading whitespace is not skipped, and the locale is never consulted.
+     Parsing stops at the first non-digit; the caller can compare the
+     return value with `v.length` to require the whole view to match.
+ @param v The text to parse.
+ @param out Receives the value; left untouched on failure.
+ @return The number of bytes consumed, or 0 if there are no digits or the value is out of range.
+*/
+size_t str_to_i64(str_view_t v, int64_t *out);
+
+/*!
+ @function str_to_u64
+ @brief Parse an unsigned decimal integer from the start of a view.
+ @discussion Same rules as `str_to_i64`, except a `-` sign is rejected.
+ @param v The text to parse.
+ @param out Receives the value; left untouched on failure.
+ @return The number of bytes consumed, or 0 if there are no digits or the value is out of range.
+*/
+size_t str_to_u64(str_view_t v, uint64_t *out);
+
+/*!
+ @function str_to_f64
+ @brief Parse a double from the start of a view.
+ @discussion Accepts `[+-]digits[.digits][(e|E)[+-]digits]`, where either
+     the integer or the fraction part may be empty, as well as `inf`,
+     `infinity` and `nan` in any case. The decimal point is always `.`.
+     The result is correctly rounded: most inputs are resolved with the
+     Eisel-Lemire algorithm, and only inputs with more than 19 significant
+     digits that sit on a rounding boundary fall back to `strtod`.
+     Out-of-range values become zero or infinity.
+ @param v The text to parse.
+ @param out Receives the value; left untouched on failure.
+ @return The number of bytes consumed, or 0 if no number was found.
+*/
+size_t str_to_f64(str_view_t v, double *out);
+
+/*!
+ @function str_from_i64
+ @brief Create a new ASCII string holding v in decimal.
+ @param v The value.
+ @return A new `str_t`, or NULL on allocation failure.
+*/
+str_t str_from_i64(int64_t v);
+
+/*!
+ @function str_from_u64
+ @brief Create a new ASCII string holding v in decimal.
+ @param v The value.
+ @return A new `str_t`, or NULL on allocation failure.
+*/
+str_t str_from_u64(uint64_t v);
+
+/*!
+ @function str_from_f64
+ @brief Create a new ASCII string holding the shortest text that round-trips to v.
+ @discussion Uses the same layout as `str_builder_append_f64`, so
+     `str_to_f64` parses the result back to exactly v.
+ @param v The value.
+ @return A new `str_t`, or NULL on allocation failure.
+*/
+str_t str_from_f64(double v);
+
+/* Parallel scanning (requires paul_threads.h to be included first) */
+#ifdef PAUL_THREADS_HEADER
+#ifndef STR_PARALLEL_MIN_CHUNK
+#define STR_PARALLEL_MIN_CHUNK (1 << 20)
+#endif
+
+/*!
+ @function str_find_all_parallel
+ @brief Find every non-overlapping occurrence of needle in s using a thread pool.
+ @discussion The string is cut into one chunk per worker plus one for the
+     calling thread (never smaller than `STR_PARALLEL_MIN_CHUNK` bytes).
+     Each chunk is scanned independently for matches that start inside it,
+     including matches that run past its end. The per-chunk results are
+     then stitched together in order so that the result is exactly the
+     leftmost, non-overlapping set a serial scan would produce. The calling
+     thread takes part in the work, and completion is tracked per call, so
+     the pool may be shared with unrelated jobs. Passing a NULL pool runs
+     everything on the calling thread. Only ASCII and UTF-8 strings are
+     supported.
+ @param pool Thread pool from paul_threads.h, or NULL.
+ @param s The string to search.
+ @param needle The string to find.
+ @param positions Receives a `STR_MALLOC`ed array of byte offsets (NULL when there are no matches); release it with `STR_FREE`.
+ @return The number of matches, or (size_t)-1 on allocation failure.
+*/
+size_t str_find_all_parallel(thrd_pool_t *pool, const str_t s, const str_t needle, size_t **positions);
+
+/*!
+ @function str_count_parallel
+ @brief Count non-overlapping occurrences of needle in s using a thread pool.
+ @discussion Same partitioning as `str_find_all_parallel`, but only a
+     short prefix of each chunk's matches is kept for stitching.
+ @param pool Thread pool from paul_threads.h, or NULL.
+ @param s The string to search.
+ @param needle The string to count.
+ @return The number of matches, or (size_t)-1 on allocation failure.
+*/
+size_t str_count_parallel(thrd_pool_t *pool, const str_t s, const str_t needle);
+
+/*!
+ @function str_replace_all_parallel
+ @brief Replace every non-overlapping occurrence of old_sub using a thread pool.
+ @discussion Matches are located with `str_find_all_parallel`. The output
+     is allocated once at its exact size and filled by the workers, each
+     copying a disjoint range of the source.
+ @param pool Thread pool from paul_threads.h, or NULL.
+ @param s The source string; it is not modified.
+ @param old_sub Substring to replace; an empty substring matches nothing.
+ @param new_sub Replacement.
+ @return A new narrow `str_t`, or NULL on allocation failure. It is UTF-8
+     when `s` is, or when a UTF-8 `new_sub` was spliced in, and ASCII
+     otherwise.
+*/
+str_t str_replace_all_parallel(thrd_pool_t *pool, const str_t s, const str_t old_sub, const str_t new_sub);
+
+/*!
+ @function str_split_lines_parallel
+ @brief Split s into lines using a thread pool.
+ @discussion Produces the same lines as `str_split_lines`: lines end at
+     `\n` or `\r\n`, the terminator is not part of the line, and there is
+     no empty line after a final newline. Workers first count newlines in their chunk, then write
+     their views straight into the shared result array.
+ @param pool Thread pool from paul_threads.h, or NULL.
+ @param s The string to split.
+ @param lines Receives a `STR_MALLOC`ed array of views into `s` (NULL when there are no lines); release it with `STR_FREE`.
+ @return The number of lines, or (size_t)-1 on allocation failure.
+*/
+size_t str_split_lines_parallel(thrd_pool_t *pool, const str_t s, str_view_t **lines);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+#endif // PAUL_STRING_H
+
+#if defined(PAUL_STRING_IMPLEMENTATION) || defined(PAUL_IMPLEMENTATION)
+typedef struct str_header {
+    uint64_t hash;
+    uint16_t type;
+    uint16_t flags;
+    uint32_t length;
+    char data[];
+} str_header_t;
+
+typedef struct wstr_header {
+    uint64_t hash;
+    uint16_t type;
+    uint16_t flags;
+    uint32_t length;
+    wchar_t data[];
+} wstr_header_t;
+
+/* Stored encodings */
+#define STR_TYPE_ASCII 0
+#define STR_TYPE_WIDE 1
+#define STR_TYPE_UTF8 2
+
+/* Header flags */
+#define STR_FLAG_INTERNED 0x1 /* owned by a str_pool_t, immutable */
+#define STR_FLAG_HASHED 0x2   /* hash field is valid */
+#define STR_FLAG_ARENA 0x4    /* owned by a str_arena_t, see STR_ARENA */
+
+/* Helper macros to access string header fields */
+#define STR_HASH(s) (*(uint64_t *)((char *)(s) - 16))
+#define STR_TYPE(s) (*(uint16_t *)((char *)(s) - 8))
+#define STR_FLAGS(s) (*(uint16_t *)((char *)(s) - 6))
+#define STR_LENGTH(s) (*(uint32_t *)((char *)(s) - 4))
+#define STR_IS_NARROW(type) ((type) != STR_TYPE_WIDE)
+/* ASCII and UTF-8 share a byte layout, so any two narrow strings mix */
+#define STR_COMPATIBLE(a, b) ((a) == (b) || (STR_IS_NARROW(a) && STR_IS_NARROW(b)))
+#define STR_HEADER_SIZE(type) (STR_IS_NARROW(type) ? sizeof(str_header_t) : sizeof(wstr_header_t))
+#define STR_ELEM_SIZE(type) (STR_IS_NARROW(type) ? sizeof(char) : sizeof(wchar_t))
+/* Arena strings store their owning arena in front of the header */
+#define STR_ARENA_PREFIX sizeof(uint64_t)
+#define STR_ARENA(s) (*(str_arena_t **)((char *)(s) - STR_HEADER_SIZE(STR_TYPE(s)) - STR_ARENA_PREFIX))
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define _STR_SSE2
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define _STR_AVX2
+#endif
+#if (defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__) || defined(_M_X64) || defined(_M_IX86) || defined(_M_ARM64)
+#define _STR_LITTLE_ENDIAN
+#endif
+#include <float.h>
+#if defined(FLT_EVAL_METHOD) && FLT_EVAL_METHOD == 0
+/* double arithmetic is exact enough for Clinger's fast path */
+#define _STR_CLINGER
+#endif
+
+static inline unsigned _str_ctz32(uint32_t x) {
+#ifdef _MSC_VER
+    unsigned long i;
+    _BitScanForward(&i, x);
+    return (unsigned)i;
+#else
+    return (unsigned)__builtin_ctz(x);
+#endif
+}
+
+static inline unsigned _str_clz64(uint64_t x) {
+#ifdef _MSC_VER
+    unsigned long i;
+    _BitScanReverse64(&i, x);
+    return 63u - (unsigned)i;
+#else
+    return (unsigned)__builtin_clzll(x);
+#endif
+}
+
+static inline unsigned _str_popcount32(uint32_t x) {
+#ifdef _MSC_VER
+    return (unsigned)__popcnt(x);
+#else
+    return (unsigned)__builtin_popcount(x);
+#endif
+}
+
+/* The cached hash is filled in lazily by str_hash, possibly on several
+   threads reading the same const string. The hash is published with a
+   release on the flags word, readers pair it with an acquire. */
+static inline uint16_t _str_load_flags(const str_t s) {
+#ifdef _MSC_VER
+    return (uint16_t)_InterlockedOr16((volatile short *)&STR_FLAGS(s), 0);
+#else
+    return __atomic_load_n(&STR_FLAGS(s), __ATOMIC_ACQUIRE);
+#endif
+}
+
+static inline uint64_t _str_load_hash(const str_t s) {
+#ifdef _MSC_VER
+    return (uint64_t)_InterlockedCompareExchange64((volatile __int64 *)&STR_HASH(s), 0, 0);
+#else
+    return __atomic_load_n(&STR_HASH(s), __ATOMIC_RELAXED);
+#endif
+}
+
+static inline void _str_publish_hash(const str_t s, uint64_t h) {
+#ifdef _MSC_VER
+    _InterlockedExchange64((volatile __int64 *)&STR_HASH(s), (__int64)h);
+    _InterlockedOr16((volatile short *)&STR_FLAGS(s), STR_FLAG_HASHED);
+#else
+    __atomic_store_n(&STR_HASH(s), h, __ATOMIC_RELAXED);
+    __atomic_fetch_or(&STR_FLAGS(s), (uint16_t)STR_FLAG_HASHED, __ATOMIC_RELEASE);
+#endif
+}
+
+/* 64x64 -> 128 bit multiply, *a receives the low half and *b the high half */
+static inline void _str_mum(uint64_t *a, uint64_t *b) {
+#ifdef __SIZEOF_INT128__
+    __uint128_t r = (__uint128_t)*a * *b;
+    *a = (uint64_t)r;
+    *b = (uint64_t)(r >> 64);
+#else
+    uint64_t ha = *a >> 32, hb = *b >> 32, la = (uint32_t)*a, lb = (uint32_t)*b;
+    uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+    uint64_t t = rl + (rm0 << 32), c = t < rl;
+    uint64_t lo = t + (rm1 << 32);
+    c += lo < t;
+    *a = lo;
+    *b = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+#endif
+}
+
+static inline uint64_t _str_mix(uint64_t a, uint64_t b) {
+    _str_mum(&a, &b);
+    return a ^ b;
+}
+
+static inline uint64_t _str_r8(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+static inline uint64_t _str_r4(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+/* ASCII-lowercase every byte of a packed word (SWAR), other bytes untouched */
+static inline uint64_t _str_fold8(bool fold, uint64_t x) {
+    if (!fold)
+        return x;
+    uint64_t low7 = x & 0x7f7f7f7f7f7f7f7full;
+    uint64_t ge_a = low7 + 0x3f3f3f3f3f3f3f3full; // high bit set when byte >= 'A'
+    uint64_t gt_z = low7 + 0x2525252525252525ull; // high bit set when byte > 'Z'
+    uint64_t upper = ge_a & ~gt_z & ~x & 0x8080808080808080ull;
+    return x | (upper >> 2);
+}
+
+static inline uint64_t _str_rf8(bool fold, const uint8_t *p) {
+    return _str_fold8(fold, _str_r8(p));
+}
+
+static inline uint64_t _str_rf4(bool fold, const uint8_t *p) {
+    return _str_fold8(fold, _str_r4(p));
+}
+
+/* wyhash-style 64-bit hash over raw bytes, optionally folding ASCII case */
+static inline uint64_t _str_hash_impl(const void *data, size_t len, uint64_t seed, bool fold) {
+    static const uint64_t k0 = 0xa0761d6478bd642full, k1 = 0xe7037ed1a0b428dbull;
+    static const uint64_t k2 = 0x8ebc6af09c88c6e3ull, k3 = 0x589965cc75374cc3ull;
+    const uint8_t *p = (const uint8_t *)data;
+    uint64_t a, b;
+    seed ^= _str_mix(seed ^ k0, k1);
+    if (len <= 16) {
+        if (len >= 4) {
+            size_t off = (len >> 3) << 2;
+            a = (_str_rf4(fold, p) << 32) | _str_rf4(fold, p + off);
+            b = (_str_rf4(fold, p + len - 4) << 32) | _str_rf4(fold, p + len - 4 - off);
+        } else if (len > 0) {
+            a = ((uint64_t)_str_fold8(fold, p[0]) << 16) | ((uint64_t)_str_fold8(fold, p[len >> 1]) << 8) |
+                _str_fold8(fold, p[len - 1]);
+            b = 0;
+        } else
+            a = b = 0;
+    } else {
+        size_t i = len;
+        if (i > 48) {
+            uint64_t s1 = seed, s2 = seed;
+            do {
+                seed = _str_mix(_str_rf8(fold, p) ^ k1, _str_rf8(fold, p + 8) ^ seed);
+                s1 = _str_mix(_str_rf8(fold, p + 16) ^ k2, _str_rf8(fold, p + 24) ^ s1);
+                s2 = _str_mix(_str_rf8(fold, p + 32) ^ k3, _str_rf8(fold, p + 40) ^ s2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= s1 ^ s2;
+        }
+        while (i > 16) {
+            seed = _str_mix(_str_rf8(fold, p) ^ k1, _str_rf8(fold, p + 8) ^ seed);
+            p += 16;
+            i -= 16;
+        }
+        a = _str_rf8(fold, p + i - 16);
+        b = _str_rf8(fold, p + i - 8);
+    }
+    a ^= k1;
+    b ^= seed;
+    _str_mum(&a, &b);
+    return _str_mix(a ^ k0 ^ len, b ^ k1);
+}
+
+static uint64_t _str_hash_bytes(const void *data, size_t len, uint64_t seed) {
+    return _str_hash_impl(data, len, seed, false);
+}
+
+static uint64_t _str_hash_fold(const void *data, size_t len, uint64_t seed) {
+    return _str_hash_impl(data, len, seed, true);
+}
+
+static inline uint8_t _str_fold1(uint8_t c) {
+    return (uint8_t)(c - 'A') < 26 ? c | 0x20 : c;
+}
+
+#ifdef _STR_SSE2
+static inline __m128i _str_fold16(__m128i v) {
+    __m128i m = _mm_cmplt_epi8(_mm_add_epi8(v, _mm_set1_epi8(0x3F)), _mm_set1_epi8(-128 + 26));
+    return _mm_or_si128(v, _mm_and_si128(m, _mm_set1_epi8(0x20)));
+}
+#endif
+
+/* Flip bit 5 of every byte in [lo, lo + 26): lo = 'A' lowers, lo = 'a' uppers */
+static void _str_ascii_case(char *p, size_t n, char lo) {
+    size_t i = 0;
+#ifdef _STR_AVX2
+    const __m256i bias32 = _mm256_set1_epi8((char)(0x80 - lo));
+    const __m256i lim32 = _mm256_set1_epi8(-128 + 26);
+    const __m256i bit32 = _mm256_set1_epi8(0x20);
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+        __m256i m = _mm256_cmpgt_epi8(lim32, _mm256_add_epi8(v, bias32));
+        _mm256_storeu_si256((__m256i *)(p + i), _mm256_xor_si256(v, _mm256_and_si256(m, bit32)));
+    }
+#endif
+#ifdef _STR_SSE2
+    const __m128i bias = _mm_set1_epi8((char)(0x80 - lo));
+    const __m128i lim = _mm_set1_epi8(-128 + 26);
+    const __m128i bit = _mm_set1_epi8(0x20);
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        __m128i m = _mm_cmplt_epi8(_mm_add_epi8(v, bias), lim);
+        _mm_storeu_si128((__m128i *)(p + i), _mm_xor_si128(v, _mm_and_si128(m, bit)));
+    }
+#endif
+    for (; i < n; i++)
+        if ((unsigned char)(p[i] - lo) < 26)
+            p[i] ^= 0x20;
+}
+
+/* Index of the first byte where a and b differ ignoring ASCII case, or n */
+static size_t _str_casemismatch(const uint8_t *a, const uint8_t *b, size_t n) {
+    size_t i = 0;
+#ifdef _STR_SSE2
+    for (; i + 16 <= n; i += 16) {
+        __m128i x = _str_fold16(_mm_loadu_si128((const __m128i *)(a + i)));
+        __m128i y = _str_fold16(_mm_loadu_si128((const __m128i *)(b + i)));
+        uint32_t m = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) ^ 0xFFFF;
+        if (m)
+            return i + _str_ctz32(m);
+    }
+#endif
+    while (i < n && _str_fold1(a[i]) == _str_fold1(b[i]))
+        i++;
+    return i;
+}
+
+/* First case-insensitive occurrence of needle in hay, or (size_t)-1 */
+static size_t _str_casefind(const uint8_t *hay, size_t hn, const uint8_t *needle, size_t nn) {
+    if (nn == 0)
+        return 0;
+    if (nn > hn)
+        return (size_t)-1;
+    uint8_t lo = _str_fold1(needle[0]);
+    uint8_t up = (uint8_t)(lo - 'a') < 26 ? lo ^ 0x20 : lo;
+    size_t last = hn - nn, i = 0;
+#ifdef _STR_SSE2
+    const __m128i vlo = _mm_set1_epi8((char)lo), vup = _mm_set1_epi8((char)up);
+    for (; i + 16 <= last + 1; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(hay + i));
+        uint32_t m = (uint32_t)_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, vlo), _mm_cmpeq_epi8(v, vup)));
+        for (; m; m &= m - 1) {
+            size_t j = i + _str_ctz32(m);
+            if (_str_casemismatch(hay + j + 1, needle + 1, nn - 1) == nn - 1)
+                return j;
+        }
+    }
+#endif
+    for (; i <= last; i++)
+        if (_str_fold1(hay[i]) == lo && _str_casemismatch(hay + i + 1, needle + 1, nn - 1) == nn - 1)
+            return i;
+    return (size_t)-1;
+}
+
+/* First occurrence of needle in hay. Candidates are found by comparing the
+   needle's first and last bytes at 16/32 positions at once, then verified. */
+static const char *_str_memmem(const char *hay, size_t n, const char *needle, size_t m) {
+    if (m == 0)
+        return hay;
+    if (m > n)
+        return NULL;
+    if (m == 1)
+        return (const char *)memchr(hay, needle[0], n);
+    size_t last = n - m, i = 0;
+#ifdef _STR_AVX2
+    const __m256i first32 = _mm256_set1_epi8(needle[0]), tail32 = _mm256_set1_epi8(needle[m - 1]);
+    for (; i + 32 <= last + 1; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(hay + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(hay + i + m - 1));
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first32), _mm256_cmpeq_epi8(b, tail32)));
+        for (; mask; mask &= mask - 1) {
+            size_t j = i + _str_ctz32(mask);
+            if (memcmp(hay + j + 1, needle + 1, m - 2) == 0)
+                return hay + j;
+        }
+    }
+#endif
+#ifdef _STR_SSE2
+    const __m128i first = _mm_set1_epi8(needle[0]), tail = _mm_set1_epi8(needle[m - 1]);
+    for (; i + 16 <= last + 1; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(hay + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(hay + i + m - 1));
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, tail)));
+        for (; mask; mask &= mask - 1) {
+            size_t j = i + _str_ctz32(mask);
+            if (memcmp(hay + j + 1, needle + 1, m - 2) == 0)
+                return hay + j;
+        }
+    }
+#endif
+    for (; i <= last; i++)
+        if (hay[i] == needle[0] && hay[i + m - 1] == needle[m - 1] && memcmp(hay + i + 1, needle + 1, m - 2) == 0)
+            return hay + i;
+    return NULL;
+}
+
+static inline wchar_t _str_wfold(wchar_t c) {
+    return c >= L'A' && c <= L'Z' ? c + 32 : c;
+}
+
+/* Initialise the header of a string whose data starts at s */
+static str_t _str_init(str_t s, uint32_t type, size_t len) {
+    STR_HASH(s) = 0;
+    STR_TYPE(s) = (uint16_t)type;
+    STR_FLAGS(s) = 0;
+    STR_LENGTH(s) = (uint32_t)len;
+    if (STR_IS_NARROW(type))
+        ((char *)s)[len] = '\0';
+    else
+        ((wchar_t *)s)[len] = L'\0';
+    return s;
+}
+
+/* Allocate an uninitialised string of len characters with the given type */
+static str_t _str_new(uint32_t type, size_t len) {
+    size_t header_size = STR_HEADER_SIZE(type);
+    char *h = (char *)STR_MALLOC(header_size + (len + 1) * STR_ELEM_SIZE(type));
+    if (!h)
+        return NULL;
+    return _str_init((str_t)(h + header_size), type, len);
+}
+
+static str_t _make_ascii(const char *s, size_t len) {
+    str_t result = _str_new(STR_TYPE_ASCII, len);
+    if (result)
+        memcpy(result, s, len);
+    return result;
+}
+
+static str_t _make_utf16(const wchar_t *s, size_t len) {
+    str_t result = _str_new(STR_TYPE_WIDE, len);
+    if (result)
+        memcpy(result, s, len * sizeof(wchar_t));
+    return result;
+}
+
+/* Interned strings are shared and must never be modified in place. Every
+   mutator calls this first, so it also drops the cached hash. */
+static inline bool _str_writable(str_t s) {
+    if (STR_FLAGS(s) & STR_FLAG_INTERNED)
+        return false;
+    STR_FLAGS(s) &= ~STR_FLAG_HASHED;
+    return true;
+}
+
+static str_t _str_dup(const str_t *s, size_t header_size, size_t elem_size) {
+    void *p = *s;
+    void *header_start = (char *)p - header_size;
+    uint32_t len = STR_LENGTH(p);
+    size_t alloc_sz = header_size + (len + 1) * elem_size;
+    void *new_p = STR_MALLOC(alloc_sz);
+    if (!new_p)
+        return NULL;
+    memcpy(new_p, header_start, alloc_sz);
+    str_t result = (str_t)((char *)new_p + header_size);
+    STR_FLAGS(result) &= ~(STR_FLAG_INTERNED | STR_FLAG_ARENA);
+    return result;
+}
+
+#ifndef STR_ARENA_CHUNK_SIZE
+#define STR_ARENA_CHUNK_SIZE 65536
+#endif
+
+typedef struct str_arena_chunk {
+    struct str_arena_chunk *next;
+    size_t used;
+    size_t capacity;
+    uint64_t data[];
+} str_arena_chunk_t;
+
+struct str_arena {
+    str_arena_chunk_t *chunks;
+    size_t chunk_size;
+};
+
+#define _STR_ALIGN8(n) (((n) + 7) & ~(size_t)7)
+
+/* Bump-allocate size bytes (8-byte aligned) from the arena's chunks */
+static void *_str_arena_alloc(str_arena_t *arena, size_t size) {
+    size = _STR_ALIGN8(size);
+    size_t chunk_size = arena->chunk_size ? arena->chunk_size : STR_ARENA_CHUNK_SIZE;
+    str_arena_chunk_t *c = arena->chunks;
+    if (!c || c->capacity - c->used < size) {
+        size_t cap = size > chunk_size ? size : chunk_size;
+        if (!(c = (str_arena_chunk_t *)STR_MALLOC(sizeof(str_arena_chunk_t) + cap)))
+            return NULL;
+        c->used = 0;
+        c->capacity = cap;
+        if (arena->chunks && size > chunk_size) {
+            // Keep filling the current chunk, oversized blocks get their own
+            c->next = arena->chunks->next;
+            arena->chunks->next = c;
+        } else {
+            c->next = arena->chunks;
+            arena->chunks = c;
+        }
+    }
+    void *p = (char *)c->data + c->used;
+    c->used += size;
+    return p;
+}
+
+/* Free every chunk except (optionally) the current one */
+static void _str_arena_release(str_arena_t *arena, bool keep) {
+    str_arena_chunk_t *c = arena->chunks;
+    if (keep && c) {
+        c->used = 0;
+        c = c->next;
+        arena->chunks->next = NULL;
+    } else
+        arena->chunks = NULL;
+    for (str_arena_chunk_t *next; c; c = next) {
+        next = c->next;
+        STR_FREE(c);
+    }
+}
+
+static str_t _str_arena_new(str_arena_t *arena, uint32_t type, size_t len) {
+    size_t header_size = STR_HEADER_SIZE(type);
+    char *h = (char *)_str_arena_alloc(arena, STR_ARENA_PREFIX + header_size + (len + 1) * STR_ELEM_SIZE(type));
+    if (!h)
+        return NULL;
+    *(str_arena_t **)h = arena;
+    str_t s = _str_init((str_t)(h + STR_ARENA_PREFIX + header_size), type, len);
+    STR_FLAGS(s) = STR_FLAG_ARENA;
+    return s;
+}
+
+/* Offset of an arena string's block in the current chunk, or -1 when it is
+   not the most recent allocation */
+static ptrdiff_t _str_arena_tail(str_t s) {
+    str_arena_chunk_t *c = STR_ARENA(s)->chunks;
+    uint32_t type = STR_TYPE(s);
+    size_t header_size = STR_HEADER_SIZE(type);
+    char *block = (char *)s - header_size - STR_ARENA_PREFIX;
+    size_t size = _STR_ALIGN8(STR_ARENA_PREFIX + header_size + (STR_LENGTH(s) + 1) * STR_ELEM_SIZE(type));
+    return block + size == (char *)c->data + c->used ? block - (char *)c->data : -1;
+}
+
+static str_t _str_arena_resize(str_t s, size_t new_len) {
+    str_arena_t *arena = STR_ARENA(s);
+    uint32_t type = STR_TYPE(s);
+    uint32_t old_len = STR_LENGTH(s);
+    size_t elem_size = STR_ELEM_SIZE(type);
+    size_t new_sz = _STR_ALIGN8(STR_ARENA_PREFIX + STR_HEADER_SIZE(type) + (new_len + 1) * elem_size);
+    ptrdiff_t tail = _str_arena_tail(s);
+    if (tail >= 0 && (size_t)tail + new_sz <= arena->chunks->capacity)
+        arena->chunks->used = (size_t)tail + new_sz;
+    else if (new_len > old_len) {
+        // The old block stays dead until the arena is reset
+        str_t r = _str_arena_new(arena, type, new_len);
+        if (!r)
+            return NULL;
+        memcpy(r, s, old_len * elem_size);
+        STR_HASH(r) = STR_HASH(s);
+        STR_FLAGS(r) = STR_FLAGS(s);
+        s = r;
+    }
+    STR_LENGTH(s) = (uint32_t)new_len;
+    if (STR_IS_NARROW(type))
+        ((char *)s)[new_len] = '\0';
+    else
+        ((wchar_t *)s)[new_len] = L'\0';
+    return s;
+}
+
+/* Length of the leading run of 7-bit bytes */
+static size_t _str_ascii_run(const uint8_t *p, size_t n) {
+    size_t i = 0;
+#ifdef _STR_SSE2
+    for (; i + 32 <= n; i += 32) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(p + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(p + i + 16));
+        if (_mm_movemask_epi8(_mm_or_si128(a, b)))
+            break;
+    }
+    for (; i + 16 <= n; i += 16) {
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(p + i)));
+        if (mask)
+            return i + _str_ctz32(mask);
+    }
+#else
+    for (; i + 8 <= n; i += 8) {
+        uint64_t w;
+        memcpy(&w, p + i, 8);
+        if (w & 0x8080808080808080ULL)
+            break;
+    }
+#endif
+    while (i < n && p[i] < 0x80)
+        i++;
+    return i;
+}
+
+/* Decode one multi-byte sequence, returns its length or 0 when malformed */
+static size_t _str_utf8_decode(const uint8_t *p, const uint8_t *end, uint32_t *cp) {
+    uint8_t c = p[0];
+    size_t n;
+    uint32_t v, min;
+    if (c >= 0xC2 && c <= 0xDF) {
+        n = 2;
+        v = c & 0x1F;
+        min = 0x80;
+    } else if ((c & 0xF0) == 0xE0) {
+        n = 3;
+        v = c & 0x0F;
+        min = 0x800;
+    } else if (c >= 0xF0 && c <= 0xF4) {
+        n = 4;
+        v = c & 0x07;
+        min = 0x10000;
+    } else
+        return 0;
+    if ((size_t)(end - p) < n)
+        return 0;
+    for (size_t i = 1; i < n; i++) {
+        if ((p[i] & 0xC0) != 0x80)
+            return 0;
+        v = (v << 6) | (p[i] & 0x3F);
+    }
+    if (v < min || v > 0x10FFFF || (v >= 0xD800 && v <= 0xDFFF))
+        return 0;
+    *cp = v;
+    return n;
+}
+
+/* Encode a code point, returns the number of bytes (out may be NULL) */
+static size_t _str_utf8_encode(uint32_t cp, char *out) {
+    if (cp < 0x80) {
+        if (out)
+            out[0] = (char)cp;
+        return 1;
+    }
+    if (cp < 0x800) {
+        if (out) {
+            out[0] = (char)(0xC0 | (cp >> 6));
+            out[1] = (char)(0x80 | (cp & 0x3F));
+        }
+        return 2;
+    }
+    if (cp < 0x10000) {
+        if (out) {
+            out[0] = (char)(0xE0 | (cp >> 12));
+            out[1] = (char)(0x80 | ((cp >> 6) & 0x3F));
+            out[2] = (char)(0x80 | (cp & 0x3F));
+        }
+        return 3;
+    }
+    if (out) {
+        out[0] = (char)(0xF0 | (cp >> 18));
+        out[1] = (char)(0x80 | ((cp >> 12) & 0x3F));
+        out[2] = (char)(0x80 | ((cp >> 6) & 0x3F));
+        out[3] = (char)(0x80 | (cp & 0x3F));
+    }
+    return 4;
+}
+
+/* Zero-extend bytes to 16/32-bit units */
+static void _str_widen16(const uint8_t *src, size_t n, uint16_t *dst) {
+    size_t i = 0;
+#ifdef _STR_SSE2
+    __m128i zero = _mm_setzero_si128();
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_unpacklo_epi8(v, zero));
+        _mm_storeu_si128((__m128i *)(dst + i + 8), _mm_unpackhi_epi8(v, zero));
+    }
+#endif
+    for (; i < n; i++)
+        dst[i] = src[i];
+}
+
+static void _str_widen32(const uint8_t *src, size_t n, uint32_t *dst) {
+    size_t i = 0;
+#ifdef _STR_SSE2
+    __m128i zero = _mm_setzero_si128();
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i lo = _mm_unpacklo_epi8(v, zero);
+        __m128i hi = _mm_unpackhi_epi8(v, zero);
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_unpacklo_epi16(lo, zero));
+        _mm_storeu_si128((__m128i *)(dst + i + 4), _mm_unpackhi_epi16(lo, zero));
+        _mm_storeu_si128((__m128i *)(dst + i + 8), _mm_unpacklo_epi16(hi, zero));
+        _mm_storeu_si128((__m128i *)(dst + i + 12), _mm_unpackhi_epi16(hi, zero));
+    }
+#endif
+    for (; i < n; i++)
+        dst[i] = src[i];
+}
+
+/* Narrow the leading run of units below 0x80, returns its length (dst may be NULL) */
+static size_t _str_narrow16(const uint16_t *src, size_t n, uint8_t *dst) {
+    size_t i = 0;
+#ifdef _STR_SSE2
+    __m128i high = _mm_set1_epi16((short)0xFF80);
+    __m128i zero = _mm_setzero_si128();
+    for (; i + 8 <= n; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(v, high), zero)) != 0xFFFF)
+            break;
+        if (dst)
+            _mm_storel_epi64((__m128i *)(dst + i), _mm_packus_epi16(v, v));
+    }
+#endif
+    for (; i < n && src[i] < 0x80; i++)
+        if (dst)
+            dst[i] = (uint8_t)src[i];
+    return i;
+}
+
+static size_t _str_narrow32(const uint32_t *src, size_t n, uint8_t *dst) {
+    size_t i = 0;
+#ifdef _STR_SSE2
+    __m128i high = _mm_set1_epi32((int)0xFFFFFF80);
+    __m128i zero = _mm_setzero_si128();
+    for (; i + 8 <= n; i += 8) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + i + 4));
+        __m128i bits = _mm_and_si128(_mm_or_si128(a, b), high);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(bits, zero)) != 0xFFFF)
+            break;
+        if (dst) {
+            __m128i w = _mm_packs_epi32(a, b);
+            _mm_storel_epi64((__m128i *)(dst + i), _mm_packus_epi16(w, w));
+        }
+    }
+#endif
+    for (; i < n && src[i] < 0x80; i++)
+        if (dst)
+            dst[i] = (uint8_t)src[i];
+    return i;
+}
+
+bool str_utf8_valid(const char *data, size_t len) {
+    const uint8_t *p = (const uint8_t *)data;
+    const uint8_t *end = p + len;
+    while (p < end) {
+        p += _str_ascii_run(p, (size_t)(end - p));
+        if (p == end)
+            break;
+        uint32_t cp;
+        size_t n = _str_utf8_decode(p, end, &cp);
+        if (!n)
+            return false;
+        p += n;
+    }
+    return true;
+}
+
+size_t str_utf8_count(const char *data, size_t len) {
+    const uint8_t *p = (const uint8_t *)data;
+    size_t i = 0, count = 0;
+#ifdef _STR_SSE2
+    /* Continuation bytes 0x80-0xBF are the signed bytes below -64 */
+    __m128i limit = _mm_set1_epi8(-65);
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        count += _str_popcount32((uint32_t)_mm_movemask_epi8(_mm_cmpgt_epi8(v, limit)));
+    }
+#endif
+    for (; i < len; i++)
+        count += (p[i] & 0xC0) != 0x80;
+    return count;
+}
+
+size_t str_utf8_to_utf16(const char *src, size_t len, uint16_t *dst) {
+    const uint8_t *p = (const uint8_t *)src;
+    const uint8_t *end = p + len;
+    size_t out = 0;
+    while (p < end) {
+        size_t run = _str_ascii_run(p, (size_t)(end - p));
+        if (dst)
+            _str_widen16(p, run, dst + out);
+        out += run;
+        p += run;
+        if (p == end)
+            break;
+        uint32_t cp;
+        size_t n = _str_utf8_decode(p, end, &cp);
+        if (!n)
+            return (size_t)-1;
+        p += n;
+        if (cp >= 0x10000) {
+            if (dst) {
+                cp -= 0x10000;
+                dst[out] = (uint16_t)(0xD800 | (cp >> 10));
+                dst[out + 1] = (uint16_t)(0xDC00 | (cp & 0x3FF));
+            }
+            out += 2;
+        } else {
+            if (dst)
+                dst[out] = (uint16_t)cp;
+            out++;
+        }
+    }
+    return out;
+}
+
+size_t str_utf8_to_utf32(const char *src, size_t len, uint32_t *dst) {
+    const uint8_t *p = (const uint8_t *)src;
+    const uint8_t *end = p + len;
+    size_t out = 0;
+    while (p < end) {
+        size_t run = _str_ascii_run(p, (size_t)(end - p));
+        if (dst)
+            _str_widen32(p, run, dst + out);
+        out += run;
+        p += run;
+        if (p == end)
+            break;
+        uint32_t cp;
+        size_t n = _str_utf8_decode(p, end, &cp);
+        if (!n)
+            return (size_t)-1;
+        p += n;
+        if (dst)
+            dst[out] = cp;
+        out++;
+    }
+    return out;
+}
+
+size_t str_utf16_to_utf8(const uint16_t *src, size_t len, char *dst) {
+    size_t i = 0, out = 0;
+    while (i < len) {
+        size_t run = _str_narrow16(src + i, len - i, dst ? (uint8_t *)dst + out : NULL);
+        i += run;
+        out += run;
+        if (i == len)
+            break;
+        uint32_t cp = src[i++];
+        if (cp >= 0xD800 && cp <= 0xDBFF) {
+            if (i == len || src[i] < 0xDC00 || src[i] > 0xDFFF)
+                return (size_t)-1;
+            cp = 0x10000 + ((cp - 0xD800) << 10) + (uint32_t)(src[i++] - 0xDC00);
+        } else if (cp >= 0xDC00 && cp <= 0xDFFF)
+            return (size_t)-1;
+        out += _str_utf8_encode(cp, dst ? dst + out : NULL);
+    }
+    return out;
+}
+
+size_t str_utf32_to_utf8(const uint32_t *src, size_t len, char *dst) {
+    size_t i = 0, out = 0;
+    while (i < len) {
+        size_t run = _str_narrow32(src + i, len - i, dst ? (uint8_t *)dst + out : NULL);
+        i += run;
+        out += run;
+        if (i == len)
+            break;
+        uint32_t cp = src[i++];
+        if (cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF))
+            return (size_t)-1;
+        out += _str_utf8_encode(cp, dst ? dst + out : NULL);
+    }
+    return out;
+}
+
+/* Transcode between UTF-8 and wchar_t, which is UTF-16 on Windows and UTF-32 elsewhere */
+static size_t _str_utf8_to_wide(const char *src, size_t len, wchar_t *dst) {
+    if (sizeof(wchar_t) == 2)
+        return str_utf8_to_utf16(src, len, (uint16_t *)dst);
+    return str_utf8_to_utf32(src, len, (uint32_t *)dst);
+}
+
+static size_t _str_wide_to_utf8(const wchar_t *src, size_t len, char *dst) {
+    if (sizeof(wchar_t) == 2)
+        return str_utf16_to_utf8((const uint16_t *)src, len, dst);
+    return str_utf32_to_utf8((const uint32_t *)src, len, dst);
+}
+
+str_t str_dup(const str_t s) {
+    uint32_t type = STR_TYPE(s);
+    return _str_dup(&s, STR_HEADER_SIZE(type), STR_ELEM_SIZE(type));
+}
+
+void str_free(str_t s) {
+    if (!s)
+        return;
+    uint16_t flags = STR_FLAGS(s);
+    if (flags & STR_FLAG_INTERNED)
+        return;
+    if (flags & STR_FLAG_ARENA) {
+        ptrdiff_t tail = _str_arena_tail(s);
+        if (tail >= 0)
+            STR_ARENA(s)->chunks->used = (size_t)tail;
+        return;
+    }
+    STR_FREE((char *)s - STR_HEADER_SIZE(STR_TYPE(s)));
+}
+
+str_t str_from_cstr(const char *cstr) {
+    return _make_ascii(cstr, strlen(cstr));
+}
+
+str_t str_from_wcstr(const wchar_t *cstr) {
+    return _make_utf16(cstr, wcslen(cstr));
+}
+
+str_t str_from_utf8(const char *cstr) {
+    return str_from_utf8_n(cstr, strlen(cstr));
+}
+
+str_t str_from_utf8_n(const char *data, size_t len) {
+    if (!str_utf8_valid(data, len))
+        return NULL;
+    str_t s = _str_new(STR_TYPE_UTF8, len);
+    if (s)
+        memcpy(s, data, len);
+    return s;
+}
+
+str_t str_make_ascii(str_t s) {
+    uint32_t type = STR_TYPE(s);
+    uint32_t len = STR_LENGTH(s);
+    str_t result;
+    switch (type) {
+        case STR_TYPE_ASCII:
+            return str_dup(s);
+        case STR_TYPE_UTF8:
+            if (_str_ascii_run((const uint8_t *)s, len) != len)
+                return NULL;
+            if ((result = _str_new(STR_TYPE_ASCII, len)))
+                memcpy(result, s, len);
+            return result;
+        default:
+            if (_str_wide_to_utf8((const wchar_t *)s, len, NULL) != len)
+                return NULL; // Cannot convert
+            if ((result = _str_new(STR_TYPE_ASCII, len)))
+                _str_wide_to_utf8((const wchar_t *)s, len, (char *)result);
+            return result;
+    }
+}
+
+str_t str_make_utf8(str_t s) {
+    uint32_t type = STR_TYPE(s);
+    uint32_t len = STR_LENGTH(s);
+    str_t result;
+    switch (type) {
+        case STR_TYPE_UTF8:
+            return str_dup(s);
+        case STR_TYPE_ASCII:
+            if ((result = _str_new(STR_TYPE_UTF8, len)))
+                memcpy(result, s, len);
+            return result;
+        default: {
+            size_t n = _str_wide_to_utf8((const wchar_t *)s, len, NULL);
+            if (n == (size_t)-1)
+                return NULL;
+            if ((result = _str_new(STR_TYPE_UTF8, n)))
+                _str_wide_to_utf8((const wchar_t *)s, len, (char *)result);
+            return result;
+        }
+    }
+}
+
+str_t str_make_utf16(str_t s) {
+    uint32_t type = STR_TYPE(s);
+    uint32_t len = STR_LENGTH(s);
+    str_t result;
+    if (type == STR_TYPE_WIDE)
+        return str_dup(s);
+    if (type == STR_TYPE_ASCII) {
+        // Convert narrow to wide, one unit per byte
+        if ((result = _str_new(STR_TYPE_WIDE, len))) {
+            if (sizeof(wchar_t) == 2)
+                _str_widen16((const uint8_t *)s, len, (uint16_t *)result);
+            else
+                _str_widen32((const uint8_t *)s, len, (uint32_t *)result);
+        }
+        return result;
+    }
+    size_t n = _str_utf8_to_wide((const char *)s, len, NULL);
+    if (n == (size_t)-1)
+        return NULL;
+    if ((result = _str_new(STR_TYPE_WIDE, n)))
+        _str_utf8_to_wide((const char *)s, len, (wchar_t *)result);
+    return result;
+}
+
+const char *str_raw_cstr(const str_t s) {
+    uint32_t type = STR_TYPE(s);
+    return STR_IS_NARROW(type) ? (const char *)s : NULL;
+}
+
+const wchar_t *str_raw_wcstr(const str_t s) {
+    uint32_t type = STR_TYPE(s);
+    return type == 1 ? (const wchar_t *)s : NULL;
+}
+
+bool str_is_ascii(const str_t s) {
+    uint32_t type = STR_TYPE(s);
+    return type == 0;
+}
+
+bool str_is_utf16(const str_t s) {
+    uint32_t type = STR_TYPE(s);
+    return type == 1;
+}
+
+bool str_is_utf8(const str_t s) {
+    return STR_TYPE(s) == STR_TYPE_UTF8;
+}
+
+size_t str_utf8_length(const str_t s) {
+    uint32_t type = STR_TYPE(s);
+    uint32_t len = STR_LENGTH(s);
+    return type == STR_TYPE_UTF8 ? str_utf8_count((const char *)s, len) : len;
+}
+
+bool str_resize(str_t *s, size_t new_len) {
+    if (!_str_writable(*s) || new_len > UINT32_MAX)
+        return false;
+    uint32_t type = STR_TYPE(*s);
+    uint32_t old_len = STR_LENGTH(*s);
+    size_t header_size = STR_HEADER_SIZE(type);
+    size_t elem_size = STR_ELEM_SIZE(type);
+    if (STR_FLAGS(*s) & STR_FLAG_ARENA) {
+        str_t r = _str_arena_resize(*s, new_len);
+        if (!r)
+            return false;
+        *s = r;
+        return true;
+    }
+    size_t new_alloc_sz = header_size + (new_len + 1) * elem_size;
+    void *new_p = STR_REALLOC((char *)*s - header_size, new_alloc_sz);
+    if (!new_p) {
+        if (new_len > old_len)
+            return false;
+        // A failed shrink keeps the old block, which is still big enough
+        new_p = (char *)*s - header_size;
+    }
+    void *new_data = (char *)new_p + header_size;
+    STR_LENGTH(new_data) = (uint32_t)new_len;
+    if (STR_IS_NARROW(type))
+        ((char *)new_data)[new_len] = '\0';
+    else
+        ((wchar_t *)new_data)[new_len] = L'\0';
+    *s = (str_t)new_data;
+    return true;
+}
+
+void str_copy(str_t dest, const str_t src) {
+    if (!_str_writable(dest))
+        return;
+    uint32_t type_dest = STR_TYPE(dest);
+    uint32_t type_src = STR_TYPE(src);
+    if (!STR_COMPATIBLE(type_dest, type_src))
+        return; // or handle conversion
+    uint32_t len_src = STR_LENGTH(src);
+    size_t elem_size = STR_ELEM_SIZE(type_dest);
+    memcpy((void *)dest, (void *)src, len_src * elem_size);
+    if (type_src == STR_TYPE_UTF8)
+        STR_TYPE(dest) = STR_TYPE_UTF8;
+    if (STR_IS_NARROW(type_dest))
+        ((char *)dest)[len_src] = '\0';
+    else
+        ((wchar_t *)dest)[len_src] = L'\0';
+    STR_LENGTH(dest) = len_src;
+}
+
+void str_concat(str_t *dest, const str_t src) {
+    if (!_str_writable(*dest))
+        return;
+    uint32_t type_dest = STR_TYPE(*dest);
+    uint32_t type_src = STR_TYPE(src);
+    if (!STR_COMPATIBLE(type_dest, type_src))
+        return;
+    uint32_t len_dest = STR_LENGTH(*dest);
+    uint32_t len_src = STR_LENGTH(src);
+    size_t new_len = len_dest + len_src;
+    if (!str_resize(dest, new_len))
+        return;
+    size_t elem_size = STR_ELEM_SIZE(type_dest);
+    memcpy((char *)*dest + len_dest * elem_size, (void *)src, len_src * elem_size);
+    if (type_src == STR_TYPE_UTF8)
+        STR_TYPE(*dest) = STR_TYPE_UTF8;
+}
+
+void str_append_char(str_t *s, char c) {
+    if (!_str_writable(*s))
+        return;
+    uint32_t type = STR_TYPE(*s);
+    if (!STR_IS_NARROW(type))
+        return; // only for ASCII/UTF-8
+    if (type == STR_TYPE_UTF8 && (unsigned char)c >= 0x80)
+        return; // a lone byte would break the encoding, use str_concat
+    uint32_t len = STR_LENGTH(*s);
+    if (!str_resize(s, len + 1))
+        return;
+    ((char *)*s)[len] = c;
+}
+
+void str_insert(str_t *s, size_t pos, const str_t substr) {
+    if (!_str_writable(*s))
+        return;
+    uint32_t type_s = STR_TYPE(*s);
+    uint32_t type_sub = STR_TYPE(substr);
+    if (!STR_COMPATIBLE(type_s, type_sub))
+        return;
+    uint32_t len_s = STR_LENGTH(*s);
+    uint32_t len_sub = STR_LENGTH(substr);
+    if (pos > len_s)
+        return;
+    size_t new_len = len_s + len_sub;
+    if (!str_resize(s, new_len))
+        return;
+    size_t elem_size = STR_ELEM_SIZE(type_s);
+    memmove((char *)*s + (pos + len_sub) * elem_size, (char *)*s + pos * elem_size, (len_s - pos) * elem_size);
+    memcpy((char *)*s + pos * elem_size, (void *)substr, len_sub * elem_size);
+    if (type_sub == STR_TYPE_UTF8)
+        STR_TYPE(*s) = STR_TYPE_UTF8;
+}
+
+void str_erase(str_t *s, size_t pos, size_t len) {
+    if (!_str_writable(*s))
+        return;
+    uint32_t type = STR_TYPE(*s);
+    uint32_t len_s = STR_LENGTH(*s);
+    if (pos >= len_s || len == 0)
+        return;
+    if (pos + len > len_s)
+        len = len_s - pos;
+    size_t elem_size = STR_ELEM_SIZE(type);
+    memmove((char *)*s + pos * elem_size, (char *)*s + (pos + len) * elem_size, (len_s - pos - len) * elem_size);
+    str_resize(s, len_s - len);
+}
+
+void str_replace(str_t *s, const str_t old_sub, const str_t new_sub) {
+    if (!_str_writable(*s))
+        return;
+    // Simplified: find and replace first occurrence
+    size_t pos = str_find(*s, old_sub);
+    if (pos != (size_t)-1) {
+        uint32_t len_old = STR_LENGTH(old_sub);
+        str_erase(s, pos, len_old);
+        str_insert(s, pos, new_sub);
+    }
+}
+
+#define _STR_IS_SPACE(c) ((c) == ' ' || ((c) >= '\t' && (c) <= '\r'))
+
+void str_trim(str_t *s) {
+    if (!_str_writable(*s))
+        return;
+    uint32_t type = STR_TYPE(*s);
+    uint32_t len = STR_LENGTH(*s);
+    size_t start = 0, end = len;
+    if (STR_IS_NARROW(type)) {
+        char *data = (char *)*s;
+        while (start < end && _STR_IS_SPACE(data[start]))
+            start++;
+        while (end > start && _STR_IS_SPACE(data[end - 1]))
+            end--;
+        if (start > 0)
+            memmove(data, data + start, end - start);
+        data[end - start] = '\0';
+    } else {
+        wchar_t *data = (wchar_t *)*s;
+        while (start < end && _STR_IS_SPACE(data[start]))
+            start++;
+        while (end > start && _STR_IS_SPACE(data[end - 1]))
+            end--;
+        if (start > 0)
+            memmove(data, data + start, (end - start) * sizeof(wchar_t));
+        data[end - start] = L'\0';
+    }
+    // Shrinking never needs a new allocation, keep the capacity. Arena
+    // strings give the freed tail back so the arena can still find them.
+    if (STR_FLAGS(*s) & STR_FLAG_ARENA)
+        str_resize(s, end - start);
+    else
+        STR_LENGTH(*s) = (uint32_t)(end - start);
+}
+
+void str_to_upper(str_t *s) {
+    if (!_str_writable(*s))
+        return;
+    uint32_t type = STR_TYPE(*s);
+    uint32_t len = STR_LENGTH(*s);
+    if (STR_IS_NARROW(type))
+        _str_ascii_case((char *)*s, len, 'a');
+    else
+        for (size_t i = 0; i < len; i++) {
+            wchar_t c = ((wchar_t *)*s)[i];
+            ((wchar_t *)*s)[i] = c < 128 ? (c >= L'a' && c <= L'z' ? c - 32 : c) : (wchar_t)towupper(c);
+        }
+}
+
+void str_to_lower(str_t *s) {
+    if (!_str_writable(*s))
+        return;
+    uint32_t type = STR_TYPE(*s);
+    uint32_t len = STR_LENGTH(*s);
+    if (STR_IS_NARROW(type))
+        _str_ascii_case((char *)*s, len, 'A');
+    else
+        for (size_t i = 0; i < len; i++) {
+            wchar_t c = ((wchar_t *)*s)[i];
+            ((wchar_t *)*s)[i] = c < 128 ? _str_wfold(c) : (wchar_t)towlower(c);
+        }
+}
+
+int str_cmp(const str_t a, const str_t b) {
+    if (a == b)
+        return 0;
+    uint32_t type_a = STR_TYPE(a);
+    uint32_t type_b = STR_TYPE(b);
+    if (!STR_COMPATIBLE(type_a, type_b))
+        return STR_IS_NARROW(type_a) ? -1 : 1;
+    uint32_t len_a = STR_LENGTH(a);
+    uint32_t len_b = STR_LENGTH(b);
+    if (STR_IS_NARROW(type_a))
+        return strncmp((const char *)a, (const char *)b, len_a < len_b ? len_a : len_b) ?: (len_a - len_b);
+    else
+        return wcsncmp((const wchar_t *)a, (const wchar_t *)b, len_a < len_b ? len_a : len_b) ?: (len_a - len_b);
+}
+
+bool str_equal(const str_t a, const str_t b) {
+    if (a == b)
+        return true;
+    uint32_t type_a = STR_TYPE(a);
+    uint32_t type_b = STR_TYPE(b);
+    if (!STR_COMPATIBLE(type_a, type_b))
+        return false;
+    uint32_t len_a = STR_LENGTH(a);
+    uint32_t len_b = STR_LENGTH(b);
+    if (len_a != len_b)
+        return false;
+    if ((_str_load_flags(a) & _str_load_flags(b) & STR_FLAG_HASHED) && _str_load_hash(a) != _str_load_hash(b))
+        return false;
+    size_t elem_size = STR_ELEM_SIZE(type_a);
+    return memcmp((void *)a, (void *)b, len_a * elem_size) == 0;
+}
+
+size_t str_find(const str_t s, const str_t substr) {
+    uint32_t type_s = STR_TYPE(s);
+    uint32_t type_sub = STR_TYPE(substr);
+    if (!STR_COMPATIBLE(type_s, type_sub))
+        return (size_t)-1;
+    uint32_t len_s = STR_LENGTH(s);
+    uint32_t len_sub = STR_LENGTH(substr);
+    if (len_sub == 0)
+        return 0;
+    if (len_sub > len_s)
+        return (size_t)-1;
+    if (STR_IS_NARROW(type_s)) {
+        const char *hit = _str_memmem((const char *)s, len_s, (const char *)substr, len_sub);
+        return hit ? (size_t)(hit - (const char *)s) : (size_t)-1;
+    }
+    size_t elem_size = STR_ELEM_SIZE(type_s);
+    const void *data_s = (const void *)s;
+    const void *data_sub = (const void *)substr;
+    for (size_t i = 0; i <= len_s - len_sub; i++) {
+        const void *p1 = (const char *)data_s + i * elem_size;
+        if (memcmp(p1, data_sub, len_sub * elem_size) == 0)
+            return i;
+    }
+    return (size_t)-1;
+}
+
+int str_casecmp(const str_t a, const str_t b) {
+    if (a == b)
+        return 0;
+    uint32_t type_a = STR_TYPE(a);
+    uint32_t type_b = STR_TYPE(b);
+    if (!STR_COMPATIBLE(type_a, type_b))
+        return STR_IS_NARROW(type_a) ? -1 : 1;
+    uint32_t len_a = STR_LENGTH(a);
+    uint32_t len_b = STR_LENGTH(b);
+    size_t n = len_a < len_b ? len_a : len_b;
+    if (STR_IS_NARROW(type_a)) {
+        size_t i = _str_casemismatch((const uint8_t *)a, (const uint8_t *)b, n);
+        if (i < n)
+            return (int)_str_fold1(((const uint8_t *)a)[i]) - (int)_str_fold1(((const uint8_t *)b)[i]);
+    } else
+        for (size_t i = 0; i < n; i++) {
+            wchar_t ca = _str_wfold(((const wchar_t *)a)[i]);
+            wchar_t cb = _str_wfold(((const wchar_t *)b)[i]);
+            if (ca != cb)
+                return ca < cb ? -1 : 1;
+        }
+    return len_a < len_b ? -1 : len_a > len_b;
+}
+
+size_t str_casefind(const str_t s, const str_t substr) {
+    uint32_t type_s = STR_TYPE(s);
+    uint32_t type_sub = STR_TYPE(substr);
+    if (!STR_COMPATIBLE(type_s, type_sub))
+        return (size_t)-1;
+    uint32_t len_s = STR_LENGTH(s);
+    uint32_t len_sub = STR_LENGTH(substr);
+    if (STR_IS_NARROW(type_s))
+        return _str_casefind((const uint8_t *)s, len_s, (const uint8_t *)substr, len_sub);
+    if (len_sub > len_s)
+        return (size_t)-1;
+    const wchar_t *ws = (const wchar_t *)s, *wsub = (const wchar_t *)substr;
+    for (size_t i = 0; i <= len_s - len_sub; i++) {
+        size_t j = 0;
+        while (j < len_sub && _str_wfold(ws[i + j]) == _str_wfold(wsub[j]))
+            j++;
+        if (j == len_sub)
+            return i;
+    }
+    return (size_t)-1;
+}
+
+uint64_t str_hash(const str_t s) {
+    if (_str_load_flags(s) & STR_FLAG_HASHED)
+        return _str_load_hash(s);
+    // Racing threads compute the same value, whichever store lands is fine
+    uint64_t h = _str_hash_bytes(s, STR_LENGTH(s) * STR_ELEM_SIZE(STR_TYPE(s)), 0);
+    _str_publish_hash(s, h);
+    return h;
+}
+
+uint64_t str_hash_bytes(const void *data, size_t len, uint32_t seed) {
+    return _str_hash_bytes(data, len, seed);
+}
+
+uint64_t str_casehash(const str_t s) {
+    return _str_hash_fold(s, STR_LENGTH(s) * STR_ELEM_SIZE(STR_TYPE(s)), 0);
+}
+
+size_t str_find_char(const str_t s, char c) {
+    uint32_t type = STR_TYPE(s);
+    if (!STR_IS_NARROW(type))
+        return (size_t)-1; // only for ASCII/UTF-8
+    uint32_t len = STR_LENGTH(s);
+    for (size_t i = 0; i < len; i++)
+        if (((const char *)s)[i] == c)
+            return i;
+    return (size_t)-1;
+}
+
+bool str_starts_with(const str_t s, const str_t prefix) {
+    uint32_t type_s = STR_TYPE(s);
+    uint32_t type_p = STR_TYPE(prefix);
+    if (!STR_COMPATIBLE(type_s, type_p))
+        return false;
+    uint32_t len_p = STR_LENGTH(prefix);
+    uint32_t len_s = STR_LENGTH(s);
+    if (len_p > len_s)
+        return false;
+    size_t elem_size = STR_ELEM_SIZE(type_s);
+    return memcmp((void *)s, (void *)prefix, len_p * elem_size) == 0;
+}
+
+bool str_ends_with(const str_t s, const str_t suffix) {
+    uint32_t type_s = STR_TYPE(s);
+    uint32_t type_suf = STR_TYPE(suffix);
+    if (!STR_COMPATIBLE(type_s, type_suf))
+        return false;
+    uint32_t len_suf = STR_LENGTH(suffix);
+    uint32_t len_s = STR_LENGTH(s);
+    if (len_suf > len_s)
+        return false;
+    size_t elem_size = STR_ELEM_SIZE(type_s);
+    return memcmp((char *)s + (len_s - len_suf) * elem_size, (void *)suffix, len_suf * elem_size) == 0;
+}
+
+/* Generic wildcard implementation generated via macro for char/wchar_t.
+ * Supports '*', '?', and character classes like [abc], [a-z], and negation [^...].
+ * Class members and ranges compare as UCHAR, so bytes >= 0x80 sort high.
+ */
+#define WILDCARD_IMPL(fname, CHAR, UCHAR)                                             \
+    bool fname(const str_t s, const CHAR *pattern)                                    \
+    {                                                                                 \
+        const CHAR *str = (const CHAR *)s;                                            \
+        const CHAR *p = pattern;                                                      \
+        const CHAR *st = str;                                                         \
+        const CHAR *star = NULL;                                                      \
+        const CHAR *ss = NULL;                                                        \
+        while (*st)                                                                   \
+        {                                                                             \
+            /* a '[' without a closing ']' is a literal */                            \
+            const CHAR *close = NULL;                                                 \
+            if (*p == (CHAR)'[')                                                      \
+            {                                                                         \
+                close = p + 1;                                                        \
+                if (*close == (CHAR)'^')                                              \
+                    close++;                                                          \
+                while (*close && *close != (CHAR)']')                                 \
+                    close++;                                                          \
+                if (!*close)                                                          \
+                    close = NULL;                                                     \
+            }                                                                         \
+            if (*p == (CHAR)'*')                                                      \
+            {                                                                         \
+                star = p++;                                                           \
+                ss = st;                                                              \
+            }                                                                         \
+            else if (close)                                                           \
+            {                                                                         \
+                const CHAR *q = p + 1;                                                \
+                bool negate = false;                                                  \
+                if (*q == (CHAR)'^')                                                  \
+                {                                                                     \
+                    negate = true;                                                    \
+                    q++;                                                              \
+                }                                                                     \
+                bool matched = false;                                                 \
+                UCHAR c = (UCHAR)*st;                                                 \
+                UCHAR prev = 0;                                                       \
+                for (; q < close; q++)                                                \
+                {                                                                     \
+                    if (*q == (CHAR)'-' && prev && q + 1 < close)                     \
+                    {                                                                 \
+                        if (c >= prev && c <= (UCHAR)q[1])                            \
+                            matched = true;                                           \
+                        q++;                                                          \
+                        prev = 0;                                                     \
+                    }                                                                 \
+                    else                                                              \
+                    {                                                                 \
+                        if (c == (UCHAR)*q)                                           \
+                            matched = true;                                           \
+                        prev = (UCHAR)*q;                                             \
+                    }                                                                 \
+                }                                                                     \
+                p = close + 1;                                                        \
+                if (negate)                                                           \
+                    matched = !matched;                                               \
+                if (matched)                                                          \
+                {                                                                     \
+                    st++;                                                             \
+                    continue;                                                         \
+                }                                                                     \
+                if (star)                                                             \
+                {                                                                     \
+                    p = star + 1;                                                     \
+                    st = ++ss;                                                        \
+                    continue;                                                         \
+                }                                                                     \
+                return false;                                                         \
+            }                                                                         \
+            else if (*p && (*p == (CHAR)'?' || *p == *st))                            \
+            {                                                                         \
+                p++;                                                                  \
+                st++;                                                                 \
+            }                                                                         \
+            else                                                                      \
+            {                                                                         \
+                if (star)                                                             \
+                {                                                                     \
+                    p = star + 1;                                                     \
+                    st = ++ss;                                                        \
+                    continue;                                                         \
+                }                                                                     \
+                return false;                                                         \
+            }                                                                         \
+        }                                                                             \
+        while (*p == (CHAR)'*')                                                       \
+            p++;                                                                      \
+        return *p == (CHAR)'\0';                                                      \
+    }
+WILDCARD_IMPL(str_wildcard_ascii, char, unsigned char)
+WILDCARD_IMPL(str_wildcard_wide, wchar_t, uint32_t)
+#undef WILDCARD_IMPL
+
+typedef struct str_glob_seg {
+    size_t len;      // atoms in the segment
+    size_t words;    // 64-bit words per byte mask
+    uint64_t *masks; // masks[c * words + w]: bit i set when atom i accepts byte c
+    int first;       // first atom when it is a single literal byte, else -1
+} str_glob_seg_t;
+
+struct str_glob {
+    size_t count; // segments, the pattern split at '*'
+    bool star;    // false when the whole subject must match segs[0]
+    size_t min_len;
+    str_glob_seg_t segs[];
+};
+
+/* Parse one atom at *pp into a byte set, returns the byte for plain literals or -1 */
+static int _str_glob_atom(const char **pp, uint8_t set[32]) {
+    const unsigned char *p = (const unsigned char *)*pp;
+    int literal = -1;
+    memset(set, 0, 32);
+    if (*p == '?') {
+        memset(set, 0xFF, 32);
+        p++;
+    } else if (*p == '[' && strchr((const char *)p + 1 + (p[1] == '^'), ']')) {
+        const unsigned char *q = p + 1;
+        bool negate = *q == '^';
+        if (negate)
+            q++;
+        unsigned char prev = 0;
+        for (; *q && *q != ']'; q++) {
+            if (*q == '-' && prev && q[1] && q[1] != ']') {
+                for (unsigned c = prev; c <= q[1]; c++)
+                    set[c >> 3] |= (uint8_t)(1u << (c & 7));
+                q++;
+                prev = 0;
+            } else {
+                set[*q >> 3] |= (uint8_t)(1u << (*q & 7));
+                prev = *q;
+            }
+        }
+        if (negate)
+            for (int i = 0; i < 32; i++)
+                set[i] = (uint8_t)~set[i];
+        p = q + 1;
+    } else {
+        // Literals, including a '[' that is never closed
+        set[*p >> 3] |= (uint8_t)(1u << (*p & 7));
+        literal = *p++;
+    }
+    *pp = (const char *)p;
+    return literal;
+}
+
+str_glob_t *str_glob_compile(const char *pattern) {
+    // First pass: count segments and atoms to size a single allocation
+    uint8_t set[32];
+    size_t count = 1, atoms = 0, words = 0;
+    for (const char *p = pattern; *p;) {
+        if (*p == '*') {
+            while (*p == '*')
+                p++;
+            words += (atoms + 63) / 64;
+            atoms = 0;
+            count++;
+        } else {
+            _str_glob_atom(&p, set);
+            atoms++;
+        }
+    }
+    words += (atoms + 63) / 64;
+    size_t head = sizeof(str_glob_t) + count * sizeof(str_glob_seg_t);
+    head = (head + 7) & ~(size_t)7;
+    str_glob_t *g = (str_glob_t *)STR_MALLOC(head + words * 256 * sizeof(uint64_t));
+    if (!g)
+        return NULL;
+    memset(g, 0, head + words * 256 * sizeof(uint64_t));
+    g->count = count;
+    g->star = count > 1;
+    // Second pass: fill in the per-byte masks of every segment
+    uint64_t *masks = (uint64_t *)((char *)g + head);
+    str_glob_seg_t *seg = g->segs;
+    const char *p = pattern;
+    for (size_t i = 0; i < count; i++, seg++) {
+        const char *q = p;
+        seg->first = -1;
+        while (*q && *q != '*') {
+            _str_glob_atom(&q, set);
+            seg->len++;
+        }
+        seg->words = (seg->len + 63) / 64;
+        seg->masks = masks;
+        masks += seg->words * 256;
+        for (size_t k = 0; *p && *p != '*'; k++) {
+            int literal = _str_glob_atom(&p, set);
+            if (k == 0)
+                seg->first = literal;
+            for (unsigned c = 0; c < 256; c++)
+                if (set[c >> 3] & (1u << (c & 7)))
+                    seg->masks[c * seg->words + k / 64] |= 1ull << (k & 63);
+        }
+        while (*p == '*')
+            p++;
+        g->min_len += seg->len;
+    }
+    return g;
+}
+
+void str_glob_free(str_glob_t *glob) {
+    STR_FREE(glob);
+}
+
+/* Does seg match in place at p (which has at least seg->len bytes)? */
+static bool _str_glob_at(const str_glob_seg_t *seg, const uint8_t *p) {
+    for (size_t i = 0; i < seg->len; i++)
+        if (!((seg->masks[p[i] * seg->words + i / 64] >> (i & 63)) & 1))
+            return false;
+    return true;
+}
+
+/* Leftmost occurrence of seg in p[0..n), or (size_t)-1. Shift-And keeps the
+   set of live partial matches in a bit vector so every byte is seen once. */
+static size_t _str_glob_search(const str_glob_seg_t *seg, const uint8_t *p, size_t n) {
+    size_t last = seg->len - 1, words = seg->words;
+    if (words == 1) {
+        const uint64_t *m = seg->masks, hit = 1ull << last;
+        uint64_t d = 0;
+        for (size_t j = 0; j < n; j++) {
+            if (!d && seg->first >= 0) {
+                const uint8_t *q = (const uint8_t *)memchr(p + j, seg->first, n - j);
+                if (!q)
+                    return (size_t)-1;
+                j = (size_t)(q - p);
+            }
+            d = ((d << 1) | 1) & m[p[j]];
+            if (d & hit)
+                return j - last;
+        }
+        return (size_t)-1;
+    }
+    uint64_t small[8], *d = words <= 8 ? small : (uint64_t *)STR_MALLOC(words * sizeof(uint64_t));
+    size_t result = (size_t)-1;
+    if (!d)
+        return result;
+    memset(d, 0, words * sizeof(uint64_t));
+    bool live = false;
+    for (size_t j = 0; j < n; j++) {
+        if (!live && seg->first >= 0) {
+            const uint8_t *q = (const uint8_t *)memchr(p + j, seg->first, n - j);
+            if (!q)
+                break;
+            j = (size_t)(q - p);
+        }
+        const uint64_t *m = seg->masks + (size_t)p[j] * words;
+        uint64_t carry = 1, any = 0;
+        for (size_t w = 0; w < words; w++) {
+            uint64_t next = d[w] >> 63;
+            d[w] = ((d[w] << 1) | carry) & m[w];
+            any |= d[w];
+            carry = next;
+        }
+        live = any != 0;
+        if ((d[last / 64] >> (last & 63)) & 1) {
+            result = j - last;
+            break;
+        }
+    }
+    if (d != small)
+        STR_FREE(d);
+    return result;
+}
+
+static bool _str_glob_match(const str_glob_t *g, const uint8_t *p, size_t n) {
+    if (n < g->min_len)
+        return false;
+    const str_glob_seg_t *head = &g->segs[0];
+    if (!g->star)
+        return n == head->len && _str_glob_at(head, p);
+    const str_glob_seg_t *tail = &g->segs[g->count - 1];
+    if (!_str_glob_at(head, p) || !_str_glob_at(tail, p + n - tail->len))
+        return false;
+    // Greedy leftmost placement of the middle segments is optimal for '*'
+    size_t pos = head->len, end = n - tail->len;
+    for (size_t i = 1; i + 1 < g->count; i++) {
+        size_t at = _str_glob_search(&g->segs[i], p + pos, end - pos);
+        if (at == (size_t)-1)
+            return false;
+        pos += at + g->segs[i].len;
+    }
+    return true;
+}
+
+bool str_glob_match(const str_glob_t *glob, const str_t s) {
+    if (!STR_IS_NARROW(STR_TYPE(s)))
+        return false;
+    return _str_glob_match(glob, (const uint8_t *)s, STR_LENGTH(s));
+}
+
+bool str_glob_match_view(const str_glob_t *glob, str_view_t v) {
+    return _str_glob_match(glob, (const uint8_t *)v.data, v.length);
+}
+
+size_t str_glob_match_batch(const str_glob_t *glob, const str_t *strs, size_t count, bool *results) {
+    size_t matched = 0;
+    for (size_t i = 0; i < count; i++) {
+        str_t s = strs[i];
+        bool r = STR_LENGTH(s) >= glob->min_len && str_glob_match(glob, s);
+        if (results)
+            results[i] = r;
+        matched += r;
+    }
+    return matched;
+}
+
+size_t str_length(const str_t s) {
+    return STR_LENGTH(s);
+}
+
+char str_char_at(const str_t s, size_t index) {
+    if (!STR_IS_NARROW(STR_TYPE(s)))
+        return 0;
+    uint32_t len = str_length(s);
+    if (index >= len)
+        return 0;
+    return ((const char *)s)[index];
+}
+
+wchar_t str_wchar_at(const str_t s, size_t index) {
+    if (!str_is_utf16(s))
+        return 0;
+    uint32_t len = str_length(s);
+    if (index >= len)
+        return 0;
+    return ((const wchar_t *)s)[index];
+}
+
+#define STR_SPLIT_CHAR 0
+#define STR_SPLIT_STRING 1
+#define STR_SPLIT_ANY 2
+#define STR_SPLIT_LINES 3
+
+/* Find the first byte in [p, end) that is a member of the iterator's set */
+static const char *_str_scan_any(const char *p, const char *end, const str_split_t *it) {
+#ifdef _STR_SSE2
+    if (it->delim_len <= 8) {
+        __m128i needles[8];
+        for (size_t i = 0; i < it->delim_len; i++)
+            needles[i] = _mm_set1_epi8(it->delim[i]);
+        while (end - p >= 16) {
+            __m128i block = _mm_loadu_si128((const __m128i *)p);
+            __m128i hits = _mm_cmpeq_epi8(block, needles[0]);
+            for (size_t i = 1; i < it->delim_len; i++)
+                hits = _mm_or_si128(hits, _mm_cmpeq_epi8(block, needles[i]));
+            uint32_t mask = (uint32_t)_mm_movemask_epi8(hits);
+            if (mask)
+                return p + _str_ctz32(mask);
+            p += 16;
+        }
+    }
+#endif
+    for (; p < end; p++) {
+        uint8_t c = (uint8_t)*p;
+        if (it->set[c >> 3] & (1u << (c & 7)))
+            return p;
+    }
+    return end;
+}
+
+str_view_t str_view(const str_t s) {
+    if (!STR_IS_NARROW(STR_TYPE(s)))
+        return (str_view_t){NULL, 0};
+    return (str_view_t){(const char *)s, STR_LENGTH(s)};
+}
+
+str_view_t str_view_cstr(const char *cstr) {
+    return (str_view_t){cstr, cstr ? strlen(cstr) : 0};
+}
+
+bool str_view_equal(str_view_t a, str_view_t b) {
+    return a.length == b.length && (a.length == 0 || memcmp(a.data, b.data, a.length) == 0);
+}
+
+str_t str_from_view(str_view_t v) {
+    return _make_ascii(v.data, v.length);
+}
+
+static str_split_t _str_split_make(str_view_t v, int mode, const char *delim, size_t delim_len) {
+    str_split_t it;
+    memset(&it, 0, sizeof(it));
+    it.cursor = v.data;
+    it.end = v.data + v.length;
+    it.delim = delim;
+    it.delim_len = delim_len;
+    it.mode = mode;
+    it.done = mode == STR_SPLIT_LINES && v.length == 0;
+    return it;
+}
+
+str_split_t str_split_char(str_view_t v, char delim) {
+    str_split_t it = _str_split_make(v, STR_SPLIT_CHAR, NULL, 1);
+    it.set[0] = (uint8_t)delim; /* single-char mode keeps the delimiter in set[0] */
+    return it;
+}
+
+str_split_t str_split_str(str_view_t v, const char *delim) {
+    return _str_split_make(v, STR_SPLIT_STRING, delim, strlen(delim));
+}
+
+str_split_t str_split_any(str_view_t v, const char *set) {
+    str_split_t it = _str_split_make(v, STR_SPLIT_ANY, set, strlen(set));
+    for (const char *p = set; *p; p++)
+        it.set[(uint8_t)*p >> 3] |= (uint8_t)(1u << ((uint8_t)*p & 7));
+    return it;
+}
+
+str_split_t str_split_lines(str_view_t v) {
+    return _str_split_make(v, STR_SPLIT_LINES, NULL, 1);
+}
+
+bool str_split_next(str_split_t *it, str_view_t *out) {
+    if (it->done)
+        return false;
+    const char *start = it->cursor;
+    size_t remaining = (size_t)(it->end - start);
+    const char *hit = NULL;
+    // An empty view may have a NULL data pointer, which memchr must not see
+    switch (remaining ? it->mode : -1) {
+        case STR_SPLIT_CHAR:
+            hit = (const char *)memchr(start, (char)it->set[0], remaining);
+            break;
+        case STR_SPLIT_STRING:
+            if (it->delim_len)
+                hit = _str_memmem(start, remaining, it->delim, it->delim_len);
+            break;
+        case STR_SPLIT_ANY:
+            if (it->delim_len) {
+                hit = _str_scan_any(start, it->end, it);
+                if (hit == it->end)
+                    hit = NULL;
+            }
+            break;
+        case STR_SPLIT_LINES:
+            hit = (const char *)memchr(start, '\n', remaining);
+            break;
+    }
+    if (!hit) {
+        out->data = start;
+        out->length = remaining;
+        it->cursor = it->end;
+        it->done = true;
+        return true;
+    }
+    out->data = start;
+    out->length = (size_t)(hit - start);
+    it->cursor = hit + (it->mode == STR_SPLIT_ANY ? 1 : it->delim_len);
+    if (it->mode == STR_SPLIT_LINES) {
+        if (out->length && hit[-1] == '\r')
+            out->length--;
+        if (it->cursor == it->end)
+            it->done = true;
+    }
+    return true;
+}
+
+str_arena_t *str_arena_create(size_t chunk_size) {
+    str_arena_t *arena = (str_arena_t *)STR_MALLOC(sizeof(str_arena_t));
+    if (!arena)
+        return NULL;
+    arena->chunks = NULL;
+    arena->chunk_size = chunk_size;
+    return arena;
+}
+
+void str_arena_reset(str_arena_t *arena) {
+    if (arena)
+        _str_arena_release(arena, true);
+}
+
+void str_arena_destroy(str_arena_t *arena) {
+    if (!arena)
+        return;
+    _str_arena_release(arena, false);
+    STR_FREE(arena);
+}
+
+static str_t _str_arena_make(str_arena_t *arena, uint32_t type, const void *data, size_t len) {
+    str_t s = _str_arena_new(arena, type, len);
+    if (s)
+        memcpy(s, data, len * STR_ELEM_SIZE(type));
+    return s;
+}
+
+str_t str_arena_from_cstr(str_arena_t *arena, const char *cstr) {
+    return _str_arena_make(arena, STR_TYPE_ASCII, cstr, strlen(cstr));
+}
+
+str_t str_arena_from_wcstr(str_arena_t *arena, const wchar_t *wcstr) {
+    return _str_arena_make(arena, STR_TYPE_WIDE, wcstr, wcslen(wcstr));
+}
+
+str_t str_arena_from_view(str_arena_t *arena, str_view_t v) {
+    return _str_arena_make(arena, STR_TYPE_ASCII, v.data, v.length);
+}
+
+str_t str_arena_dup(str_arena_t *arena, const str_t s) {
+    return _str_arena_make(arena, STR_TYPE(s), s, STR_LENGTH(s));
+}
+
+struct str_pool {
+    str_t *slots;
+    size_t capacity;
+    size_t count;
+    str_arena_t arena;
+};
+
+static bool _str_pool_grow(str_pool_t *pool) {
+    size_t cap = pool->capacity ? pool->capacity * 2 : 64;
+    str_t *slots = (str_t *)STR_MALLOC(cap * sizeof(str_t));
+    if (!slots)
+        return false;
+    memset(slots, 0, cap * sizeof(str_t));
+    for (size_t i = 0; i < pool->capacity; i++) {
+        str_t s = pool->slots[i];
+        if (!s)
+            continue;
+        size_t j = (size_t)STR_HASH(s) & (cap - 1);
+        while (slots[j])
+            j = (j + 1) & (cap - 1);
+        slots[j] = s;
+    }
+    STR_FREE(pool->slots);
+    pool->slots = slots;
+    pool->capacity = cap;
+    return true;
+}
+
+static str_t _str_intern(str_pool_t *pool, uint32_t type, const void *data, size_t len) {
+    size_t elem_size = STR_ELEM_SIZE(type);
+    uint64_t hash = _str_hash_bytes(data, len * elem_size, 0);
+    if ((pool->count + 1) * 4 > pool->capacity * 3 && !_str_pool_grow(pool))
+        return NULL;
+    size_t mask = pool->capacity - 1;
+    size_t i = (size_t)hash & mask;
+    for (str_t s; (s = pool->slots[i]); i = (i + 1) & mask)
+        if (STR_HASH(s) == hash && STR_TYPE(s) == type && STR_LENGTH(s) == len &&
+            memcmp(s, data, len * elem_size) == 0)
+            return s;
+    size_t header_size = STR_HEADER_SIZE(type);
+    char *h = (char *)_str_arena_alloc(&pool->arena, header_size + (len + 1) * elem_size);
+    if (!h)
+        return NULL;
+    str_t s = _str_init((str_t)(h + header_size), type, len);
+    memcpy(s, data, len * elem_size);
+    STR_HASH(s) = hash;
+    STR_FLAGS(s) = STR_FLAG_INTERNED | STR_FLAG_HASHED;
+    pool->slots[i] = s;
+    pool->count++;
+    return s;
+}
+
+str_pool_t *str_pool_create(void) {
+    str_pool_t *pool = (str_pool_t *)STR_MALLOC(sizeof(str_pool_t));
+    if (pool)
+        memset(pool, 0, sizeof(str_pool_t));
+    return pool;
+}
+
+void str_pool_destroy(str_pool_t *pool) {
+    if (!pool)
+        return;
+    _str_arena_release(&pool->arena, false);
+    STR_FREE(pool->slots);
+    STR_FREE(pool);
+}
+
+size_t str_pool_count(const str_pool_t *pool) {
+    return pool ? pool->count : 0;
+}
+
+str_t str_intern(str_pool_t *pool, const str_t s) {
+    if ((STR_FLAGS(s) & STR_FLAG_INTERNED) && pool->count) {
+        // Fast path: already canonical in this pool
+        size_t mask = pool->capacity - 1;
+        for (size_t i = (size_t)STR_HASH(s) & mask; pool->slots[i]; i = (i + 1) & mask)
+            if (pool->slots[i] == s)
+                return s;
+    }
+    return _str_intern(pool, STR_TYPE(s), s, STR_LENGTH(s));
+}
+
+str_t str_intern_cstr(str_pool_t *pool, const char *cstr) {
+    return _str_intern(pool, STR_TYPE_ASCII, cstr, strlen(cstr));
+}
+
+str_t str_intern_view(str_pool_t *pool, str_view_t v) {
+    return _str_intern(pool, STR_TYPE_ASCII, v.data, v.length);
+}
+
+bool str_is_interned(const str_t s) {
+    return (STR_FLAGS(s) & STR_FLAG_INTERNED) != 0;
+}
+
+/* The tag byte is STR_SSO_CAPACITY - length for inline strings, which makes
+   it the NUL terminator at full capacity, and STR_SSO_HEAP when the handle
+   holds a heap str_t instead */
+#define STR_SSO_TAG(s) ((s)->buf[STR_SSO_CAPACITY])
+#define STR_SSO_HEAP ((char)0x80)
+
+static inline str_t _sstr_heap(const sstr_t *s) {
+    str_t p;
+    memcpy(&p, s->buf, sizeof(str_t));
+    return p;
+}
+
+/* Store a heap string in the handle, a failed allocation leaves it empty */
+static inline void _sstr_set_heap(sstr_t *s, str_t p) {
+    memset(s->buf, 0, sizeof(s->buf));
+    if (!p) {
+        STR_SSO_TAG(s) = STR_SSO_CAPACITY;
+        return;
+    }
+    memcpy(s->buf, &p, sizeof(str_t));
+    STR_SSO_TAG(s) = STR_SSO_HEAP;
+}
+
+/* Inline bytes carry no type; like the builder, any byte >= 0x80 makes them UTF-8 */
+static inline uint32_t _sstr_type(const char *data, size_t len) {
+    return _str_ascii_run((const uint8_t *)data, len) == len ? STR_TYPE_ASCII : STR_TYPE_UTF8;
+}
+
+static sstr_t _sstr_make(const char *data, size_t len) {
+    sstr_t r;
+    memset(&r, 0, sizeof(r));
+    if (len <= STR_SSO_CAPACITY) {
+        memcpy(r.buf, data, len);
+        STR_SSO_TAG(&r) = (char)(STR_SSO_CAPACITY - len);
+    } else {
+        str_t p = _str_new(_sstr_type(data, len), len);
+        if (p)
+            memcpy(p, data, len);
+        _sstr_set_heap(&r, p);
+    }
+    return r;
+}
+
+sstr_t sstr_from_cstr(const char *cstr) {
+    return _sstr_make(cstr, strlen(cstr));
+}
+
+sstr_t sstr_from_view(str_view_t v) {
+    return _sstr_make(v.data, v.length);
+}
+
+sstr_t sstr_from_str(const str_t s) {
+    uint32_t len = STR_LENGTH(s);
+    if (!STR_IS_NARROW(STR_TYPE(s)))
+        return _sstr_make("", 0);
+    if (len <= STR_SSO_CAPACITY)
+        return _sstr_make((const char *)s, len);
+    sstr_t r;
+    _sstr_set_heap(&r, str_dup(s));
+    return r;
+}
+
+str_t sstr_to_str(const sstr_t *s) {
+    if (STR_SSO_TAG(s) == STR_SSO_HEAP)
+        return str_dup(_sstr_heap(s));
+    size_t len = sstr_length(s);
+    str_t r = _str_new(_sstr_type(s->buf, len), len);
+    if (r)
+        memcpy(r, s->buf, len);
+    return r;
+}
+
+sstr_t sstr_dup(const sstr_t *s) {
+    if (STR_SSO_TAG(s) != STR_SSO_HEAP)
+        return *s;
+    sstr_t r;
+    _sstr_set_heap(&r, str_dup(_sstr_heap(s)));
+    return r;
+}
+
+void sstr_free(sstr_t *s) {
+    if (STR_SSO_TAG(s) == STR_SSO_HEAP)
+        str_free(_sstr_heap(s));
+    memset(s->buf, 0, sizeof(s->buf));
+    STR_SSO_TAG(s) = STR_SSO_CAPACITY;
+}
+
+bool sstr_is_inline(const sstr_t *s) {
+    return STR_SSO_TAG(s) != STR_SSO_HEAP;
+}
+
+size_t sstr_length(const sstr_t *s) {
+    char tag = STR_SSO_TAG(s);
+    return tag == STR_SSO_HEAP ? STR_LENGTH(_sstr_heap(s)) : (size_t)(STR_SSO_CAPACITY - tag);
+}
+
+const char *sstr_cstr(const sstr_t *s) {
+    return STR_SSO_TAG(s) == STR_SSO_HEAP ? (const char *)_sstr_heap(s) : s->buf;
+}
+
+str_view_t sstr_view(const sstr_t *s) {
+    str_view_t v = {sstr_cstr(s), sstr_length(s)};
+    return v;
+}
+
+char sstr_char_at(const sstr_t *s, size_t index) {
+    return index < sstr_length(s) ? sstr_cstr(s)[index] : 0;
+}
+
+void sstr_append(sstr_t *s, str_view_t v) {
+    if (!v.length)
+        return;
+    size_t len = sstr_length(s);
+    if (STR_SSO_TAG(s) == STR_SSO_HEAP) {
+        str_t p = _sstr_heap(s);
+        // The view may point into p, which the resize can move
+        bool inside = v.data >= (const char *)p && v.data < (const char *)p + len;
+        size_t offset = inside ? (size_t)(v.data - (const char *)p) : 0;
+        if (!str_resize(&p, len + v.length))
+            return;
+        memcpy((char *)p + len, inside ? (const char *)p + offset : v.data, v.length);
+        if (STR_TYPE(p) == STR_TYPE_ASCII)
+            STR_TYPE(p) = _sstr_type((const char *)p + len, v.length);
+        _sstr_set_heap(s, p);
+    } else if (len + v.length <= STR_SSO_CAPACITY) {
+        memcpy(s->buf + len, v.data, v.length);
+        STR_SSO_TAG(s) = (char)(STR_SSO_CAPACITY - len - v.length);
+    } else {
+        // Spill: build the heap string in one allocation
+        str_t p = _str_new(STR_TYPE_ASCII, len + v.length);
+        if (!p)
+            return;
+        memcpy(p, s->buf, len);
+        memcpy((char *)p + len, v.data, v.length);
+        STR_TYPE(p) = _sstr_type((const char *)p, len + v.length);
+        _sstr_set_heap(s, p);
+    }
+}
+
+void sstr_append_char(sstr_t *s, char c) {
+    str_view_t v = {&c, 1};
+    sstr_append(s, v);
+}
+
+int sstr_cmp(const sstr_t *a, const sstr_t *b) {
+    size_t len_a = sstr_length(a), len_b = sstr_length(b);
+    int r = memcmp(sstr_cstr(a), sstr_cstr(b), len_a < len_b ? len_a : len_b);
+    return r ? r : len_a < len_b ? -1 : len_a > len_b;
+}
+
+bool sstr_equal(const sstr_t *a, const sstr_t *b) {
+    char tag_a = STR_SSO_TAG(a), tag_b = STR_SSO_TAG(b);
+    if (tag_a != tag_b)
+        return false; // heap strings are always longer than inline ones
+    if (tag_a != STR_SSO_HEAP)
+        return memcmp(a->buf, b->buf, sizeof(a->buf)) == 0;
+    size_t len = sstr_length(a);
+    return len == sstr_length(b) && memcmp(sstr_cstr(a), sstr_cstr(b), len) == 0;
+}
+
+uint64_t sstr_hash(const sstr_t *s) {
+    return _str_hash_bytes(sstr_cstr(s), sstr_length(s), 0);
+}
+
+typedef struct str_rope_node {
+    struct str_rope_node *left;
+    struct str_rope_node *right;
+    uint32_t priority;
+    uint32_t len; // bytes in this chunk
+    uint32_t cap; // bytes allocated for data
+    size_t size;  // bytes in this subtree
+    char data[];
+} str_rope_node_t;
+
+struct str_rope {
+    str_rope_node_t *root;
+    str_rope_node_t *spare[2]; // preallocated so splits can never fail
+    uint32_t seed;
+    uint64_t version; // bumped by every modification, for iterators
+};
+
+static inline size_t _str_rope_size(const str_rope_node_t *n) {
+    return n ? n->size : 0;
+}
+
+static inline void _str_rope_update(str_rope_node_t *n) {
+    n->size = n->len + _str_rope_size(n->left) + _str_rope_size(n->right);
+}
+
+static inline uint32_t _str_rope_rand(str_rope_t *rope) {
+    uint32_t x = rope->seed;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return rope->seed = x;
+}
+
+/* A chunk allocated for exactly len bytes, copied from data unless it is NULL */
+static str_rope_node_t *_str_rope_node(str_rope_t *rope, const char *data, size_t len) {
+    str_rope_node_t *n = (str_rope_node_t *)STR_MALLOC(offsetof(str_rope_node_t, data) + len);
+    if (!n)
+        return NULL;
+    n->left = n->right = NULL;
+    n->priority = _str_rope_rand(rope);
+    n->len = n->cap = (uint32_t)len;
+    n->size = len;
+    if (data)
+        memcpy(n->data, data, len);
+    return n;
+}
+
+/* Grow a chunk that is not linked into any tree, NULL on failure (n is kept) */
+static str_rope_node_t *_str_rope_grow(str_rope_node_t *n, size_t cap) {
+    n = (str_rope_node_t *)STR_REALLOC(n, offsetof(str_rope_node_t, data) + cap);
+    if (n)
+        n->cap = (uint32_t)cap;
+    return n;
+}
+
+static void _str_rope_free(str_rope_node_t *n) {
+    while (n) {
+        _str_rope_free(n->left);
+        str_rope_node_t *right = n->right;
+        STR_FREE(n);
+        n = right;
+    }
+}
+
+/* Bytes a split at pos moves into a new chunk, 0 when pos is on a chunk boundary */
+static size_t _str_rope_cut(const str_rope_node_t *t, size_t pos) {
+    while (t) {
+        size_t ls = _str_rope_size(t->left);
+        if (pos <= ls)
+            t = t->left;
+        else if (pos < ls + t->len)
+            return ls + t->len - pos;
+        else {
+            pos -= ls + t->len;
+            t = t->right;
+        }
+    }
+    return 0;
+}
+
+/* Make sure spare[i] can take a cut of need[i] bytes */
+static bool _str_rope_reserve(str_rope_t *rope, size_t need0, size_t need1) {
+    size_t need[2] = {need0, need1};
+    for (int i = 0; i < 2; i++) {
+        str_rope_node_t *n = rope->spare[i];
+        if (!need[i] || (n && n->cap >= need[i]))
+            continue;
+        n = n ? _str_rope_grow(n, need[i]) : _str_rope_node(rope, NULL, need[i]);
+        if (!n)
+            return false;
+        rope->spare[i] = n;
+    }
+    return true;
+}
+
+static str_rope_node_t *_str_rope_merge(str_rope_node_t *a, str_rope_node_t *b) {
+    if (!a)
+        return b;
+    if (!b)
+        return a;
+    if (a->priority > b->priority) {
+        a->right = _str_rope_merge(a->right, b);
+        _str_rope_update(a);
+        return a;
+    }
+    b->left = _str_rope_merge(a, b->left);
+    _str_rope_update(b);
+    return b;
+}
+
+/* Split t into [0, pos) and [pos, size), cutting a chunk in two when pos
+   falls inside it (the tail goes into *spare, reserved big enough for it) */
+static void _str_rope_split(str_rope_node_t **spare, str_rope_node_t *t, size_t pos, str_rope_node_t **l, str_rope_node_t **r) {
+    if (!t) {
+        *l = *r = NULL;
+        return;
+    }
+    size_t ls = _str_rope_size(t->left);
+    if (pos <= ls) {
+        _str_rope_split(spare, t->left, pos, l, &t->left);
+        _str_rope_update(t);
+        *r = t;
+    } else if (pos >= ls + t->len) {
+        _str_rope_split(spare, t->right, pos - ls - t->len, &t->right, r);
+        _str_rope_update(t);
+        *l = t;
+    } else {
+        size_t off = pos - ls;
+        str_rope_node_t *tail = *spare;
+        *spare = NULL;
+        tail->len = (uint32_t)(t->len - off);
+        tail->size = tail->len;
+        memcpy(tail->data, t->data + off, tail->len);
+        t->len = (uint32_t)off;
+        str_rope_node_t *right = t->right;
+        t->right = NULL;
+        _str_rope_update(t);
+        *l = t;
+        *r = _str_rope_merge(tail, right);
+    }
+}
+
+/* Remove the first chunk of t into *first, returns what is left of t */
+static str_rope_node_t *_str_rope_pop_first(str_rope_node_t *t, str_rope_node_t **first) {
+    if (!t->left) {
+        str_rope_node_t *right = t->right;
+        t->right = NULL;
+        _str_rope_update(t);
+        *first = t;
+        return right;
+    }
+    t->left = _str_rope_pop_first(t->left, first);
+    _str_rope_update(t);
+    return t;
+}
+
+/* Remove the last chunk of t into *last, returns what is left of t */
+static str_rope_node_t *_str_rope_pop_last(str_rope_node_t *t, str_rope_node_t **last) {
+    if (!t->right) {
+        str_rope_node_t *left = t->left;
+        t->left = NULL;
+        _str_rope_update(t);
+        *last = t;
+        return left;
+    }
+    t->right = _str_rope_pop_last(t->right, last);
+    _str_rope_update(t);
+    return t;
+}
+
+/* Merge l and r, folding the two chunks that meet at the seam into one
+   when either is below STR_ROPE_MERGE_SIZE and together they fit a chunk.
+   If the fold cannot allocate, the chunks are simply kept apart. */
+static str_rope_node_t *_str_rope_join(str_rope_node_t *l, str_rope_node_t *r) {
+    if (!l || !r)
+        return _str_rope_merge(l, r);
+    const str_rope_node_t *a = l, *b = r;
+    while (a->right)
+        a = a->right;
+    while (b->left)
+        b = b->left;
+    size_t len = a->len + b->len;
+    if (len > STR_ROPE_CHUNK_SIZE || (a->len >= STR_ROPE_MERGE_SIZE && b->len >= STR_ROPE_MERGE_SIZE))
+        return _str_rope_merge(l, r);
+    str_rope_node_t *last, *first;
+    l = _str_rope_pop_last(l, &last);
+    r = _str_rope_pop_first(r, &first);
+    if (last->cap < len) {
+        str_rope_node_t *grown = _str_rope_grow(last, len);
+        if (!grown)
+            return _str_rope_merge(_str_rope_merge(l, last), _str_rope_merge(first, r));
+        last = grown;
+    }
+    memcpy(last->data + last->len, first->data, first->len);
+    last->len = (uint32_t)len;
+    last->size = len;
+    STR_FREE(first);
+    return _str_rope_merge(_str_rope_merge(l, last), r);
+}
+
+/* Link to the chunk for an insertion at pos, preferring the end of the
+   preceding chunk */
+static str_rope_node_t **_str_rope_insert_target(str_rope_node_t **link, size_t pos, size_t *off) {
+    while (*link) {
+        str_rope_node_t *t = *link;
+        size_t ls = _str_rope_size(t->left);
+        if (pos < ls || (pos == ls && t->left))
+            link = &t->left;
+        else if (pos <= ls + t->len) {
+            *off = pos - ls;
+            return link;
+        } else {
+            pos -= ls + t->len;
+            link = &t->right;
+        }
+    }
+    return NULL;
+}
+
+/* Build a treap holding v split into full chunks */
+static str_rope_node_t *_str_rope_build(str_rope_t *rope, str_view_t v, bool *ok) {
+    str_rope_node_t *root = NULL;
+    *ok = true;
+    for (size_t i = 0; i < v.length; i += STR_ROPE_CHUNK_SIZE) {
+        size_t n = v.length - i < STR_ROPE_CHUNK_SIZE ? v.length - i : STR_ROPE_CHUNK_SIZE;
+        str_rope_node_t *node = _str_rope_node(rope, v.data + i, n);
+        if (!node) {
+            _str_rope_free(root);
+            *ok = false;
+            return NULL;
+        }
+        root = _str_rope_merge(root, node);
     }
+    return root;
+}
+
+str_rope_t *str_rope_create(void) {
+    str_rope_t *rope = (str_rope_t *)STR_MALLOC(sizeof(str_rope_t));
+    if (!rope)
+        return NULL;
+    rope->root = NULL;
+    rope->spare[0] = rope->spare[1] = NULL;
+    rope->seed = 0x9E3779B9u;
+    rope->version = 0;
+    return rope;
+}
+
+str_rope_t *str_rope_from_view(str_view_t v) {
+    str_rope_t *rope = str_rope_create();
+    if (rope && !str_rope_append(rope, v)) {
+        str_rope_destroy(rope);
+        return NULL;
+    }
+    return rope;
+}
+
+void str_rope_destroy(str_rope_t *rope) {
+    if (!rope)
+        return;
+    _str_rope_free(rope->root);
+    STR_FREE(rope->spare[0]);
+    STR_FREE(rope->spare[1]);
+    STR_FREE(rope);
+}
+
+size_t str_rope_length(const str_rope_t *rope) {
+    return _str_rope_size(rope->root);
+}
+
+bool str_rope_insert(str_rope_t *rope, size_t pos, str_view_t v) {
+    if (pos > _str_rope_size(rope->root))
+        return false;
+    if (!v.length)
+        return true;
+    size_t off;
+    str_rope_node_t **link = _str_rope_insert_target(&rope->root, pos, &off);
+    str_rope_node_t *t = link ? *link : NULL;
+    if (t && t->len + v.length <= STR_ROPE_CHUNK_SIZE) {
+        // Fast path: the text fits in the chunk at pos
+        if (t->len + v.length > t->cap) {
+            size_t cap = t->cap * 2 < STR_ROPE_CHUNK_SIZE ? t->cap * 2 : STR_ROPE_CHUNK_SIZE;
+            str_rope_node_t *grown = _str_rope_grow(t, cap > t->len + v.length ? cap : t->len + v.length);
+            if (!grown)
+                return false;
+            *link = t = grown;
+        }
+        rope->version++;
+        memmove(t->data + off + v.length, t->data + off, t->len - off);
+        memcpy(t->data + off, v.data, v.length);
+        t->len += (uint32_t)v.length;
+        for (str_rope_node_t *n = rope->root; n != t;) {
+            size_t ls = _str_rope_size(n->left);
+            n->size += v.length;
+            if (pos < ls || (pos == ls && n->left))
+                n = n->left;
+            else {
+                pos -= ls + n->len;
+                n = n->right;
+            }
+        }
+        t->size += v.length;
+        return true;
+    }
+    bool ok;
+    if (!_str_rope_reserve(rope, _str_rope_cut(rope->root, pos), 0))
+        return false;
+    str_rope_node_t *mid = _str_rope_build(rope, v, &ok), *l, *r;
+    if (!ok)
+        return false;
+    rope->version++;
+    _str_rope_split(&rope->spare[0], rope->root, pos, &l, &r);
+    rope->root = _str_rope_join(_str_rope_join(l, mid), r);
+    return true;
+}
+
+bool str_rope_append(str_rope_t *rope, str_view_t v) {
+    return str_rope_insert(rope, _str_rope_size(rope->root), v);
+}
+
+bool str_rope_erase(str_rope_t *rope, size_t pos, size_t len) {
+    size_t size = _str_rope_size(rope->root);
+    if (pos >= size || !len)
+        return true;
+    if (len > size - pos)
+        len = size - pos;
+    if (!_str_rope_reserve(rope, _str_rope_cut(rope->root, pos), _str_rope_cut(rope->root, pos + len)))
+        return false;
+    rope->version++;
+    str_rope_node_t *l, *m, *r;
+    _str_rope_split(&rope->spare[0], rope->root, pos, &l, &r);
+    _str_rope_split(&rope->spare[1], r, len, &m, &r);
+    _str_rope_free(m);
+    rope->root = _str_rope_join(l, r);
+    return true;
+}
+
+void str_rope_concat(str_rope_t *dest, str_rope_t *src) {
+    dest->version++;
+    src->version++;
+    dest->root = _str_rope_join(dest->root, src->root);
+    src->root = NULL;
+}
+
+/* Chunk holding byte pos, with *off set to the offset inside it */
+static const str_rope_node_t *_str_rope_find(const str_rope_node_t *t, size_t pos, size_t *off) {
+    while (t) {
+        size_t ls = _str_rope_size(t->left);
+        if (pos < ls)
+            t = t->left;
+        else if (pos < ls + t->len) {
+            *off = pos - ls;
+            return t;
+        } else {
+            pos -= ls + t->len;
+            t = t->right;
+        }
+    }
+    return NULL;
+}
+
+char str_rope_char_at(const str_rope_t *rope, size_t index) {
+    size_t off;
+    const str_rope_node_t *t = _str_rope_find(rope->root, index, &off);
+    return t ? t->data[off] : 0;
+}
+
+/* Push a chunk still to visit. A full stack drops its bottom entry; the
+   iterator seeks again from its offset when the stack runs dry early. */
+static void _str_rope_iter_push(str_rope_iter_t *it, const str_rope_node_t *t) {
+    if (it->depth == STR_ROPE_ITER_DEPTH) {
+        memmove(it->stack, it->stack + 1, (STR_ROPE_ITER_DEPTH - 1) * sizeof(it->stack[0]));
+        it->depth--;
+    }
+    it->stack[it->depth++] = t;
+}
+
+/* Push t and its chain of left children, the leftmost ends up on top */
+static void _str_rope_iter_descend(str_rope_iter_t *it, const str_rope_node_t *t) {
+    for (; t; t = t->left)
+        _str_rope_iter_push(it, t);
+}
+
+/* Rebuild the stack for it->pos, returns the offset into the top chunk */
+static size_t _str_rope_iter_seek(str_rope_iter_t *it) {
+    const str_rope_node_t *t = it->rope->root;
+    size_t pos = it->pos;
+    it->depth = 0;
+    it->version = it->rope->version;
+    while (t) {
+        size_t ls = _str_rope_size(t->left);
+        if (pos < ls) {
+            _str_rope_iter_push(it, t);
+            t = t->left;
+        } else if (pos < ls + t->len) {
+            _str_rope_iter_push(it, t);
+            return pos - ls;
+        } else {
+            pos -= ls + t->len;
+            t = t->right;
+        }
+    }
+    return 0;
+}
+
+str_rope_iter_t str_rope_iter(const str_rope_t *rope) {
+    str_rope_iter_t it;
+    it.rope = rope;
+    it.pos = 0;
+    it.version = rope->version;
+    it.depth = 0;
+    _str_rope_iter_descend(&it, rope->root);
+    return it;
+}
+
+bool str_rope_iter_next(str_rope_iter_t *it, str_view_t *out) {
+    size_t off = 0;
+    if (it->version != it->rope->version || (!it->depth && it->pos < _str_rope_size(it->rope->root)))
+        off = _str_rope_iter_seek(it);
+    while (it->depth) {
+        const str_rope_node_t *t = it->stack[--it->depth];
+        _str_rope_iter_descend(it, t->right);
+        if (off < t->len) {
+            out->data = t->data + off;
+            out->length = t->len - off;
+            it->pos += out->length;
+            return true;
+        }
+        off = 0;
+    }
+    return false;
+}
+
+str_t str_rope_flatten(const str_rope_t *rope) {
+    str_t s = _str_new(STR_TYPE_ASCII, _str_rope_size(rope->root));
+    if (!s)
+        return NULL;
+    str_rope_iter_t it = str_rope_iter(rope);
+    char *dst = (char *)s;
+    for (str_view_t v; str_rope_iter_next(&it, &v); dst += v.length)
+        memcpy(dst, v.data, v.length);
+    return s;
+}
+
+static const char _STR_DIGITS2[201] = "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+                                     "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+                                     "8081828384858687888990919293949596979899";
+
+/* Write v in decimal ending just before end, returns the first character */
+static char *_str_fmt_u64(char *end, uint64_t v) {
+    while (v >= 100) {
+        unsigned r = (unsigned)(v % 100);
+        v /= 100;
+        end -= 2;
+        memcpy(end, _STR_DIGITS2 + r * 2, 2);
+    }
+    if (v >= 10) {
+        end -= 2;
+        memcpy(end, _STR_DIGITS2 + v * 2, 2);
+    } else
+        *--end = (char)('0' + v);
+    return end;
+}
+
+static char *_str_fmt_i64(char *end, int64_t v) {
+    if (v >= 0)
+        return _str_fmt_u64(end, (uint64_t)v);
+    char *p = _str_fmt_u64(end, 0 - (uint64_t)v);
+    *--p = '-';
+    return p;
+}
+
+/* Tables for Ryu: 5^i normalised to 125 bits, and 2^k / 5^i rounded up */
+static const uint64_t _STR_POW5_INV_SPLIT[342][2] = {
+    {1u, 2305843009213693952u}, {11068046444225730970u, 1844674407370955161u},
+    {5165088340638674453u, 1475739525896764129u}, {7821419487252849886u, 1180591620717411303u},
+    {8824922364862649494u, 1888946593147858085u}, {7059937891890119595u, 1511157274518286468u},
+    {13026647942995916322u, 1208925819614629174u}, {9774590264567735146u, 1934281311383406679u},
+    {11509021026396098440u, 1547425049106725343u}, {16585914450600699399u, 1237940039285380274u},
+    {15469416676735388068u, 1980704062856608439u}, {16064882156130220778u, 1584563250285286751u},
+    {9162556910162266299u, 1267650600228229401u}, {7281393426775805432u, 2028240960365167042u},
+    {16893161185646375315u, 1622592768292133633u}, {2446482504291369283u, 1298074214633706907u},
+    {7603720821608101175u, 2076918743413931051u}, {2393627842544570617u, 1661534994731144841u},
+    {16672297533003297786u, 1329227995784915872u}, {11918280793837635165u, 2126764793255865396u},
+    {5845275820328197809u, 1701411834604692317u}, {15744267100488289217u, 1361129467683753853u},
+    {3054734472329800808u, 2177807148294006166u}, {17201182836831481939u, 1742245718635204932u},
+    {6382248639981364905u, 1393796574908163946u}, {2832900194486363201u, 2230074519853062314u},
+    {5955668970331000884u, 1784059615882449851u}, {1075186361522890384u, 1427247692705959881u},
+    {12788344622662355584u, 2283596308329535809u}, {13920024512871794791u, 1826877046663628647u},
+    {3757321980813615186u, 1461501637330902918u}, {10384555214134712795u, 1169201309864722334u},
+    {5547241898389809503u, 1870722095783555735u}, {4437793518711847602u, 1496577676626844588u},
+    {10928932444453298728u, 1197262141301475670u}, {17486291911125277965u, 1915619426082361072u},
+    {6610335899416401726u, 1532495540865888858u}, {12666966349016942027u, 1225996432692711086u},
+    {12888448528943286597u, 1961594292308337738u}, {17689456452638449924u, 1569275433846670190u},
+    {14151565162110759939u, 1255420347077336152u}, {7885109000409574610u, 2008672555323737844u},
+    {9997436015069570011u, 1606938044258990275u}, {7997948812055656009u, 1285550435407192220u},
+    {12796718099289049614u, 2056880696651507552u}, {2858676849947419045u, 1645504557321206042u},
+    {13354987924183666206u, 1316403645856964833u}, {17678631863951955605u, 2106245833371143733u},
+    {3074859046935833515u, 1684996666696914987u}, {13527933681774397782u, 1347997333357531989u},
+    {10576647446613305481u, 2156795733372051183u}, {15840015586774465031u, 1725436586697640946u},
+    {8982663654677661702u, 1380349269358112757u}, {18061610662226169046u, 2208558830972980411u},
+    {10759939715039024913u, 1766847064778384329u}, {12297300586773130254u, 1413477651822707463u},
+    {15986332124095098083u, 2261564242916331941u}, {9099716884534168143u, 1809251394333065553u},
+    {14658471137111155161u, 1447401115466452442u}, {4348079280205103483u, 1157920892373161954u},
+    {14335624477811986218u, 1852673427797059126u}, {7779150767507678651u, 1482138742237647301u},
+    {2533971799264232598u, 1185710993790117841u}, {15122401323048503126u, 1897137590064188545u},
+    {12097921058438802501u, 1517710072051350836u}, {5988988032009131678u, 1214168057641080669u},
+    {16961078480698431330u, 1942668892225729070u}, {13568862784558745064u, 1554135113780583256u},
+    {7165741412905085728u, 1243308091024466605u}, {11465186260648137165u, 1989292945639146568u},
+    {16550846638002330379u, 1591434356511317254u}, {16930026125143774626u, 1273147485209053803u},
+    {4951948911778577463u, 2037035976334486086u}, {272210314680951647u, 1629628781067588869u},
+    {3907117066486671641u, 1303703024854071095u}, {6251387306378674625u, 2085924839766513752u},
+    {16069156289328670670u, 1668739871813211001u}, {9165976216721026213u, 1334991897450568801u},
+    {7286864317269821294u, 2135987035920910082u}, {16897537898041588005u, 1708789628736728065u},
+    {13518030318433270404u, 1367031702989382452u}, {6871453250525591353u, 2187250724783011924u},
+    {9186511415162383406u, 1749800579826409539u}, {11038557946871817048u, 1399840463861127631u},
+    {10282995085511086630u, 2239744742177804210u}, {8226396068408869304u, 1791795793742243368u},
+    {13959814484210916090u, 1433436634993794694u}, {11267656730511734774u, 2293498615990071511u},
+    {5324776569667477496u, 1834798892792057209u}, {7949170070475892320u, 1467839114233645767u},
+    {17427382500606444826u, 1174271291386916613u}, {5747719112518849781u, 1878834066219066582u},
+    {15666221734240810795u, 1503067252975253265u}, {12532977387392648636u, 1202453802380202612u},
+    {5295368560860596524u, 1923926083808324180u}, {4236294848688477220u, 1539140867046659344u},
+    {7078384693692692099u, 1231312693637327475u}, {11325415509908307358u, 1970100309819723960u},
+    {9060332407926645887u, 1576080247855779168u}, {14626963555825137356u, 1260864198284623334u},
+    {12335095245094488799u, 2017382717255397335u}, {9868076196075591040u, 1613906173804317868u},
+    {15273158586344293478u, 1291124939043454294u}, {13369007293925138595u, 2065799902469526871u},
+    {7005857020398200553u, 1652639921975621497u}, {16672732060544291412u, 1322111937580497197u},
+    {11918976037903224966u, 2115379100128795516u}, {5845832015580669650u, 1692303280103036413u},
+    {12055363241948356366u, 1353842624082429130u}, {841837113407818570u, 2166148198531886609u},
+    {4362818505468165179u, 1732918558825509287u}, {14558301248600263113u, 1386334847060407429u},
+    {12225235553534690011u, 2218135755296651887u}, {2401490813343931363u, 1774508604237321510u},
+    {1921192650675145090u, 1419606883389857208u}, {17831303500047873437u, 2271371013423771532u},
+    {6886345170554478103u, 1817096810739017226u}, {1819727321701672159u, 1453677448591213781u},
+    {16213177116328979020u, 1162941958872971024u}, {14873036941900635463u, 1860707134196753639u},
+    {15587778368262418694u, 1488565707357402911u}, {8780873879868024632u, 1190852565885922329u},
+    {2981351763563108441u, 1905364105417475727u}, {13453127855076217722u, 1524291284333980581u},
+    {7073153469319063855u, 1219433027467184465u}, {11317045550910502167u, 1951092843947495144u},
+    {12742985255470312057u, 1560874275157996115u}, {10194388204376249646u, 1248699420126396892u},
+    {1553625868034358140u, 1997919072202235028u}, {8621598323911307159u, 1598335257761788022u},
+    {17965325103354776697u, 1278668206209430417u}, {13987124906400001422u, 2045869129935088668u},
+    {121653480894270168u, 1636695303948070935u}, {97322784715416134u, 1309356243158456748u},
+    {14913111714512307107u, 2094969989053530796u}, {8241140556867935363u, 1675975991242824637u},
+    {17660958889720079260u, 1340780792994259709u}, {17189487779326395846u, 2145249268790815535u},
+    {13751590223461116677u, 1716199415032652428u}, {18379969808252713988u, 1372959532026121942u},
+    {14650556434236701088u, 2196735251241795108u}, {652398703163629901u, 1757388200993436087u},
+    {11589965406756634890u, 1405910560794748869u}, {7475898206584884855u, 2249456897271598191u},
+    {2291369750525997561u, 1799565517817278553u}, {9211793429904618695u, 1439652414253822842u},
+    {18428218302589300235u, 2303443862806116547u}, {7363877012587619542u, 1842755090244893238u},
+    {13269799239553916280u, 1474204072195914590u}, {10615839391643133024u, 1179363257756731672u},
+    {2227947767661371545u, 1886981212410770676u}, {16539753473096738529u, 1509584969928616540u},
+    {13231802778477390823u, 1207667975942893232u}, {6413489186596184024u, 1932268761508629172u},
+    {16198837793502678189u, 1545815009206903337u}, {5580372605318321905u, 1236652007365522670u},
+    {8928596168509315048u, 1978643211784836272u}, {18210923379033183008u, 1582914569427869017u},
+    {7190041073742725760u, 1266331655542295214u}, {436019273762630246u, 2026130648867672343u},
+    {7727513048493924843u, 1620904519094137874u}, {9871359253537050198u, 1296723615275310299u},
+    {4726128361433549347u, 2074757784440496479u}, {7470251503888749801u, 1659806227552397183u},
+    {13354898832594820487u, 1327844982041917746u}, {13989140502667892133u, 2124551971267068394u},
+    {14880661216876224029u, 1699641577013654715u}, {11904528973500979224u, 1359713261610923772u},
+    {4289851098633925465u, 2175541218577478036u}, {18189276137874781665u, 1740432974861982428u},
+    {3483374466074094362u, 1392346379889585943u}, {1884050330976640656u, 2227754207823337509u},
+    {5196589079523222848u, 1782203366258670007u}, {15225317707844309248u, 1425762693006936005u},
+    {5913764258841343181u, 2281220308811097609u}, {8420360221814984868u, 1824976247048878087u},
+    {17804334621677718864u, 1459980997639102469u}, {17932816512084085415u, 1167984798111281975u},
+    {10245762345624985047u, 1868775676978051161u}, {4507261061758077715u, 1495020541582440929u},
+    {7295157664148372495u, 1196016433265952743u}, {7982903447895485668u, 1913626293225524389u},
+    {10075671573058298858u, 1530901034580419511u}, {4371188443704728763u, 1224720827664335609u},
+    {14372599139411386667u, 1959553324262936974u}, {15187428126271019657u, 1567642659410349579u},
+    {15839291315758726049u, 1254114127528279663u}, {3206773216762499739u, 2006582604045247462u},
+    {13633465017635730761u, 1605266083236197969u}, {14596120828850494932u, 1284212866588958375u},
+    {4907049252451240275u, 2054740586542333401u}, {236290587219081897u, 1643792469233866721u},
+    {14946427728742906810u, 1315033975387093376u}, {16535586736504830250u, 2104054360619349402u},
+    {5849771759720043554u, 1683243488495479522u}, {15747863852001765813u, 1346594790796383617u},
+    {10439186904235184007u, 2154551665274213788u}, {15730047152871967852u, 1723641332219371030u},
+    {12584037722297574282u, 1378913065775496824u}, {9066413911450387881u, 2206260905240794919u},
+    {10942479943902220628u, 1765008724192635935u}, {8753983955121776503u, 1412006979354108748u},
+    {10317025513452932081u, 2259211166966573997u}, {874922781278525018u, 1807368933573259198u},
+    {8078635854506640661u, 1445895146858607358u}, {13841606313089133175u, 1156716117486885886u},
+    {14767872471458792434u, 1850745787979017418u}, {746251532941302978u, 1480596630383213935u},
+    {597001226353042382u, 1184477304306571148u}, {15712597221132509104u, 1895163686890513836u},
+    {8880728962164096960u, 1516130949512411069u}, {10793931984473187891u, 1212904759609928855u},
+    {17270291175157100626u, 1940647615375886168u}, {2748186495899949531u, 1552518092300708935u},
+    {2198549196719959625u, 1242014473840567148u}, {18275073973719576693u, 1987223158144907436u},
+    {10930710364233751031u, 1589778526515925949u}, {12433917106128911148u, 1271822821212740759u},
+    {8826220925580526867u, 2034916513940385215u}, {7060976740464421494u, 1627933211152308172u},
+    {16716827836597268165u, 1302346568921846537u}, {11989529279587987770u, 2083754510274954460u},
+    {9591623423670390216u, 1667003608219963568u}, {15051996368420132820u, 1333602886575970854u},
+    {13015147745246481542u, 2133764618521553367u}, {3033420566713364587u, 1707011694817242694u},
+    {6116085268112601993u, 1365609355853794155u}, {9785736428980163188u, 2184974969366070648u},
+    {15207286772667951197u, 1747979975492856518u}, {1097782973908629988u, 1398383980394285215u},
+    {1756452758253807981u, 2237414368630856344u}, {5094511021344956708u, 1789931494904685075u},
+    {4075608817075965366u, 1431945195923748060u}, {6520974107321544586u, 2291112313477996896u},
+    {1527430471115325346u, 1832889850782397517u}, {12289990821117991246u, 1466311880625918013u},
+    {17210690286378213644u, 1173049504500734410u}, {9090360384495590213u, 1876879207201175057u},
+    {18340334751822203140u, 1501503365760940045u}, {14672267801457762512u, 1201202692608752036u},
+    {16096930852848599373u, 1921924308174003258u}, {1809498238053148529u, 1537539446539202607u},
+    {12515645034668249793u, 1230031557231362085u}, {1578287981759648052u, 1968050491570179337u},
+    {12330676829633449412u, 1574440393256143469u}, {13553890278448669853u, 1259552314604914775u},
+    {3239480371808320148u, 2015283703367863641u}, {17348979556414297411u, 1612226962694290912u},
+    {6500486015647617283u, 1289781570155432730u}, {10400777625036187652u, 2063650512248692368u},
+    {15699319729512770768u, 1650920409798953894u}, {16248804598352126938u, 1320736327839163115u},
+    {7551343283653851484u, 2113178124542660985u}, {6041074626923081187u, 1690542499634128788u},
+    {12211557331022285596u, 1352433999707303030u}, {1091747655926105338u, 2163894399531684849u},
+    {4562746939482794594u, 1731115519625347879u}, {7339546366328145998u, 1384892415700278303u},
+    {8053925371383123274u, 2215827865120445285u}, {6443140297106498619u, 1772662292096356228u},
+    {12533209867169019542u, 1418129833677084982u}, {5295740528502789974u, 2269007733883335972u},
+    {15304638867027962949u, 1815206187106668777u}, {4865013464138549713u, 1452164949685335022u},
+    {14960057215536570740u, 1161731959748268017u}, {9178696285890871890u, 1858771135597228828u},
+    {14721654658196518159u, 1487016908477783062u}, {4398626097073393881u, 1189613526782226450u},
+    {7037801755317430209u, 1903381642851562320u}, {5630241404253944167u, 1522705314281249856u},
+    {814844308661245011u, 1218164251424999885u}, {1303750893857992017u, 1949062802279999816u},
+    {15800395974054034906u, 1559250241823999852u}, {5261619149759407279u, 1247400193459199882u},
+    {12107939454356961969u, 1995840309534719811u}, {5997002748743659252u, 1596672247627775849u},
+    {8486951013736837725u, 1277337798102220679u}, {2511075177753209390u, 2043740476963553087u},
+    {13076906586428298482u, 1634992381570842469u}, {14150874083884549109u, 1307993905256673975u},
+    {4194654460505726958u, 2092790248410678361u}, {18113118827372222859u, 1674232198728542688u},
+    {3422448617672047318u, 1339385758982834151u}, {16543964232501006678u, 2143017214372534641u},
+    {9545822571258895019u, 1714413771498027713u}, {15015355686490936662u, 1371531017198422170u},
+    {5577825024675947042u, 2194449627517475473u}, {11840957649224578280u, 1755559702013980378u},
+    {16851463748863483271u, 1404447761611184302u}, {12204946739213931940u, 2247116418577894884u},
+    {13453306206113055875u, 1797693134862315907u}, {3383947335406624054u, 1438154507889852726u},
+    {16482362180876329456u, 2301047212623764361u}, {9496540929959153242u, 1840837770099011489u},
+    {11286581558709232917u, 1472670216079209191u}, {5339916432225476010u, 1178136172863367353u},
+    {4854517476818851293u, 1885017876581387765u}, {3883613981455081034u, 1508014301265110212u},
+    {14174937629389795797u, 1206411441012088169u}, {11611853762797942306u, 1930258305619341071u},
+    {5600134195496443521u, 1544206644495472857u}, {15548153800622885787u, 1235365315596378285u},
+    {6430302007287065643u, 1976584504954205257u}, {16212288050055383484u, 1581267603963364205u},
+    {12969830440044306787u, 1265014083170691364u}, {9683682259845159889u, 2024022533073106183u},
+    {15125643437359948558u, 1619218026458484946u}, {8411165935146048523u, 1295374421166787957u},
+    {17147214310975587960u, 2072599073866860731u}, {10028422634038560045u, 1658079259093488585u},
+    {8022738107230848036u, 1326463407274790868u}, {9147032156827446534u, 2122341451639665389u},
+    {11006974540203867551u, 1697873161311732311u}, {5116230817421183718u, 1358298529049385849u},
+    {15564666937357714594u, 2173277646479017358u}, {1383687105660440706u, 1738622117183213887u},
+    {12174996128754083534u, 1390897693746571109u}, {8411947361780802685u, 2225436309994513775u},
+    {6729557889424642148u, 1780349047995611020u}, {5383646311539713719u, 1424279238396488816u},
+    {1235136468979721303u, 2278846781434382106u}, {15745504434151418335u, 1823077425147505684u},
+    {16285752362063044992u, 1458461940118004547u}, {5649904260166615347u, 1166769552094403638u},
+    {5350498001524674232u, 1866831283351045821u}, {591049586477829062u, 1493465026680836657u},
+    {11540886113407994219u, 1194772021344669325u}, {18673707743239135u, 1911635234151470921u},
+    {14772334225162232601u, 1529308187321176736u}, {8128518565387875758u, 1223446549856941389u},
+    {1937583260394870242u, 1957514479771106223u}, {8928764237799716840u, 1566011583816884978u},
+    {14521709019723594119u, 1252809267053507982u}, {8477339172590109297u, 2004494827285612772u},
+    {17849917782297818407u, 1603595861828490217u}, {6901236596354434079u, 1282876689462792174u},
+    {18420676183650915173u, 2052602703140467478u}, {3668494502695001169u, 1642082162512373983u},
+    {10313493231639821582u, 1313665730009899186u}, {9122891541139893884u, 2101865168015838698u},
+    {14677010862395735754u, 1681492134412670958u}, {673562245690857633u, 1345193707530136767u},
+};
+static const uint64_t _STR_POW5_SPLIT[326][2] = {
+    {0u, 1152921504606846976u}, {0u, 1441151880758558720u}, {0u, 1801439850948198400u},
+    {0u, 2251799813685248000u}, {0u, 1407374883553280000u}, {0u, 1759218604441600000u},
+    {0u, 2199023255552000000u}, {0u, 1374389534720000000u}, {0u, 1717986918400000000u},
+    {0u, 2147483648000000000u}, {0u, 1342177280000000000u}, {0u, 1677721600000000000u},
+    {0u, 2097152000000000000u}, {0u, 1310720000000000000u}, {0u, 1638400000000000000u},
+    {0u, 2048000000000000000u}, {0u, 1280000000000000000u}, {0u, 1600000000000000000u},
+    {0u, 2000000000000000000u}, {0u, 1250000000000000000u}, {0u, 1562500000000000000u},
+    {0u, 1953125000000000000u}, {0u, 1220703125000000000u}, {0u, 1525878906250000000u},
+    {0u, 1907348632812500000u}, {0u, 1192092895507812500u}, {0u, 1490116119384765625u},
+    {4611686018427387904u, 1862645149230957031u}, {9799832789158199296u, 1164153218269348144u},
+    {12249790986447749120u, 1455191522836685180u}, {15312238733059686400u, 1818989403545856475u},
+    {14528612397897220096u, 2273736754432320594u}, {13692068767113150464u, 1421085471520200371u},
+    {12503399940464050176u, 1776356839400250464u}, {15629249925580062720u, 2220446049250313080u},
+    {9768281203487539200u, 1387778780781445675u}, {7598665485932036096u, 1734723475976807094u},
+    {274959820560269312u, 2168404344971008868u}, {9395221924704944128u, 1355252715606880542u},
+    {2520655369026404352u, 1694065894508600678u}, {12374191248137781248u, 2117582368135750847u},
+    {14651398557727195136u, 1323488980084844279u}, {13702562178731606016u, 1654361225106055349u},
+    {3293144668132343808u, 2067951531382569187u}, {18199116482078572544u, 1292469707114105741u},
+    {8913837547316051968u, 1615587133892632177u}, {15753982952572452864u, 2019483917365790221u},
+    {12152082354571476992u, 1262177448353618888u}, {15190102943214346240u, 1577721810442023610u},
+    {9764256642163156992u, 1972152263052529513u}, {17631875447420442880u, 1232595164407830945u},
+    {8204786253993389888u, 1540743955509788682u}, {1032610780636961552u, 1925929944387235853u},
+    {2951224747111794922u, 1203706215242022408u}, {3689030933889743652u, 1504632769052528010u},
+    {13834660704216955373u, 1880790961315660012u}, {17870034976990372916u, 1175494350822287507u},
+    {17725857702810578241u, 1469367938527859384u}, {3710578054803671186u, 1836709923159824231u},
+    {26536550077201078u, 2295887403949780289u}, {11545800389866720434u, 1434929627468612680u},
+    {14432250487333400542u, 1793662034335765850u}, {8816941072311974870u, 2242077542919707313u},
+    {17039803216263454053u, 1401298464324817070u}, {12076381983474541759u, 1751623080406021338u},
+    {5872105442488401391u, 2189528850507526673u}, {15199280947623720629u, 1368455531567204170u},
+    {9775729147674874978u, 1710569414459005213u}, {16831347453020981627u, 2138211768073756516u},
+    {1296220121283337709u, 1336382355046097823u}, {15455333206886335848u, 1670477943807622278u},
+    {10095794471753144002u, 2088097429759527848u}, {6309871544845715001u, 1305060893599704905u},
+    {12499025449484531656u, 1631326116999631131u}, {11012095793428276666u, 2039157646249538914u},
+    {11494245889320060820u, 1274473528905961821u}, {532749306367912313u, 1593091911132452277u},
+    {5277622651387278295u, 1991364888915565346u}, {7910200175544436838u, 1244603055572228341u},
+    {14499436237857933952u, 1555753819465285426u}, {8900923260467641632u, 1944692274331606783u},
+    {12480606065433357876u, 1215432671457254239u}, {10989071563364309441u, 1519290839321567799u},
+    {9124653435777998898u, 1899113549151959749u}, {8008751406574943263u, 1186945968219974843u},
+    {5399253239791291175u, 1483682460274968554u}, {15972438586593889776u, 1854603075343710692u},
+    {759402079766405302u, 1159126922089819183u}, {14784310654990170340u, 1448908652612273978u},
+    {9257016281882937117u, 1811135815765342473u}, {16182956370781059300u, 2263919769706678091u},
+    {7808504722524468110u, 1414949856066673807u}, {5148944884728197234u, 1768687320083342259u},
+    {1824495087482858639u, 2210859150104177824u}, {1140309429676786649u, 1381786968815111140u},
+    {1425386787095983311u, 1727233711018888925u}, {6393419502297367043u, 2159042138773611156u},
+    {13219259225790630210u, 1349401336733506972u}, {16524074032238287762u, 1686751670916883715u},
+    {16043406521870471799u, 2108439588646104644u}, {803757039314269066u, 1317774742903815403u},
+    {14839754354425000045u, 1647218428629769253u}, {4714634887749086344u, 2059023035787211567u},
+    {9864175832484260821u, 1286889397367007229u}, {16941905809032713930u, 1608611746708759036u},
+    {2730638187581340797u, 2010764683385948796u}, {10930020904093113806u, 1256727927116217997u},
+    {18274212148543780162u, 1570909908895272496u}, {4396021111970173586u, 1963637386119090621u},
+    {5053356204195052443u, 1227273366324431638u}, {15540067292098591362u, 1534091707905539547u},
+    {14813398096695851299u, 1917614634881924434u}, {13870059828862294966u, 1198509146801202771u},
+    {12725888767650480803u, 1498136433501503464u}, {15907360959563101004u, 1872670541876879330u},
+    {14553786618154326031u, 1170419088673049581u}, {4357175217410743827u, 1463023860841311977u},
+    {10058155040190817688u, 1828779826051639971u}, {7961007781811134206u, 2285974782564549964u},
+    {14199001900486734687u, 1428734239102843727u}, {13137066357181030455u, 1785917798878554659u},
+    {11809646928048900164u, 2232397248598193324u}, {16604401366885338411u, 1395248280373870827u},
+    {16143815690179285109u, 1744060350467338534u}, {10956397575869330579u, 2180075438084173168u},
+    {6847748484918331612u, 1362547148802608230u}, {17783057643002690323u, 1703183936003260287u},
+    {17617136035325974999u, 2128979920004075359u}, {17928239049719816230u, 1330612450002547099u},
+    {17798612793722382384u, 1663265562503183874u}, {13024893955298202172u, 2079081953128979843u},
+    {5834715712847682405u, 1299426220705612402u}, {16516766677914378815u, 1624282775882015502u},
+    {11422586310538197711u, 2030353469852519378u}, {11750802462513761473u, 1268970918657824611u},
+    {10076817059714813937u, 1586213648322280764u}, {12596021324643517422u, 1982767060402850955u},
+    {5566670318688504437u, 1239229412751781847u}, {2346651879933242642u, 1549036765939727309u},
+    {7545000868343941206u, 1936295957424659136u}, {4715625542714963254u, 1210184973390411960u},
+    {5894531928393704067u, 1512731216738014950u}, {16591536947346905892u, 1890914020922518687u},
+    {17287239619732898039u, 1181821263076574179u}, {16997363506238734644u, 1477276578845717724u},
+    {2799960309088866689u, 1846595723557147156u}, {10973347230035317489u, 1154122327223216972u},
+    {13716684037544146861u, 1442652909029021215u}, {12534169028502795672u, 1803316136286276519u},
+    {11056025267201106687u, 2254145170357845649u}, {18439230838069161439u, 1408840731473653530u},
+    {13825666510731675991u, 1761050914342066913u}, {3447025083132431277u, 2201313642927583642u},
+    {6766076695385157452u, 1375821026829739776u}, {8457595869231446815u, 1719776283537174720u},
+    {10571994836539308519u, 2149720354421468400u}, {6607496772837067824u, 1343575221513417750u},
+    {17482743002901110588u, 1679469026891772187u}, {17241742735199000331u, 2099336283614715234u},
+    {15387775227926763111u, 1312085177259197021u}, {5399660979626290177u, 1640106471573996277u},
+    {11361262242960250625u, 2050133089467495346u}, {11712474920277544544u, 1281333180917184591u},
+    {10028907631919542777u, 1601666476146480739u}, {7924448521472040567u, 2002083095183100924u},
+    {14176152362774801162u, 1251301934489438077u}, {3885132398186337741u, 1564127418111797597u},
+    {9468101516160310080u, 1955159272639746996u}, {15140935484454969608u, 1221974545399841872u},
+    {479425281859160394u, 1527468181749802341u}, {5210967620751338397u, 1909335227187252926u},
+    {17091912818251750210u, 1193334516992033078u}, {12141518985959911954u, 1491668146240041348u},
+    {15176898732449889943u, 1864585182800051685u}, {11791404716994875166u, 1165365739250032303u},
+    {10127569877816206054u, 1456707174062540379u}, {8047776328842869663u, 1820883967578175474u},
+    {836348374198811271u, 2276104959472719343u}, {7440246761515338900u, 1422565599670449589u},
+    {13911994470321561530u, 1778206999588061986u}, {8166621051047176104u, 2222758749485077483u},
+    {2798295147690791113u, 1389224218428173427u}, {17332926989895652603u, 1736530273035216783u},
+    {17054472718942177850u, 2170662841294020979u}, {8353202440125167204u, 1356664275808763112u},
+    {10441503050156459005u, 1695830344760953890u}, {3828506775840797949u, 2119787930951192363u},
+    {86973725686804766u, 1324867456844495227u}, {13943775212390669669u, 1656084321055619033u},
+    {3594660960206173375u, 2070105401319523792u}, {2246663100128858359u, 1293815875824702370u},
+    {12031700912015848757u, 1617269844780877962u}, {5816254103165035138u, 2021587305976097453u},
+    {5941001823691840913u, 1263492066235060908u}, {7426252279614801142u, 1579365082793826135u},
+    {4671129331091113523u, 1974206353492282669u}, {5225298841145639904u, 1233878970932676668u},
+    {6531623551432049880u, 1542348713665845835u}, {3552843420862674446u, 1927935892082307294u},
+    {16055585193321335241u, 1204959932551442058u}, {10846109454796893243u, 1506199915689302573u},
+    {18169322836923504458u, 1882749894611628216u}, {11355826773077190286u, 1176718684132267635u},
+    {9583097447919099954u, 1470898355165334544u}, {11978871809898874942u, 1838622943956668180u},
+    {14973589762373593678u, 2298278679945835225u}, {2440964573842414192u, 1436424174966147016u},
+    {3051205717303017741u, 1795530218707683770u}, {13037379183483547984u, 2244412773384604712u},
+    {8148361989677217490u, 1402757983365377945u}, {14797138505523909766u, 1753447479206722431u},
+    {13884737113477499304u, 2191809349008403039u}, {15595489723564518921u, 1369880843130251899u},
+    {14882676136028260747u, 1712351053912814874u}, {9379973133180550126u, 2140438817391018593u},
+    {17391698254306313589u, 1337774260869386620u}, {3292878744173340370u, 1672217826086733276u},
+    {4116098430216675462u, 2090272282608416595u}, {266718509671728212u, 1306420176630260372u},
+    {333398137089660265u, 1633025220787825465u}, {5028433689789463235u, 2041281525984781831u},
+    {10060300083759496378u, 1275800953740488644u}, {12575375104699370472u, 1594751192175610805u},
+    {1884160825592049379u, 1993438990219513507u}, {17318501580490888525u, 1245899368887195941u},
+    {7813068920331446945u, 1557374211108994927u}, {5154650131986920777u, 1946717763886243659u},
+    {915813323278131534u, 1216698602428902287u}, {14979824709379828129u, 1520873253036127858u},
+    {9501408849870009354u, 1901091566295159823u}, {12855909558809837702u, 1188182228934474889u},
+    {2234828893230133415u, 1485227786168093612u}, {2793536116537666769u, 1856534732710117015u},
+    {8663489100477123587u, 1160334207943823134u}, {1605989338741628675u, 1450417759929778918u},
+    {11230858710281811652u, 1813022199912223647u}, {9426887369424876662u, 2266277749890279559u},
+    {12809333633531629769u, 1416423593681424724u}, {16011667041914537212u, 1770529492101780905u},
+    {6179525747111007803u, 2213161865127226132u}, {13085575628799155685u, 1383226165704516332u},
+    {16356969535998944606u, 1729032707130645415u}, {15834525901571292854u, 2161290883913306769u},
+    {2979049660840976177u, 1350806802445816731u}, {17558870131333383934u, 1688508503057270913u},
+    {8113529608884566205u, 2110635628821588642u}, {9682642023980241782u, 1319147268013492901u},
+    {16714988548402690132u, 1648934085016866126u}, {11670363648648586857u, 2061167606271082658u},
+    {11905663298832754689u, 1288229753919426661u}, {1047021068258779650u, 1610287192399283327u},
+    {15143834390605638274u, 2012858990499104158u}, {4853210475701136017u, 1258036869061940099u},
+    {1454827076199032118u, 1572546086327425124u}, {1818533845248790147u, 1965682607909281405u},
+    {3442426662494187794u, 1228551629943300878u}, {13526405364972510550u, 1535689537429126097u},
+    {3072948650933474476u, 1919611921786407622u}, {15755650962115585259u, 1199757451116504763u},
+    {15082877684217093670u, 1499696813895630954u}, {9630225068416591280u, 1874621017369538693u},
+    {8324733676974063502u, 1171638135855961683u}, {5794231077790191473u, 1464547669819952104u},
+    {7242788847237739342u, 1830684587274940130u}, {18276858095901949986u, 2288355734093675162u},
+    {16034722328366106645u, 1430222333808546976u}, {1596658836748081690u, 1787777917260683721u},
+    {6607509564362490017u, 2234722396575854651u}, {1823850468512862308u, 1396701497859909157u},
+    {6891499104068465790u, 1745876872324886446u}, {17837745916940358045u, 2182346090406108057u},
+    {4231062170446641922u, 1363966306503817536u}, {5288827713058302403u, 1704957883129771920u},
+    {6611034641322878003u, 2131197353912214900u}, {13355268687681574560u, 1331998346195134312u},
+    {16694085859601968200u, 1664997932743917890u}, {11644235287647684442u, 2081247415929897363u},
+    {4971804045566108824u, 1300779634956185852u}, {6214755056957636030u, 1625974543695232315u},
+    {3156757802769657134u, 2032468179619040394u}, {6584659645158423613u, 1270292612261900246u},
+    {17454196593302805324u, 1587865765327375307u}, {17206059723201118751u, 1984832206659219134u},
+    {6142101308573311315u, 1240520129162011959u}, {3065940617289251240u, 1550650161452514949u},
+    {8444111790038951954u, 1938312701815643686u}, {665883850346957067u, 1211445438634777304u},
+    {832354812933696334u, 1514306798293471630u}, {10263815553021896226u, 1892883497866839537u},
+    {17944099766707154901u, 1183052186166774710u}, {13206752671529167818u, 1478815232708468388u},
+    {16508440839411459773u, 1848519040885585485u}, {12623618533845856310u, 1155324400553490928u},
+    {15779523167307320387u, 1444155500691863660u}, {1277659885424598868u, 1805194375864829576u},
+    {1597074856780748586u, 2256492969831036970u}, {5609857803915355770u, 1410308106144398106u},
+    {16235694291748970521u, 1762885132680497632u}, {1847873790976661535u, 2203606415850622041u},
+    {12684136165428883219u, 1377254009906638775u}, {11243484188358716120u, 1721567512383298469u},
+    {219297180166231438u, 2151959390479123087u}, {7054589765244976505u, 1344974619049451929u},
+    {13429923224983608535u, 1681218273811814911u}, {12175718012802122765u, 2101522842264768639u},
+    {14527352785642408584u, 1313451776415480399u}, {13547504963625622826u, 1641814720519350499u},
+    {12322695186104640628u, 2052268400649188124u}, {16925056528170176201u, 1282667750405742577u},
+    {7321262604930556539u, 1603334688007178222u}, {18374950293017971482u, 2004168360008972777u},
+    {4566814905495150320u, 1252605225005607986u}, {14931890668723713708u, 1565756531257009982u},
+    {9441491299049866327u, 1957195664071262478u}, {1289246043478778550u, 1223247290044539049u},
+    {6223243572775861092u, 1529059112555673811u}, {3167368447542438461u, 1911323890694592264u},
+    {1979605279714024038u, 1194577431684120165u}, {7086192618069917952u, 1493221789605150206u},
+    {18081112809442173248u, 1866527237006437757u}, {13606538515115052232u, 1166579523129023598u},
+    {7784801107039039482u, 1458224403911279498u}, {507629346944023544u, 1822780504889099373u},
+    {5246222702107417334u, 2278475631111374216u}, {3278889188817135834u, 1424047269444608885u},
+    {8710297504448807696u, 1780059086805761106u},
+};
+
+static inline uint32_t _str_pow5bits(int32_t e) {
+    return (uint32_t)(((e * 1217359) >> 19) + 1);
+}
+
+static inline uint32_t _str_log10_pow2(int32_t e) {
+    return (uint32_t)((e * 78913) >> 18);
+}
+
+static inline uint32_t _str_log10_pow5(int32_t e) {
+    return (uint32_t)((e * 732923) >> 20);
+}
+
+static inline bool _str_multiple_of_pow5(uint64_t v, uint32_t p) {
+    uint32_t count = 0;
+    for (; v % 5 == 0; v /= 5)
+        count++;
+    return count >= p;
+}
+
+/* (m * mul) >> j for a 64-bit m and a 128-bit mul, with 64 < j < 128 */
+static inline uint64_t _str_mul_shift64(uint64_t m, const uint64_t *mul, int32_t j) {
+    uint64_t lo0 = m, hi0 = mul[0];
+    uint64_t lo2 = m, hi2 = mul[1];
+    _str_mum(&lo0, &hi0);
+    _str_mum(&lo2, &hi2);
+    uint64_t sum = hi0 + lo2;
+    hi2 += sum < hi0;
+    unsigned dist = (unsigned)(j - 64);
+    return (hi2 << (64 - dist)) | (sum >> dist);
+}
+
+/* Shortest decimal digits and exponent for a finite, non-zero double (Ryu) */
+static uint64_t _str_d2d(uint64_t ieee_mantissa, uint32_t ieee_exponent, int32_t *exponent) {
+    int32_t e2;
+    uint64_t m2;
+    if (ieee_exponent == 0) {
+        e2 = 1 - 1023 - 52 - 2;
+        m2 = ieee_mantissa;
+    } else {
+        e2 = (int32_t)ieee_exponent - 1023 - 52 - 2;
+        m2 = (1ull << 52) | ieee_mantissa;
+    }
+    bool accept_bounds = (m2 & 1) == 0;
+    // Step 2: the interval of valid representations is [mm, mp] around mv
+    uint64_t mv = 4 * m2;
+    uint32_t mm_shift = ieee_mantissa != 0 || ieee_exponent <= 1;
+    // Step 3: convert to a decimal power base
+    uint64_t vr, vp, vm;
+    int32_t e10;
+    bool vm_trailing_zeros = false, vr_trailing_zeros = false;
+    if (e2 >= 0) {
+        uint32_t q = _str_log10_pow2(e2) - (e2 > 3);
+        e10 = (int32_t)q;
+        int32_t k = 125 + (int32_t)_str_pow5bits((int32_t)q) - 1;
+        int32_t i = -e2 + (int32_t)q + k;
+        vr = _str_mul_shift64(4 * m2, _STR_POW5_INV_SPLIT[q], i);
+        vp = _str_mul_shift64(4 * m2 + 2, _STR_POW5_INV_SPLIT[q], i);
+        vm = _str_mul_shift64(4 * m2 - 1 - mm_shift, _STR_POW5_INV_SPLIT[q], i);
+        if (q <= 21) {
+            // Only one of mp, mv and mm can be a multiple of 5, if any
+            if (mv % 5 == 0)
+                vr_trailing_zeros = _str_multiple_of_pow5(mv, q);
+            else if (accept_bounds)
+                vm_trailing_zeros = _str_multiple_of_pow5(mv - 1 - mm_shift, q);
+            else
+                vp -= _str_multiple_of_pow5(mv + 2, q);
+        }
+    } else {
+        uint32_t q = _str_log10_pow5(-e2) - (-e2 > 1);
+        e10 = (int32_t)q + e2;
+        int32_t i = -e2 - (int32_t)q;
+        int32_t k = (int32_t)_str_pow5bits(i) - 125;
+        int32_t j = (int32_t)q - k;
+        vr = _str_mul_shift64(4 * m2, _STR_POW5_SPLIT[i], j);
+        vp = _str_mul_shift64(4 * m2 + 2, _STR_POW5_SPLIT[i], j);
+        vm = _str_mul_shift64(4 * m2 - 1 - mm_shift, _STR_POW5_SPLIT[i], j);
+        if (q <= 1) {
+            // mv = 4 * m2 always has at least two trailing zero bits
+            vr_trailing_zeros = true;
+            if (accept_bounds)
+                vm_trailing_zeros = mm_shift == 1;
+            else
+                --vp;
+        } else if (q < 63)
+            vr_trailing_zeros = (mv & ((1ull << q) - 1)) == 0;
+    }
+    // Step 4: find the shortest representation in the interval
+    int32_t removed = 0;
+    uint8_t last_removed = 0;
+    uint64_t output;
+    if (vm_trailing_zeros || vr_trailing_zeros) {
+        // Rare general case
+        for (; vp / 10 > vm / 10; removed++) {
+            vm_trailing_zeros &= vm % 10 == 0;
+            vr_trailing_zeros &= last_removed == 0;
+            last_removed = (uint8_t)(vr % 10);
+            vr /= 10;
+            vp /= 10;
+            vm /= 10;
+        }
+        if (vm_trailing_zeros)
+            for (; vm % 10 == 0; removed++) {
+                vr_trailing_zeros &= last_removed == 0;
+                last_removed = (uint8_t)(vr % 10);
+                vr /= 10;
+                vp /= 10;
+                vm /= 10;
+            }
+        if (vr_trailing_zeros && last_removed == 5 && vr % 2 == 0)
+            last_removed = 4; // round half to even
+        output = vr + ((vr == vm && (!accept_bounds || !vm_trailing_zeros)) || last_removed >= 5);
+    } else {
+        bool round_up = false;
+        if (vp / 100 > vm / 100) {
+            // Remove two digits at a time when possible
+            round_up = vr % 100 >= 50;
+            vr /= 100;
+            vp /= 100;
+            vm /= 100;
+            removed += 2;
+        }
+        for (; vp / 10 > vm / 10; removed++) {
+            round_up = vr % 10 >= 5;
+            vr /= 10;
+            vp /= 10;
+            vm /= 10;
+        }
+        output = vr + (vr == vm || round_up);
+    }
+    *exponent = e10 + removed;
+    return output;
+}
+
+/* Format a double into buf (at least 32 bytes), returns the length */
+static size_t _str_fmt_f64(char *buf, double v) {
+    uint64_t bits;
+    memcpy(&bits, &v, sizeof(bits));
+    bool sign = (bits >> 63) != 0;
+    uint64_t ieee_mantissa = bits & ((1ull << 52) - 1);
+    uint32_t ieee_exponent = (uint32_t)((bits >> 52) & 0x7FF);
+    char *p = buf;
+    if (ieee_exponent == 0x7FF) {
+        const char *special = ieee_mantissa ? "NaN" : sign ? "-Infinity" : "Infinity";
+        size_t n = strlen(special);
+        memcpy(buf, special, n);
+        return n;
+    }
+    if (sign)
+        *p++ = '-';
+    if (!ieee_exponent && !ieee_mantissa) {
+        *p++ = '0';
+        return (size_t)(p - buf);
+    }
+    int32_t e;
+    char digits[20];
+    char *d = _str_fmt_u64(digits + sizeof(digits), _str_d2d(ieee_mantissa, ieee_exponent, &e));
+    int32_t k = (int32_t)(digits + sizeof(digits) - d);
+    int32_t n = k + e; // value = 0.digits * 10^n
+    if (k <= n && n <= 21) {
+        memcpy(p, d, (size_t)k);
+        memset(p + k, '0', (size_t)(n - k));
+        p += n;
+    } else if (0 < n && n <= 21) {
+        memcpy(p, d, (size_t)n);
+        p[n] = '.';
+        memcpy(p + n + 1, d + n, (size_t)(k - n));
+        p += k + 1;
+    } else if (-6 < n && n <= 0) {
+        *p++ = '0';
+        *p++ = '.';
+        memset(p, '0', (size_t)-n);
+        p += -n;
+        memcpy(p, d, (size_t)k);
+        p += k;
+    } else {
+        *p++ = d[0];
+        if (k > 1) {
+            *p++ = '.';
+            memcpy(p, d + 1, (size_t)(k - 1));
+            p += k - 1;
+        }
+        *p++ = 'e';
+        *p++ = n - 1 < 0 ? '-' : '+';
+        char exp[8];
+        char *x = _str_fmt_u64(exp + sizeof(exp), (uint64_t)(n - 1 < 0 ? 1 - n : n - 1));
+        memcpy(p, x, (size_t)(exp + sizeof(exp) - x));
+        p += exp + sizeof(exp) - x;
+    }
+    return (size_t)(p - buf);
+}
+
+#ifndef STR_BUILDER_MAX_CHUNK
+#define STR_BUILDER_MAX_CHUNK 65536
+#endif
+
+struct str_builder_chunk {
+    struct str_builder_chunk *next;
+    size_t used;
+    size_t capacity;
+    char data[];
+};
+
+/* Contiguous space for n more bytes, linking a new chunk when the tail is full */
+static char *_str_builder_reserve(str_builder_t *b, size_t n) {
+    str_builder_chunk_t *c = b->tail;
+    if (c && c->capacity - c->used >= n)
+        return c->data + c->used;
+    size_t cap = c ? c->capacity * 2 : 256;
+    if (cap > STR_BUILDER_MAX_CHUNK)
+        cap = STR_BUILDER_MAX_CHUNK;
+    if (cap < n)
+        cap = n;
+    str_builder_chunk_t *chunk = (str_builder_chunk_t *)STR_MALLOC(sizeof(str_builder_chunk_t) + cap);
+    if (!chunk)
+        return NULL;
+    chunk->next = NULL;
+    chunk->used = 0;
+    chunk->capacity = cap;
+    if (c)
+        c->next = chunk;
+    else
+        b->head = chunk;
+    b->tail = chunk;
+    return chunk->data;
+}
+
+static inline void _str_builder_commit(str_builder_t *b, size_t n) {
+    b->tail->used += n;
+    b->length += n;
+}
+
+void str_builder_init(str_builder_t *b) {
+    b->head = b->tail = NULL;
+    b->length = 0;
+    b->utf8 = false;
+}
+
+void str_builder_free(str_builder_t *b) {
+    for (str_builder_chunk_t *c = b->head, *next; c; c = next) {
+        next = c->next;
+        STR_FREE(c);
+    }
+    str_builder_init(b);
+}
+
+size_t str_builder_length(const str_builder_t *b) {
+    return b->length;
+}
+
+bool str_builder_append_view(str_builder_t *b, str_view_t v) {
+    if (!b->utf8 && _str_ascii_run((const uint8_t *)v.data, v.length) != v.length)
+        b->utf8 = true;
+    str_builder_chunk_t *c = b->tail;
+    if (c && c->used < c->capacity) {
+        // Top up the current chunk first, the rest goes into a new one
+        size_t n = c->capacity - c->used < v.length ? c->capacity - c->used : v.length;
+        memcpy(c->data + c->used, v.data, n);
+        _str_builder_commit(b, n);
+        v.data += n;
+        v.length -= n;
+    }
+    if (!v.length)
+        return true;
+    char *dst = _str_builder_reserve(b, v.length);
+    if (!dst)
+        return false;
+    memcpy(dst, v.data, v.length);
+    _str_builder_commit(b, v.length);
+    return true;
+}
+
+bool str_builder_append_cstr(str_builder_t *b, const char *cstr) {
+    return str_builder_append_view(b, str_view_cstr(cstr));
+}
+
+bool str_builder_append(str_builder_t *b, const str_t s) {
+    uint32_t type = STR_TYPE(s);
+    uint32_t len = STR_LENGTH(s);
+    if (STR_IS_NARROW(type)) {
+        b->utf8 |= type == STR_TYPE_UTF8;
+        str_view_t v = {(const char *)s, len};
+        return str_builder_append_view(b, v);
+    }
+    size_t n = _str_wide_to_utf8((const wchar_t *)s, len, NULL);
+    if (n == (size_t)-1)
+        return false;
+    char *dst = _str_builder_reserve(b, n);
+    if (!dst)
+        return false;
+    _str_wide_to_utf8((const wchar_t *)s, len, dst);
+    _str_builder_commit(b, n);
+    b->utf8 |= n != len;
+    return true;
+}
+
+bool str_builder_append_char(str_builder_t *b, char c) {
+    char *dst = _str_builder_reserve(b, 1);
+    if (!dst)
+        return false;
+    *dst = c;
+    _str_builder_commit(b, 1);
+    b->utf8 |= (unsigned char)c >= 0x80;
+    return true;
+}
+
+bool str_builder_append_i64(str_builder_t *b, int64_t v) {
+    char buf[20], *p = _str_fmt_i64(buf + sizeof(buf), v);
+    str_view_t view = {p, (size_t)(buf + sizeof(buf) - p)};
+    return str_builder_append_view(b, view);
+}
+
+bool str_builder_append_u64(str_builder_t *b, uint64_t v) {
+    char buf[20], *p = _str_fmt_u64(buf + sizeof(buf), v);
+    str_view_t view = {p, (size_t)(buf + sizeof(buf) - p)};
+    return str_builder_append_view(b, view);
+}
+
+bool str_builder_append_f64(str_builder_t *b, double v) {
+    char *dst = _str_builder_reserve(b, 32);
+    if (!dst)
+        return false;
+    _str_builder_commit(b, _str_fmt_f64(dst, v));
+    return true;
+}
+
+str_t str_builder_finish(str_builder_t *b) {
+    str_t s = _str_new(b->utf8 ? STR_TYPE_UTF8 : STR_TYPE_ASCII, b->length);
+    if (!s)
+        return NULL;
+    char *dst = (char *)s;
+    for (str_builder_chunk_t *c = b->head; c; c = c->next) {
+        memcpy(dst, c->data, c->used);
+        dst += c->used;
+    }
+    str_builder_free(b);
+    return s;
+}
+
+/* Truncated 128-bit 5^q for q in [-342, 308], for Eisel-Lemire parsing */
+static const uint64_t _STR_POW5_128[651][2] = {
+    {1242899115359157055u, 17218479456385750618u}, {5388497965526861063u, 10761549660241094136u},
+    {6735622456908576329u, 13451937075301367670u}, {17642900107990496220u, 16814921344126709587u},
+    {8720969558280366185u, 10509325840079193492u}, {10901211947850457732u, 13136657300098991865u},
+    {18238200953240460069u, 16420821625123739831u}, {18316404623416369399u, 10263013515702337394u},
+    {13672133742415685941u, 12828766894627921743u}, {12478481159592219522u, 16035958618284902179u},
+    {5493207715531443249u, 10022474136428063862u}, {16089881681269079869u, 12528092670535079827u},
+    {15500666083158961933u, 15660115838168849784u}, {9687916301974351208u, 9787572398855531115u},
+    {7498209359040551106u, 12234465498569413894u}, {149389661945913074u, 15293081873211767368u},
+    {93368538716195671u, 9558176170757354605u}, {4728396691822632493u, 11947720213446693256u},
+    {5910495864778290617u, 14934650266808366570u}, {8305745933913819539u, 9334156416755229106u},
+    {1158810380537498616u, 11667695520944036383u}, {15283571030954036982u, 14584619401180045478u},
+    {9881091751837770420u, 18230774251475056848u}, {6175682344898606512u, 11394233907171910530u},
+    {16942974967978033949u, 14242792383964888162u}, {11955346673117766628u, 17803490479956110203u},
+    {5166248661484910190u, 11127181549972568877u}, {11069496845283525642u, 13908976937465711096u},
+    {13836871056604407053u, 17386221171832138870u}, {4036358391950366504u, 10866388232395086794u},
+    {14268820026792733938u, 13582985290493858492u}, {17836025033490917422u, 16978731613117323115u},
+    {8841672636718129437u, 10611707258198326947u}, {6440404777470273892u, 13264634072747908684u},
+    {8050505971837842365u, 16580792590934885855u}, {11949095260039733334u, 10362995369334303659u},
+    {10324683056622278764u, 12953744211667879574u}, {3682481783923072647u, 16192180264584849468u},
+    {11524923151806696212u, 10120112665365530917u}, {571095884476206553u, 12650140831706913647u},
+    {14548927910877421904u, 15812676039633642058u}, {13704765962725776594u, 9882922524771026286u},
+    {7907585416552444934u, 12353653155963782858u}, {661109733835780360u, 15442066444954728573u},
+    {2719036592861056677u, 9651291528096705358u}, {12622167777931096654u, 12064114410120881697u},
+    {1942651667131707105u, 15080143012651102122u}, {5825843310384704845u, 9425089382906938826u},
+    {16505676174835656864u, 11781361728633673532u}, {2185351144835019464u, 14726702160792091916u},
+    {2731688931043774330u, 18408377700990114895u}, {8624834609543440812u, 11505236063118821809u},
+    {15392729280356688919u, 14381545078898527261u}, {5405853545163697437u, 17976931348623159077u},
+    {5684501474941004850u, 11235582092889474423u}, {2493940825248868159u, 14044477616111843029u},
+    {7729112049988473103u, 17555597020139803786u}, {9442381049670183593u, 10972248137587377366u},
+    {2579604275232953683u, 13715310171984221708u}, {3224505344041192104u, 17144137714980277135u},
+    {8932844867666826921u, 10715086071862673209u}, {15777742103010921555u, 13393857589828341511u},
+    {15110491610336264040u, 16742321987285426889u}, {2526528228819083169u, 10463951242053391806u},
+    {12381532322878629770u, 13079939052566739757u}, {1641857348316123500u, 16349923815708424697u},
+    {12555375888766046947u, 10218702384817765435u}, {11082533842530170780u, 12773377981022206794u},
+    {4629795266307937667u, 15966722476277758493u}, {5199465050656154994u, 9979201547673599058u},
+    {15722703350174969551u, 12474001934591998822u}, {10430007150863936130u, 15592502418239998528u},
+    {6518754469289960081u, 9745314011399999080u}, {8148443086612450102u, 12181642514249998850u},
+    {962181821410786819u, 15227053142812498563u}, {16742264702877599426u, 9516908214257811601u},
+    {7092772823314835570u, 11896135267822264502u}, {18089338065998320271u, 14870169084777830627u},
+    {8999993282035256217u, 9293855677986144142u}, {2026619565689294464u, 11617319597482680178u},
+    {11756646493966393888u, 14521649496853350222u}, {5472436080603216552u, 18152061871066687778u},
+    {8031958568804398249u, 11345038669416679861u}, {14651634229432885715u, 14181298336770849826u},
+    {9091170749936331336u, 17726622920963562283u}, {3376138709496513133u, 11079139325602226427u},
+    {18055231442152805128u, 13848924157002783033u}, {8733981247408842698u, 17311155196253478792u},
+    {5458738279630526686u, 10819471997658424245u}, {11435108867965546262u, 13524339997073030306u},
+    {5070514048102157020u, 16905424996341287883u}, {863228270850154185u, 10565890622713304927u},
+    {14914093393844856443u, 13207363278391631158u}, {9419244705451294746u, 16509204097989538948u},
+    {15110399977761835024u, 10318252561243461842u}, {9664627935347517973u, 12897815701554327303u},
+    {7469098900757009562u, 16122269626942909129u}, {16197401859041600736u, 10076418516839318205u},
+    {6411694268519837208u, 12595523146049147757u}, {12626303854077184414u, 15744403932561434696u},
+    {7891439908798240259u, 9840252457850896685u}, {14475985904425188227u, 12300315572313620856u},
+    {18094982380531485284u, 15375394465392026070u}, {6697677969404790399u, 9609621540870016294u},
+    {17595469498610763806u, 12012026926087520367u}, {17382650854836066854u, 15015033657609400459u},
+    {8558313775058847832u, 9384396036005875287u}, {6086206200396171886u, 11730495045007344109u},
+    {12219443768922602761u, 14663118806259180136u}, {15274304711153253452u, 18328898507823975170u},
+    {14158126462898171311u, 11455561567389984481u}, {3862600023340550427u, 14319451959237480602u},
+    {14051622066030463842u, 17899314949046850752u}, {8782263791269039901u, 11187071843154281720u},
+    {10977829739086299876u, 13983839803942852150u}, {4498915137003099037u, 17479799754928565188u},
+    {12035193997481712706u, 10924874846830353242u}, {5820620459997365075u, 13656093558537941553u},
+    {11887461593424094248u, 17070116948172426941u}, {9735506505103752857u, 10668823092607766838u},
+    {2946011094524915263u, 13336028865759708548u}, {3682513868156144079u, 16670036082199635685u},
+    {4607414176811284001u, 10418772551374772303u}, {1147581702586717097u, 13023465689218465379u},
+    {15269535183515560084u, 16279332111523081723u}, {7237616480483531100u, 10174582569701926077u},
+    {13658706619031801779u, 12718228212127407596u}, {17073383273789752224u, 15897785265159259495u},
+    {17588393573759676996u, 9936115790724537184u}, {3538747893490044629u, 12420144738405671481u},
+    {9035120885289943691u, 15525180923007089351u}, {12564479580947296663u, 9703238076879430844u},
+    {15705599476184120828u, 12129047596099288555u}, {15020313326802763131u, 15161309495124110694u},
+    {4776009810824339053u, 9475818434452569184u}, {5970012263530423816u, 11844773043065711480u},
+    {7462515329413029771u, 14805966303832139350u}, {52386062455755702u, 9253728939895087094u},
+    {9288854614924470436u, 11567161174868858867u}, {6999382250228200141u, 14458951468586073584u},
+    {8749227812785250177u, 18073689335732591980u}, {14691639419845557168u, 11296055834832869987u},
+    {13752863256379558556u, 14120069793541087484u}, {17191079070474448196u, 17650087241926359355u},
+    {8438581409832836170u, 11031304526203974597u}, {15159912780718433117u, 13789130657754968246u},
+    {9726518939043265588u, 17236413322193710308u}, {15302446373756816800u, 10772758326371068942u},
+    {9904685930341245193u, 13465947907963836178u}, {3157485376071780683u, 16832434884954795223u},
+    {8890957387685944783u, 10520271803096747014u}, {1890324697752655170u, 13150339753870933768u},
+    {2362905872190818963u, 16437924692338667210u}, {6088502188546649756u, 10273702932711667006u},
+    {16833999772538088003u, 12842128665889583757u}, {7207441660390446292u, 16052660832361979697u},
+    {16033866083812498692u, 10032913020226237310u}, {10818960567910847557u, 12541141275282796638u},
+    {4300328673033783639u, 15676426594103495798u}, {16522763475928278486u, 9797766621314684873u},
+    {6818396289628184396u, 12247208276643356092u}, {8522995362035230495u, 15309010345804195115u},
+    {3021029092058325107u, 9568131466127621947u}, {17611344420355070096u, 11960164332659527433u},
+    {8179122470161673908u, 14950205415824409292u}, {14335323580705822000u, 9343878384890255807u},
+    {13307468457454889596u, 11679847981112819759u}, {12022649553391224092u, 14599809976391024699u},
+    {10416625923311642211u, 18249762470488780874u}, {11122077220497164286u, 11406101544055488046u},
+    {4679224488766679549u, 14257626930069360058u}, {15072402647813125244u, 17822033662586700072u},
+    {9420251654883203278u, 11138771039116687545u}, {16387000587031392001u, 13923463798895859431u},
+    {15872064715361852097u, 17404329748619824289u}, {3002511419460075705u, 10877706092887390181u},
+    {8364825292752482535u, 13597132616109237726u}, {1232659579085827361u, 16996415770136547158u},
+    {14605470292210805812u, 10622759856335341973u}, {4421779809981343554u, 13278449820419177467u},
+    {915538744049291538u, 16598062275523971834u}, {5183897733458195115u, 10373788922202482396u},
+    {6479872166822743894u, 12967236152753102995u}, {3488154190101041964u, 16209045190941378744u},
+    {2180096368813151227u, 10130653244338361715u}, {16560178516298602746u, 12663316555422952143u},
+    {16088537126945865529u, 15829145694278690179u}, {7749492695127472003u, 9893216058924181362u},
+    {463493832054564196u, 12366520073655226703u}, {14414425345350368957u, 15458150092069033378u},
+    {13620701859271368502u, 9661343807543145861u}, {3190819268807046916u, 12076679759428932327u},
+    {17823582141290972357u, 15095849699286165408u}, {11139738838306857723u, 9434906062053853380u},
+    {13924673547883572154u, 11793632577567316725u}, {3570783879572301480u, 14742040721959145907u},
+    {18298537904747540562u, 18427550902448932383u}, {18354115218108294707u, 11517219314030582739u},
+    {18330958004207980480u, 14396524142538228424u}, {4466953431550423984u, 17995655178172785531u},
+    {486002885505321038u, 11247284486357990957u}, {5219189625309039202u, 14059105607947488696u},
+    {6523987031636299002u, 17573882009934360870u}, {17912549950054850588u, 10983676256208975543u},
+    {17779001419141175331u, 13729595320261219429u}, {8388693718644305452u, 17161994150326524287u},
+    {12160462601793772764u, 10726246343954077679u}, {10588892233814828051u, 13407807929942597099u},
+    {8624429273841147159u, 16759759912428246374u}, {778582277723329070u, 10474849945267653984u},
+    {973227847154161338u, 13093562431584567480u}, {1216534808942701673u, 16366953039480709350u},
+    {14595392310871352257u, 10229345649675443343u}, {13632554370161802418u, 12786682062094304179u},
+    {12429006944274865118u, 15983352577617880224u}, {7768129340171790699u, 9989595361011175140u},
+    {9710161675214738374u, 12486994201263968925u}, {16749388112445810871u, 15608742751579961156u},
+    {1244995533423855986u, 9755464219737475723u}, {15391302472061983695u, 12194330274671844653u},
+    {5404070034795315907u, 15242912843339805817u}, {14906758817815542202u, 9526820527087378635u},
+    {14021762503842039848u, 11908525658859223294u}, {8303831092947774002u, 14885657073574029118u},
+    {578208414664970847u, 9303535670983768199u}, {14557818573613377271u, 11629419588729710248u},
+    {18197273217016721589u, 14536774485912137810u}, {13523219484416126178u, 18170968107390172263u},
+    {15369541205401160717u, 11356855067118857664u}, {765182433041899281u, 14196068833898572081u},
+    {5568164059729762005u, 17745086042373215101u}, {5785945546544795205u, 11090678776483259438u},
+    {16455803970035769814u, 13863348470604074297u}, {6734696907262548556u, 17329185588255092872u},
+    {4209185567039092847u, 10830740992659433045u}, {9873167977226253963u, 13538426240824291306u},
+    {3118087934678041646u, 16923032801030364133u}, {4254647968387469981u, 10576895500643977583u},
+    {706623942056949572u, 13221119375804971979u}, {14718337982853350677u, 16526399219756214973u},
+    {11504804248497038125u, 10328999512347634358u}, {5157633273766521849u, 12911249390434542948u},
+    {6447041592208152311u, 16139061738043178685u}, {6335244004343789146u, 10086913586276986678u},
+    {17142427042284512241u, 12608641982846233347u}, {16816347784428252397u, 15760802478557791684u},
+    {1286845328412881940u, 9850501549098619803u}, {15443614715798266137u, 12313126936373274753u},
+    {5469460339465668959u, 15391408670466593442u}, {8030098730593431003u, 9619630419041620901u},
+    {14649309431669176658u, 12024538023802026126u}, {9088264752731695015u, 15030672529752532658u},
+    {10291851488884697288u, 9394170331095332911u}, {8253128342678483706u, 11742712913869166139u},
+    {5704724409920716729u, 14678391142336457674u}, {16354277549255671720u, 18347988927920572092u},
+    {998051431430019017u, 11467493079950357558u}, {10470936326142299579u, 14334366349937946947u},
+    {8476984389250486570u, 17917957937422433684u}, {14521487280136329914u, 11198723710889021052u},
+    {18151859100170412392u, 13998404638611276315u}, {18078137856785627587u, 17498005798264095394u},
+    {15910522178918405146u, 10936253623915059621u}, {6053094668365842720u, 13670317029893824527u},
+    {2954682317029915496u, 17087896287367280659u}, {17987577512639554849u, 10679935179604550411u},
+    {17872785872372055657u, 13349918974505688014u}, {13117610303610293764u, 16687398718132110018u},
+    {12810192458183821506u, 10429624198832568761u}, {2177682517447613171u, 13037030248540710952u},
+    {2722103146809516464u, 16296287810675888690u}, {6313000485183335694u, 10185179881672430431u},
+    {3279564588051781713u, 12731474852090538039u}, {17934513790346890853u, 15914343565113172548u},
+    {1985699082112030975u, 9946464728195732843u}, {16317181907922202431u, 12433080910244666053u},
+    {6561419329620589327u, 15541351137805832567u}, {11018416108653950185u, 9713344461128645354u},
+    {4549648098962661924u, 12141680576410806693u}, {10298746142130715309u, 15177100720513508366u},
+    {1825030320404309164u, 9485687950320942729u}, {6892973918932774359u, 11857109937901178411u},
+    {4004531380238580045u, 14821387422376473014u}, {16337890167931276240u, 9263367138985295633u},
+    {6587304654631931588u, 11579208923731619542u}, {17457502855144690293u, 14474011154664524427u},
+    {17210192550503474962u, 18092513943330655534u}, {6144684325637283947u, 11307821214581659709u},
+    {12292541425473992838u, 14134776518227074636u}, {15365676781842491048u, 17668470647783843295u},
+    {16521077016292638761u, 11042794154864902059u}, {16039660251938410547u, 13803492693581127574u},
+    {10826203278068237376u, 17254365866976409468u}, {15989749085647424168u, 10783978666860255917u},
+    {6152128301777116498u, 13479973333575319897u}, {12301846395648783526u, 16849966666969149871u},
+    {14606183024921571560u, 10531229166855718669u}, {4422670725869800738u, 13164036458569648337u},
+    {10140024425764638826u, 16455045573212060421u}, {8643358275316593218u, 10284403483257537763u},
+    {6192511825718353619u, 12855504354071922204u}, {7740639782147942024u, 16069380442589902755u},
+    {2532056854628769813u, 10043362776618689222u}, {12388443105140738074u, 12554203470773361527u},
+    {10873867862998534689u, 15692754338466701909u}, {9102010423587778132u, 9807971461541688693u},
+    {15989199047912110569u, 12259964326927110866u}, {10763126773035362404u, 15324955408658888583u},
+    {13644483260788183358u, 9578097130411805364u}, {17055604075985229198u, 11972621413014756705u},
+    {7484447039699372786u, 14965776766268445882u}, {9289465418239495895u, 9353610478917778676u},
+    {11611831772799369869u, 11692013098647223345u}, {679731660717048624u, 14615016373309029182u},
+    {10073036612751086588u, 18268770466636286477u}, {8601490892183123070u, 11417981541647679048u},
+    {10751863615228903838u, 14272476927059598810u}, {4216457482181353989u, 17840596158824498513u},
+    {14164500972431816003u, 11150372599265311570u}, {8482254178684994196u, 13937965749081639463u},
+    {5991131704928854841u, 17422457186352049329u}, {15273672361649004036u, 10889035741470030830u},
+    {9868718415206479237u, 13611294676837538538u}, {3112525982153323238u, 17014118346046923173u},
+    {4251171748059520976u, 10633823966279326983u}, {702278666647013315u, 13292279957849158729u},
+    {5489534351736154548u, 16615349947311448411u}, {1125115960621402641u, 10384593717069655257u},
+    {6018080969204141205u, 12980742146337069071u}, {2910915193077788602u, 16225927682921336339u},
+    {17960223060169475540u, 10141204801825835211u}, {17838592806784456521u, 12676506002282294014u},
+    {13074868971625794844u, 15845632502852867518u}, {3560107088838733873u, 9903520314283042199u},
+    {18285191916330581054u, 12379400392853802748u}, {4409745821703674701u, 15474250491067253436u},
+    {11979463175419572496u, 9671406556917033397u}, {1139270913992301908u, 12089258196146291747u},
+    {15259146697772541097u, 15111572745182864683u}, {7231123676894144234u, 9444732965739290427u},
+    {4427218577690292388u, 11805916207174113034u}, {14757395258967641293u, 14757395258967641292u},
+    {0u, 9223372036854775808u}, {0u, 11529215046068469760u},
+    {0u, 14411518807585587200u}, {0u, 18014398509481984000u},
+    {0u, 11258999068426240000u}, {0u, 14073748835532800000u},
+    {0u, 17592186044416000000u}, {0u, 10995116277760000000u},
+    {0u, 13743895347200000000u}, {0u, 17179869184000000000u},
+    {0u, 10737418240000000000u}, {0u, 13421772800000000000u},
+    {0u, 16777216000000000000u}, {0u, 10485760000000000000u},
+    {0u, 13107200000000000000u}, {0u, 16384000000000000000u},
+    {0u, 10240000000000000000u}, {0u, 12800000000000000000u},
+    {0u, 16000000000000000000u}, {0u, 10000000000000000000u},
+    {0u, 12500000000000000000u}, {0u, 15625000000000000000u},
+    {0u, 9765625000000000000u}, {0u, 12207031250000000000u},
+    {0u, 15258789062500000000u}, {0u, 9536743164062500000u},
+    {0u, 11920928955078125000u}, {0u, 14901161193847656250u},
+    {4611686018427387904u, 9313225746154785156u}, {5764607523034234880u, 11641532182693481445u},
+    {11817445422220181504u, 14551915228366851806u}, {5548434740920451072u, 18189894035458564758u},
+    {17302829768357445632u, 11368683772161602973u}, {7793479155164643328u, 14210854715202003717u},
+    {14353534962383192064u, 17763568394002504646u}, {4359273333062107136u, 11102230246251565404u},
+    {5449091666327633920u, 13877787807814456755u}, {2199678564482154496u, 17347234759768070944u},
+    {1374799102801346560u, 10842021724855044340u}, {1718498878501683200u, 13552527156068805425u},
+    {6759809616554491904u, 16940658945086006781u}, {6530724019560251392u, 10587911840678754238u},
+    {17386777061305090048u, 13234889800848442797u}, {7898413271349198848u, 16543612251060553497u},
+    {16465723340661719040u, 10339757656912845935u}, {15970468157399760896u, 12924697071141057419u},
+    {15351399178322313216u, 16155871338926321774u}, {4982938468024057856u, 10097419586828951109u},
+    {10840359103457460224u, 12621774483536188886u}, {4327076842467049472u, 15777218104420236108u},
+    {11927795063396681728u, 9860761315262647567u}, {10298057810818464256u, 12325951644078309459u},
+    {8260886245095692416u, 15407439555097886824u}, {5163053903184807760u, 9629649721936179265u},
+    {11065503397408397604u, 12037062152420224081u}, {18443565265187884909u, 15046327690525280101u},
+    {13833071299956122020u, 9403954806578300063u}, {12679653106517764621u, 11754943508222875079u},
+    {11237880364719817872u, 14693679385278593849u}, {212292400617608628u, 18367099231598242312u},
+    {132682750386005392u, 11479437019748901445u}, {4777539456409894645u, 14349296274686126806u},
+    {15195296357367144114u, 17936620343357658507u}, {7191217214140771119u, 11210387714598536567u},
+    {4377335499248575995u, 14012984643248170709u}, {10083355392488107898u, 17516230804060213386u},
+    {10913783138732455340u, 10947644252537633366u}, {4418856886560793367u, 13684555315672041708u},
+    {5523571108200991709u, 17105694144590052135u}, {10369760970266701674u, 10691058840368782584u},
+    {12962201212833377092u, 13363823550460978230u}, {6979379479186945558u, 16704779438076222788u},
+    {13585484211346616781u, 10440487148797639242u}, {7758483227328495169u, 13050608935997049053u},
+    {14309790052588006865u, 16313261169996311316u}, {18166990819722280098u, 10195788231247694572u},
+    {4261994450943298507u, 12744735289059618216u}, {5327493063679123134u, 15930919111324522770u},
+    {7941369183226839863u, 9956824444577826731u}, {5315025460606161924u, 12446030555722283414u},
+    {15867153862612478214u, 15557538194652854267u}, {7611128154919104931u, 9723461371658033917u},
+    {14125596212076269068u, 12154326714572542396u}, {17656995265095336336u, 15192908393215677995u},
+    {8729779031470891258u, 9495567745759798747u}, {6300537770911226168u, 11869459682199748434u},
+    {17099044250493808518u, 14836824602749685542u}, {6075216638131242420u, 9273015376718553464u},
+    {7594020797664053025u, 11591269220898191830u}, {269153960225290473u, 14489086526122739788u},
+    {336442450281613091u, 18111358157653424735u}, {7127805559067090038u, 11319598848533390459u},
+    {4298070930406474644u, 14149498560666738074u}, {14595960699862869113u, 17686873200833422592u},
+    {9122475437414293195u, 11054295750520889120u}, {11403094296767866494u, 13817869688151111400u},
+    {14253867870959833118u, 17272337110188889250u}, {13520353437777283602u, 10795210693868055781u},
+    {3065383741939440791u, 13494013367335069727u}, {17666787732706464701u, 16867516709168837158u},
+    {6430056314514152534u, 10542197943230523224u}, {8037570393142690668u, 13177747429038154030u},
+    {823590954573587527u, 16472184286297692538u}, {5126430365035880108u, 10295115178936057836u},
+    {6408037956294850135u, 12868893973670072295u}, {3398361426941174765u, 16086117467087590369u},
+    {13653190937906703988u, 10053823416929743980u}, {17066488672383379985u, 12567279271162179975u},
+    {16721424822051837077u, 15709099088952724969u}, {3533361486141316317u, 9818186930595453106u},
+    {13640073894531421205u, 12272733663244316382u}, {7826720331309500698u, 15340917079055395478u},
+    {280014188641050032u, 9588073174409622174u}, {9573389772656088348u, 11985091468012027717u},
+    {16578423234247498339u, 14981364335015034646u}, {5749828502977298558u, 9363352709384396654u},
+    {16410657665576399005u, 11704190886730495817u}, {6678264026688335045u, 14630238608413119772u},
+    {8347830033360418806u, 18287798260516399715u}, {2911550761636567802u, 11429873912822749822u},
+    {12862810488900485560u, 14287342391028437277u}, {2243455055843443238u, 17859177988785546597u},
+    {3708002419115845976u, 11161986242990966623u}, {23317005467419566u, 13952482803738708279u},
+    {13864204312116438170u, 17440603504673385348u}, {17888499731927549664u, 10900377190420865842u},
+    {13137252628054661272u, 13625471488026082303u}, {11809879766640938686u, 17031839360032602879u},
+    {14298703881791668535u, 10644899600020376799u}, {13261693833812197764u, 13306124500025470999u},
+    {11965431273837859301u, 16632655625031838749u}, {9784237555362356015u, 10395409765644899218u},
+    {3006924907348169211u, 12994262207056124023u}, {17593714189467375226u, 16242827758820155028u},
+    {1772699331562333708u, 10151767349262596893u}, {6827560182880305039u, 12689709186578246116u},
+    {8534450228600381299u, 15862136483222807645u}, {7639874402088932264u, 9913835302014254778u},
+    {326470965756389522u, 12392294127517818473u}, {5019774725622874806u, 15490367659397273091u},
+    {831516194300602802u, 9681479787123295682u}, {10262767279730529310u, 12101849733904119602u},
+    {3605087062808385830u, 15127312167380149503u}, {9170708441896323000u, 9454570104612593439u},
+    {6851699533943015846u, 11818212630765741799u}, {3952938399001381903u, 14772765788457177249u},
+    {13999801545444333449u, 9232978617785735780u}, {17499751931805416812u, 11541223272232169725u},
+    {8039631859474607303u, 14426529090290212157u}, {14661225842770647033u, 18033161362862765196u},
+    {18386638188586430203u, 11270725851789228247u}, {18371611717305649850u, 14088407314736535309u},
+    {9129456591349898601u, 17610509143420669137u}, {17235125415662156385u, 11006568214637918210u},
+    {12320534732722919674u, 13758210268297397763u}, {10788982397476261688u, 17197762835371747204u},
+    {15966486035277439363u, 10748601772107342002u}, {10734735507242023396u, 13435752215134177503u},
+    {8806733365625141341u, 16794690268917721879u}, {12421737381156795194u, 10496681418073576174u},
+    {6303799689591218185u, 13120851772591970218u}, {17103121648843798539u, 16401064715739962772u},
+    {1466078993672598279u, 10250665447337476733u}, {6444284760518135752u, 12813331809171845916u},
+    {8055355950647669691u, 16016664761464807395u}, {2728754459941099604u, 10010415475915504622u},
+    {12634315111781150314u, 12513019344894380777u}, {1957835834444274180u, 15641274181117975972u},
+    {10447019433382447170u, 9775796363198734982u}, {3835402254873283155u, 12219745453998418728u},
+    {4794252818591603944u, 15274681817498023410u}, {7608094030047140369u, 9546676135936264631u},
+    {4898431519131537557u, 11933345169920330789u}, {10734725417341809851u, 14916681462400413486u},
+    {2097517367411243253u, 9322925914000258429u}, {7233582727691441970u, 11653657392500323036u},
+    {9041978409614302462u, 14567071740625403795u}, {6690786993590490174u, 18208839675781754744u},
+    {4181741870994056359u, 11380524797363596715u}, {615491320315182544u, 14225655996704495894u},
+    {9992736187248753989u, 17782069995880619867u}, {3939617107816777291u, 11113793747425387417u},
+    {9536207403198359517u, 13892242184281734271u}, {7308573235570561493u, 17365302730352167839u},
+    {11485387299872682789u, 10853314206470104899u}, {9745048106413465582u, 13566642758087631124u},
+    {12181310133016831978u, 16958303447609538905u}, {695789805494438130u, 10598939654755961816u},
+    {869737256868047663u, 13248674568444952270u}, {10310543607939835386u, 16560843210556190337u},
+    {17973304801030866876u, 10350527006597618960u}, {4019886927579031980u, 12938158758247023701u},
+    {9636544677901177879u, 16172698447808779626u}, {10634526442115624078u, 10107936529880487266u},
+    {4069786015789754290u, 12634920662350609083u}, {475546501309804958u, 15793650827938261354u},
+    {4908902581746016003u, 9871031767461413346u}, {15359500264037295811u, 12338789709326766682u},
+    {9976003293191843956u, 15423487136658458353u}, {17764217104313372233u, 9639679460411536470u},
+    {12981899343536939483u, 12049599325514420588u}, {16227374179421174354u, 15061999156893025735u},
+    {17059637889779315827u, 9413749473058141084u}, {2877803288514593168u, 11767186841322676356u},
+    {3597254110643241460u, 14708983551653345445u}, {9108253656731439729u, 18386229439566681806u},
+    {1080972517029761926u, 11491393399729176129u}, {5962901664714590312u, 14364241749661470161u},
+    {12065313099320625794u, 17955302187076837701u}, {9846663696289085073u, 11222063866923023563u},
+    {7696643601933968437u, 14027579833653779454u}, {397432465562684739u, 17534474792067224318u},
+    {14083453346258841674u, 10959046745042015198u}, {8380944645968776284u, 13698808431302518998u},
+    {1252808770606194547u, 17123510539128148748u}, {10006377518483647400u, 10702194086955092967u},
+    {7896285879677171346u, 13377742608693866209u}, {14482043368023852087u, 16722178260867332761u},
+    {2133748077373825698u, 10451361413042082976u}, {2667185096717282123u, 13064201766302603720u},
+    {3333981370896602653u, 16330252207878254650u}, {6695424375237764562u, 10206407629923909156u},
+    {8369280469047205703u, 12758009537404886445u}, {15073286604736395033u, 15947511921756108056u},
+    {9420804127960246895u, 9967194951097567535u}, {7164319141522920715u, 12458993688871959419u},
+    {4343712908476262990u, 15573742111089949274u}, {7326506586225052273u, 9733588819431218296u},
+    {9158133232781315341u, 12166986024289022870u}, {2224294504121868368u, 15208732530361278588u},
+    {10613556101930943538u, 9505457831475799117u}, {17878631145841067327u, 11881822289344748896u},
+    {3901544858591782542u, 14852277861680936121u}, {13967680582688333849u, 9282673663550585075u},
+    {12847914709933029407u, 11603342079438231344u}, {16059893387416286759u, 14504177599297789180u},
+    {1628122660560806833u, 18130221999122236476u}, {10240948699705280078u, 11331388749451397797u},
+    {17412871893058988002u, 14164235936814247246u}, {12542717829468959195u, 17705294921017809058u},
+    {12450884661845487401u, 11065809325636130661u}, {1728547772024695539u, 13832261657045163327u},
+    {15995742770313033136u, 17290327071306454158u}, {5385653213018257806u, 10806454419566533849u},
+    {11343752534700210161u, 13508068024458167311u}, {9568004649947874797u, 16885085030572709139u},
+    {3674159897003727796u, 10553178144107943212u}, {4592699871254659745u, 13191472680134929015u},
+    {1129188820640936778u, 16489340850168661269u}, {3011586022114279438u, 10305838031355413293u},
+    {8376168546070237202u, 12882297539194266616u}, {10470210682587796502u, 16102871923992833270u},
+    {1932195658189984910u, 10064294952495520794u}, {11638616609592256945u, 12580368690619400992u},
+    {14548270761990321182u, 15725460863274251240u}, {9092669226243950738u, 9828413039546407025u},
+    {15977522551232326327u, 12285516299433008781u}, {6136845133758244197u, 15356895374291260977u},
+    {15364743254667372383u, 9598059608932038110u}, {9982557031479439671u, 11997574511165047638u},
+    {3254824252494523781u, 14996968138956309548u}, {11257637194663853171u, 9373105086847693467u},
+    {9460360474902428559u, 11716381358559616834u}, {2602078556773259891u, 14645476698199521043u},
+    {17087656251248738576u, 18306845872749401303u}, {17597314184671543466u, 11441778670468375814u},
+    {12773270693984653525u, 14302223338085469768u}, {15966588367480816906u, 17877779172606837210u},
+    {14590803748102898470u, 11173611982879273256u}, {18238504685128623088u, 13967014978599091570u},
+    {13574758819556003052u, 17458768723248864463u}, {15401753289863583763u, 10911730452030540289u},
+    {5417133557047315992u, 13639663065038175362u}, {15994788983163920798u, 17049578831297719202u},
+    {14608429132904838403u, 10655986769561074501u}, {4425478360848884291u, 13319983461951343127u},
+    {920161932633717460u, 16649979327439178909u}, {2880944217109767365u, 10406237079649486818u},
+    {12824552308241985014u, 13007796349561858522u}, {6807318348447705459u, 16259745436952323153u},
+    {15783789013848285672u, 10162340898095201970u}, {10506364230455581282u, 12702926122619002463u},
+    {8521269269642088699u, 15878657653273753079u}, {12243322321167387293u, 9924161033296095674u},
+    {6080780864604458308u, 12405201291620119593u}, {12212662099182960789u, 15506501614525149491u},
+    {5327070802775656541u, 9691563509078218432u}, {6658838503469570676u, 12114454386347773040u},
+    {8323548129336963345u, 15143067982934716300u}, {14425589617690377899u, 9464417489334197687u},
+    {13420301003685584469u, 11830521861667747109u}, {2940318199324816875u, 14788152327084683887u},
+    {8755227902219092403u, 9242595204427927429u}, {15555720896201253407u, 11553244005534909286u},
+    {10221279083396790951u, 14441555006918636608u}, {12776598854245988689u, 18051943758648295760u},
+    {7985374283903742931u, 11282464849155184850u}, {758345818024902856u, 14103081061443981063u},
+    {14782990327813292282u, 17628851326804976328u}, {9239368954883307676u, 11018032079253110205u},
+    {16160897212031522499u, 13772540099066387756u}, {1754377441329851508u, 17215675123832984696u},
+    {1096485900831157192u, 10759796952395615435u}, {15205665431321110202u, 13449746190494519293u},
+    {5172023733869224041u, 16812182738118149117u}, {5538357842881958977u, 10507614211323843198u},
+    {16146319340457224530u, 13134517764154803997u}, {6347841120289366950u, 16418147205193504997u},
+    {6273243709394548296u, 10261342003245940623u},
+};
+static const double _STR_POW10_EXACT[23] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+                                             1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+static inline bool _str_is_digit(char c) {
+    return (unsigned char)(c - '0') < 10;
+}
+
+#ifdef _STR_LITTLE_ENDIAN
+/* SWAR test that all eight bytes of v are ASCII digits */
+static inline bool _str_is_8digits(uint64_t v) {
+    uint64_t a = v + 0x4646464646464646ull, b = v - 0x3030303030303030ull;
+    return !((a | b) & 0x8080808080808080ull);
 }
 
-void str_trim(str_t *s) {
-    uint32_t type = STR_TYPE(*s);
-    if (type != 0)
-        return; // only for ASCII
-    char *data = (char *)*s;
-    uint32_t len = STR_LENGTH(*s);
-    size_t start = 0, end = len;
-    while (start < end && (data[start] == ' ' || data[start] == '\t' || data[start] == '\n'))
-        start++;
-    while (end > start && (data[end - 1] == ' ' || data[end - 1] == '\t' || data[end - 1] == '\n'))
-        end--;
-    if (start > 0 || end < len) {
-        memmove(data, data + start, end - start);
-        str_resize(s, end - start);
+/* Convert eight ASCII digits, first digit in the lowest byte */
+static inline uint32_t _str_parse_8digits(uint64_t v) {
+    v -= 0x3030303030303030ull;
+    v = v * 10 + (v >> 8);
+    v = ((v & 0x000000FF000000FFull) * 0x000F424000000064ull + ((v >> 16) & 0x000000FF000000FFull) * 0x0000271000000001ull) >> 32;
+    return (uint32_t)v;
+}
+#endif
+
+/* Accumulate the digit run at p into *acc (wrapping on overflow), returns its end */
+static const char *_str_scan_digits(const char *p, const char *end, uint64_t *acc) {
+    uint64_t v = *acc;
+#ifdef _STR_LITTLE_ENDIAN
+    for (uint64_t w; end - p >= 8; p += 8) {
+        memcpy(&w, p, 8);
+        if (!_str_is_8digits(w))
+            break;
+        v = v * 100000000 + _str_parse_8digits(w);
     }
+#endif
+    for (; p < end && _str_is_digit(*p); p++)
+        v = v * 10 + (uint64_t)(*p - '0');
+    *acc = v;
+    return p;
 }
 
-void str_to_upper(str_t *s) {
-    uint32_t type = STR_TYPE(*s);
-    uint32_t len = STR_LENGTH(*s);
-    if (type == 0)
-        for (size_t i = 0; i < len; i++)
-            ((char *)*s)[i] = toupper(((char *)*s)[i]);
-    else
-        for (size_t i = 0; i < len; i++)
-            ((wchar_t *)*s)[i] = towupper(((wchar_t *)*s)[i]);
+/* Parse the digits at p into *out, returns their end or NULL on no digits or overflow */
+static const char *_str_parse_digits(const char *p, const char *end, uint64_t *out) {
+    const char *first = p;
+    while (p < end && *p == '0')
+        p++;
+    uint64_t v = 0;
+    const char *q = _str_scan_digits(p, end, &v);
+    size_t n = (size_t)(q - p);
+    if (q == first || n > 20 || (n == 20 && (*p > '1' || v < 10000000000000000000ull)))
+        return NULL;
+    *out = v;
+    return q;
 }
 
-void str_to_lower(str_t *s) {
-    uint32_t type = STR_TYPE(*s);
-    uint32_t len = STR_LENGTH(*s);
-    if (type == 0)
-        for (size_t i = 0; i < len; i++)
-            ((char *)*s)[i] = tolower(((char *)*s)[i]);
-    else
-        for (size_t i = 0; i < len; i++)
-            ((wchar_t *)*s)[i] = towlower(((wchar_t *)*s)[i]);
+size_t str_to_u64(str_view_t v, uint64_t *out) {
+    const char *p = v.data, *end = p + v.length;
+    if (p < end && *p == '+')
+        p++;
+    uint64_t r;
+    const char *q = _str_parse_digits(p, end, &r);
+    if (!q)
+        return 0;
+    *out = r;
+    return (size_t)(q - v.data);
 }
 
-int str_cmp(const str_t a, const str_t b) {
-    uint32_t type_a = STR_TYPE(a);
-    uint32_t type_b = STR_TYPE(b);
-    if (type_a != type_b)
-        return type_a < type_b ? -1 : 1;
-    uint32_t len_a = STR_LENGTH(a);
-    uint32_t len_b = STR_LENGTH(b);
-    if (type_a == 0)
-        return strncmp((const char *)a, (const char *)b, len_a < len_b ? len_a : len_b) ?: (len_a - len_b);
-    else
-        return wcsncmp((const wchar_t *)a, (const wchar_t *)b, len_a < len_b ? len_a : len_b) ?: (len_a - len_b);
+size_t str_to_i64(str_view_t v, int64_t *out) {
+    const char *p = v.data, *end = p + v.length;
+    bool neg = false;
+    if (p < end && (*p == '-' || *p == '+'))
+        neg = *p++ == '-';
+    uint64_t r;
+    const char *q = _str_parse_digits(p, end, &r);
+    if (!q || r > (uint64_t)INT64_MAX + neg)
+        return 0;
+    *out = neg ? (int64_t)(0 - r) : (int64_t)r;
+    return (size_t)(q - v.data);
 }
 
-bool str_equal(const str_t a, const str_t b) {
-    uint32_t type_a = STR_TYPE(a);
-    uint32_t type_b = STR_TYPE(b);
-    if (type_a != type_b)
-        return false;
-    uint32_t len_a = STR_LENGTH(a);
-    uint32_t len_b = STR_LENGTH(b);
-    if (len_a != len_b)
+/* Eisel-Lemire: the bits of w * 10^q as a positive double; w has at most 19 digits */
+static uint64_t _str_eisel_lemire(uint64_t w, int64_t q) {
+    if (!w || q < -342)
+        return 0;
+    if (q > 308)
+        return 0x7FF0000000000000ull;
+    unsigned lz = _str_clz64(w);
+    w <<= lz;
+    const uint64_t *pow5 = _STR_POW5_128[q + 342];
+    uint64_t lo = w, hi = pow5[1];
+    _str_mum(&lo, &hi);
+    // Only refine with the low half of 5^q when the bits below the result could carry
+    if ((hi & 0x1FF) == 0x1FF) {
+        uint64_t lo2 = w, hi2 = pow5[0];
+        _str_mum(&lo2, &hi2);
+        lo += hi2;
+        hi += lo < hi2;
+    }
+    unsigned upper = (unsigned)(hi >> 63), shift = upper + 9;
+    uint64_t mantissa = hi >> shift;
+    int32_t power2 = (int32_t)((((152170 + 65536) * q) >> 16) + 63 + upper) - (int32_t)lz + 1023;
+    if (power2 <= 0) {
+        // Subnormal, a carry into bit 52 yields the smallest normal exponent
+        if (1 - power2 >= 64)
+            return 0;
+        mantissa >>= 1 - power2;
+        mantissa += mantissa & 1;
+        return mantissa >> 1;
+    }
+    // Exact halfway cases round to even; they only occur for small q
+    if (lo <= 1 && q >= -4 && q <= 23 && (mantissa & 3) == 1 && mantissa << shift == hi)
+        mantissa &= ~(uint64_t)1;
+    mantissa += mantissa & 1;
+    mantissa >>= 1;
+    if (mantissa >= (uint64_t)2 << 52) {
+        mantissa = (uint64_t)1 << 52;
+        power2++;
+    }
+    if (power2 >= 0x7FF)
+        return 0x7FF0000000000000ull;
+    return (uint64_t)power2 << 52 | (mantissa & (((uint64_t)1 << 52) - 1));
+}
+
+/* Exact conversion through strtod, fed only digits and an exponent so the locale cannot interfere */
+static bool _str_parse_f64_slow(const char *first, const char *last, int64_t exp10, double *out) {
+    char local[256], *buf = local;
+    size_t cap = (size_t)(last - first) + 24;
+    if (cap > sizeof(local) && !(buf = (char *)STR_MALLOC(cap)))
         return false;
-    size_t elem_size = STR_ELEM_SIZE(type_a);
-    return memcmp((void *)a, (void *)b, len_a * elem_size) == 0;
+    char *d = buf;
+    for (const char *p = first; p < last; p++)
+        if (*p != '.')
+            *d++ = *p;
+    *d++ = 'e';
+    char exp[24], *e = _str_fmt_i64(exp + sizeof(exp), exp10);
+    memcpy(d, e, (size_t)(exp + sizeof(exp) - e));
+    d[exp + sizeof(exp) - e] = '\0';
+    *out = strtod(buf, NULL);
+    if (buf != local)
+        STR_FREE(buf);
+    return true;
 }
 
-size_t str_find(const str_t s, const str_t substr) {
-    uint32_t type_s = STR_TYPE(s);
-    uint32_t type_sub = STR_TYPE(substr);
-    if (type_s != type_sub)
+static size_t _str_parse_special(const char *p, const char *end, bool neg, double *out) {
+    static const char *words[3] = {"infinity", "inf", "nan"};
+    size_t avail = (size_t)(end - p);
+    for (int i = 0; i < 3; i++) {
+        size_t n = strlen(words[i]);
+        if (avail < n)
+            continue;
+        size_t j = 0;
+        while (j < n && (p[j] | 0x20) == words[i][j])
+            j++;
+        if (j < n)
+            continue;
+        uint64_t bits = (i < 2 ? 0x7FF0000000000000ull : 0x7FF8000000000000ull) | (uint64_t)neg << 63;
+        memcpy(out, &bits, sizeof(bits));
+        return n;
+    }
+    return 0;
+}
+
+size_t str_to_f64(str_view_t v, double *out) {
+    const char *p = v.data, *end = p + v.length;
+    bool neg = false;
+    if (p < end && (*p == '-' || *p == '+'))
+        neg = *p++ == '-';
+    const char *int_start = p;
+    uint64_t w = 0;
+    p = _str_scan_digits(p, end, &w);
+    const char *int_end = p, *frac_start = p, *frac_end = p;
+    if (p < end && *p == '.') {
+        frac_start = p + 1;
+        frac_end = p = _str_scan_digits(frac_start, end, &w);
+    }
+    size_t digits = (size_t)(int_end - int_start) + (size_t)(frac_end - frac_start);
+    if (!digits) {
+        size_t n = _str_parse_special(int_start, end, neg, out);
+        return n ? (size_t)(int_start - v.data) + n : 0;
+    }
+    int64_t exp_part = 0;
+    if (p < end && (*p | 0x20) == 'e') {
+        const char *e = p + 1;
+        bool exp_neg = false;
+        if (e < end && (*e == '-' || *e == '+'))
+            exp_neg = *e++ == '-';
+        if (e < end && _str_is_digit(*e)) {
+            for (; e < end && _str_is_digit(*e); e++)
+                if (exp_part < 0x10000000)
+                    exp_part = exp_part * 10 + (*e - '0');
+            if (exp_neg)
+                exp_part = -exp_part;
+            p = e;
+        }
+    }
+    int64_t exp10 = exp_part - (frac_end - frac_start);
+    bool truncated = false;
+    if (digits > 19) {
+        // Leading zeros are not significant
+        for (const char *z = int_start; z < frac_end && (*z == '0' || *z == '.'); z++)
+            digits -= *z == '0';
+        if (digits > 19) {
+            // Keep the first 19 significant digits and scale by the rest
+            truncated = true;
+            w = 0;
+            const char *q = int_start;
+            for (; q < int_end && w < 1000000000000000000ull; q++)
+                w = w * 10 + (uint64_t)(*q - '0');
+            if (w >= 1000000000000000000ull)
+                exp10 = (int_end - q) + exp_part;
+            else {
+                for (q = frac_start; q < frac_end && w < 1000000000000000000ull; q++)
+                    w = w * 10 + (uint64_t)(*q - '0');
+                exp10 = (frac_start - q) + exp_part;
+            }
+        }
+    }
+    double d;
+#ifdef _STR_CLINGER
+    if (!truncated && exp10 >= -22 && exp10 <= 22 && w <= (uint64_t)1 << 53) {
+        d = exp10 < 0 ? (double)w / _STR_POW10_EXACT[-exp10] : (double)w * _STR_POW10_EXACT[exp10];
+        *out = neg ? -d : d;
+        return (size_t)(p - v.data);
+    }
+#endif
+    uint64_t bits = _str_eisel_lemire(w, exp10);
+    // The dropped digits can only matter when w and w + 1 land on different doubles
+    if (truncated && bits != _str_eisel_lemire(w + 1, exp10) &&
+        _str_parse_f64_slow(int_start, frac_end, exp_part - (frac_end - frac_start), &d)) {
+        *out = neg ? -d : d;
+        return (size_t)(p - v.data);
+    }
+    bits |= (uint64_t)neg << 63;
+    memcpy(out, &bits, sizeof(bits));
+    return (size_t)(p - v.data);
+}
+
+str_t str_from_i64(int64_t v) {
+    char buf[20], *p = _str_fmt_i64(buf + sizeof(buf), v);
+    return _make_ascii(p, (size_t)(buf + sizeof(buf) - p));
+}
+
+str_t str_from_u64(uint64_t v) {
+    char buf[20], *p = _str_fmt_u64(buf + sizeof(buf), v);
+    return _make_ascii(p, (size_t)(buf + sizeof(buf) - p));
+}
+
+str_t str_from_f64(double v) {
+    char buf[32];
+    return _make_ascii(buf, _str_fmt_f64(buf, v));
+}
+
+#ifdef PAUL_THREADS_HEADER
+/* State shared by one _str_par_run call and the helper jobs it queued.
+   Helpers that only start once every task is claimed must still find it,
+   so it lives on the heap until the last reference is dropped. */
+typedef struct str_par_run {
+    mtx_t lock;
+    cnd_t done;
+    uint64_t next;  // next task to claim, updated atomically
+    size_t running; // helpers inside their claim loop, under lock
+    size_t refs;    // caller plus queued helpers, under lock
+    size_t count;
+    size_t size;
+    char *tasks;
+    void (*fn)(void *);
+} str_par_run_t;
+
+static inline uint64_t _str_par_claim(str_par_run_t *run) {
+#ifdef _MSC_VER
+    return (uint64_t)_InterlockedExchangeAdd64((volatile __int64 *)&run->next, 1);
+#else
+    return __atomic_fetch_add(&run->next, 1, __ATOMIC_RELAXED);
+#endif
+}
+
+/* Run tasks until none are left unclaimed */
+static void _str_par_drain(str_par_run_t *run) {
+    for (uint64_t i; (i = _str_par_claim(run)) < run->count;)
+        run->fn(run->tasks + i * run->size);
+}
+
+/* Drop a reference with run->lock held */
+static void _str_par_release(str_par_run_t *run) {
+    bool last = --run->refs == 0;
+    mtx_unlock(&run->lock);
+    if (last) {
+        cnd_destroy(&run->done);
+        mtx_destroy(&run->lock);
+        STR_FREE(run);
+    }
+}
+
+static void _str_par_help(void *arg) {
+    str_par_run_t *run = (str_par_run_t *)arg;
+    mtx_lock(&run->lock);
+    run->running++;
+    mtx_unlock(&run->lock);
+    _str_par_drain(run);
+    mtx_lock(&run->lock);
+    if (--run->running == 0)
+        cnd_signal(&run->done);
+    _str_par_release(run);
+}
+
+/* Cleanup for a helper the pool discards without running it */
+static void _str_par_discard(void *arg) {
+    str_par_run_t *run = (str_par_run_t *)arg;
+    mtx_lock(&run->lock);
+    _str_par_release(run);
+}
+
+/* Number of chunks to cut n bytes into */
+static size_t _str_par_chunks(thrd_pool_t *pool, size_t n) {
+    size_t k = (pool ? thrd_pool_get_thread_count(pool) : 0) + 1;
+    size_t max = n / STR_PARALLEL_MIN_CHUNK;
+    return k < max ? k : max ? max : 1;
+}
+
+/* Run fn over count tasks of the given size. The caller claims tasks too
+   and waits only for those a helper has started, so it cannot deadlock
+   when called from a job on the same pool while the helpers are queued. */
+static void _str_par_run(thrd_pool_t *pool, void (*fn)(void *), void *tasks, size_t size, size_t count) {
+    str_par_run_t *run = count > 1 && pool ? (str_par_run_t *)STR_MALLOC(sizeof(str_par_run_t)) : NULL;
+    if (run && mtx_init(&run->lock, 0) != thrd_success) {
+        STR_FREE(run);
+        run = NULL;
+    } else if (run && cnd_init(&run->done) != thrd_success) {
+        mtx_destroy(&run->lock);
+        STR_FREE(run);
+        run = NULL;
+    }
+    if (!run) {
+        for (size_t i = 0; i < count; i++)
+            fn((char *)tasks + i * size);
+        return;
+    }
+    run->next = 0;
+    run->running = 0;
+    run->refs = 1;
+    run->count = count;
+    run->size = size;
+    run->tasks = (char *)tasks;
+    run->fn = fn;
+    for (size_t i = 1; i < count; i++) {
+        mtx_lock(&run->lock);
+        run->refs++;
+        mtx_unlock(&run->lock);
+        if (thrd_pool_submit(pool, _str_par_help, run, _str_par_discard) != thrd_success) {
+            mtx_lock(&run->lock);
+            run->refs--;
+            mtx_unlock(&run->lock);
+            break;
+        }
+    }
+    _str_par_drain(run);
+    mtx_lock(&run->lock);
+    while (run->running)
+        cnd_wait(&run->done, &run->lock);
+    _str_par_release(run);
+}
+
+#ifndef STR_PARALLEL_SYNC
+#define STR_PARALLEL_SYNC 256
+#endif
+
+typedef struct str_par_find {
+    const char *hay;
+    size_t n;         // length of the whole string
+    const char *needle;
+    size_t m;
+    size_t start;     // chunk owns matches starting in [start, end)
+    size_t end;
+    size_t limit;     // positions kept: all, or STR_PARALLEL_SYNC when counting
+    size_t count;     // matches in the chunk's own greedy chain
+    size_t *pos;      // the first min(count, limit) positions of that chain
+    size_t cap;
+    size_t last_end;  // end of the chain's last match
+    bool failed;
+} str_par_find_t;
+
+static bool _str_par_push(str_par_find_t *t, size_t p) {
+    if (t->count < t->limit) {
+        if (t->count == t->cap) {
+            size_t cap = t->cap ? t->cap * 2 : 64;
+            size_t *pos = (size_t *)STR_REALLOC(t->pos, cap * sizeof(size_t));
+            if (!pos)
+                return false;
+            t->pos = pos;
+            t->cap = cap;
+        }
+        t->pos[t->count] = p;
+    }
+    t->count++;
+    return true;
+}
+
+/* Greedy leftmost chain of matches starting at or after from and before end */
+static size_t _str_par_next(const str_par_find_t *t, size_t from) {
+    size_t stop = t->end + t->m - 1 < t->n ? t->end + t->m - 1 : t->n;
+    if (from >= t->end || stop - from < t->m)
         return (size_t)-1;
-    uint32_t len_s = STR_LENGTH(s);
-    uint32_t len_sub = STR_LENGTH(substr);
-    if (len_sub == 0)
+    const char *hit = _str_memmem(t->hay + from, stop - from, t->needle, t->m);
+    return hit ? (size_t)(hit - t->hay) : (size_t)-1;
+}
+
+static void _str_par_find_task(void *arg) {
+    str_par_find_t *t = (str_par_find_t *)arg;
+    for (size_t p = _str_par_next(t, t->start); p != (size_t)-1; p = _str_par_next(t, p + t->m)) {
+        if (!_str_par_push(t, p)) {
+            t->failed = true;
+            return;
+        }
+        t->last_end = p + t->m;
+    }
+}
+
+/* Append n positions to a growing result array */
+static bool _str_par_emit(size_t **out, size_t *cap, size_t total, const size_t *p, size_t n) {
+    if (total + n > *cap) {
+        size_t grown_cap = *cap * 2 > total + n ? *cap * 2 : total + n;
+        size_t *grown = (size_t *)STR_REALLOC(*out, grown_cap * sizeof(size_t));
+        if (!grown)
+            return false;
+        *out = grown;
+        *cap = grown_cap;
+    }
+    memcpy(*out + total, p, n * sizeof(size_t));
+    return true;
+}
+
+/* Scan in parallel, then stitch the chunk chains into the serial result.
+   A chunk's chain is only wrong when the previous match spills into it; in
+   that case the chunk is rescanned from the spill point until the rescan
+   lands on a match of the chunk's own chain, from which the two agree. */
+static size_t _str_par_find(thrd_pool_t *pool, const str_t s, const str_t needle, size_t **positions) {
+    if (positions)
+        *positions = NULL;
+    uint32_t n = STR_LENGTH(s), m = STR_LENGTH(needle);
+    if (!STR_IS_NARROW(STR_TYPE(s)) || !STR_IS_NARROW(STR_TYPE(needle)) || !m || m > n)
         return 0;
-    if (len_sub > len_s)
+    size_t k = _str_par_chunks(pool, n);
+    str_par_find_t *tasks = (str_par_find_t *)STR_MALLOC(k * sizeof(str_par_find_t));
+    if (!tasks)
         return (size_t)-1;
-    size_t elem_size = STR_ELEM_SIZE(type_s);
-    const void *data_s = (const void *)s;
-    const void *data_sub = (const void *)substr;
-    for (size_t i = 0; i <= len_s - len_sub; i++) {
-        const void *p1 = (const char *)data_s + i * elem_size;
-        if (memcmp(p1, data_sub, len_sub * elem_size) == 0)
-            return i;
+    for (size_t i = 0; i < k; i++) {
+        str_par_find_t *t = &tasks[i];
+        memset(t, 0, sizeof(*t));
+        t->hay = (const char *)s;
+        t->n = n;
+        t->needle = (const char *)needle;
+        t->m = m;
+        t->start = n / k * i;
+        t->end = i + 1 == k ? n : n / k * (i + 1);
+        t->limit = positions ? (size_t)-1 : STR_PARALLEL_SYNC;
     }
-    return (size_t)-1;
+    _str_par_run(pool, _str_par_find_task, tasks, sizeof(str_par_find_t), k);
+    size_t total = 0, carry = 0, cap = 0;
+    size_t *out = NULL;
+    bool failed = false;
+    for (size_t i = 0; i < k && !failed; i++) {
+        str_par_find_t *t = &tasks[i];
+        size_t idx = 0;
+        if ((failed = t->failed))
+            break;
+        if (!t->count)
+            continue;
+        if (carry > t->start && t->pos[0] < carry) {
+            // Rescan from the spill point until we land on the chunk's chain
+            size_t kept = t->count < t->limit ? t->count : t->limit, p;
+            for (p = _str_par_next(t, carry); p != (size_t)-1; p = _str_par_next(t, carry)) {
+                while (idx < kept && t->pos[idx] < p)
+                    idx++;
+                if (idx < kept && t->pos[idx] == p)
+                    break;
+                if (positions && !_str_par_emit(&out, &cap, total, &p, 1)) {
+                    failed = true;
+                    break;
+                }
+                total++;
+                carry = p + t->m;
+            }
+            if (p == (size_t)-1 || failed)
+                continue;
+        }
+        // From pos[idx] on the chunk's chain is the serial result
+        size_t adopt = t->count - idx;
+        if (positions && !_str_par_emit(&out, &cap, total, t->pos + idx, adopt))
+            failed = true;
+        total += adopt;
+        carry = t->last_end;
+    }
+    for (size_t i = 0; i < k; i++)
+        STR_FREE(tasks[i].pos);
+    STR_FREE(tasks);
+    if (failed) {
+        STR_FREE(out);
+        return (size_t)-1;
+    }
+    if (positions)
+        *positions = out;
+    return total;
 }
 
-size_t str_find_char(const str_t s, char c) {
-    uint32_t type = STR_TYPE(s);
-    if (type != 0)
-        return (size_t)-1; // only for ASCII
-    uint32_t len = STR_LENGTH(s);
-    for (size_t i = 0; i < len; i++)
-        if (((const char *)s)[i] == c)
-            return i;
-    return (size_t)-1;
+size_t str_find_all_parallel(thrd_pool_t *pool, const str_t s, const str_t needle, size_t **positions) {
+    return _str_par_find(pool, s, needle, positions);
 }
 
-bool str_starts_with(const str_t s, const str_t prefix) {
-    uint32_t type_s = STR_TYPE(s);
-    uint32_t type_p = STR_TYPE(prefix);
-    if (type_s != type_p)
-        return false;
-    uint32_t len_p = STR_LENGTH(prefix);
-    uint32_t len_s = STR_LENGTH(s);
-    if (len_p > len_s)
-        return false;
-    size_t elem_size = STR_ELEM_SIZE(type_s);
-    return memcmp((void *)s, (void *)prefix, len_p * elem_size) == 0;
+size_t str_count_parallel(thrd_pool_t *pool, const str_t s, const str_t needle) {
+    return _str_par_find(pool, s, needle, NULL);
 }
 
-bool str_ends_with(const str_t s, const str_t suffix) {
-    uint32_t type_s = STR_TYPE(s);
-    uint32_t type_suf = STR_TYPE(suffix);
-    if (type_s != type_suf)
-        return false;
-    uint32_t len_suf = STR_LENGTH(suffix);
-    uint32_t len_s = STR_LENGTH(s);
-    if (len_suf > len_s)
-        return false;
-    size_t elem_size = STR_ELEM_SIZE(type_s);
-    return memcmp((char *)s + (len_s - len_suf) * elem_size, (void *)suffix, len_suf * elem_size) == 0;
+typedef struct str_par_replace {
+    const char *src;
+    char *dst;
+    const size_t *pos;
+    size_t count;
+    size_t m;
+    const char *rep;
+    size_t r;
+    size_t start; // source bytes [start, end) and the matches starting there
+    size_t end;
+} str_par_replace_t;
+
+static void _str_par_replace_task(void *arg) {
+    str_par_replace_t *t = (str_par_replace_t *)arg;
+    // First match starting at or after start
+    size_t lo = 0, hi = t->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (t->pos[mid] < t->start)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    size_t cur = t->start;
+    if (lo && t->pos[lo - 1] + t->m > cur)
+        cur = t->pos[lo - 1] + t->m;
+    for (size_t i = lo;; i++) {
+        size_t stop = i < t->count && t->pos[i] < t->end ? t->pos[i] : t->end;
+        if (cur < stop) {
+            // Every earlier match shrank or grew the output by r - m bytes
+            memcpy(t->dst + cur - i * t->m + i * t->r, t->src + cur, stop - cur);
+            cur = stop;
+        }
+        if (i >= t->count || t->pos[i] >= t->end)
+            break;
+        memcpy(t->dst + t->pos[i] - i * t->m + i * t->r, t->rep, t->r);
+        cur = t->pos[i] + t->m;
+    }
 }
 
-/* Generic wildcard implementation generated via macro for char/wchar_t.
- * Supports '*', '?', and character classes like [abc], [a-z], and negation [^...].
- */
-#define WILDCARD_IMPL(fname, CHAR)                                                    \
-    bool fname(const str_t s, const CHAR *pattern)                                    \
-    {                                                                                 \
-        const CHAR *str = (const CHAR *)s;                                            \
-        const CHAR *p = pattern;                                                      \
-        const CHAR *st = str;                                                         \
-        const CHAR *star = NULL;                                                      \
-        const CHAR *ss = NULL;                                                        \
-        while (*st)                                                                   \
-        {                                                                             \
-            if (*p == (CHAR)'*')                                                      \
-            {                                                                         \
-                star = p++;                                                           \
-                ss = st;                                                              \
-            }                                                                         \
-            else if (*p && (*p == (CHAR)'?' || *p == *st))                            \
-            {                                                                         \
-                p++;                                                                  \
-                st++;                                                                 \
-            }                                                                         \
-            else if (*p == (CHAR)'[')                                                 \
-            {                                                                         \
-                const CHAR *q = p + 1;                                                \
-                bool negate = false;                                                  \
-                if (*q == (CHAR)'^')                                                  \
-                {                                                                     \
-                    negate = true;                                                    \
-                    q++;                                                              \
-                }                                                                     \
-                bool matched = false;                                                 \
-                CHAR prev = 0;                                                        \
-                while (*q && *q != (CHAR)']')                                         \
-                {                                                                     \
-                    if (*q == (CHAR)'-' && prev && *(q + 1) && *(q + 1) != (CHAR)']') \
-                    {                                                                 \
-                        CHAR start = prev;                                            \
-                        CHAR end = *(q + 1);                                          \
-                        if (*st >= start && *st <= end)                               \
-                            matched = true;                                           \
-                        q += 2;                                                       \
-                        prev = 0;                                                     \
-                        continue;                                                     \
-                    }                                                                 \
-                    else                                                              \
-                    {                                                                 \
-                        if (*st == *q)                                                \
-                            matched = true;                                           \
-                        prev = *q;                                                    \
-                    }                                                                 \
-                    q++;                                                              \
-                }                                                                     \
-                /* advance p past bracket */                                          \
-                while (*p && *p != (CHAR)']')                                         \
-                    p++;                                                              \
-                if (*p == (CHAR)']')                                                  \
-                    p++;                                                              \
-                if (negate)                                                           \
-                    matched = !matched;                                               \
-                if (matched)                                                          \
-                {                                                                     \
-                    st++;                                                             \
-                    continue;                                                         \
-                }                                                                     \
-                if (star)                                                             \
-                {                                                                     \
-                    p = star + 1;                                                     \
-                    st = ++ss;                                                        \
-                    continue;                                                         \
-                }                                                                     \
-                return false;                                                         \
-            }                                                                         \
-            else                                                                      \
-            {                                                                         \
-                if (star)                                                             \
-                {                                                                     \
-                    p = star + 1;                                                     \
-                    st = ++ss;                                                        \
-                    continue;                                                         \
-                }                                                                     \
-                return false;                                                         \
-            }                                                                         \
-        }                                                                             \
-        while (*p == (CHAR)'*')                                                       \
-            p++;                                                                      \
-        return *p == (CHAR)'\0';                                                      \
+str_t str_replace_all_parallel(thrd_pool_t *pool, const str_t s, const str_t old_sub, const str_t new_sub) {
+    if (!STR_IS_NARROW(STR_TYPE(s)) || !STR_IS_NARROW(STR_TYPE(new_sub)))
+        return NULL;
+    size_t *pos;
+    size_t count = _str_par_find(pool, s, old_sub, &pos);
+    if (count == (size_t)-1)
+        return NULL;
+    uint32_t n = STR_LENGTH(s);
+    size_t m = STR_LENGTH(old_sub), r = STR_LENGTH(new_sub);
+    // As with str_insert, splicing in a UTF-8 replacement makes the result UTF-8
+    uint32_t type = count && STR_TYPE(new_sub) == STR_TYPE_UTF8 ? STR_TYPE_UTF8 : STR_TYPE(s);
+    str_t result = _str_new(type, n - count * m + count * r);
+    if (!result || !count) {
+        if (result)
+            memcpy(result, s, n);
+        STR_FREE(pos);
+        return result;
     }
-WILDCARD_IMPL(str_wildcard_ascii, char)
-WILDCARD_IMPL(str_wildcard_wide, wchar_t)
-#undef WILDCARD_IMPL
+    size_t k = _str_par_chunks(pool, n);
+    str_par_replace_t *tasks = (str_par_replace_t *)STR_MALLOC(k * sizeof(str_par_replace_t));
+    if (!tasks) {
+        STR_FREE(pos);
+        str_free(result);
+        return NULL;
+    }
+    for (size_t i = 0; i < k; i++) {
+        str_par_replace_t *t = &tasks[i];
+        t->src = (const char *)s;
+        t->dst = (char *)result;
+        t->pos = pos;
+        t->count = count;
+        t->m = m;
+        t->rep = (const char *)new_sub;
+        t->r = r;
+        t->start = n / k * i;
+        t->end = i + 1 == k ? n : n / k * (i + 1);
+    }
+    _str_par_run(pool, _str_par_replace_task, tasks, sizeof(str_par_replace_t), k);
+    STR_FREE(tasks);
+    STR_FREE(pos);
+    return result;
+}
 
-size_t str_length(const str_t s) {
-    return STR_LENGTH(s);
+/* Number of bytes equal to c in p[0..n) */
+static size_t _str_count_byte(const char *p, size_t n, char c) {
+    size_t count = 0, i = 0;
+#ifdef _STR_SSE2
+    const __m128i vc = _mm_set1_epi8(c);
+    for (; i + 16 <= n; i += 16)
+        count += _str_popcount32((uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i)), vc)));
+#endif
+    for (; i < n; i++)
+        count += p[i] == c;
+    return count;
 }
 
-char str_char_at(const str_t s, size_t index) {
-    if (!str_is_ascii(s))
-        return 0;
-    uint32_t len = str_length(s);
-    if (index >= len)
-        return 0;
-    return ((const char *)s)[index];
+typedef struct str_par_lines {
+    const char *data;
+    size_t start;
+    size_t end;
+    size_t newlines;   // phase 1: newlines in [start, end)
+    size_t last;       // phase 1: offset one past the chunk's last newline, or 0
+    size_t line_start; // phase 2: start of the first line ending in this chunk
+    str_view_t *out;   // phase 2: where this chunk's lines go
+} str_par_lines_t;
+
+static void _str_par_lines_count(void *arg) {
+    str_par_lines_t *t = (str_par_lines_t *)arg;
+    t->newlines = _str_count_byte(t->data + t->start, t->end - t->start, '\n');
+    if (t->newlines) {
+        const char *p = t->data + t->end;
+        while (p[-1] != '\n')
+            p--;
+        t->last = (size_t)(p - t->data);
+    }
 }
 
-wchar_t str_wchar_at(const str_t s, size_t index) {
-    if (!str_is_utf16(s))
-        return 0;
-    uint32_t len = str_length(s);
-    if (index >= len)
+static void _str_par_lines_fill(void *arg) {
+    str_par_lines_t *t = (str_par_lines_t *)arg;
+    const char *line = t->data + t->line_start, *end = t->data + t->end;
+    str_view_t *out = t->out;
+    for (const char *p = t->data + t->start; (p = (const char *)memchr(p, '\n', (size_t)(end - p))); line = ++p) {
+        out->data = line;
+        out->length = (size_t)(p - line);
+        if (out->length && line[out->length - 1] == '\r')
+            out->length--;
+        out++;
+    }
+}
+
+size_t str_split_lines_parallel(thrd_pool_t *pool, const str_t s, str_view_t **lines) {
+    *lines = NULL;
+    uint32_t n = STR_LENGTH(s);
+    if (!STR_IS_NARROW(STR_TYPE(s)) || !n)
         return 0;
-    return ((const wchar_t *)s)[index];
+    size_t k = _str_par_chunks(pool, n);
+    str_par_lines_t *tasks = (str_par_lines_t *)STR_MALLOC(k * sizeof(str_par_lines_t));
+    if (!tasks)
+        return (size_t)-1;
+    for (size_t i = 0; i < k; i++) {
+        memset(&tasks[i], 0, sizeof(str_par_lines_t));
+        tasks[i].data = (const char *)s;
+        tasks[i].start = n / k * i;
+        tasks[i].end = i + 1 == k ? n : n / k * (i + 1);
+    }
+    _str_par_run(pool, _str_par_lines_count, tasks, sizeof(str_par_lines_t), k);
+    // Prefix sums give every chunk its output slot and first line start
+    size_t total = 0, line_start = 0;
+    for (size_t i = 0; i < k; i++) {
+        tasks[i].line_start = line_start;
+        total += tasks[i].newlines;
+        if (tasks[i].newlines)
+            line_start = tasks[i].last;
+    }
+    bool tail = line_start < n;
+    str_view_t *out = (str_view_t *)STR_MALLOC((total + tail) * sizeof(str_view_t));
+    if (!out) {
+        STR_FREE(tasks);
+        return (size_t)-1;
+    }
+    for (size_t i = 0, slot = 0; i < k; slot += tasks[i++].newlines)
+        tasks[i].out = out + slot;
+    _str_par_run(pool, _str_par_lines_fill, tasks, sizeof(str_par_lines_t), k);
+    if (tail) {
+        str_view_t *v = &out[total++];
+        v->data = (const char *)s + line_start;
+        v->length = n - line_start;
+    }
+    STR_FREE(tasks);
+    *lines = out;
+    return total;
 }
+#endif
 
 #endif // PAUL_STRING_IMPLEMENTATION